@@ -62,7 +62,7 @@ Arguments:
 
   UnknownAdapter -
 
-  DeviceContext -
+  DeviceContext - index of the capture endpoint the filter belongs to
 
   MiniportPair -
 
@@ -78,14 +78,14 @@ Return Value:
     ASSERT(MiniportPair);
 
     UNREFERENCED_PARAMETER(UnknownAdapter);
-    UNREFERENCED_PARAMETER(DeviceContext);
 
     CMicArrayMiniportTopology* obj =
         new (PoolFlags, MINTOPORT_POOLTAG)
         CMicArrayMiniportTopology(UnknownOuter,
             MiniportPair->TopoDescriptor,
             MiniportPair->DeviceMaxChannels,
-            MiniportPair->DeviceType);
+            MiniportPair->DeviceType,
+            (ULONG)(ULONG_PTR)DeviceContext);
     if (NULL == obj)
     {
         return STATUS_INSUFFICIENT_RESOURCES;
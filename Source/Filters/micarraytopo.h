@@ -39,10 +39,11 @@ public:
         _In_opt_    PUNKNOWN                UnknownOuter,
         _In_        PCFILTER_DESCRIPTOR* FilterDesc,
         _In_        USHORT                  DeviceMaxChannels,
-        _In_        eDeviceType             DeviceType
+        _In_        eDeviceType             DeviceType,
+        _In_        ULONG                   EndpointIndex
     )
         : CUnknown(UnknownOuter),
-        CMiniportTopologySimpleAudioSample(FilterDesc, DeviceMaxChannels),
+        CMiniportTopologySimpleAudioSample(FilterDesc, DeviceMaxChannels, EndpointIndex),
         m_DeviceType(DeviceType)
     {
         ASSERT(m_DeviceType == eMicArrayDevice1);
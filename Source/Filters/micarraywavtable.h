@@ -20,44 +20,93 @@ Abstract:-
 //
 #define MICARRAY_RAW_CHANNELS                   2       // Channels for raw mode
 #define MICARRAY_DEVICE_MAX_CHANNELS            2       // Max channels overall
-#define MICARRAY_32_BITS_PER_SAMPLE_PCM         32      // 32 Bits Per Sample
-#define MICARRAY_RAW_SAMPLE_RATE                48000   // Raw sample rate
+#define MICARRAY_MIN_BITS_PER_SAMPLE_PCM        16      // Min Bits Per Sample
+#define MICARRAY_MAX_BITS_PER_SAMPLE_PCM        32      // Max Bits Per Sample
+#define MICARRAY_32_BITS_PER_SAMPLE_FLOAT       32      // 32 Bits Per Sample
+#define MICARRAY_MIN_SAMPLE_RATE                16000   // Min sample rate
+#define MICARRAY_MAX_SAMPLE_RATE                96000   // Max sample rate
 
 //
-// Max # of pin instances.
+// Max # of pin instances. Every capture stream reads the endpoint's feeder
+// ring through a reader of its own, so this is at most PCM_RING_MAX_READERS.
 //
-#define MICARRAY_MAX_INPUT_STREAMS              1
+#define MICARRAY_MAX_INPUT_STREAMS              8
+
+//
+// One supported device format. Samples are packed, so 24-bit formats have a
+// 24-bit container; SubType is the tail of a KSDATAFORMAT_SUBTYPE_ name.
+//
+#define MICARRAY_DEVICE_FORMAT(SubType, Channels, ChannelMask, SamplesPerSec, BitsPerSample, ValidBitsPerSample) \
+    {                                                                           \
+        {                                                                       \
+            sizeof(KSDATAFORMAT_WAVEFORMATEXTENSIBLE),                          \
+            0,                                                                  \
+            0,                                                                  \
+            0,                                                                  \
+            STATICGUIDOF(KSDATAFORMAT_TYPE_AUDIO),                              \
+            STATICGUIDOF(KSDATAFORMAT_SUBTYPE_##SubType),                       \
+            STATICGUIDOF(KSDATAFORMAT_SPECIFIER_WAVEFORMATEX)                   \
+        },                                                                      \
+        {                                                                       \
+            {                                                                   \
+                WAVE_FORMAT_EXTENSIBLE,                                         \
+                (Channels),                                                     \
+                (SamplesPerSec),                                                \
+                (SamplesPerSec) * (Channels) * ((BitsPerSample) / 8),           \
+                (Channels) * ((BitsPerSample) / 8), /* nBlockAlign */           \
+                (BitsPerSample),                                                \
+                sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX)             \
+            },                                                                  \
+            (ValidBitsPerSample),                                               \
+            (ChannelMask),                                                      \
+            STATICGUIDOF(KSDATAFORMAT_SUBTYPE_##SubType)                        \
+        }                                                                       \
+    }
 
 //=============================================================================
+//
+// Every format the capture pin streams in, best first: CMiniportWaveRT::
+// DataRangeIntersection picks the first entry that fits the client's range.
+// The first entry is also the default format. The stream converts from the
+// feeder's format straight into any of these, so clients that want e.g.
+// 16 kHz int16 get it from the driver instead of a conversion in the audio
+// engine.
+//
 static
 KSDATAFORMAT_WAVEFORMATEXTENSIBLE MicArrayPinSupportedDeviceFormats[] =
 {
-    // 48 KHz 32-bit 2 channels
-    {
-        {
-            sizeof(KSDATAFORMAT_WAVEFORMATEXTENSIBLE),
-            0,
-            0,
-            0,
-            STATICGUIDOF(KSDATAFORMAT_TYPE_AUDIO),
-            STATICGUIDOF(KSDATAFORMAT_SUBTYPE_PCM),
-            STATICGUIDOF(KSDATAFORMAT_SPECIFIER_WAVEFORMATEX)
-        },
-        {
-            {
-                WAVE_FORMAT_EXTENSIBLE,
-                2,
-                48000,
-                48000 * 2 * 4, // 4 bytes per float sample
-                2 * 4,         // nBlockAlign
-                32,            // wBitsPerSample
-                sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX)
-            },
-            32,
-            KSAUDIO_SPEAKER_STEREO,
-            STATICGUIDOF(KSDATAFORMAT_SUBTYPE_PCM)
-        }
-    }
+    MICARRAY_DEVICE_FORMAT(PCM,        2, KSAUDIO_SPEAKER_STEREO, 48000, 32, 32),
+    MICARRAY_DEVICE_FORMAT(PCM,        1, KSAUDIO_SPEAKER_MONO,   48000, 32, 32),
+    MICARRAY_DEVICE_FORMAT(IEEE_FLOAT, 2, KSAUDIO_SPEAKER_STEREO, 48000, 32, 32),
+    MICARRAY_DEVICE_FORMAT(IEEE_FLOAT, 1, KSAUDIO_SPEAKER_MONO,   48000, 32, 32),
+    MICARRAY_DEVICE_FORMAT(PCM,        2, KSAUDIO_SPEAKER_STEREO, 48000, 24, 24),
+    MICARRAY_DEVICE_FORMAT(PCM,        1, KSAUDIO_SPEAKER_MONO,   48000, 24, 24),
+    MICARRAY_DEVICE_FORMAT(PCM,        2, KSAUDIO_SPEAKER_STEREO, 48000, 16, 16),
+    MICARRAY_DEVICE_FORMAT(PCM,        1, KSAUDIO_SPEAKER_MONO,   48000, 16, 16),
+    MICARRAY_DEVICE_FORMAT(PCM,        2, KSAUDIO_SPEAKER_STEREO, 44100, 32, 32),
+    MICARRAY_DEVICE_FORMAT(PCM,        1, KSAUDIO_SPEAKER_MONO,   44100, 32, 32),
+    MICARRAY_DEVICE_FORMAT(IEEE_FLOAT, 2, KSAUDIO_SPEAKER_STEREO, 44100, 32, 32),
+    MICARRAY_DEVICE_FORMAT(IEEE_FLOAT, 1, KSAUDIO_SPEAKER_MONO,   44100, 32, 32),
+    MICARRAY_DEVICE_FORMAT(PCM,        2, KSAUDIO_SPEAKER_STEREO, 44100, 24, 24),
+    MICARRAY_DEVICE_FORMAT(PCM,        1, KSAUDIO_SPEAKER_MONO,   44100, 24, 24),
+    MICARRAY_DEVICE_FORMAT(PCM,        2, KSAUDIO_SPEAKER_STEREO, 44100, 16, 16),
+    MICARRAY_DEVICE_FORMAT(PCM,        1, KSAUDIO_SPEAKER_MONO,   44100, 16, 16),
+    MICARRAY_DEVICE_FORMAT(PCM,        2, KSAUDIO_SPEAKER_STEREO, 96000, 32, 32),
+    MICARRAY_DEVICE_FORMAT(PCM,        1, KSAUDIO_SPEAKER_MONO,   96000, 32, 32),
+    MICARRAY_DEVICE_FORMAT(IEEE_FLOAT, 2, KSAUDIO_SPEAKER_STEREO, 96000, 32, 32),
+    MICARRAY_DEVICE_FORMAT(IEEE_FLOAT, 1, KSAUDIO_SPEAKER_MONO,   96000, 32, 32),
+    MICARRAY_DEVICE_FORMAT(PCM,        2, KSAUDIO_SPEAKER_STEREO, 96000, 24, 24),
+    MICARRAY_DEVICE_FORMAT(PCM,        1, KSAUDIO_SPEAKER_MONO,   96000, 24, 24),
+    MICARRAY_DEVICE_FORMAT(PCM,        2, KSAUDIO_SPEAKER_STEREO, 96000, 16, 16),
+    MICARRAY_DEVICE_FORMAT(PCM,        1, KSAUDIO_SPEAKER_MONO,   96000, 16, 16),
+    MICARRAY_DEVICE_FORMAT(PCM,        2, KSAUDIO_SPEAKER_STEREO, 16000, 32, 32),
+    MICARRAY_DEVICE_FORMAT(PCM,        1, KSAUDIO_SPEAKER_MONO,   16000, 32, 32),
+    MICARRAY_DEVICE_FORMAT(IEEE_FLOAT, 2, KSAUDIO_SPEAKER_STEREO, 16000, 32, 32),
+    MICARRAY_DEVICE_FORMAT(IEEE_FLOAT, 1, KSAUDIO_SPEAKER_MONO,   16000, 32, 32),
+    MICARRAY_DEVICE_FORMAT(PCM,        2, KSAUDIO_SPEAKER_STEREO, 16000, 24, 24),
+    MICARRAY_DEVICE_FORMAT(PCM,        1, KSAUDIO_SPEAKER_MONO,   16000, 24, 24),
+    MICARRAY_DEVICE_FORMAT(PCM,        2, KSAUDIO_SPEAKER_STEREO, 16000, 16, 16),
+    MICARRAY_DEVICE_FORMAT(PCM,        1, KSAUDIO_SPEAKER_MONO,   16000, 16, 16)
 };
 
 //
@@ -113,11 +162,27 @@ KSDATARANGE_AUDIO MicArrayPinDataRangesRawStream[] =
             STATICGUIDOF(KSDATAFORMAT_SUBTYPE_PCM),
             STATICGUIDOF(KSDATAFORMAT_SPECIFIER_WAVEFORMATEX)
         },
-        MICARRAY_RAW_CHANNELS,
-        MICARRAY_32_BITS_PER_SAMPLE_PCM,
-        MICARRAY_32_BITS_PER_SAMPLE_PCM,
-        MICARRAY_RAW_SAMPLE_RATE,
-        MICARRAY_RAW_SAMPLE_RATE
+        MICARRAY_DEVICE_MAX_CHANNELS,
+        MICARRAY_MIN_BITS_PER_SAMPLE_PCM,
+        MICARRAY_MAX_BITS_PER_SAMPLE_PCM,
+        MICARRAY_MIN_SAMPLE_RATE,
+        MICARRAY_MAX_SAMPLE_RATE
+    },
+    {
+        {
+            sizeof(KSDATARANGE_AUDIO),
+            KSDATARANGE_ATTRIBUTES,         // An attributes list follows this data range
+            0,
+            0,
+            STATICGUIDOF(KSDATAFORMAT_TYPE_AUDIO),
+            STATICGUIDOF(KSDATAFORMAT_SUBTYPE_IEEE_FLOAT),
+            STATICGUIDOF(KSDATAFORMAT_SPECIFIER_WAVEFORMATEX)
+        },
+        MICARRAY_DEVICE_MAX_CHANNELS,
+        MICARRAY_32_BITS_PER_SAMPLE_FLOAT,
+        MICARRAY_32_BITS_PER_SAMPLE_FLOAT,
+        MICARRAY_MIN_SAMPLE_RATE,
+        MICARRAY_MAX_SAMPLE_RATE
     },
 };
 
@@ -125,8 +190,12 @@ static
 PKSDATARANGE MicArrayPinDataRangePointersStream[] =
 {
     // All supported device formats should be listed in the DataRange.
+    // The ranges are wider than the format table; IsFormatSupported and
+    // DataRangeIntersection only accept what is in the table.
     PKSDATARANGE(&MicArrayPinDataRangesRawStream[0]),
     PKSDATARANGE(&PinDataRangeAttributeList),
+    PKSDATARANGE(&MicArrayPinDataRangesRawStream[1]),
+    PKSDATARANGE(&PinDataRangeAttributeList),
 };
 
 //=============================================================================
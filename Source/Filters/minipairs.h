@@ -95,13 +95,15 @@ ENDPOINT_MINIPAIR MicArray1Miniports =
 // Capture miniport pairs. NOTE: the split of render and capture is arbitrary and
 // unnessary, this array could contain render endpoints.
 //
+// The table is built at load from the CaptureEndpointCount registry value, see
+// CaptureEndpoints_Init: the first endpoint is MicArray1Miniports itself, the
+// others are copies of it under names of their own.
+//
 static
-PENDPOINT_MINIPAIR  g_CaptureEndpoints[] =
-{
-    &MicArray1Miniports,
-};
+PENDPOINT_MINIPAIR* g_CaptureEndpoints = NULL;
 
-#define g_cCaptureEndpoints (SIZEOF_ARRAY(g_CaptureEndpoints))
+static
+ULONG               g_cCaptureEndpoints = 0;
 
 //=============================================================================
 //
@@ -30,11 +30,13 @@ class CMiniportTopologySimpleAudioSample
     PPCFILTER_DESCRIPTOR        m_FilterDescriptor;     // Filter descriptor.
     PPORTEVENTS                 m_PortEvents;           // Event interface.
     USHORT                      m_DeviceMaxChannels;    // Max device channels.
+    ULONG                       m_ulEndpointIndex;      // Endpoint whose mixer registers the nodes use.
 
   public:
     CMiniportTopologySimpleAudioSample(
         _In_        PCFILTER_DESCRIPTOR    *FilterDesc,
-        _In_        USHORT                  DeviceMaxChannels
+        _In_        USHORT                  DeviceMaxChannels,
+        _In_        ULONG                   EndpointIndex
         );
     
     ~CMiniportTopologySimpleAudioSample();
@@ -310,6 +310,7 @@ DECLARE_INTERFACE_(IAdapterCommon, IUnknown)
     STDMETHOD_(BOOL,            MixerMuteRead)
     (
         THIS_
+        _In_  ULONG               Endpoint,
         _In_  ULONG               Index,
         _In_  ULONG               Channel
     ) PURE;
@@ -317,6 +318,7 @@ DECLARE_INTERFACE_(IAdapterCommon, IUnknown)
     STDMETHOD_(VOID,            MixerMuteWrite)
     (
         THIS_
+        _In_  ULONG               Endpoint,
         _In_  ULONG               Index,
         _In_  ULONG               Channel,
         _In_  BOOL                Value
@@ -336,6 +338,7 @@ DECLARE_INTERFACE_(IAdapterCommon, IUnknown)
     STDMETHOD_(LONG,            MixerVolumeRead) 
     ( 
         THIS_
+        _In_  ULONG               Endpoint,
         _In_  ULONG               Index,
         _In_  ULONG               Channel
     ) PURE;
@@ -343,6 +346,7 @@ DECLARE_INTERFACE_(IAdapterCommon, IUnknown)
     STDMETHOD_(VOID,            MixerVolumeWrite) 
     ( 
         THIS_
+        _In_  ULONG               Endpoint,
         _In_  ULONG               Index,
         _In_  ULONG               Channel,
         _In_  LONG                Value 
@@ -351,10 +355,20 @@ DECLARE_INTERFACE_(IAdapterCommon, IUnknown)
     STDMETHOD_(LONG,            MixerPeakMeterRead) 
     ( 
         THIS_
+        _In_  ULONG               Endpoint,
         _In_  ULONG               Index,
         _In_  ULONG               Channel
     ) PURE;
 
+    STDMETHOD_(VOID,            MixerPeakMeterWrite) 
+    ( 
+        THIS_
+        _In_  ULONG               Endpoint,
+        _In_  ULONG               Index,
+        _In_  ULONG               Channel,
+        _In_  LONG                Value 
+    ) PURE;
+
     STDMETHOD_(VOID,            MixerReset) 
     ( 
         THIS 
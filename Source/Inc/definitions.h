@@ -167,6 +167,8 @@ typedef struct _PortClassDeviceContext              // 32       64      Byte off
 //
 extern DWORD g_DoNotCreateDataFiles;
 extern DWORD g_DisableBthScoBypass;
+extern DWORD g_UserPcmCapacityMs;
+extern DWORD g_UserPcmTargetMs;
 extern UNICODE_STRING g_RegistryPath;
 
 //=============================================================================
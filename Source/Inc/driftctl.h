@@ -0,0 +1,182 @@
+/*++
+
+Module Name:
+
+    driftctl.h
+
+Abstract:
+
+    Control loop that locks a feeder's clock to the capture stream's.
+
+    A feeder paced by its own clock (a sound card, a network peer) never
+    produces exactly the stream's rate, so a ring drained at the nominal
+    ratio slowly fills up or runs dry. The loop watches the ring's fill
+    error, how far the queued audio strays from the latency target, and
+    answers with a trim for the resampler's ratio in parts per billion:
+
+      trim = Kp * error + Ki * integral(error dt)
+
+    The fill changes at the rate the feeder and the trimmed stream disagree,
+    so the loop is a second order system with natural frequency sqrt(Ki)
+    and damping Kp / (2 * sqrt(Ki)). It is tuned critically damped and slow,
+    a few minutes to settle, which keeps the trim smooth enough that the
+    pitch change is inaudible. The integral converges on the feeder's drift
+    and holds the average fill on target with no steady-state error.
+
+    Feeders deliver in bursts, so the fill seen by the DPC jumps by a whole
+    chunk depending on when the last one landed. Once the clocks are locked
+    that landing point barely moves, and each time it crosses a DPC the
+    error flips by a chunk. The error is low-pass filtered before it reaches
+    the loop, so those flips average out into the true position between
+    them instead of kicking the trim; what remains is a slow wander of the
+    fill within half a chunk of the target and of the trim within a few tens
+    of ppm. A fast loop would turn the flips into a limit cycle pinned at
+    the trim limit. The integral is not wound up while the trim is
+    saturated.
+--*/
+
+#ifndef _MICYAUDIO_DRIFTCTL_H_
+#define _MICYAUDIO_DRIFTCTL_H_
+
+#if !defined(_WIN32)
+#include <stdint.h>
+
+typedef int32_t         LONG;
+typedef uint8_t         BOOLEAN;
+#define TRUE            1
+#define FALSE           0
+#define FORCEINLINE     static inline __attribute__((always_inline))
+#endif
+
+//
+// Loop natural frequency in rad/s and the error filter's time constant in
+// seconds. The filter is five times faster than the loop, so it costs about
+// 10 degrees of phase margin. Feeding a 10 ms burst feeder drifting 300 ppm
+// through these, the fill settles with no mean error and stays within 5 ms.
+//
+#define DRIFTCTL_NATURAL_FREQUENCY  0.02
+#define DRIFTCTL_FILTER_SECONDS     10.0
+
+typedef struct _DRIFTCTL
+{
+    double      Proportional;       // Kp, ppb per second of error
+    double      Integral;           // Ki, ppb per second of error per second
+    double      Limit;              // largest trim either way, ppb
+    double      Filtered;           // smoothed fill error, seconds
+    double      Accumulated;        // integral term, ppb
+    BOOLEAN     Primed;             // Filtered holds a measurement
+} DRIFTCTL, *PDRIFTCTL;
+
+//=============================================================================
+FORCEINLINE
+void
+DriftCtl_Reset
+(
+    PDRIFTCTL   Control
+)
+{
+    Control->Filtered    = 0.0;
+    Control->Accumulated = 0.0;
+    Control->Primed      = FALSE;
+}
+
+//=============================================================================
+FORCEINLINE
+void
+DriftCtl_Init
+(
+    PDRIFTCTL   Control,
+    LONG        LimitPpm
+)
+{
+    const double wn = DRIFTCTL_NATURAL_FREQUENCY;
+
+    // Critically damped: Kp = 2 * wn, Ki = wn^2, scaled to ppb.
+    Control->Proportional = 2.0 * wn * 1e9;
+    Control->Integral     = wn * wn * 1e9;
+    Control->Limit        = (double)LimitPpm * 1000.0;
+
+    DriftCtl_Reset(Control);
+}
+
+//=============================================================================
+FORCEINLINE
+LONG
+DriftCtl_Update
+(
+    PDRIFTCTL   Control,
+    double      ErrorSeconds,
+    double      ElapsedSeconds
+)
+/*++
+
+Routine Description:
+
+  Feeds one measurement to the loop and returns the trim to apply until the
+  next one.
+
+Arguments:
+
+  ErrorSeconds - queued audio minus the target, in seconds. Positive when
+    the feeder runs ahead, which the trim answers by consuming faster.
+
+  ElapsedSeconds - stream time since the previous update.
+
+Return Value:
+
+  Ratio trim in parts per billion, within the limit.
+
+--*/
+{
+    double trim;
+    double step;
+
+    if (ElapsedSeconds <= 0.0)
+    {
+        ElapsedSeconds = 0.0;
+    }
+
+    if (!Control->Primed)
+    {
+        Control->Filtered = ErrorSeconds;
+        Control->Primed   = TRUE;
+    }
+    else
+    {
+        Control->Filtered += (ErrorSeconds - Control->Filtered) *
+                             (ElapsedSeconds / (DRIFTCTL_FILTER_SECONDS + ElapsedSeconds));
+    }
+
+    step = Control->Integral * Control->Filtered * ElapsedSeconds;
+    trim = Control->Proportional * Control->Filtered + Control->Accumulated + step;
+
+    // Only integrate while that does not push the trim further past the
+    // limit, so the loop recovers as soon as the error turns.
+    if ((trim <= Control->Limit || step < 0.0) && (trim >= -Control->Limit || step > 0.0))
+    {
+        Control->Accumulated += step;
+    }
+
+    if (Control->Accumulated > Control->Limit)
+    {
+        Control->Accumulated = Control->Limit;
+    }
+    else if (Control->Accumulated < -Control->Limit)
+    {
+        Control->Accumulated = -Control->Limit;
+    }
+
+    trim = Control->Proportional * Control->Filtered + Control->Accumulated;
+    if (trim > Control->Limit)
+    {
+        trim = Control->Limit;
+    }
+    else if (trim < -Control->Limit)
+    {
+        trim = -Control->Limit;
+    }
+
+    return (LONG)trim;
+}
+
+#endif // _MICYAUDIO_DRIFTCTL_H_
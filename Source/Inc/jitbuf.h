@@ -0,0 +1,339 @@
+/*++
+
+Module Name:
+
+    jitbuf.h
+
+Abstract:
+
+    Jitter buffer for feeders that deliver in irregular bursts, after the
+    delay manager of WebRTC's NetEq.
+
+    The capture stream drains the ring at a steady rate while a feeder fed
+    from the network fills it whenever packets happen to arrive. The fill
+    the DPC sees at a wakeup sits below the highest fill of the last second
+    or two by however late the feeder is running at that moment: its
+    relative delay. Every wakeup's delay goes into a histogram of 1 ms
+    buckets whose older entries fade with a time constant of
+    JITBUF_FORGET_SECONDS, and the target fill is set so that the ring
+    covers the JITBUF_QUANTILE of those delays on top of what one wakeup
+    takes:
+
+      target = need + delay(quantile) - mean delay
+
+    The mean delay comes off because the fill being held on target is the
+    average fill, which already sits that far below the peak. The target
+    never drops below the configured pre-roll nor rises above half the ring.
+
+    After RUN, and again after the ring has run dry, the buffer holds the
+    stream back while the feeder builds the fill up to the target, so a
+    feeder that starts a few milliseconds late does not leave the ring
+    running permanently close to empty. Once playing, the fill, averaged
+    over JITBUF_LEVEL_SECONDS, is let wander JITBUF_HYSTERESIS_SECONDS and
+    one wakeup above the target; beyond that the excess is dropped. A
+    smooth feeder therefore settles at a low latency, and a bursty one gets
+    as much as its bursts need.
+--*/
+
+#ifndef _MICYAUDIO_JITBUF_H_
+#define _MICYAUDIO_JITBUF_H_
+
+#if !defined(_WIN32)
+#include <stdint.h>
+
+typedef uint32_t        ULONG;
+typedef uint8_t         BOOLEAN;
+#define TRUE            1
+#define FALSE           0
+#define FORCEINLINE     static inline __attribute__((always_inline))
+#endif
+
+#define JITBUF_BUCKETS              256     // 1 ms each, longer delays count in the last
+#define JITBUF_BUCKET_SECONDS       0.001
+#define JITBUF_QUANTILE             0.995
+#define JITBUF_FORGET_SECONDS       20.0
+#define JITBUF_PEAK_SECONDS         1.0
+#define JITBUF_LEVEL_SECONDS        1.0
+#define JITBUF_HYSTERESIS_SECONDS   0.010
+
+typedef enum _JITBUF_ACTION
+{
+    JitBufPlay = 0,                 // read the ring as usual
+    JitBufBuffer,                   // read nothing, the feeder is building up the fill
+    JitBufShrink                    // drop Excess seconds of the oldest audio first
+} JITBUF_ACTION;
+
+typedef struct _JITBUF
+{
+    double      MinTarget;          // pre-roll, seconds
+    double      MaxTarget;          // seconds
+    double      Target;             // fill to hold, seconds
+    double      Level;              // fill averaged over JITBUF_LEVEL_SECONDS
+    double      Peak;               // highest fill of the current peak window
+    double      PreviousPeak;       // and of the one before
+    double      PeakElapsed;        // stream time into the current peak window
+    double      Weight;             // what the next delay counts for
+    double      Total;              // sum of Buckets
+    double      DelaySum;           // weighted sum of the delays
+    double      Excess;             // to drop, with JitBufShrink
+    BOOLEAN     Buffering;
+    double      Buckets[JITBUF_BUCKETS];
+} JITBUF, *PJITBUF;
+
+//=============================================================================
+FORCEINLINE
+void
+JitBuf_Reset
+(
+    PJITBUF     Jit
+)
+/*++
+
+Routine Description:
+
+  Forgets the feeder's delays and buffers up to the pre-roll again.
+
+--*/
+{
+    Jit->Target       = Jit->MinTarget;
+    Jit->Level        = 0.0;
+    Jit->Peak         = 0.0;
+    Jit->PreviousPeak = 0.0;
+    Jit->PeakElapsed  = 0.0;
+    Jit->Weight       = 1.0;
+    Jit->Total        = 0.0;
+    Jit->DelaySum     = 0.0;
+    Jit->Excess       = 0.0;
+    Jit->Buffering    = TRUE;
+    for (ULONG i = 0; i < JITBUF_BUCKETS; i++)
+    {
+        Jit->Buckets[i] = 0.0;
+    }
+}
+
+//=============================================================================
+FORCEINLINE
+void
+JitBuf_Init
+(
+    PJITBUF     Jit,
+    double      PreRollSeconds,
+    double      MaxSeconds
+)
+{
+    Jit->MinTarget = PreRollSeconds;
+    Jit->MaxTarget = (MaxSeconds > PreRollSeconds) ? MaxSeconds : PreRollSeconds;
+
+    JitBuf_Reset(Jit);
+}
+
+//=============================================================================
+FORCEINLINE
+void
+JitBuf_Record
+(
+    PJITBUF     Jit,
+    double      DelaySeconds,
+    double      ElapsedSeconds
+)
+/*++
+
+Routine Description:
+
+  Adds a delay to the histogram. Rather than fading every bucket at every
+  wakeup, each new delay counts for a little more than the one before; the
+  buckets are scaled back down before the weights could lose precision.
+
+--*/
+{
+    ULONG bucket = (ULONG)(DelaySeconds / JITBUF_BUCKET_SECONDS);
+
+    if (bucket >= JITBUF_BUCKETS)
+    {
+        bucket = JITBUF_BUCKETS - 1;
+    }
+
+    Jit->Weight *= 1.0 + ElapsedSeconds / JITBUF_FORGET_SECONDS;
+
+    Jit->Buckets[bucket] += Jit->Weight;
+    Jit->Total           += Jit->Weight;
+    Jit->DelaySum        += Jit->Weight * DelaySeconds;
+
+    if (Jit->Weight > 1e9)
+    {
+        double scale = 1.0 / Jit->Weight;
+
+        for (ULONG i = 0; i < JITBUF_BUCKETS; i++)
+        {
+            Jit->Buckets[i] *= scale;
+        }
+        Jit->Total    *= scale;
+        Jit->DelaySum *= scale;
+        Jit->Weight    = 1.0;
+    }
+}
+
+//=============================================================================
+FORCEINLINE
+double
+JitBuf_Quantile
+(
+    const JITBUF *  Jit
+)
+/*++
+
+Routine Description:
+
+  Upper edge of the bucket holding the JITBUF_QUANTILE of the delays.
+
+--*/
+{
+    double  rank = Jit->Total * JITBUF_QUANTILE;
+    double  seen = 0.0;
+    ULONG   i;
+
+    for (i = 0; i < JITBUF_BUCKETS - 1; i++)
+    {
+        seen += Jit->Buckets[i];
+        if (seen >= rank)
+        {
+            break;
+        }
+    }
+
+    return (double)(i + 1) * JITBUF_BUCKET_SECONDS;
+}
+
+//=============================================================================
+FORCEINLINE
+double
+JitBuf_MeanDelay
+(
+    const JITBUF *  Jit
+)
+{
+    return (Jit->Total > 0.0) ? Jit->DelaySum / Jit->Total : 0.0;
+}
+
+//=============================================================================
+FORCEINLINE
+JITBUF_ACTION
+JitBuf_Update
+(
+    PJITBUF     Jit,
+    double      FillSeconds,
+    double      NeedSeconds
+)
+/*++
+
+Routine Description:
+
+  Feeds one wakeup's view of the ring to the buffer and says what to do
+  with it.
+
+Arguments:
+
+  FillSeconds - audio queued in the ring, before this wakeup reads any.
+
+  NeedSeconds - audio this wakeup is about to produce, which is also the
+    stream time since the previous update.
+
+Return Value:
+
+  JitBufBuffer while the fill is building up to the target, counted at the
+  peak that puts its average on the target. JitBufShrink when Excess
+  should be dropped before reading; the buffer already counts it as gone.
+  JitBufPlay otherwise, including at the wakeup that finds the ring short:
+  it plays what there is, and the next ones buffer.
+
+--*/
+{
+    double delay;
+    double target;
+    double start;
+
+    if (NeedSeconds < 0.0)
+    {
+        NeedSeconds = 0.0;
+    }
+
+    if (Jit->Buffering)
+    {
+        // The fill right after the feeder delivers sits the mean delay
+        // above the average it is about to settle at. Half the ring is
+        // always within reach.
+        start = Jit->Target + JitBuf_MeanDelay(Jit);
+        if (start > Jit->MaxTarget)
+        {
+            start = Jit->MaxTarget;
+        }
+
+        if (FillSeconds < start)
+        {
+            return JitBufBuffer;
+        }
+
+        // Delays are measured from the fill the feeder has now built up.
+        Jit->Buffering    = FALSE;
+        Jit->Level        = Jit->Target;
+        Jit->Peak         = FillSeconds;
+        Jit->PreviousPeak = FillSeconds;
+        Jit->PeakElapsed  = 0.0;
+    }
+
+    // The peak covers the last one to two windows, so a feeder that slowly
+    // falls behind drags it down instead of piling up delay.
+    Jit->PeakElapsed += NeedSeconds;
+    if (Jit->PeakElapsed >= JITBUF_PEAK_SECONDS)
+    {
+        Jit->PreviousPeak = Jit->Peak;
+        Jit->Peak         = FillSeconds;
+        Jit->PeakElapsed  = 0.0;
+    }
+    if (FillSeconds > Jit->Peak)
+    {
+        Jit->Peak = FillSeconds;
+    }
+
+    delay = ((Jit->Peak > Jit->PreviousPeak) ? Jit->Peak : Jit->PreviousPeak) - FillSeconds;
+    JitBuf_Record(Jit, delay, NeedSeconds);
+
+    target = NeedSeconds + JitBuf_Quantile(Jit) - JitBuf_MeanDelay(Jit);
+    if (target < Jit->MinTarget)
+    {
+        target = Jit->MinTarget;
+    }
+    else if (target > Jit->MaxTarget)
+    {
+        target = Jit->MaxTarget;
+    }
+    Jit->Target = target;
+
+    Jit->Level += (FillSeconds - Jit->Level) * (NeedSeconds / (JITBUF_LEVEL_SECONDS + NeedSeconds));
+
+    if (FillSeconds < NeedSeconds)
+    {
+        Jit->Buffering = TRUE;
+        return JitBufPlay;
+    }
+
+    if (Jit->Level > target + NeedSeconds + JITBUF_HYSTERESIS_SECONDS)
+    {
+        // Never drop into this wakeup's audio.
+        Jit->Excess = Jit->Level - target;
+        if (Jit->Excess > FillSeconds - NeedSeconds)
+        {
+            Jit->Excess = FillSeconds - NeedSeconds;
+        }
+
+        Jit->Level        -= Jit->Excess;
+        Jit->Peak         -= Jit->Excess;
+        Jit->PreviousPeak -= Jit->Excess;
+
+        return JitBufShrink;
+    }
+
+    return JitBufPlay;
+}
+
+#endif // _MICYAUDIO_JITBUF_H_
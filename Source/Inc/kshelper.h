@@ -69,6 +69,7 @@ NTSTATUS
 PropertyHandler_Volume
 (
     _In_  PADAPTERCOMMON        AdapterCommon,
+    _In_  ULONG                 Endpoint,
     _In_  PPCPROPERTY_REQUEST   PropertyRequest,
     _In_  ULONG                 MaxChannels
 );
@@ -77,6 +78,7 @@ NTSTATUS
 PropertyHandler_Mute
 (
     _In_  PADAPTERCOMMON        AdapterCommon,
+    _In_  ULONG                 Endpoint,
     _In_  PPCPROPERTY_REQUEST   PropertyRequest,
     _In_  ULONG                 MaxChannels
 );
@@ -85,6 +87,7 @@ NTSTATUS
 PropertyHandler_PeakMeter2
 (
     _In_  PADAPTERCOMMON        AdapterCommon,
+    _In_  ULONG                 Endpoint,
     _In_  PPCPROPERTY_REQUEST   PropertyRequest,
     _In_  ULONG                 MaxChannels
 );
@@ -0,0 +1,224 @@
+/*++
+
+Module Name:
+
+    lathist.h
+
+Abstract:
+
+    Fixed-size log-linear latency histogram, in the style of HdrHistogram.
+
+    Every power of two range of values is split into LAT_HIST_SUB_COUNT
+    equal buckets, so a recorded value is known to within 1/8 of itself
+    (12.5%) whatever its magnitude, while 225 buckets cover 0 to 2^30 with
+    values below 16 recorded exactly. Larger values go to an overflow
+    bucket; the histogram also keeps the exact count, sum and maximum.
+
+    Recording is a bit scan, two shifts and a few stores, and nothing is
+    ever allocated. A histogram is not synchronized: the driver keeps one
+    per processor and records into it at DISPATCH_LEVEL, and merges the
+    copies when they are read.
+
+    User-mode readers of the latency statistics (micyioctl.h) can use the
+    header to interpret the buckets.
+--*/
+
+#ifndef _SIMPLEAUDIOSAMPLE_LATHIST_H_
+#define _SIMPLEAUDIOSAMPLE_LATHIST_H_
+
+#if !defined(_WIN32)
+#include <stdint.h>
+
+typedef uint64_t        ULONGLONG;
+typedef uint32_t        ULONG;
+#define FORCEINLINE     static inline __attribute__((always_inline))
+#endif
+
+#define LAT_HIST_SUB_BITS       3
+#define LAT_HIST_SUB_COUNT      (1u << LAT_HIST_SUB_BITS)
+#define LAT_HIST_MAX_BITS       30      // values from 2^30 on overflow
+#define LAT_HIST_OVERFLOW       ((LAT_HIST_MAX_BITS - LAT_HIST_SUB_BITS + 1) * LAT_HIST_SUB_COUNT)
+#define LAT_HIST_BUCKETS        (LAT_HIST_OVERFLOW + 1)
+
+typedef struct _LAT_HIST
+{
+    ULONGLONG   Count;
+    ULONGLONG   Sum;
+    ULONGLONG   Max;
+    ULONGLONG   Buckets[LAT_HIST_BUCKETS];
+} LAT_HIST, *PLAT_HIST;
+
+//=============================================================================
+FORCEINLINE
+ULONG
+LatHist_BucketOf
+(
+    ULONGLONG   Value
+)
+/*++
+
+Routine Description:
+
+  Values below 2 * LAT_HIST_SUB_COUNT have a bucket each. Above, a value
+  whose highest set bit is bit m falls in sub-bucket (Value >> s) - COUNT of
+  the range starting at bucket (s + 1) * COUNT, where s = m - SUB_BITS.
+
+--*/
+{
+    ULONG msb;
+    ULONG shift;
+
+    if (Value < 2 * LAT_HIST_SUB_COUNT)
+    {
+        return (ULONG)Value;
+    }
+    if (Value >= ((ULONGLONG)1 << LAT_HIST_MAX_BITS))
+    {
+        return LAT_HIST_OVERFLOW;
+    }
+
+#if defined(_WIN32)
+    _BitScanReverse64(&msb, Value);
+#else
+    msb = 63 - (ULONG)__builtin_clzll(Value);
+#endif
+
+    shift = msb - LAT_HIST_SUB_BITS;
+
+    return (shift + 1) * LAT_HIST_SUB_COUNT + (ULONG)(Value >> shift) - LAT_HIST_SUB_COUNT;
+}
+
+//=============================================================================
+FORCEINLINE
+ULONGLONG
+LatHist_BucketLow
+(
+    ULONG       Bucket
+)
+/*++
+
+Routine Description:
+
+  Smallest value that falls in Bucket. Bucket + 1 starts where it ends.
+
+--*/
+{
+    ULONG shift;
+
+    if (Bucket < 2 * LAT_HIST_SUB_COUNT)
+    {
+        return Bucket;
+    }
+    if (Bucket >= LAT_HIST_OVERFLOW)
+    {
+        return (ULONGLONG)1 << LAT_HIST_MAX_BITS;
+    }
+
+    shift = Bucket / LAT_HIST_SUB_COUNT - 1;
+
+    return (ULONGLONG)(Bucket % LAT_HIST_SUB_COUNT + LAT_HIST_SUB_COUNT) << shift;
+}
+
+//=============================================================================
+FORCEINLINE
+void
+LatHist_Reset
+(
+    PLAT_HIST   Hist
+)
+{
+    Hist->Count = 0;
+    Hist->Sum   = 0;
+    Hist->Max   = 0;
+    for (ULONG i = 0; i < LAT_HIST_BUCKETS; i++)
+    {
+        Hist->Buckets[i] = 0;
+    }
+}
+
+//=============================================================================
+FORCEINLINE
+void
+LatHist_Record
+(
+    PLAT_HIST   Hist,
+    ULONGLONG   Value
+)
+{
+    Hist->Buckets[LatHist_BucketOf(Value)]++;
+    Hist->Count++;
+    Hist->Sum += Value;
+    if (Value > Hist->Max)
+    {
+        Hist->Max = Value;
+    }
+}
+
+//=============================================================================
+FORCEINLINE
+void
+LatHist_Merge
+(
+    PLAT_HIST           To,
+    const LAT_HIST *    From
+)
+{
+    for (ULONG i = 0; i < LAT_HIST_BUCKETS; i++)
+    {
+        To->Buckets[i] += From->Buckets[i];
+    }
+    To->Count += From->Count;
+    To->Sum   += From->Sum;
+    if (From->Max > To->Max)
+    {
+        To->Max = From->Max;
+    }
+}
+
+//=============================================================================
+FORCEINLINE
+ULONGLONG
+LatHist_Percentile
+(
+    const LAT_HIST *    Hist,
+    ULONG               PerMille
+)
+/*++
+
+Routine Description:
+
+  Upper bound of the PerMille-th permille of the recorded values: the end
+  of the bucket holding that rank, capped at the maximum. 0 if nothing has
+  been recorded.
+
+--*/
+{
+    ULONGLONG rank;
+    ULONGLONG seen = 0;
+
+    if (Hist->Count == 0)
+    {
+        return 0;
+    }
+
+    rank = (Hist->Count * (PerMille > 1000 ? 1000 : PerMille) + 999) / 1000;
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+
+    for (ULONG i = 0; i < LAT_HIST_OVERFLOW; i++)
+    {
+        seen += Hist->Buckets[i];
+        if (seen >= rank)
+        {
+            ULONGLONG high = LatHist_BucketLow(i + 1) - 1;
+
+            return high < Hist->Max ? high : Hist->Max;
+        }
+    }
+
+    return Hist->Max;
+}
+
+#endif // _SIMPLEAUDIOSAMPLE_LATHIST_H_
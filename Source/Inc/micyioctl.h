@@ -0,0 +1,475 @@
+/*++
+
+Module Name:
+
+    micyioctl.h
+
+Abstract:
+
+    Control device interface (\\.\MicyAudio) shared between the driver and
+    user-mode feeders. Only depends on CTL_CODE and the basic Windows types,
+    so it can be included after either wdm.h or windows.h/winioctl.h.
+--*/
+
+#ifndef _MICYAUDIO_IOCTL_H_
+#define _MICYAUDIO_IOCTL_H_
+
+#define MICY_IOCTL_TYPE     29
+
+//
+// Copies PCM into the capture ring. Input buffer is a MICYAUDIO_SET_AUDIO_DATA
+// header immediately followed by DataSize bytes of PCM. The optional output
+// buffer receives a MICYAUDIO_SUBMIT_RESULT.
+//
+#define IOCTL_MICYAUDIO_SET_AUDIO_DATA \
+    CTL_CODE(MICY_IOCTL_TYPE, 0x902, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Maps a capture ring into the calling process. The optional input buffer is
+// a MICYAUDIO_MAP_RING_REQUEST selecting the stream (default 0). Output
+// buffer is a MICYAUDIO_RING_MAPPING. While the mapping exists the caller is the ring's
+// only producer and IOCTL_MICYAUDIO_SET_AUDIO_DATA fails with
+// STATUS_DEVICE_BUSY. The mapping is torn down by IOCTL_MICYAUDIO_UNMAP_RING
+// or when the handle used to create it is closed. A handle maps at most one
+// ring at a time.
+//
+#define IOCTL_MICYAUDIO_MAP_RING \
+    CTL_CODE(MICY_IOCTL_TYPE, 0x903, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MICYAUDIO_UNMAP_RING \
+    CTL_CODE(MICY_IOCTL_TYPE, 0x904, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Submits several chunks, possibly for several streams, in one call. Input
+// buffer is a MICYAUDIO_BATCH_HEADER, ChunkCount MICYAUDIO_CHUNK_DESCRIPTORs
+// and then the payload the descriptors point into. The optional output
+// buffer receives a MICYAUDIO_SUBMIT_RESULT totalled over all chunks. Chunks
+// flagged MICYAUDIO_CHUNK_FLAG_WAIT may leave the request pending.
+//
+#define IOCTL_MICYAUDIO_SUBMIT_BATCH \
+    CTL_CODE(MICY_IOCTL_TYPE, 0x905, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Per-stream buffering and scheduling. Input buffer of SET_CONFIG and output buffer of
+// GET_CONFIG is a MICYAUDIO_STREAM_CONFIG (GET_CONFIG reads StreamId from the
+// input). A new capacity takes effect the next time a capture stream on the
+// endpoint leaves KSSTATE_STOP, and is ignored while the ring is mapped.
+//
+#define IOCTL_MICYAUDIO_SET_CONFIG \
+    CTL_CODE(MICY_IOCTL_TYPE, 0x906, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MICYAUDIO_GET_CONFIG \
+    CTL_CODE(MICY_IOCTL_TYPE, 0x907, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Registers events that are signaled as the capture stream drains a ring, so
+// a feeder can sleep until the ring needs data instead of polling. Input
+// buffer is a MICYAUDIO_WATERMARKS. Works for mapped and IOCTL feeders alike.
+// Each stream has one set of watermarks, owned by the handle that set them;
+// they are removed by setting both events to zero or by closing that handle.
+//
+#define IOCTL_MICYAUDIO_SET_WATERMARKS \
+    CTL_CODE(MICY_IOCTL_TYPE, 0x908, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Declares the sample format and rate a feeder submits for a stream, so they
+// need not match the capture format: the stream converts while it copies
+// into the DMA buffer. Input buffer of SET_INPUT_FORMAT and output buffer of
+// GET_INPUT_FORMAT is a MICYAUDIO_INPUT_FORMAT (GET_INPUT_FORMAT reads
+// StreamId from the input). Like a new capacity, the format takes effect the
+// next time a capture stream on the endpoint leaves KSSTATE_STOP, so declare
+// it before starting the stream. It also applies to a mapped ring.
+//
+#define IOCTL_MICYAUDIO_SET_INPUT_FORMAT \
+    CTL_CODE(MICY_IOCTL_TYPE, 0x909, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MICYAUDIO_GET_INPUT_FORMAT \
+    CTL_CODE(MICY_IOCTL_TYPE, 0x90A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Reads the levels of the audio a capture stream has delivered, as measured
+// from its DMA buffer. Input buffer is the StreamId (ULONG), output buffer a
+// MICYAUDIO_LEVELS. The same peaks feed the endpoint's peak meter node.
+//
+#define IOCTL_MICYAUDIO_GET_LEVELS \
+    CTL_CODE(MICY_IOCTL_TYPE, 0x90B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Maps the DMA buffer of a capture stream in direct mode
+// (MICYAUDIO_CONFIG_FLAG_DIRECT) into the calling process, together with a
+// MICYAUDIO_DIRECT_POSITION page. The optional input buffer is a
+// MICYAUDIO_MAP_RING_REQUEST selecting the stream (default 0). Output buffer
+// is a MICYAUDIO_DIRECT_MAPPING. Fails with STATUS_DEVICE_NOT_READY until
+// the stream has allocated its buffer and with STATUS_DEVICE_BUSY while
+// another handle has it mapped. The mapping is torn down by
+// IOCTL_MICYAUDIO_UNMAP_DIRECT or when the handle used to create it is
+// closed; it stays valid after the stream closes, with State set to
+// MICYAUDIO_DIRECT_STATE_CLOSED. A handle maps at most one DMA buffer at a
+// time, besides a ring.
+//
+#define IOCTL_MICYAUDIO_MAP_DIRECT \
+    CTL_CODE(MICY_IOCTL_TYPE, 0x90C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define IOCTL_MICYAUDIO_UNMAP_DIRECT \
+    CTL_CODE(MICY_IOCTL_TYPE, 0x90D, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Reads the driver's counters for a capture endpoint, summed over all CPUs
+// since the driver loaded. Input buffer is the StreamId (ULONG), output
+// buffer a MICYAUDIO_STATS.
+//
+#define IOCTL_MICYAUDIO_GET_STATS \
+    CTL_CODE(MICY_IOCTL_TYPE, 0x90E, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Reads the driver's latency histograms, merged over all CPUs and streams.
+// The optional input buffer is a ULONG of MICYAUDIO_LATENCY_FLAG_*, output
+// buffer a MICYAUDIO_LATENCY.
+//
+#define IOCTL_MICYAUDIO_GET_LATENCY \
+    CTL_CODE(MICY_IOCTL_TYPE, 0x90F, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define MICYAUDIO_MAX_BATCH_CHUNKS      256
+
+//
+// Most capture endpoints the driver creates. How many it does create is the
+// CaptureEndpointCount registry value (DWORD, default 1) of the driver's
+// Parameters key, read at load. StreamId N addresses the Nth of them.
+//
+#define MICYAUDIO_MAX_ENDPOINTS         16
+
+#define MICYAUDIO_MIN_CAPACITY_MS       5
+#define MICYAUDIO_MAX_CAPACITY_MS       10000
+
+typedef struct _MICYAUDIO_SET_AUDIO_DATA
+{
+    ULONG       StreamId;           // capture endpoint: 0 or 1 = first, N = Nth
+    ULONG       DataSize;           // bytes of PCM following the header
+    UCHAR       AudioData[1];
+} MICYAUDIO_SET_AUDIO_DATA, *PMICYAUDIO_SET_AUDIO_DATA;
+
+#define MICYAUDIO_SET_AUDIO_DATA_HEADER_SIZE \
+    FIELD_OFFSET(MICYAUDIO_SET_AUDIO_DATA, AudioData)
+
+typedef struct _MICYAUDIO_BATCH_HEADER
+{
+    ULONG       ChunkCount;         // 1..MICYAUDIO_MAX_BATCH_CHUNKS
+    ULONG       Reserved;           // must be zero
+} MICYAUDIO_BATCH_HEADER, *PMICYAUDIO_BATCH_HEADER;
+
+//
+// Offset is relative to the start of the payload, i.e. the first byte after
+// the descriptor array. Chunks may appear in any order and may overlap.
+//
+typedef struct _MICYAUDIO_CHUNK_DESCRIPTOR
+{
+    ULONG       StreamId;
+    ULONG       Offset;
+    ULONG       Length;
+    ULONG       Flags;              // MICYAUDIO_CHUNK_FLAG_*
+} MICYAUDIO_CHUNK_DESCRIPTOR, *PMICYAUDIO_CHUNK_DESCRIPTOR;
+
+//
+// Instead of dropping what does not fit, pend the request until the chunk
+// has been written in full. Chunks are written in order, so later chunks of
+// the request wait too. Waiting requests on a stream are served in
+// submission order and complete as the capture stream drains the ring, which
+// lets a feeder pace itself with overlapped I/O. Pended requests are
+// cancelled by CancelIo or when the handle is closed. A WAIT chunk for a
+// stream whose ring is mapped is treated as a plain chunk.
+//
+#define MICYAUDIO_CHUNK_FLAG_WAIT       0x00000001
+
+#define MICYAUDIO_CHUNK_FLAGS_VALID     (MICYAUDIO_CHUNK_FLAG_WAIT)
+
+//
+// CapacityMs bounds how much audio the ring can hold. TargetMs is the
+// latency the capture stream holds the ring to: when more than twice the
+// target is queued the oldest audio is dropped back down to the target.
+// TargetMs 0 disables trimming, for bursty feeders that rely on buffering.
+//
+typedef struct _MICYAUDIO_STREAM_CONFIG
+{
+    ULONG       StreamId;
+    ULONG       CapacityMs;         // MICYAUDIO_MIN/MAX_CAPACITY_MS
+    ULONG       TargetMs;           // 0 or <= CapacityMs / 2
+    ULONG       Flags;              // MICYAUDIO_CONFIG_FLAG_*
+} MICYAUDIO_STREAM_CONFIG, *PMICYAUDIO_STREAM_CONFIG;
+
+//
+// By default the capture stream only wakes up once per packet. In low
+// latency mode it also wakes up every millisecond in between, so the ring
+// is drained, and WAIT submissions and watermarks are served, at 1 ms
+// granularity. Costs up to ten times as many timer interrupts. Applies the
+// next time the stream leaves KSSTATE_STOP.
+//
+#define MICYAUDIO_CONFIG_FLAG_LOW_LATENCY   0x00000001
+
+//
+// A feeder paced by its own clock never quite matches the stream's rate, so
+// by default its ring slowly fills until trimmed or runs dry. In adaptive
+// rate mode the capture stream instead watches the ring's fill around
+// TargetMs and trims its resampling ratio by up to
+// MICYAUDIO_MAX_RATE_ADJUSTMENT_PPM to hold it there, locking the feeder's
+// clock to its own. The fill settles within half a feeder chunk of the
+// target over a few minutes; TargetMs should cover a chunk plus a packet.
+// Requires a nonzero TargetMs and a PCM or float stream format. Applies the
+// next time the stream leaves KSSTATE_STOP.
+//
+#define MICYAUDIO_CONFIG_FLAG_ADAPTIVE_RATE 0x00000002
+
+//
+// In direct mode the feeder writes the stream format straight into the
+// capture stream's DMA buffer, mapped with IOCTL_MICYAUDIO_MAP_DIRECT, ahead
+// of the stream's position; the stream neither reads the ring nor converts.
+// Whatever the feeder has not written by the time the stream reaches it is
+// captured as silence. Only one capture stream per endpoint can be in
+// direct mode; others opened alongside it read the ring as usual. Applies to
+// capture streams opened afterwards.
+//
+#define MICYAUDIO_CONFIG_FLAG_DIRECT        0x00000004
+
+//
+// In jitter buffer mode, for feeders fed from a network, TargetMs is a
+// pre-roll: after RUN the capture stream produces silence (or
+// concealment) until the feeder has queued that much. From then on the
+// stream measures how irregularly the feeder delivers and holds the ring's
+// fill just high enough to ride out 99.5% of it, never below TargetMs and
+// never above half of CapacityMs; audio queued well beyond that is
+// dropped, and when the ring runs dry anyway the stream waits for it to
+// fill back up before reading on. The latency therefore grows when the
+// feeder turns bursty and shrinks over tens of seconds when it calms down.
+// Combined with adaptive rate, the rate is trimmed to hold the fill at that
+// target. Requires a nonzero TargetMs. Does not apply in direct mode.
+// Applies the next time the stream leaves KSSTATE_STOP.
+//
+#define MICYAUDIO_CONFIG_FLAG_JITTER_BUFFER 0x00000008
+
+//
+// What the capture stream puts in place of audio the feeder was late with.
+// Silence zero-fills as before. The other modes play on from the last pitch
+// period the feeder delivered: fade fades it out over 5 ms, repeat holds it
+// for 10 ms and fades it out by 60 ms, noise crossfades it over 5 ms into
+// comfort noise at the audio's quietest recent level. Audio that comes back
+// mid-gap is crossfaded in over 5 ms. Does not apply in direct mode.
+// Applies the next time the stream leaves KSSTATE_STOP.
+//
+#define MICYAUDIO_CONFIG_CONCEAL_MASK       0x00000030
+#define MICYAUDIO_CONFIG_CONCEAL_SHIFT      4
+#define MICYAUDIO_CONFIG_CONCEAL_SILENCE    0x00000000
+#define MICYAUDIO_CONFIG_CONCEAL_FADE       0x00000010
+#define MICYAUDIO_CONFIG_CONCEAL_REPEAT     0x00000020
+#define MICYAUDIO_CONFIG_CONCEAL_NOISE      0x00000030
+
+#define MICYAUDIO_CONFIG_FLAGS_VALID        (MICYAUDIO_CONFIG_FLAG_LOW_LATENCY | \
+                                             MICYAUDIO_CONFIG_FLAG_ADAPTIVE_RATE | \
+                                             MICYAUDIO_CONFIG_FLAG_DIRECT | \
+                                             MICYAUDIO_CONFIG_FLAG_JITTER_BUFFER | \
+                                             MICYAUDIO_CONFIG_CONCEAL_MASK)
+
+#define MICYAUDIO_MAX_RATE_ADJUSTMENT_PPM   500
+
+//
+// LowEvent is signaled when the ring's fill drops below LowBytes, HighEvent
+// when it rises above HighBytes. Each fires once per crossing and is armed
+// again once the fill is back on the other side of its threshold; use auto-
+// reset events. Events are handles valid in the calling process, either may
+// be zero. LowBytes must be in 1..Capacity and HighBytes below Capacity
+// (MICYAUDIO_RING_MAPPING), with LowBytes <= HighBytes if both are set.
+//
+typedef struct _MICYAUDIO_WATERMARKS
+{
+    ULONG       StreamId;
+    ULONG       LowBytes;
+    ULONG       HighBytes;
+    ULONG       Reserved;
+    ULONG64     LowEvent;           // HANDLE
+    ULONG64     HighEvent;          // HANDLE
+} MICYAUDIO_WATERMARKS, *PMICYAUDIO_WATERMARKS;
+
+//
+// Channel count and order are always those of the capture stream; the
+// sample encoding and rate may differ. Floating point samples are full scale
+// at +-1.0 and clipped beyond it. A SampleRate other than the stream's is
+// converted by a polyphase resampler whose Quality trades latency and CPU
+// for accuracy (about 8, 16 or 32 input frames of latency).
+//
+#define MICYAUDIO_SAMPLE_FORMAT_NATIVE      0   // the capture stream's own format
+#define MICYAUDIO_SAMPLE_FORMAT_INT16       1
+#define MICYAUDIO_SAMPLE_FORMAT_INT24       2   // packed, 3 bytes per sample
+#define MICYAUDIO_SAMPLE_FORMAT_INT32       3
+#define MICYAUDIO_SAMPLE_FORMAT_FLOAT32     4
+
+#define MICYAUDIO_RESAMPLER_QUALITY_DEFAULT 0   // medium
+#define MICYAUDIO_RESAMPLER_QUALITY_LOW     1
+#define MICYAUDIO_RESAMPLER_QUALITY_MEDIUM  2
+#define MICYAUDIO_RESAMPLER_QUALITY_HIGH    3
+
+#define MICYAUDIO_MIN_SAMPLE_RATE           8000
+#define MICYAUDIO_MAX_SAMPLE_RATE           192000
+
+typedef struct _MICYAUDIO_INPUT_FORMAT
+{
+    ULONG       StreamId;
+    ULONG       SampleFormat;       // MICYAUDIO_SAMPLE_FORMAT_*
+    ULONG       SampleRate;         // 0 = the capture stream's rate
+    ULONG       Quality;            // MICYAUDIO_RESAMPLER_QUALITY_*
+} MICYAUDIO_INPUT_FORMAT, *PMICYAUDIO_INPUT_FORMAT;
+
+//
+// Levels are linear, 0 to 0x7FFFFFFF for full scale. Peak is the highest
+// since the previous IOCTL_MICYAUDIO_GET_LEVELS, which clears it; Rms is
+// over the last wakeup of the stream (one packet, or 1 ms in low latency
+// mode). Channels is 0 until a capture stream has run on the endpoint.
+//
+#define MICYAUDIO_MAX_LEVEL_CHANNELS        8
+
+typedef struct _MICYAUDIO_LEVELS
+{
+    ULONG       StreamId;
+    ULONG       Channels;
+    ULONG       Peak[MICYAUDIO_MAX_LEVEL_CHANNELS];
+    ULONG       Rms[MICYAUDIO_MAX_LEVEL_CHANNELS];
+} MICYAUDIO_LEVELS, *PMICYAUDIO_LEVELS;
+
+//
+// Counters of a capture endpoint; streams on the same endpoint add up.
+// The Ioctl* members count every request of the control device, whatever
+// its StreamId. IoctlLatency[0] counts requests served in under 1 us,
+// IoctlLatency[i] those that took [2^(i-1), 2^i) us and the last bucket
+// everything longer.
+//
+#define MICYAUDIO_STATS_LATENCY_BUCKETS     16
+
+typedef struct _MICYAUDIO_STATS
+{
+    ULONG       StreamId;
+    ULONG       Reserved;
+    ULONG64     BytesSubmitted;     // written into the ring by submissions
+    ULONG64     BytesDropped;       // submitted but did not fit
+    ULONG64     SilenceBytes;       // concealed or zero-filled because the feeder was late
+    ULONG64     DpcCount;           // notification DPCs of capture streams
+    ULONG64     DpcMaxNs;           // longest of them
+    ULONG64     RingHighWater;      // most bytes found queued in the ring
+    ULONG64     IoctlCount;
+    ULONG64     IoctlLatency[MICYAUDIO_STATS_LATENCY_BUCKETS];
+} MICYAUDIO_STATS, *PMICYAUDIO_STATS;
+
+//
+// Latency histograms, in nanoseconds. Buckets are log-linear (lathist.h):
+// values below 2^(SUB_BITS + 1) have a bucket each; above, every power of two
+// range is split into 2^SUB_BITS equal buckets, and the last bucket holds
+// everything from 2^MAX_BITS on. Count, SumNs and MaxNs are exact.
+//
+// DPC_TIME is how long a stream's notification DPC ran, LOCK_HOLD how long
+// it held the stream's position lock, and DPC_LATENESS how long after the
+// QPC it was armed for the DPC started. IOCTL_TIME is how long the control
+// device took to serve a request.
+//
+#define MICYAUDIO_LATENCY_DPC_TIME          0
+#define MICYAUDIO_LATENCY_DPC_LATENESS      1
+#define MICYAUDIO_LATENCY_IOCTL_TIME        2
+#define MICYAUDIO_LATENCY_LOCK_HOLD         3
+#define MICYAUDIO_LATENCY_HISTOGRAMS        4
+
+#define MICYAUDIO_LATENCY_SUB_BITS          3
+#define MICYAUDIO_LATENCY_MAX_BITS          30
+#define MICYAUDIO_LATENCY_BUCKETS           225
+
+//
+// Clears the histograms once they have been read. Values recorded while the
+// request runs may be lost or counted again after the reset.
+//
+#define MICYAUDIO_LATENCY_FLAG_RESET        0x00000001
+#define MICYAUDIO_LATENCY_FLAGS_VALID       (MICYAUDIO_LATENCY_FLAG_RESET)
+
+typedef struct _MICYAUDIO_LATENCY_HISTOGRAM
+{
+    ULONG64     Count;
+    ULONG64     SumNs;
+    ULONG64     MaxNs;
+    ULONG64     Buckets[MICYAUDIO_LATENCY_BUCKETS];
+} MICYAUDIO_LATENCY_HISTOGRAM, *PMICYAUDIO_LATENCY_HISTOGRAM;
+
+typedef struct _MICYAUDIO_LATENCY
+{
+    MICYAUDIO_LATENCY_HISTOGRAM Histograms[MICYAUDIO_LATENCY_HISTOGRAMS];
+} MICYAUDIO_LATENCY, *PMICYAUDIO_LATENCY;
+
+typedef struct _MICYAUDIO_SUBMIT_RESULT
+{
+    ULONG       BytesAccepted;
+    ULONG       BytesDropped;       // did not fit in the ring, or a partial frame ending a chunk
+} MICYAUDIO_SUBMIT_RESULT, *PMICYAUDIO_SUBMIT_RESULT;
+
+typedef struct _MICYAUDIO_MAP_RING_REQUEST
+{
+    ULONG       StreamId;
+} MICYAUDIO_MAP_RING_REQUEST, *PMICYAUDIO_MAP_RING_REQUEST;
+
+//
+// Layout of a mapped ring. The control block (PCM_RING_CONTROL, see
+// pcmring.h) is at BaseAddress + ControlOffset and the data area of Capacity
+// bytes at BaseAddress + DataOffset. The feeder binds a PCM_RING to these
+// with PcmRing_Bind and produces with PcmRing_Write; the kernel consumes.
+//
+typedef struct _MICYAUDIO_RING_MAPPING
+{
+    ULONG64     BaseAddress;
+    ULONG       ControlOffset;
+    ULONG       DataOffset;
+    ULONG       Capacity;           // bytes, power of two
+    ULONG       Reserved;
+} MICYAUDIO_RING_MAPPING, *PMICYAUDIO_RING_MAPPING;
+
+//
+// Position page of a direct mode DMA buffer. Positions are linear byte counts
+// since the stream last left KSSTATE_STOP; byte N of the stream lives at
+// offset N % BufferBytes of the buffer. The driver restarts ReadPosition
+// from 0 and increments Generation whenever the stream stops.
+//
+// The feeder writes audio for positions at and after ReadPosition and then
+// publishes how far it got by storing WritePosition, with release semantics
+// so the audio is visible first. It should stay less than BufferBytes minus
+// PacketBytes ahead of ReadPosition: the packets just behind ReadPosition
+// may still be being read by the audio engine. A WritePosition behind the
+// stream, or more than BufferBytes ahead of it (e.g. from before a
+// restart), counts as nothing written.
+//
+// ReadQpc is the performance counter value at which the stream reached
+// ReadPosition; it is stored before ReadPosition, so read ReadPosition,
+// then ReadQpc, then ReadPosition again until the two agree.
+//
+#define MICYAUDIO_DIRECT_STATE_STOPPED      0
+#define MICYAUDIO_DIRECT_STATE_PAUSED       1
+#define MICYAUDIO_DIRECT_STATE_RUNNING      2
+#define MICYAUDIO_DIRECT_STATE_CLOSED       3   // the stream is gone, unmap
+
+typedef struct _MICYAUDIO_DIRECT_POSITION
+{
+    // Written by the driver.
+    volatile ULONG64    ReadPosition;
+    volatile ULONG64    ReadQpc;
+    volatile ULONG64    SilenceBytes;       // zero-filled because the feeder was late
+    volatile ULONG      State;              // MICYAUDIO_DIRECT_STATE_*
+    volatile ULONG      Generation;
+    ULONG               BufferBytes;
+    ULONG               PacketBytes;        // 0 if the stream is not event driven
+    ULONG               BlockAlign;
+    ULONG               SamplesPerSec;
+    UCHAR               Reserved1[16];
+
+    // Written by the feeder, on a cache line of its own.
+    volatile ULONG64    WritePosition;
+    UCHAR               Reserved2[56];
+} MICYAUDIO_DIRECT_POSITION, *PMICYAUDIO_DIRECT_POSITION;
+
+typedef struct _MICYAUDIO_DIRECT_MAPPING
+{
+    ULONG64     BufferAddress;      // BufferBytes of audio in the stream format
+    ULONG64     PositionAddress;    // MICYAUDIO_DIRECT_POSITION
+    ULONG       BufferBytes;
+    ULONG       Reserved;
+} MICYAUDIO_DIRECT_MAPPING, *PMICYAUDIO_DIRECT_MAPPING;
+
+#endif // _MICYAUDIO_IOCTL_H_
@@ -48,7 +48,7 @@ public:
         _In_opt_    PVOID                   DeviceContext
     )
     : CUnknown(UnknownOuter),
-      CMiniportTopologySimpleAudioSample(FilterDesc, DeviceMaxChannels),
+      CMiniportTopologySimpleAudioSample(FilterDesc, DeviceMaxChannels, (ULONG)(ULONG_PTR)DeviceContext),
       m_DeviceType(DeviceType),
       m_DeviceContext(DeviceContext)
     {
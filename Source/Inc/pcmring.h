@@ -0,0 +1,651 @@
+/*++
+
+Module Name:
+
+    pcmring.h
+
+Abstract:
+
+    Lock-free single-producer/single-consumer byte ring used to hand PCM
+    data from the feeder (control device IOCTL path) to the capture DPC.
+
+    The ring keeps two monotonically increasing 64-bit cursors, each on its
+    own cache line. Only the producer stores WriteCursor and only the
+    consumer stores ReadCursor; the other side reads it with acquire
+    semantics. Capacity is always a power of two so the cursor to offset
+    conversion is a mask, and a 64-bit cursor never wraps in practice.
+
+    The cursor block may live in memory shared with an untrusted process.
+    Every cursor is therefore loaded once, and a fill level outside
+    [0, Capacity] is treated as corruption: the producer sees a full ring
+    and the consumer resynchronizes by discarding, so a misbehaving peer can
+    only starve itself and never steer a copy outside the data area.
+
+    A ring can also be read by several consumers at once, each getting every
+    byte (PcmRing_Reader*). Every reader then has a private cursor the
+    producer never sees, and the consumer side publishes the slowest active
+    reader as ReadCursor with PcmRing_Release, so the producer is unchanged
+    and still only ever overwrites what all readers are done with. A reader
+    that is not counted towards ReadCursor can be lapped; it notices, before
+    or after copying, and skips ahead to the newest data instead of handing
+    out bytes that were overwritten under it.
+
+    Besides the basic Windows types the header only needs the
+    ReadAcquire64/WriteRelease64/InterlockedCompareExchange64 intrinsics,
+    so user-mode feeders that map the ring (micyioctl.h) can use it too.
+--*/
+
+#ifndef _SIMPLEAUDIOSAMPLE_PCMRING_H_
+#define _SIMPLEAUDIOSAMPLE_PCMRING_H_
+
+#if !defined(_WIN32)
+//
+// Host build: map the Windows types and barriers onto the C11-style builtins.
+//
+#include <stdint.h>
+#include <string.h>
+
+typedef int64_t         LONG64;
+typedef uint32_t        ULONG;
+typedef uint8_t         UCHAR;
+typedef UCHAR           *PUCHAR;
+typedef int             BOOLEAN;
+#define DECLSPEC_CACHEALIGN             __attribute__((aligned(64)))
+#define FORCEINLINE                     static inline __attribute__((always_inline))
+#define ReadAcquire64(p)                __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ReadNoFence64(p)                __atomic_load_n((p), __ATOMIC_RELAXED)
+#define WriteRelease64(p, v)            __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define WriteNoFence64(p, v)            __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define RtlCopyMemory(d, s, n)          memcpy((d), (s), (n))
+#define MemoryBarrier()                 __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange64(p, x, c) __sync_val_compare_and_swap((p), (c), (x))
+#endif
+
+#define PCM_RING_CACHE_LINE             64
+#define PCM_RING_MIN_CAPACITY           PCM_RING_CACHE_LINE
+#define PCM_RING_MAX_CAPACITY           0x40000000UL        // 1 GB
+#define PCM_RING_MAX_READERS            8
+
+//
+// Cursor block. Each cursor owns a full cache line so the producer and the
+// consumer never write to the same line.
+//
+typedef struct DECLSPEC_CACHEALIGN _PCM_RING_CONTROL
+{
+    volatile LONG64     WriteCursor;        // producer owned, total bytes written
+    UCHAR               Reserved0[PCM_RING_CACHE_LINE - sizeof(LONG64)];
+    volatile LONG64     ReadCursor;         // consumer owned, total bytes read
+    UCHAR               Reserved1[PCM_RING_CACHE_LINE - sizeof(LONG64)];
+} PCM_RING_CONTROL, *PPCM_RING_CONTROL;
+
+typedef struct _PCM_RING
+{
+    PPCM_RING_CONTROL   Control;
+    PUCHAR              Data;
+    ULONG               Capacity;           // bytes, power of two
+    ULONG               Mask;               // Capacity - 1
+} PCM_RING, *PPCM_RING;
+
+//
+// Private cursor of one of several readers. Only that reader stores it, so
+// each gets its own cache line; PcmRing_Release reads them all.
+//
+typedef struct DECLSPEC_CACHEALIGN _PCM_RING_READER
+{
+    volatile LONG64     Cursor;             // total bytes this reader consumed
+    ULONG               Laps;               // times the producer overran it
+    UCHAR               Reserved[PCM_RING_CACHE_LINE - sizeof(LONG64) - sizeof(ULONG)];
+} PCM_RING_READER, *PPCM_RING_READER;
+
+//=============================================================================
+FORCEINLINE
+ULONG
+PcmRing_RoundCapacity
+(
+    ULONG   Requested
+)
+/*++
+
+Routine Description:
+
+  Rounds a requested capacity up to the next power of two, clamped to
+  [PCM_RING_MIN_CAPACITY, PCM_RING_MAX_CAPACITY].
+
+--*/
+{
+    ULONG capacity = PCM_RING_MIN_CAPACITY;
+
+    if (Requested > PCM_RING_MAX_CAPACITY)
+    {
+        return PCM_RING_MAX_CAPACITY;
+    }
+
+    while (capacity < Requested)
+    {
+        capacity <<= 1;
+    }
+
+    return capacity;
+}
+
+//=============================================================================
+FORCEINLINE
+void
+PcmRing_Bind
+(
+    PPCM_RING           Ring,
+    PPCM_RING_CONTROL   Control,
+    PUCHAR              Data,
+    ULONG               Capacity
+)
+/*++
+
+Routine Description:
+
+  Binds a ring view to existing storage without touching the cursors. Used
+  by a peer that attaches to a ring some other party has already set up.
+  Capacity must be a power of two.
+
+--*/
+{
+    Ring->Control   = Control;
+    Ring->Data      = Data;
+    Ring->Capacity  = Capacity;
+    Ring->Mask      = Capacity - 1;
+}
+
+//=============================================================================
+FORCEINLINE
+void
+PcmRing_Attach
+(
+    PPCM_RING           Ring,
+    PPCM_RING_CONTROL   Control,
+    PUCHAR              Data,
+    ULONG               Capacity
+)
+/*++
+
+Routine Description:
+
+  Binds a ring to caller-owned storage and resets both cursors. Capacity
+  must already be a power of two. Must not race with either side.
+
+--*/
+{
+    PcmRing_Bind(Ring, Control, Data, Capacity);
+
+    WriteNoFence64(&Control->WriteCursor, 0);
+    WriteNoFence64(&Control->ReadCursor, 0);
+}
+
+//=============================================================================
+FORCEINLINE
+BOOLEAN
+PcmRing_IsValidFill
+(
+    const PCM_RING *    Ring,
+    LONG64              Read,
+    LONG64              Write
+)
+{
+    return (Write - Read) >= 0 && (Write - Read) <= (LONG64)Ring->Capacity;
+}
+
+//=============================================================================
+FORCEINLINE
+ULONG
+PcmRing_Count
+(
+    const PCM_RING *    Ring
+)
+/*++
+
+Routine Description:
+
+  Returns the number of bytes currently stored. Safe from either side; the
+  result is exact for the caller's own side and conservative for the other.
+
+--*/
+{
+    LONG64 read  = ReadAcquire64(&Ring->Control->ReadCursor);
+    LONG64 write = ReadAcquire64(&Ring->Control->WriteCursor);
+
+    if (!PcmRing_IsValidFill(Ring, read, write))
+    {
+        return 0;
+    }
+
+    return (ULONG)(write - read);
+}
+
+//=============================================================================
+FORCEINLINE
+ULONG
+PcmRing_Write
+(
+    PPCM_RING           Ring,
+    const UCHAR *       Source,
+    ULONG               Length
+)
+/*++
+
+Routine Description:
+
+  Producer side. Copies up to Length bytes into the ring and publishes them
+  with a single release store. Bytes that do not fit are not written.
+
+Return Value:
+
+  Number of bytes written.
+
+--*/
+{
+    PPCM_RING_CONTROL   control = Ring->Control;
+    LONG64              write   = ReadNoFence64(&control->WriteCursor);
+    LONG64              read    = ReadAcquire64(&control->ReadCursor);
+    ULONG               space;
+    ULONG               offset;
+    ULONG               first;
+
+    if (!PcmRing_IsValidFill(Ring, read, write))
+    {
+        return 0;
+    }
+
+    space = Ring->Capacity - (ULONG)(write - read);
+
+    if (Length > space)
+    {
+        Length = space;
+    }
+
+    if (Length == 0)
+    {
+        return 0;
+    }
+
+    offset = (ULONG)write & Ring->Mask;
+    first  = Ring->Capacity - offset;
+    if (first > Length)
+    {
+        first = Length;
+    }
+
+    RtlCopyMemory(Ring->Data + offset, Source, first);
+    if (Length > first)
+    {
+        RtlCopyMemory(Ring->Data, Source + first, Length - first);
+    }
+
+    WriteRelease64(&control->WriteCursor, write + Length);
+
+    return Length;
+}
+
+//=============================================================================
+FORCEINLINE
+ULONG
+PcmRing_Read
+(
+    PPCM_RING           Ring,
+    UCHAR *             Destination,
+    ULONG               Length
+)
+/*++
+
+Routine Description:
+
+  Consumer side. Copies up to Length bytes out of the ring and releases the
+  space back to the producer with a single release store.
+
+Return Value:
+
+  Number of bytes read.
+
+--*/
+{
+    PPCM_RING_CONTROL   control = Ring->Control;
+    LONG64              read    = ReadNoFence64(&control->ReadCursor);
+    LONG64              write   = ReadAcquire64(&control->WriteCursor);
+    ULONG               avail;
+    ULONG               offset;
+    ULONG               first;
+
+    if (!PcmRing_IsValidFill(Ring, read, write))
+    {
+        WriteRelease64(&control->ReadCursor, write);
+        return 0;
+    }
+
+    avail = (ULONG)(write - read);
+
+    if (Length > avail)
+    {
+        Length = avail;
+    }
+
+    if (Length == 0)
+    {
+        return 0;
+    }
+
+    offset = (ULONG)read & Ring->Mask;
+    first  = Ring->Capacity - offset;
+    if (first > Length)
+    {
+        first = Length;
+    }
+
+    RtlCopyMemory(Destination, Ring->Data + offset, first);
+    if (Length > first)
+    {
+        RtlCopyMemory(Destination + first, Ring->Data, Length - first);
+    }
+
+    WriteRelease64(&control->ReadCursor, read + Length);
+
+    return Length;
+}
+
+//=============================================================================
+FORCEINLINE
+ULONG
+PcmRing_Skip
+(
+    PPCM_RING           Ring,
+    ULONG               Length
+)
+/*++
+
+Routine Description:
+
+  Consumer side. Drops up to Length of the oldest bytes without copying them.
+
+Return Value:
+
+  Number of bytes dropped.
+
+--*/
+{
+    PPCM_RING_CONTROL   control = Ring->Control;
+    LONG64              read    = ReadNoFence64(&control->ReadCursor);
+    LONG64              write   = ReadAcquire64(&control->WriteCursor);
+
+    if (!PcmRing_IsValidFill(Ring, read, write))
+    {
+        WriteRelease64(&control->ReadCursor, write);
+        return 0;
+    }
+
+    if (Length > (ULONG)(write - read))
+    {
+        Length = (ULONG)(write - read);
+    }
+
+    WriteRelease64(&control->ReadCursor, read + Length);
+
+    return Length;
+}
+
+//=============================================================================
+FORCEINLINE
+void
+PcmRing_Discard
+(
+    PPCM_RING           Ring
+)
+/*++
+
+Routine Description:
+
+  Consumer side. Drops everything currently stored by moving the read
+  cursor up to the producer's last published write cursor.
+
+--*/
+{
+    LONG64 write = ReadAcquire64(&Ring->Control->WriteCursor);
+
+    WriteRelease64(&Ring->Control->ReadCursor, write);
+}
+
+//=============================================================================
+FORCEINLINE
+void
+PcmRing_ReaderDiscard
+(
+    const PCM_RING *    Ring,
+    PPCM_RING_READER    Reader
+)
+/*++
+
+Routine Description:
+
+  Reader side. Moves the reader up to the producer's last published write
+  cursor, so it starts with the next byte written.
+
+--*/
+{
+    WriteRelease64(&Reader->Cursor, ReadAcquire64(&Ring->Control->WriteCursor));
+}
+
+//=============================================================================
+FORCEINLINE
+ULONG
+PcmRing_ReaderCount
+(
+    const PCM_RING *    Ring,
+    const PCM_RING_READER * Reader
+)
+/*++
+
+Routine Description:
+
+  Returns the number of bytes the reader has not consumed yet, 0 if it has
+  been lapped.
+
+--*/
+{
+    LONG64 read  = ReadNoFence64(&Reader->Cursor);
+    LONG64 write = ReadAcquire64(&Ring->Control->WriteCursor);
+
+    if (!PcmRing_IsValidFill(Ring, read, write))
+    {
+        return 0;
+    }
+
+    return (ULONG)(write - read);
+}
+
+//=============================================================================
+FORCEINLINE
+ULONG
+PcmRing_ReaderRead
+(
+    const PCM_RING *    Ring,
+    PPCM_RING_READER    Reader,
+    UCHAR *             Destination,
+    ULONG               Length
+)
+/*++
+
+Routine Description:
+
+  Reader side. Copies up to Length bytes out of the ring and advances the
+  reader's cursor; the space only goes back to the producer once every
+  active reader is past it and PcmRing_Release has been called.
+
+  A reader that is not holding the producer back can be lapped. If the fill
+  is already out of range the reader skips to the write cursor. The
+  producer may also overrun the bytes while they are being copied, and it
+  stores them before it publishes its cursor, so the write cursor cannot
+  tell. What bounds the producer is ReadCursor: it only ever writes over
+  bytes before the ReadCursor it last saw. ReadCursor is therefore checked
+  after the copy, and if it has moved past the reader the copy is thrown
+  away and the reader skips ahead the same way. An active reader is never
+  behind ReadCursor. Each such skip counts in Reader->Laps.
+
+Return Value:
+
+  Number of bytes read.
+
+--*/
+{
+    LONG64  read  = ReadNoFence64(&Reader->Cursor);
+    LONG64  write = ReadAcquire64(&Ring->Control->WriteCursor);
+    ULONG   avail;
+    ULONG   offset;
+    ULONG   first;
+
+    if (!PcmRing_IsValidFill(Ring, read, write))
+    {
+        Reader->Laps++;
+        WriteRelease64(&Reader->Cursor, write);
+        return 0;
+    }
+
+    avail = (ULONG)(write - read);
+
+    if (Length > avail)
+    {
+        Length = avail;
+    }
+
+    if (Length == 0)
+    {
+        return 0;
+    }
+
+    offset = (ULONG)read & Ring->Mask;
+    first  = Ring->Capacity - offset;
+    if (first > Length)
+    {
+        first = Length;
+    }
+
+    RtlCopyMemory(Destination, Ring->Data + offset, first);
+    if (Length > first)
+    {
+        RtlCopyMemory(Destination + first, Ring->Data, Length - first);
+    }
+
+    // Order the copy before the look at ReadCursor, so a producer allowed
+    // to write over the copied bytes shows up in it.
+    MemoryBarrier();
+
+    if (ReadAcquire64(&Ring->Control->ReadCursor) - read > 0)
+    {
+        Reader->Laps++;
+        WriteRelease64(&Reader->Cursor, ReadAcquire64(&Ring->Control->WriteCursor));
+        return 0;
+    }
+
+    WriteRelease64(&Reader->Cursor, read + Length);
+
+    return Length;
+}
+
+//=============================================================================
+FORCEINLINE
+ULONG
+PcmRing_ReaderSkip
+(
+    const PCM_RING *    Ring,
+    PPCM_RING_READER    Reader,
+    ULONG               Length
+)
+/*++
+
+Routine Description:
+
+  Reader side. Drops up to Length of the reader's oldest bytes.
+
+Return Value:
+
+  Number of bytes dropped.
+
+--*/
+{
+    LONG64 read  = ReadNoFence64(&Reader->Cursor);
+    LONG64 write = ReadAcquire64(&Ring->Control->WriteCursor);
+
+    if (!PcmRing_IsValidFill(Ring, read, write))
+    {
+        Reader->Laps++;
+        WriteRelease64(&Reader->Cursor, write);
+        return 0;
+    }
+
+    if (Length > (ULONG)(write - read))
+    {
+        Length = (ULONG)(write - read);
+    }
+
+    WriteRelease64(&Reader->Cursor, read + Length);
+
+    return Length;
+}
+
+//=============================================================================
+FORCEINLINE
+void
+PcmRing_Release
+(
+    PPCM_RING           Ring,
+    PCM_RING_READER *   Readers,
+    ULONG               ActiveMask
+)
+/*++
+
+Routine Description:
+
+  Consumer side. Publishes the cursor of the slowest reader whose bit is set
+  in ActiveMask as ReadCursor, which hands everything all of them have
+  consumed back to the producer. Does nothing without an active reader.
+
+  Readers may release concurrently, and a minimum computed from older
+  cursors must not undo a newer one: ReadCursor is only ever raised, with a
+  compare-exchange, unless what is there is not a valid fill at all.
+
+--*/
+{
+    LONG64  write = ReadAcquire64(&Ring->Control->WriteCursor);
+    LONG64  slowest = write;
+    LONG64  published;
+    ULONG   i;
+
+    if (ActiveMask == 0)
+    {
+        return;
+    }
+
+    for (i = 0; i < PCM_RING_MAX_READERS; i++)
+    {
+        if (ActiveMask & (1UL << i))
+        {
+            LONG64 cursor = ReadAcquire64(&Readers[i].Cursor);
+
+            if (PcmRing_IsValidFill(Ring, cursor, write) && cursor < slowest)
+            {
+                slowest = cursor;
+            }
+        }
+    }
+
+    for (;;)
+    {
+        published = ReadAcquire64(&Ring->Control->ReadCursor);
+
+        if (PcmRing_IsValidFill(Ring, published, write) && published >= slowest)
+        {
+            return;
+        }
+
+        if (InterlockedCompareExchange64(&Ring->Control->ReadCursor, slowest, published) == published)
+        {
+            return;
+        }
+    }
+}
+
+#endif // _SIMPLEAUDIOSAMPLE_PCMRING_H_
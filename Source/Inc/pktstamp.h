@@ -0,0 +1,129 @@
+/*++
+
+Module Name:
+
+    pktstamp.h
+
+Abstract:
+
+    Packet completion timestamps of an event driven stream.
+
+    The notification DPC stamps every packet it completes with the QPC
+    value at which the virtual clock reached the packet's end boundary and
+    keeps the last few stamps in a small ring, indexed by packet number.
+    GetReadPacket then only looks the stamp up: the conversion from frames
+    to QPC runs once per packet, in the DPC, using the clock's exact
+    integer correlation (vclock.h), and never in the caller's path.
+
+    Stamps are exact to the QPC tick the boundary frame became due on and
+    strictly increase with the packet number, across pause and run too: the
+    clock restarts at the QPC of RUN, which is after every earlier stamp. A
+    stamp is only exact on the clock of the RUN that reached its boundary,
+    so a boundary the position update at PAUSE reaches is completed at the
+    PAUSE transition rather than by the first DPC after the next RUN.
+--*/
+
+#ifndef _SIMPLEAUDIOSAMPLE_PKTSTAMP_H_
+#define _SIMPLEAUDIOSAMPLE_PKTSTAMP_H_
+
+#include "vclock.h"
+
+#define PKT_STAMP_RING_SIZE     8       // power of two
+
+typedef struct _PKT_STAMP
+{
+    LONGLONG    Packet;             // 0-based packet number, -1 = unused
+    LONGLONG    Qpc;                // QPC value of the packet's end
+} PKT_STAMP, *PPKT_STAMP;
+
+typedef struct _PKT_STAMP_RING
+{
+    PKT_STAMP   Stamps[PKT_STAMP_RING_SIZE];
+} PKT_STAMP_RING, *PPKT_STAMP_RING;
+
+//=============================================================================
+FORCEINLINE
+void
+PktStamp_Reset
+(
+    PPKT_STAMP_RING Ring
+)
+{
+    for (ULONG i = 0; i < PKT_STAMP_RING_SIZE; i++)
+    {
+        Ring->Stamps[i].Packet = -1;
+        Ring->Stamps[i].Qpc    = 0;
+    }
+}
+
+//=============================================================================
+FORCEINLINE
+LONGLONG
+PktStamp_QpcOfPosition
+(
+    const VCLOCK *  Clock,
+    ULONGLONG       LinearPosition,
+    ULONGLONG       Position
+)
+/*++
+
+Routine Description:
+
+  QPC value at which the stream reached byte Position, given that the
+  clock's current frame is at byte LinearPosition. Position must not be
+  after LinearPosition nor before the position the clock's epoch stands
+  for: the clock has no record of a pause, so a position reached before
+  the last RUN would be stamped late by the length of the pause.
+
+--*/
+{
+    LONGLONG deltaFrames = (LONGLONG)((LinearPosition - Position) / Clock->BlockAlign);
+
+    return VClock_QpcOfFrame(Clock, (LONGLONG)Clock->Frames - deltaFrames);
+}
+
+//=============================================================================
+FORCEINLINE
+void
+PktStamp_Record
+(
+    PPKT_STAMP_RING Ring,
+    LONGLONG        Packet,
+    LONGLONG        Qpc
+)
+{
+    PPKT_STAMP stamp = &Ring->Stamps[(ULONGLONG)Packet & (PKT_STAMP_RING_SIZE - 1)];
+
+    stamp->Packet = Packet;
+    stamp->Qpc    = Qpc;
+}
+
+//=============================================================================
+FORCEINLINE
+int
+PktStamp_Lookup
+(
+    const PKT_STAMP_RING *  Ring,
+    LONGLONG                Packet,
+    LONGLONG *              Qpc
+)
+/*++
+
+Return Value:
+
+  Nonzero if the stamp of Packet is still in the ring.
+
+--*/
+{
+    const PKT_STAMP * stamp = &Ring->Stamps[(ULONGLONG)Packet & (PKT_STAMP_RING_SIZE - 1)];
+
+    if (Packet < 0 || stamp->Packet != Packet)
+    {
+        return 0;
+    }
+
+    *Qpc = stamp->Qpc;
+    return 1;
+}
+
+#endif // _SIMPLEAUDIOSAMPLE_PKTSTAMP_H_
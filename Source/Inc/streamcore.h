@@ -0,0 +1,683 @@
+/*++
+
+Module Name:
+
+    streamcore.h
+
+Abstract:
+
+    Position, packet and timestamp bookkeeping of a WaveRT stream.
+
+    The core holds everything the stream's timing depends on: the virtual
+    clock (vclock.h), the stream state, the linear and presentation
+    positions, the packet boundaries of an event driven stream and the
+    stamps of the packets it completed (pktstamp.h), the OS write position
+    and end of stream of a render stream, and whether the notification
+    timer is armed. It makes the decisions of the state transitions, the
+    position update and the notification DPC; CMiniportWaveRTStream drives
+    it and keeps the locking, the audio, the timer, the events, the ETW
+    reports and the PortCls interfaces to itself.
+
+    The core takes QPC values as arguments and never reads a clock or
+    touches kernel objects, so it behaves the same whatever drives it, and
+    a host build can replay a stream's timing against a simulated QPC.
+--*/
+
+#ifndef _SIMPLEAUDIOSAMPLE_STREAMCORE_H_
+#define _SIMPLEAUDIOSAMPLE_STREAMCORE_H_
+
+#include "vclock.h"
+#include "pktstamp.h"
+
+#if !defined(MAXULONG)
+#define MAXULONG        0xFFFFFFFFu
+#endif
+
+#define STREAM_CORE_HNS_PER_MILLISECOND     10000
+
+//
+// StreamCore_SetWriteOffset results.
+//
+#define STREAM_CORE_WRITE_REJECTED          0   // after EoS, or beyond the buffer
+#define STREAM_CORE_WRITE_ACCEPTED          1
+#define STREAM_CORE_WRITE_REPEATED          2   // accepted, but the same offset as the last write of a timer driven stream
+
+//
+// StreamCore_Tick flags.
+//
+#define STREAM_CORE_TICK_SIGNAL             0x1 // signal the notification events
+#define STREAM_CORE_TICK_UNDERRUN           0x2 // the OS wrote nothing since the last packet
+
+//
+// Stream states, in KSSTATE order and with its values.
+//
+typedef enum _STREAM_CORE_STATE
+{
+    StreamCoreStop,
+    StreamCoreAcquire,
+    StreamCorePause,
+    StreamCoreRun
+} STREAM_CORE_STATE;
+
+typedef struct _STREAM_CORE
+{
+    VCLOCK              Clock;                  // drives the position while in RUN
+    STREAM_CORE_STATE   State;
+    ULONG               BufferBytes;            // size of the cyclic buffer, 0 until allocated
+    ULONG               PacketBytes;            // 0 if the stream is not event driven
+    ULONGLONG           LinearPosition;         // bytes moved since STOP
+    ULONGLONG           PresentationPosition;   // bytes due since STOP, including any held back after EoS
+    ULONGLONG           NextPacketPosition;     // linear position of the next packet boundary
+    LONGLONG            PacketCounter;          // packets completed since STOP
+    PKT_STAMP_RING      Stamps;                 // end QPC of the last packets completed
+    ULONG               WriteOffset;            // render: buffer offset the OS last wrote up to, the EoS offset after EoS
+    int                 WriteOffsetUpdated;     // render: the OS wrote since the last packet completed
+    int                 EndOfStream;            // render: the OS wrote its last packet
+    int                 LastBufferRendered;     // render: the position reached the EoS offset
+    int                 LowLatency;             // capture: also wake every 1 ms within a packet
+    int                 TimerArmed;             // in RUN; the DPC re-arms the timer while set
+    LONGLONG            TimerDueQpc;            // QPC the notification timer was last armed for
+} STREAM_CORE, *PSTREAM_CORE;
+
+//=============================================================================
+FORCEINLINE
+void
+StreamCore_Stop
+(
+    PSTREAM_CORE    Core
+)
+/*++
+
+Routine Description:
+
+  KSSTATE_STOP: every position, the packet count and the OS write position
+  start over, and so does a stream that reached EoS. The clock restarts on
+  the next RUN.
+
+--*/
+{
+    Core->State                = StreamCoreStop;
+    Core->LinearPosition       = 0;
+    Core->PresentationPosition = 0;
+    Core->NextPacketPosition   = Core->PacketBytes;
+    Core->PacketCounter        = 0;
+    PktStamp_Reset(&Core->Stamps);
+    Core->WriteOffset          = 0;
+    Core->WriteOffsetUpdated   = 0;
+    Core->EndOfStream          = 0;
+    Core->LastBufferRendered   = 0;
+    Core->TimerArmed           = 0;
+}
+
+//=============================================================================
+FORCEINLINE
+void
+StreamCore_Init
+(
+    PSTREAM_CORE    Core,
+    ULONGLONG       Frequency,
+    ULONG           FramesPerSecond,
+    ULONG           BlockAlign
+)
+{
+    VClock_Init(&Core->Clock, Frequency, FramesPerSecond, BlockAlign);
+    Core->BufferBytes = 0;
+    Core->PacketBytes = 0;
+    Core->LowLatency  = 0;
+    Core->TimerDueQpc = 0;
+    StreamCore_Stop(Core);
+}
+
+//=============================================================================
+FORCEINLINE
+void
+StreamCore_SetBuffer
+(
+    PSTREAM_CORE    Core,
+    ULONG           BufferBytes,
+    ULONG           PacketBytes
+)
+/*++
+
+Routine Description:
+
+  Sets the buffer and packet sizes once the buffer is allocated, a packet
+  size of 0 for a stream that is not event driven. Only called in
+  KSSTATE_STOP, before any packet.
+
+--*/
+{
+    Core->BufferBytes        = BufferBytes;
+    Core->PacketBytes        = PacketBytes;
+    Core->NextPacketPosition = Core->LinearPosition + PacketBytes;
+}
+
+//=============================================================================
+FORCEINLINE
+int
+StreamCore_IsTimerDriven
+(
+    const STREAM_CORE * Core
+)
+/*++
+
+Routine Description:
+
+  Whether the notification timer runs in RUN: the stream is event driven
+  and its packets last at least the 1 ms the notification interval is
+  counted in.
+
+--*/
+{
+    return Core->PacketBytes != 0 &&
+           (ULONGLONG)Core->PacketBytes * 1000 >=
+           (ULONGLONG)Core->Clock.FramesPerSecond * Core->Clock.BlockAlign;
+}
+
+//=============================================================================
+FORCEINLINE
+void
+StreamCore_Acquire
+(
+    PSTREAM_CORE    Core
+)
+{
+    Core->State = StreamCoreAcquire;
+}
+
+//=============================================================================
+FORCEINLINE
+int
+StreamCore_Run
+(
+    PSTREAM_CORE    Core,
+    LONGLONG        Qpc
+)
+/*++
+
+Routine Description:
+
+  KSSTATE_RUN at Qpc. Positions carry on from where the stream paused.
+
+Return Value:
+
+  Nonzero if the stream is timer driven: the caller arms the timer with
+  StreamCore_ArmTimer, and the DPC re-arms it until the next PAUSE.
+
+--*/
+{
+    VClock_Start(&Core->Clock, Qpc);
+    Core->State      = StreamCoreRun;
+    Core->TimerArmed = StreamCore_IsTimerDriven(Core);
+
+    return Core->TimerArmed;
+}
+
+//=============================================================================
+FORCEINLINE
+int
+StreamCore_BeginPause
+(
+    PSTREAM_CORE    Core
+)
+/*++
+
+Routine Description:
+
+  RUN -> PAUSE, before the last position update. Disarms the timer first,
+  so a DPC that is already running does not re-arm it behind the caller's
+  back.
+
+Return Value:
+
+  Nonzero if the timer was armed: the caller cancels it and waits for its
+  DPC before the last position update.
+
+--*/
+{
+    int armed = Core->TimerArmed;
+
+    Core->TimerArmed = 0;
+    return armed;
+}
+
+//=============================================================================
+FORCEINLINE
+ULONG
+StreamCore_BytesDue
+(
+    PSTREAM_CORE    Core,
+    LONGLONG        Qpc
+)
+/*++
+
+Routine Description:
+
+  Moves the clock to Qpc and returns the bytes that became due since the
+  previous call, a whole number of blocks. They count towards the
+  presentation position at once; the caller moves the linear position with
+  StreamCore_Move once it has dealt with them, possibly fewer after EoS.
+  Only a stall of hours could exceed a ULONG.
+
+--*/
+{
+    ULONGLONG framesDue = VClock_Advance(&Core->Clock, Qpc);
+    ULONG     bytes;
+
+    bytes = (ULONG)(framesDue < (ULONGLONG)(MAXULONG / Core->Clock.BlockAlign) ?
+                    framesDue : (ULONGLONG)(MAXULONG / Core->Clock.BlockAlign)) * Core->Clock.BlockAlign;
+
+    Core->PresentationPosition += bytes;
+    return bytes;
+}
+
+//=============================================================================
+FORCEINLINE
+void
+StreamCore_Move
+(
+    PSTREAM_CORE    Core,
+    ULONG           Bytes
+)
+{
+    Core->LinearPosition += Bytes;
+}
+
+//=============================================================================
+FORCEINLINE
+ULONG
+StreamCore_ClampToEndOfStream
+(
+    PSTREAM_CORE    Core,
+    ULONG           Bytes
+)
+/*++
+
+Routine Description:
+
+  Render, between StreamCore_BytesDue and StreamCore_Move. After EoS, the
+  position must not read past the EoS offset, whether it is still ahead in
+  the buffer or only reached once the position wraps around; the last
+  buffer is rendered once the position gets there.
+
+Return Value:
+
+  The bytes to move: Bytes, or fewer once EoS is in reach.
+
+--*/
+{
+    ULONG offset;
+    ULONG end;
+
+    if (!Core->EndOfStream || Core->BufferBytes == 0)
+    {
+        return Bytes;
+    }
+
+    offset = (ULONG)(Core->LinearPosition % Core->BufferBytes);
+    end    = (ULONG)((offset + (ULONGLONG)Bytes) % Core->BufferBytes);
+
+    if (offset <= Core->WriteOffset)
+    {
+        if (Bytes > Core->WriteOffset - offset)
+        {
+            Bytes = Core->WriteOffset - offset;
+        }
+    }
+    else if (end < offset && end > Core->WriteOffset)
+    {
+        Bytes -= end - Core->WriteOffset;
+    }
+
+    if (!Core->LastBufferRendered &&
+        (offset + (ULONGLONG)Bytes) % Core->BufferBytes == Core->WriteOffset)
+    {
+        Core->LastBufferRendered = 1;
+    }
+
+    return Bytes;
+}
+
+//=============================================================================
+FORCEINLINE
+LONGLONG
+StreamCore_QpcOfLinearPosition
+(
+    const STREAM_CORE * Core
+)
+/*++
+
+Routine Description:
+
+  QPC value at which the stream reached its current linear position.
+
+--*/
+{
+    return VClock_QpcOfFrame(&Core->Clock, (LONGLONG)Core->Clock.Frames);
+}
+
+//=============================================================================
+FORCEINLINE
+int
+StreamCore_CrossBoundaries
+(
+    PSTREAM_CORE    Core
+)
+/*++
+
+Routine Description:
+
+  Moves past the packet boundaries the linear position has reached.
+  Boundaries missed because the caller was held off for longer than a
+  packet collapse into one.
+
+Return Value:
+
+  Nonzero if at least one boundary was crossed.
+
+--*/
+{
+    if (Core->PacketBytes == 0 || Core->LinearPosition < Core->NextPacketPosition)
+    {
+        return 0;
+    }
+
+    do
+    {
+        Core->NextPacketPosition += Core->PacketBytes;
+    } while (Core->LinearPosition >= Core->NextPacketPosition);
+
+    return 1;
+}
+
+//=============================================================================
+FORCEINLINE
+void
+StreamCore_CompletePacket
+(
+    PSTREAM_CORE    Core
+)
+/*++
+
+Routine Description:
+
+  Counts a packet as completed after StreamCore_CrossBoundaries, stamped
+  with the moment the last boundary crossed became due.
+
+--*/
+{
+    PktStamp_Record(&Core->Stamps,
+                    Core->PacketCounter,
+                    PktStamp_QpcOfPosition(&Core->Clock,
+                                           Core->LinearPosition,
+                                           Core->NextPacketPosition - Core->PacketBytes));
+    Core->PacketCounter++;
+}
+
+//=============================================================================
+FORCEINLINE
+void
+StreamCore_Pause
+(
+    PSTREAM_CORE    Core
+)
+/*++
+
+Routine Description:
+
+  KSSTATE_PAUSE, after the last position update of a RUN -> PAUSE. A
+  boundary that update reached is crossed and its packet completed now,
+  while the clock still counts from the last RUN: the next RUN restarts the
+  clock, and a stamp taken after it would be late by the whole pause. After
+  EoS packets no longer complete, as in StreamCore_Tick.
+
+--*/
+{
+    if (Core->State == StreamCoreRun && !Core->EndOfStream &&
+        StreamCore_CrossBoundaries(Core))
+    {
+        StreamCore_CompletePacket(Core);
+    }
+
+    Core->State = StreamCorePause;
+}
+
+//=============================================================================
+FORCEINLINE
+int
+StreamCore_SetWriteOffset
+(
+    PSTREAM_CORE    Core,
+    ULONG           Offset,
+    int             EndOfStream
+)
+/*++
+
+Routine Description:
+
+  Render, SetWritePacket: the OS wrote the buffer up to Offset, its last
+  packet if EndOfStream is set. Nothing is written after EoS, and no
+  further than the end of the buffer.
+
+Return Value:
+
+  STREAM_CORE_WRITE_REJECTED, STREAM_CORE_WRITE_ACCEPTED, or
+  STREAM_CORE_WRITE_REPEATED if a timer driven stream was written up to the
+  same offset twice in a row.
+
+--*/
+{
+    int result = STREAM_CORE_WRITE_ACCEPTED;
+
+    if (Core->EndOfStream || Offset > Core->BufferBytes)
+    {
+        return STREAM_CORE_WRITE_REJECTED;
+    }
+
+    if (StreamCore_IsTimerDriven(Core) && Offset == Core->WriteOffset)
+    {
+        result = STREAM_CORE_WRITE_REPEATED;
+    }
+
+    Core->WriteOffset        = Offset;
+    Core->WriteOffsetUpdated = 1;
+    Core->EndOfStream        = EndOfStream ? 1 : 0;
+
+    return result;
+}
+
+//=============================================================================
+FORCEINLINE
+int
+StreamCore_Tick
+(
+    PSTREAM_CORE    Core
+)
+/*++
+
+Routine Description:
+
+  The notification DPC, after its position update. A packet completes when
+  the linear position reaches its boundary; the timer is armed for exactly
+  that point, so early wakeups only happen in low latency mode or after
+  EoS. If the DPC was held off for longer than a packet, the missed
+  boundaries collapse into a single completion, stamped with the moment
+  the last of them became due rather than with when the DPC got to run.
+
+  In RUN the events are signalled for a completed packet, or once the last
+  buffer has rendered after EoS, and a packet completed without the OS
+  writing since the one before is an underrun.
+
+Return Value:
+
+  STREAM_CORE_TICK_* flags.
+
+--*/
+{
+    int completed = StreamCore_CrossBoundaries(Core);
+    int flags = 0;
+
+    if (!completed && !Core->EndOfStream)
+    {
+        return 0;
+    }
+
+    if (!Core->EndOfStream)
+    {
+        StreamCore_CompletePacket(Core);
+    }
+
+    if (Core->State != StreamCoreRun)
+    {
+        return 0;
+    }
+
+    if (!Core->WriteOffsetUpdated && !Core->EndOfStream)
+    {
+        flags |= STREAM_CORE_TICK_UNDERRUN;
+    }
+    Core->WriteOffsetUpdated = 0;
+
+    if (completed || Core->LastBufferRendered)
+    {
+        flags |= STREAM_CORE_TICK_SIGNAL;
+    }
+
+    return flags;
+}
+
+//=============================================================================
+FORCEINLINE
+int
+StreamCore_GetCompletedPacket
+(
+    const STREAM_CORE * Core,
+    LONGLONG *          Packet,
+    LONGLONG *          Qpc
+)
+/*++
+
+Routine Description:
+
+  The 0-based number of the last packet completed and its end QPC.
+
+Return Value:
+
+  Zero if no packet has completed since STOP.
+
+--*/
+{
+    *Packet = Core->PacketCounter - 1;
+    return PktStamp_Lookup(&Core->Stamps, *Packet, Qpc);
+}
+
+//=============================================================================
+FORCEINLINE
+LONGLONG
+StreamCore_TicksToNextPacket
+(
+    const STREAM_CORE * Core,
+    LONGLONG            Qpc
+)
+/*++
+
+Routine Description:
+
+  QPC ticks from Qpc until the clock reaches the next packet boundary, 0 if
+  it already has.
+
+--*/
+{
+    ULONGLONG remaining;
+    ULONGLONG frames;
+    LONGLONG  ticks;
+
+    remaining = (Core->NextPacketPosition > Core->LinearPosition) ?
+                Core->NextPacketPosition - Core->LinearPosition : 0;
+    frames = (remaining + Core->Clock.BlockAlign - 1) / Core->Clock.BlockAlign;
+
+    ticks = VClock_QpcOfFrame(&Core->Clock, (LONGLONG)(Core->Clock.Frames + frames)) - Qpc;
+
+    return (ticks < 0) ? 0 : ticks;
+}
+
+//=============================================================================
+FORCEINLINE
+LONGLONG
+StreamCore_TimerDue
+(
+    const STREAM_CORE * Core,
+    LONGLONG            Qpc,
+    int                 Fine,
+    LONGLONG *          DueQpc
+)
+/*++
+
+Routine Description:
+
+  Due time of the one-shot notification timer armed at Qpc, in the
+  relative 100 ns units ExSetTimer takes: the next packet boundary, or 1 ms
+  from now if that is sooner and Fine is set. Rounded up, since waking a
+  little late only delays the boundary while waking early costs a DPC that
+  finds nothing to do, and never below one unit.
+
+Arguments:
+
+  DueQpc - receives the QPC value the timer is due at, which the DPC
+           measures its lateness against.
+
+--*/
+{
+    LONGLONG ticks = StreamCore_TicksToNextPacket(Core, Qpc);
+    LONGLONG hnsDue;
+
+    hnsDue = (LONGLONG)(((ULONGLONG)ticks * STREAM_CORE_HNS_PER_MILLISECOND * 1000 + Core->Clock.Frequency - 1) /
+                        Core->Clock.Frequency);
+
+    if (Fine && hnsDue > STREAM_CORE_HNS_PER_MILLISECOND)
+    {
+        hnsDue = STREAM_CORE_HNS_PER_MILLISECOND;
+        ticks  = (LONGLONG)(Core->Clock.Frequency / 1000);
+    }
+
+    *DueQpc = Qpc + ticks;
+
+    return (hnsDue > 1) ? hnsDue : 1;
+}
+
+//=============================================================================
+FORCEINLINE
+int
+StreamCore_ArmTimer
+(
+    PSTREAM_CORE    Core,
+    LONGLONG        Qpc,
+    LONGLONG *      HnsDue
+)
+/*++
+
+Routine Description:
+
+  Due time of the one-shot notification timer, armed at Qpc after a
+  position update: the next packet boundary, or 1 ms from now if that is
+  sooner and the stream wants finer wakeups, in low latency mode and once
+  EoS has been received so the last buffer is caught as soon as it renders.
+  StreamCore_TimerDue has the details.
+
+Return Value:
+
+  Zero if the timer stays disarmed: the stream left RUN, is not timer
+  driven or rendered its last buffer.
+
+--*/
+{
+    if (!Core->TimerArmed || Core->LastBufferRendered)
+    {
+        return 0;
+    }
+
+    *HnsDue = StreamCore_TimerDue(Core, Qpc, Core->LowLatency || Core->EndOfStream, &Core->TimerDueQpc);
+    return 1;
+}
+
+#endif // _SIMPLEAUDIOSAMPLE_STREAMCORE_H_
@@ -0,0 +1,155 @@
+/*++
+
+Module Name:
+
+    submitq.h
+
+Abstract:
+
+    Queueing rules of WAIT submissions (MICYAUDIO_CHUNK_FLAG_WAIT) on a
+    route's ring.
+
+    userpcm.cpp keeps the requests, the cancel-safe wait queue and the work
+    item; the decisions of when a chunk writes, when it pends and when the
+    consumer hands the queue to the work item are made here:
+
+      - A chunk only ever writes whole blocks that fit, so the ring never
+        goes out of frame alignment. A partial block at its end is dropped
+        rather than waited for.
+
+      - A WAIT chunk queues behind the requests already waiting on the ring,
+        unless it was just taken from the head of that queue, so a feeder's
+        audio stays in submission order.
+
+      - A WAIT chunk that did not fit goes back to the head of the queue and
+        waits for the rest of its whole blocks, or half a ring if that is
+        less, so a chunk larger than the ring still makes progress.
+
+      - The consumer only compares the free space with what the head waiter
+        needs.
+
+    The rules only look at the ring's fill, so a host simulation can run a
+    feeder against a simulated capture clock through them.
+--*/
+
+#ifndef _SIMPLEAUDIOSAMPLE_SUBMITQ_H_
+#define _SIMPLEAUDIOSAMPLE_SUBMITQ_H_
+
+#include "pcmring.h"
+
+//=============================================================================
+FORCEINLINE
+ULONG
+SubmitQ_WritableBytes
+(
+    const PCM_RING *    Ring,
+    ULONG               Length,
+    ULONG               BlockAlign
+)
+/*++
+
+Routine Description:
+
+  Producer side. Returns how much of a Length byte chunk can be written
+  now: the whole blocks of it that fit in the free space.
+
+--*/
+{
+    ULONG space = Ring->Capacity - PcmRing_Count(Ring);
+
+    Length -= Length % BlockAlign;
+    if (Length > space)
+    {
+        Length = space - (space % BlockAlign);
+    }
+
+    return Length;
+}
+
+//=============================================================================
+FORCEINLINE
+BOOLEAN
+SubmitQ_QueuesBehind
+(
+    BOOLEAN Wait,
+    BOOLEAN Resumed,
+    BOOLEAN Waiters
+)
+/*++
+
+Routine Description:
+
+  Producer side, before writing a chunk. Returns whether the chunk must
+  queue at the tail of the wait queue instead: a WAIT chunk does while
+  other requests wait on the ring, unless its request was just taken from
+  the head of the queue.
+
+--*/
+{
+    return Wait && !Resumed && Waiters;
+}
+
+//=============================================================================
+FORCEINLINE
+ULONG
+SubmitQ_WakeBytes
+(
+    ULONG   Length,
+    ULONG   Written,
+    BOOLEAN Wait,
+    ULONG   Capacity,
+    ULONG   BlockAlign
+)
+/*++
+
+Routine Description:
+
+  Producer side, after writing Written bytes of a Length byte chunk.
+  Returns the free space the chunk waits for at the head of the queue, or
+  0 if the chunk is done and the rest of it is dropped: it all fitted, it
+  is not a WAIT chunk, or only a partial block is left.
+
+--*/
+{
+    ULONG whole = Length - Length % BlockAlign;
+    ULONG need;
+
+    if (!Wait || Written >= whole)
+    {
+        return 0;
+    }
+
+    need = whole - Written;
+    if (need > Capacity / 2)
+    {
+        need = Capacity / 2;
+    }
+    if (need > BlockAlign)
+    {
+        need -= need % BlockAlign;
+    }
+
+    return need;
+}
+
+//=============================================================================
+FORCEINLINE
+BOOLEAN
+SubmitQ_HeadFits
+(
+    const PCM_RING *    Ring,
+    ULONG               WakeBytes
+)
+/*++
+
+Routine Description:
+
+  Consumer side, after freeing space. Returns whether the head waiter,
+  which needs WakeBytes of free space (0 if nothing waits), can go on.
+
+--*/
+{
+    return WakeBytes != 0 && Ring->Capacity - PcmRing_Count(Ring) >= WakeBytes;
+}
+
+#endif // _SIMPLEAUDIOSAMPLE_SUBMITQ_H_
@@ -0,0 +1,181 @@
+/*++
+
+Module Name:
+
+    vclock.h
+
+Abstract:
+
+    Sample-accurate virtual clock driving the simulated DMA position.
+
+    The clock counts whole frames since an epoch QPC value. The frame count
+    for any QPC reading is computed from the epoch with exact integer
+    arithmetic, frames = floor(ticks * FramesPerSecond / Frequency), so
+    nothing is carried between calls, no rounding error accumulates and
+    the clock cannot drift from QPC however often or rarely it is sampled.
+    Callers convert frames to bytes, so every displacement is a whole number
+    of blocks.
+
+    The product is split at whole seconds, which keeps every intermediate
+    well inside 64 bits for any realistic QPC frequency and sample rate,
+    and for elapsed times of centuries.
+--*/
+
+#ifndef _SIMPLEAUDIOSAMPLE_VCLOCK_H_
+#define _SIMPLEAUDIOSAMPLE_VCLOCK_H_
+
+#if !defined(_WIN32)
+#include <stdint.h>
+
+typedef int64_t         LONGLONG;
+typedef uint64_t        ULONGLONG;
+typedef uint32_t        ULONG;
+#define FORCEINLINE     static inline __attribute__((always_inline))
+#endif
+
+typedef struct _VCLOCK
+{
+    ULONGLONG   Frequency;          // QPC ticks per second
+    ULONG       FramesPerSecond;
+    ULONG       BlockAlign;         // bytes per frame
+    LONGLONG    Epoch;              // QPC value of frame 0
+    ULONGLONG   Frames;             // frames produced since Epoch
+} VCLOCK, *PVCLOCK;
+
+//=============================================================================
+FORCEINLINE
+void
+VClock_Init
+(
+    PVCLOCK     Clock,
+    ULONGLONG   Frequency,
+    ULONG       FramesPerSecond,
+    ULONG       BlockAlign
+)
+{
+    Clock->Frequency       = Frequency ? Frequency : 1;
+    Clock->FramesPerSecond = FramesPerSecond;
+    Clock->BlockAlign      = BlockAlign ? BlockAlign : 1;
+    Clock->Epoch           = 0;
+    Clock->Frames          = 0;
+}
+
+//=============================================================================
+FORCEINLINE
+void
+VClock_Start
+(
+    PVCLOCK     Clock,
+    LONGLONG    Qpc
+)
+/*++
+
+Routine Description:
+
+  Makes Qpc frame 0. Called whenever the stream (re)enters RUN; positions
+  are kept by the caller, the clock only measures what elapsed since.
+
+--*/
+{
+    Clock->Epoch  = Qpc;
+    Clock->Frames = 0;
+}
+
+//=============================================================================
+FORCEINLINE
+ULONGLONG
+VClock_FramesAt
+(
+    const VCLOCK *  Clock,
+    LONGLONG        Qpc
+)
+/*++
+
+Routine Description:
+
+  Number of whole frames between the epoch and Qpc.
+
+--*/
+{
+    ULONGLONG ticks;
+
+    if (Qpc <= Clock->Epoch)
+    {
+        return 0;
+    }
+
+    ticks = (ULONGLONG)(Qpc - Clock->Epoch);
+
+    return (ticks / Clock->Frequency) * Clock->FramesPerSecond +
+           (ticks % Clock->Frequency) * Clock->FramesPerSecond / Clock->Frequency;
+}
+
+//=============================================================================
+FORCEINLINE
+ULONGLONG
+VClock_Advance
+(
+    PVCLOCK     Clock,
+    LONGLONG    Qpc
+)
+/*++
+
+Routine Description:
+
+  Moves the clock to Qpc. A Qpc earlier than the last one (e.g. read on
+  another processor just before) does not move the clock backwards.
+
+Return Value:
+
+  Number of frames that became due since the previous call.
+
+--*/
+{
+    ULONGLONG target = VClock_FramesAt(Clock, Qpc);
+    ULONGLONG due;
+
+    if (target <= Clock->Frames)
+    {
+        return 0;
+    }
+
+    due = target - Clock->Frames;
+    Clock->Frames = target;
+
+    return due;
+}
+
+//=============================================================================
+FORCEINLINE
+LONGLONG
+VClock_QpcOfFrame
+(
+    const VCLOCK *  Clock,
+    LONGLONG        Frame
+)
+/*++
+
+Routine Description:
+
+  Earliest QPC value at which Frame (relative to the epoch, negative for
+  frames before it) is due; the inverse of VClock_FramesAt.
+
+--*/
+{
+    ULONGLONG frames = (Frame < 0) ? (ULONGLONG)-Frame : (ULONGLONG)Frame;
+    ULONGLONG ticks;
+
+    if (Clock->FramesPerSecond == 0)
+    {
+        return Clock->Epoch;
+    }
+
+    ticks = (frames / Clock->FramesPerSecond) * Clock->Frequency +
+            ((frames % Clock->FramesPerSecond) * Clock->Frequency +
+             Clock->FramesPerSecond - 1) / Clock->FramesPerSecond;
+
+    return (Frame < 0) ? Clock->Epoch - (LONGLONG)ticks
+                       : Clock->Epoch + (LONGLONG)ticks;
+}
+
+#endif // _SIMPLEAUDIOSAMPLE_VCLOCK_H_
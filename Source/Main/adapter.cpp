@@ -20,15 +20,15 @@ Abstract:
 #define PUT_GUIDS_HERE
 
 #include "definitions.h"
+#include <initguid.h>
+#include <devpkey.h>
 #include "endpoints.h"
 #include "minipairs.h"
+#include "userpcm.h"
+#include "driverstats.h"
 
-#define MICY_IOCTL_TYPE     29
 #define NT_DEVICE_NAME      L"\\Device\\MICY"
 #define DOS_DEVICE_NAME     L"\\DosDevices\\MicyAudio"
-// IOCTL code for setting user-provided audio data
-#define IOCTL_SIMPLEAUDIOSAMPLE_SET_AUDIO_DATA \
-    CTL_CODE(MICY_IOCTL_TYPE, 0x902, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
 typedef void (*fnPcDriverUnload) (PDRIVER_OBJECT);
 fnPcDriverUnload gPCDriverUnloadRoutine = NULL;
@@ -37,6 +37,7 @@ extern "C" DRIVER_UNLOAD DriverUnload;
 // Store original CREATE/CLOSE handlers before we replace them
 DRIVER_DISPATCH* g_OriginalCreateHandler = NULL;
 DRIVER_DISPATCH* g_OriginalCloseHandler = NULL;
+DRIVER_DISPATCH* g_OriginalCleanupHandler = NULL;
 
 //-----------------------------------------------------------------------------
 // Referenced forward.
@@ -60,6 +61,7 @@ DRIVER_DISPATCH DeviceControlHandler;
 
 _Dispatch_type_(IRP_MJ_CREATE)
 _Dispatch_type_(IRP_MJ_CLOSE)
+_Dispatch_type_(IRP_MJ_CLEANUP)
 DRIVER_DISPATCH ControlDeviceCreateClose;
 
 //
@@ -68,149 +70,160 @@ DRIVER_DISPATCH ControlDeviceCreateClose;
 //
 DWORD g_DoNotCreateDataFiles = 1;  // default is off.
 DWORD g_DisableToneGenerator = 0;  // default is to generate tones.
+
+//
+// Feeder ring buffering, see MICYAUDIO_STREAM_CONFIG. Override with the
+// registry values UserPcmCapacityMs and UserPcmTargetMs (DWORD); both can
+// also be changed per stream at runtime with IOCTL_MICYAUDIO_SET_CONFIG.
+//
+DWORD g_UserPcmCapacityMs = USERPCM_DEFAULT_CAPACITY_MS;
+DWORD g_UserPcmTargetMs = USERPCM_DEFAULT_TARGET_MS;
+
+//
+// Capture endpoints to create, 1 to MICYAUDIO_MAX_ENDPOINTS. Override with
+// the registry value CaptureEndpointCount (DWORD).
+//
+DWORD g_CaptureEndpointCount = 1;
 UNICODE_STRING g_RegistryPath;      // This is used to store the registry settings path for the driver
 PDEVICE_OBJECT g_ControlDeviceObject = NULL;  // Control device for IOCTL communication
 
-// =============================================================================
-// Simple lock-protected circular buffer to feed capture (microphone) path
-// =============================================================================
-extern "C" {
-    typedef struct _USER_PCM_RING_BUFFER {
-        PUCHAR              buffer;
-        ULONG               capacity;   // bytes
-        volatile ULONG      readIndex;  // modulo capacity
-        volatile ULONG      writeIndex; // modulo capacity
-        volatile ULONG      count;      // bytes currently stored
-        KSPIN_LOCK          lock;       // protects read/write/count
-        BOOLEAN             initialized;
-    } USER_PCM_RING_BUFFER;
-
-    static USER_PCM_RING_BUFFER g_UserPcmRb = { 0 };
-
-    static __forceinline ULONG _min_ul(ULONG a, ULONG b) { return (a < b) ? a : b; }
-
-    VOID UserPcmBuffer_Term()
+//
+// Capture endpoints after the first: copies of MicArray1Miniports under names
+// of their own. Their interfaces name MicArray1's as template, so the EP and
+// FX parameters the INF installs for MicArray1 apply to them as well. The
+// friendly name is not migrated from the template and is set here instead.
+//
+#define CAPTURE_ENDPOINT_NAME_CCH   32
+
+typedef struct _CAPTURE_ENDPOINT
+{
+    ENDPOINT_MINIPAIR               Miniports;
+    SIMPLEAUDIOSAMPLE_DEVPROPERTY   Properties[1];
+    WCHAR                           TopoName[CAPTURE_ENDPOINT_NAME_CCH];
+    WCHAR                           WaveName[CAPTURE_ENDPOINT_NAME_CCH];
+    WCHAR                           FriendlyName[CAPTURE_ENDPOINT_NAME_CCH];
+} CAPTURE_ENDPOINT, *PCAPTURE_ENDPOINT;
+
+typedef struct _CAPTURE_ENDPOINT_TABLE
+{
+    PENDPOINT_MINIPAIR              Miniports[MICYAUDIO_MAX_ENDPOINTS];
+    CAPTURE_ENDPOINT                Copies[MICYAUDIO_MAX_ENDPOINTS - 1];
+} CAPTURE_ENDPOINT_TABLE, *PCAPTURE_ENDPOINT_TABLE;
+
+PCAPTURE_ENDPOINT_TABLE g_CaptureEndpointTable = NULL;
+
+//-----------------------------------------------------------------------------
+// Functions
+//-----------------------------------------------------------------------------
+
+#pragma code_seg("PAGE")
+void ReleaseRegistryStringBuffer()
+{
+    PAGED_CODE();
+
+    if (g_RegistryPath.Buffer != NULL)
     {
-        KIRQL oldIrql;
-        KeAcquireSpinLock(&g_UserPcmRb.lock, &oldIrql);
-        if (g_UserPcmRb.buffer) {
-            PUCHAR buf = g_UserPcmRb.buffer;
-            g_UserPcmRb.buffer = NULL;
-            g_UserPcmRb.capacity = 0;
-            g_UserPcmRb.readIndex = 0;
-            g_UserPcmRb.writeIndex = 0;
-            g_UserPcmRb.count = 0;
-            g_UserPcmRb.initialized = FALSE;
-            KeReleaseSpinLock(&g_UserPcmRb.lock, oldIrql);
-            ExFreePoolWithTag(buf, MINADAPTER_POOLTAG);
-            return;
-        }
-        KeReleaseSpinLock(&g_UserPcmRb.lock, oldIrql);
+        ExFreePool(g_RegistryPath.Buffer);
+        g_RegistryPath.Buffer = NULL;
+        g_RegistryPath.Length = 0;
+        g_RegistryPath.MaximumLength = 0;
     }
+}
 
-    NTSTATUS UserPcmBuffer_Init(_In_ ULONG capacityBytes)
-    {
-        if (capacityBytes == 0) {
-            capacityBytes = 1024 * 1024; // default 1MB
-        }
+//=============================================================================
+#pragma code_seg("PAGE")
+NTSTATUS
+CaptureEndpoints_Init
+(
+    _In_ ULONG  Count
+)
+/*++
 
-        RtlZeroMemory(&g_UserPcmRb, sizeof(g_UserPcmRb));
-        g_UserPcmRb.buffer = (PUCHAR)ExAllocatePool2(POOL_FLAG_NON_PAGED, capacityBytes, MINADAPTER_POOLTAG);
-        if (!g_UserPcmRb.buffer) {
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
-        g_UserPcmRb.capacity = capacityBytes;
-        g_UserPcmRb.readIndex = 0;
-        g_UserPcmRb.writeIndex = 0;
-        g_UserPcmRb.count = 0;
-        KeInitializeSpinLock(&g_UserPcmRb.lock);
-        g_UserPcmRb.initialized = TRUE;
-        return STATUS_SUCCESS;
-    }
+Routine Description:
 
-    ULONG UserPcmBuffer_Write(_In_reads_bytes_(length) const UCHAR* src, _In_ ULONG length)
-    {
-        if (!g_UserPcmRb.initialized || src == NULL || length == 0) return 0;
-        KIRQL oldIrql;
-        KeAcquireSpinLock(&g_UserPcmRb.lock, &oldIrql);
-
-        ULONG toWrite = length;
-        // If not enough space, drop oldest (advance readIndex)
-        if (toWrite > (g_UserPcmRb.capacity - g_UserPcmRb.count)) {
-            ULONG overflow = toWrite - (g_UserPcmRb.capacity - g_UserPcmRb.count);
-            if (overflow > g_UserPcmRb.count) overflow = g_UserPcmRb.count;
-            g_UserPcmRb.readIndex = (g_UserPcmRb.readIndex + overflow) % g_UserPcmRb.capacity;
-            g_UserPcmRb.count -= overflow;
-        }
+  Builds g_CaptureEndpoints. The first endpoint is MicArray1Miniports, the
+  INF's; endpoint N after it is a copy named TopologyMicArrayN and
+  WaveMicArrayN, shown as "MicyAudio Microphone N".
 
-        // Write in up to two segments (wrap-aware)
-        ULONG first = _min_ul(toWrite, g_UserPcmRb.capacity - g_UserPcmRb.writeIndex);
-        RtlCopyMemory(g_UserPcmRb.buffer + g_UserPcmRb.writeIndex, src, first);
-        ULONG remaining = toWrite - first;
-        if (remaining) {
-            RtlCopyMemory(g_UserPcmRb.buffer, src + first, remaining);
-        }
-        g_UserPcmRb.writeIndex = (g_UserPcmRb.writeIndex + toWrite) % g_UserPcmRb.capacity;
-        g_UserPcmRb.count += toWrite;
+Arguments:
 
-        KeReleaseSpinLock(&g_UserPcmRb.lock, oldIrql);
-        return toWrite;
-    }
+  Count - endpoints to create, clamped to 1 to MICYAUDIO_MAX_ENDPOINTS.
 
-    ULONG UserPcmBuffer_Read(_Out_writes_bytes_(length) UCHAR* dst, _In_ ULONG length)
-    {
-        if (!g_UserPcmRb.initialized || dst == NULL || length == 0) return 0;
-        KIRQL oldIrql;
-        KeAcquireSpinLock(&g_UserPcmRb.lock, &oldIrql);
-
-        ULONG toRead = _min_ul(length, g_UserPcmRb.count);
-        if (toRead) {
-            ULONG first = _min_ul(toRead, g_UserPcmRb.capacity - g_UserPcmRb.readIndex);
-            RtlCopyMemory(dst, g_UserPcmRb.buffer + g_UserPcmRb.readIndex, first);
-            ULONG remaining = toRead - first;
-            if (remaining) {
-                RtlCopyMemory(dst + first, g_UserPcmRb.buffer, remaining);
-            }
-            g_UserPcmRb.readIndex = (g_UserPcmRb.readIndex + toRead) % g_UserPcmRb.capacity;
-            g_UserPcmRb.count -= toRead;
-        }
+Return Value:
+
+  NT status code.
+
+--*/
+{
+    PCAPTURE_ENDPOINT_TABLE table;
+
+    PAGED_CODE();
 
-        KeReleaseSpinLock(&g_UserPcmRb.lock, oldIrql);
-        return toRead;
+    if (Count < 1)
+    {
+        Count = 1;
+    }
+    else if (Count > MICYAUDIO_MAX_ENDPOINTS)
+    {
+        Count = MICYAUDIO_MAX_ENDPOINTS;
     }
 
-    ULONG UserPcmBuffer_Count()
+    table = (PCAPTURE_ENDPOINT_TABLE)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(CAPTURE_ENDPOINT_TABLE), MINADAPTER_POOLTAG);
+    if (table == NULL)
     {
-        if (!g_UserPcmRb.initialized) return 0;
-        return g_UserPcmRb.count;
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    VOID UserPcmBuffer_Clear()
+    table->Miniports[0] = &MicArray1Miniports;
+
+    for (ULONG i = 1; i < Count; i++)
     {
-        if (!g_UserPcmRb.initialized) return;
-        KIRQL oldIrql;
-        KeAcquireSpinLock(&g_UserPcmRb.lock, &oldIrql);
-        g_UserPcmRb.readIndex = 0;
-        g_UserPcmRb.writeIndex = 0;
-        g_UserPcmRb.count = 0;
-        KeReleaseSpinLock(&g_UserPcmRb.lock, oldIrql);
+        PCAPTURE_ENDPOINT endpoint = &table->Copies[i - 1];
+
+        // Names this short always fit.
+        (void)RtlStringCchPrintfW(endpoint->TopoName, CAPTURE_ENDPOINT_NAME_CCH, L"TopologyMicArray%u", i + 1);
+        (void)RtlStringCchPrintfW(endpoint->WaveName, CAPTURE_ENDPOINT_NAME_CCH, L"WaveMicArray%u", i + 1);
+        (void)RtlStringCchPrintfW(endpoint->FriendlyName, CAPTURE_ENDPOINT_NAME_CCH, L"MicyAudio Microphone %u", i + 1);
+
+        endpoint->Properties[0].PropertyKey = &DEVPKEY_DeviceInterface_FriendlyName;
+        endpoint->Properties[0].Type        = DEVPROP_TYPE_STRING;
+        endpoint->Properties[0].BufferSize  = (ULONG)((wcslen(endpoint->FriendlyName) + 1) * sizeof(WCHAR));
+        endpoint->Properties[0].Buffer      = endpoint->FriendlyName;
+
+        endpoint->Miniports                             = MicArray1Miniports;
+        endpoint->Miniports.TopoName                    = endpoint->TopoName;
+        endpoint->Miniports.TemplateTopoName            = MicArray1Miniports.TopoName;
+        endpoint->Miniports.TopoInterfacePropertyCount  = SIZEOF_ARRAY(endpoint->Properties);
+        endpoint->Miniports.TopoInterfaceProperties     = endpoint->Properties;
+        endpoint->Miniports.WaveName                    = endpoint->WaveName;
+        endpoint->Miniports.TemplateWaveName            = MicArray1Miniports.WaveName;
+        endpoint->Miniports.WaveInterfacePropertyCount  = SIZEOF_ARRAY(endpoint->Properties);
+        endpoint->Miniports.WaveInterfaceProperties     = endpoint->Properties;
+
+        table->Miniports[i] = &endpoint->Miniports;
     }
+
+    g_CaptureEndpointTable  = table;
+    g_CaptureEndpoints      = table->Miniports;
+    g_cCaptureEndpoints     = Count;
+
+    return STATUS_SUCCESS;
 }
-//-----------------------------------------------------------------------------
-// Functions
-//-----------------------------------------------------------------------------
 
+//=============================================================================
 #pragma code_seg("PAGE")
-void ReleaseRegistryStringBuffer()
+void
+CaptureEndpoints_Term()
 {
     PAGED_CODE();
 
-    if (g_RegistryPath.Buffer != NULL)
+    g_CaptureEndpoints  = NULL;
+    g_cCaptureEndpoints = 0;
+
+    if (g_CaptureEndpointTable != NULL)
     {
-        ExFreePool(g_RegistryPath.Buffer);
-        g_RegistryPath.Buffer = NULL;
-        g_RegistryPath.Length = 0;
-        g_RegistryPath.MaximumLength = 0;
+        ExFreePoolWithTag(g_CaptureEndpointTable, MINADAPTER_POOLTAG);
+        g_CaptureEndpointTable = NULL;
     }
 }
 
@@ -277,8 +290,11 @@ Environment:
         IoDeleteDevice(g_ControlDeviceObject);
         g_ControlDeviceObject = NULL;
     }
-    // Release user PCM ring buffer
-    UserPcmBuffer_Term();
+    // Release user PCM routes and their rings
+    UserPcmRoutes_Term();
+    DriverStats_Term();
+
+    CaptureEndpoints_Term();
 Done:
     return;
 }
@@ -360,6 +376,9 @@ Returns:
     // QueryRoutine     Flags                                               Name                     EntryContext             DefaultType                                                    DefaultData              DefaultLength
         { NULL,   RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK, L"DoNotCreateDataFiles", &g_DoNotCreateDataFiles, (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_DWORD, &g_DoNotCreateDataFiles, sizeof(ULONG)},
         { NULL,   RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK, L"DisableToneGenerator", &g_DisableToneGenerator, (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_DWORD, &g_DisableToneGenerator, sizeof(ULONG)},
+        { NULL,   RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK, L"UserPcmCapacityMs",    &g_UserPcmCapacityMs,    (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_DWORD, &g_UserPcmCapacityMs,    sizeof(ULONG)},
+        { NULL,   RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK, L"UserPcmTargetMs",      &g_UserPcmTargetMs,      (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_DWORD, &g_UserPcmTargetMs,      sizeof(ULONG)},
+        { NULL,   RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK, L"CaptureEndpointCount", &g_CaptureEndpointCount, (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_DWORD, &g_CaptureEndpointCount, sizeof(ULONG)},
         { NULL,   0,                                                        NULL,                    NULL,                    0,                                                             NULL,                    0}
     };
 
@@ -400,6 +419,9 @@ Returns:
     //
     DPF(D_VERBOSE, ("DoNotCreateDataFiles: %u", g_DoNotCreateDataFiles));
     DPF(D_VERBOSE, ("DisableToneGenerator: %u", g_DisableToneGenerator));
+    DPF(D_VERBOSE, ("UserPcmCapacityMs: %u", g_UserPcmCapacityMs));
+    DPF(D_VERBOSE, ("UserPcmTargetMs: %u", g_UserPcmTargetMs));
+    DPF(D_VERBOSE, ("CaptureEndpointCount: %u", g_CaptureEndpointCount));
 
     if (DriverKey)
     {
@@ -491,6 +513,15 @@ Return Value:
         DPF(D_ERROR, ("Registry Configuration error 0x%x", ntStatus)),
         Done);
 
+    //
+    // Build the capture endpoint table; AddDevice sizes the adapter by it.
+    //
+    ntStatus = CaptureEndpoints_Init(g_CaptureEndpointCount);
+    IF_FAILED_ACTION_JUMP(
+        ntStatus,
+        DPF(D_ERROR, ("CaptureEndpoints_Init failed, 0x%x", ntStatus)),
+        Done);
+
     //
     // Tell the class driver to initialize the driver.
     //
@@ -548,8 +579,9 @@ Return Value:
     // Store the control device object globally so we can identify it in handlers
     //
     g_ControlDeviceObject = deviceObject;
-    // Initialize user PCM ring buffer (best-effort)
-    (void)UserPcmBuffer_Init(7680 * 4);
+    // Initialize one user PCM route per capture endpoint (best-effort)
+    (void)UserPcmRoutes_Init(DriverObject, g_cCaptureEndpoints, g_UserPcmCapacityMs, g_UserPcmTargetMs);
+    (void)DriverStats_Init(g_cCaptureEndpoints);
 
     //
     // To intercept stop/remove/surprise-remove for audio devices.
@@ -557,13 +589,15 @@ Return Value:
     DriverObject->MajorFunction[IRP_MJ_PNP] = PnpHandler;
 
     //
-    // Register handlers for the control device (CREATE/CLOSE)
+    // Register handlers for the control device (CREATE/CLOSE/CLEANUP)
     // Save original handlers first, then set ours
     //
     g_OriginalCreateHandler = DriverObject->MajorFunction[IRP_MJ_CREATE];
     g_OriginalCloseHandler = DriverObject->MajorFunction[IRP_MJ_CLOSE];
+    g_OriginalCleanupHandler = DriverObject->MajorFunction[IRP_MJ_CLEANUP];
     DriverObject->MajorFunction[IRP_MJ_CREATE] = ControlDeviceCreateClose;
     DriverObject->MajorFunction[IRP_MJ_CLOSE] = ControlDeviceCreateClose;
+    DriverObject->MajorFunction[IRP_MJ_CLEANUP] = ControlDeviceCreateClose;
     
     //
     // Register DeviceIoControl handler for the control device only
@@ -593,6 +627,8 @@ Done:
 
         ReleaseRegistryStringBuffer();
 
+        CaptureEndpoints_Term();
+
         // Clean up control device if it was created
         if (g_ControlDeviceObject != NULL)
         {
@@ -710,7 +746,8 @@ InstallEndpointCaptureFilters(
     _In_ PDEVICE_OBJECT     _pDeviceObject,
     _In_ PIRP               _pIrp,
     _In_ PADAPTERCOMMON     _pAdapterCommon,
-    _In_ PENDPOINT_MINIPAIR _pAeMiniports
+    _In_ PENDPOINT_MINIPAIR _pAeMiniports,
+    _In_ ULONG              _EndpointIndex
 )
 {
     NTSTATUS    ntStatus = STATUS_SUCCESS;
@@ -719,10 +756,14 @@ InstallEndpointCaptureFilters(
 
     UNREFERENCED_PARAMETER(_pDeviceObject);
 
+    //
+    // The endpoint index is the wave miniport's device context; capture
+    // streams use it to find their user PCM route.
+    //
     ntStatus = _pAdapterCommon->InstallEndpointFilters(
         _pIrp,
         _pAeMiniports,
-        NULL,
+        (PVOID)(ULONG_PTR)_EndpointIndex,
         NULL,
         NULL,
         NULL, NULL);
@@ -745,7 +786,7 @@ InstallAllCaptureFilters(
 
     for (ULONG i = 0; i < g_cCaptureEndpoints; ++i, ++ppAeMiniports)
     {
-        ntStatus = InstallEndpointCaptureFilters(_pDeviceObject, _pIrp, _pAdapterCommon, *ppAeMiniports);
+        ntStatus = InstallEndpointCaptureFilters(_pDeviceObject, _pIrp, _pAdapterCommon, *ppAeMiniports, i);
         IF_FAILED_JUMP(ntStatus, Exit);
     }
 
@@ -956,6 +997,7 @@ Return Value:
     ULONG                   outputBufferLength;
     PVOID                   systemBuffer;
     ULONG_PTR               bytesTransferred = 0;
+    LARGE_INTEGER           start = KeQueryPerformanceCounter(NULL);
 
     PAGED_CODE();
 
@@ -978,46 +1020,280 @@ Return Value:
     stack = IoGetCurrentIrpStackLocation(_Irp);
     ioControlCode = stack->Parameters.DeviceIoControl.IoControlCode;
 
-    // Handle our custom IOCTL
-    if (ioControlCode == IOCTL_SIMPLEAUDIOSAMPLE_SET_AUDIO_DATA)
+    inputBufferLength = stack->Parameters.DeviceIoControl.InputBufferLength;
+    outputBufferLength = stack->Parameters.DeviceIoControl.OutputBufferLength;
+    systemBuffer = _Irp->AssociatedIrp.SystemBuffer;
+
+    // Handle our custom IOCTLs
+    switch (ioControlCode)
     {
-        __try {
-            inputBufferLength = stack->Parameters.DeviceIoControl.InputBufferLength;
-            outputBufferLength = stack->Parameters.DeviceIoControl.OutputBufferLength;
-            systemBuffer = _Irp->AssociatedIrp.SystemBuffer;
-
-            // Validate buffer sizes
-            if (inputBufferLength == 0)
-            {
-                ntStatus = STATUS_INVALID_PARAMETER;
-                goto End;
-            }
-
-            // For METHOD_BUFFERED, systemBuffer is valid if either input or output length > 0
-            if (systemBuffer == NULL && inputBufferLength > 0)
-            {
-                ntStatus = STATUS_INVALID_PARAMETER;
-                goto End;
-            }
-
-            // Write received PCM to the ring buffer feeding capture stream
-            ULONG written = UserPcmBuffer_Write((const UCHAR*)systemBuffer, inputBufferLength);
-            DbgPrint("MICY.SYS: Received audio data: %lu bytes, written: %lu, buffered: %lu\n",
-                inputBufferLength, written, UserPcmBuffer_Count());
-            bytesTransferred = 0;  // No output data for this IOCTL
+    case IOCTL_MICYAUDIO_SET_AUDIO_DATA:
+    case IOCTL_MICYAUDIO_SUBMIT_BATCH:
+    {
+        ULONG submitted = 0;
 
+        __try {
+            ntStatus = UserPcmSubmit_Dispatch(_Irp, &submitted);
         }
         __except (EXCEPTION_EXECUTE_HANDLER) {
             DbgPrint("SIMPLEAUDIOSAMPLE: Exception in IOCTL handler\n");
             ntStatus = STATUS_INVALID_DEVICE_REQUEST;
         }
+
+        // A pended request belongs to the feeder ring's wait queue now.
+        if (ntStatus == STATUS_PENDING)
+        {
+            DriverStats_RecordIoctl(KeQueryPerformanceCounter(NULL).QuadPart - start.QuadPart);
+            return STATUS_PENDING;
+        }
+
+        bytesTransferred = submitted;
+        break;
+    }
+
+    case IOCTL_MICYAUDIO_MAP_RING:
+    {
+        PUSER_PCM_RING ring;
+        ULONG          streamId = 0;
+
+        if (systemBuffer == NULL || outputBufferLength < sizeof(MICYAUDIO_RING_MAPPING))
+        {
+            ntStatus = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        // Input and output share the system buffer; read the request first.
+        if (inputBufferLength >= sizeof(MICYAUDIO_MAP_RING_REQUEST))
+        {
+            streamId = ((PMICYAUDIO_MAP_RING_REQUEST)systemBuffer)->StreamId;
+        }
+
+        ring = UserPcmRoute_Lookup(streamId);
+        if (ring == NULL)
+        {
+            ntStatus = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        ntStatus = UserPcmRing_MapToProcess(ring,
+                                            stack->FileObject,
+                                            (PMICYAUDIO_RING_MAPPING)systemBuffer);
+        UserPcmRing_Dereference(ring);
+        if (NT_SUCCESS(ntStatus))
+        {
+            bytesTransferred = sizeof(MICYAUDIO_RING_MAPPING);
+        }
+        break;
+    }
+
+    case IOCTL_MICYAUDIO_UNMAP_RING:
+        ntStatus = UserPcmRing_UnmapFile(stack->FileObject);
+        break;
+
+    case IOCTL_MICYAUDIO_MAP_DIRECT:
+    {
+        PUSER_DMA_BUFFER buffer;
+        ULONG            streamId = 0;
+
+        if (systemBuffer == NULL || outputBufferLength < sizeof(MICYAUDIO_DIRECT_MAPPING))
+        {
+            ntStatus = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        if (inputBufferLength >= sizeof(MICYAUDIO_MAP_RING_REQUEST))
+        {
+            streamId = ((PMICYAUDIO_MAP_RING_REQUEST)systemBuffer)->StreamId;
+        }
+
+        if (!UserPcmRoute_IsValidStreamId(streamId))
+        {
+            ntStatus = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        buffer = UserPcmRoute_LookupDirect(streamId);
+        if (buffer == NULL)
+        {
+            ntStatus = STATUS_DEVICE_NOT_READY;
+            break;
+        }
+
+        ntStatus = UserDma_MapToProcess(buffer,
+                                        stack->FileObject,
+                                        (PMICYAUDIO_DIRECT_MAPPING)systemBuffer);
+        UserDma_Dereference(buffer);
+        if (NT_SUCCESS(ntStatus))
+        {
+            bytesTransferred = sizeof(MICYAUDIO_DIRECT_MAPPING);
+        }
+        break;
+    }
+
+    case IOCTL_MICYAUDIO_UNMAP_DIRECT:
+        ntStatus = UserDma_UnmapFile(stack->FileObject);
+        break;
+
+    case IOCTL_MICYAUDIO_SET_WATERMARKS:
+        if (systemBuffer == NULL || inputBufferLength < sizeof(MICYAUDIO_WATERMARKS))
+        {
+            ntStatus = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        ntStatus = UserPcmRoute_SetWatermarks(stack->FileObject, (PMICYAUDIO_WATERMARKS)systemBuffer);
+        break;
+
+    case IOCTL_MICYAUDIO_SET_CONFIG:
+        if (systemBuffer == NULL || inputBufferLength < sizeof(MICYAUDIO_STREAM_CONFIG))
+        {
+            ntStatus = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        ntStatus = UserPcmRoute_SetConfig((PMICYAUDIO_STREAM_CONFIG)systemBuffer);
+        break;
+
+    case IOCTL_MICYAUDIO_GET_CONFIG:
+    {
+        MICYAUDIO_STREAM_CONFIG config = { 0 };
+
+        if (systemBuffer == NULL || outputBufferLength < sizeof(MICYAUDIO_STREAM_CONFIG))
+        {
+            ntStatus = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        if (inputBufferLength >= sizeof(ULONG))
+        {
+            config.StreamId = *(PULONG)systemBuffer;
+        }
+
+        ntStatus = UserPcmRoute_GetConfig(&config);
+        if (NT_SUCCESS(ntStatus))
+        {
+            RtlCopyMemory(systemBuffer, &config, sizeof(config));
+            bytesTransferred = sizeof(config);
+        }
+        break;
+    }
+
+    case IOCTL_MICYAUDIO_SET_INPUT_FORMAT:
+        if (systemBuffer == NULL || inputBufferLength < sizeof(MICYAUDIO_INPUT_FORMAT))
+        {
+            ntStatus = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        ntStatus = UserPcmRoute_SetInputFormat((PMICYAUDIO_INPUT_FORMAT)systemBuffer);
+        break;
+
+    case IOCTL_MICYAUDIO_GET_INPUT_FORMAT:
+    {
+        MICYAUDIO_INPUT_FORMAT format = { 0 };
+
+        if (systemBuffer == NULL || outputBufferLength < sizeof(MICYAUDIO_INPUT_FORMAT))
+        {
+            ntStatus = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        if (inputBufferLength >= sizeof(ULONG))
+        {
+            format.StreamId = *(PULONG)systemBuffer;
+        }
+
+        ntStatus = UserPcmRoute_GetInputFormat(&format);
+        if (NT_SUCCESS(ntStatus))
+        {
+            RtlCopyMemory(systemBuffer, &format, sizeof(format));
+            bytesTransferred = sizeof(format);
+        }
+        break;
+    }
+
+    case IOCTL_MICYAUDIO_GET_LEVELS:
+    {
+        MICYAUDIO_LEVELS levels = { 0 };
+
+        if (systemBuffer == NULL || outputBufferLength < sizeof(MICYAUDIO_LEVELS))
+        {
+            ntStatus = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        if (inputBufferLength >= sizeof(ULONG))
+        {
+            levels.StreamId = *(PULONG)systemBuffer;
+        }
+
+        ntStatus = UserPcmRoute_GetLevels(&levels);
+        if (NT_SUCCESS(ntStatus))
+        {
+            RtlCopyMemory(systemBuffer, &levels, sizeof(levels));
+            bytesTransferred = sizeof(levels);
+        }
+        break;
+    }
+
+    case IOCTL_MICYAUDIO_GET_STATS:
+    {
+        MICYAUDIO_STATS stats = { 0 };
+
+        if (systemBuffer == NULL || outputBufferLength < sizeof(MICYAUDIO_STATS))
+        {
+            ntStatus = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        if (inputBufferLength >= sizeof(ULONG))
+        {
+            stats.StreamId = *(PULONG)systemBuffer;
+        }
+
+        ntStatus = UserPcmRoute_GetStats(&stats);
+        if (NT_SUCCESS(ntStatus))
+        {
+            RtlCopyMemory(systemBuffer, &stats, sizeof(stats));
+            bytesTransferred = sizeof(stats);
+        }
+        break;
+    }
+
+    case IOCTL_MICYAUDIO_GET_LATENCY:
+    {
+        ULONG flags = 0;
+
+        if (systemBuffer == NULL || outputBufferLength < sizeof(MICYAUDIO_LATENCY))
+        {
+            ntStatus = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        // Input and output share the system buffer; read the flags first.
+        if (inputBufferLength >= sizeof(ULONG))
+        {
+            flags = *(PULONG)systemBuffer;
+        }
+
+        if (flags & ~MICYAUDIO_LATENCY_FLAGS_VALID)
+        {
+            ntStatus = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        DriverStats_GetLatency((PMICYAUDIO_LATENCY)systemBuffer, flags);
+        bytesTransferred = sizeof(MICYAUDIO_LATENCY);
+        break;
     }
-    else {
+
+    default:
         // Unknown IOCTL for control device
         return PcDispatchIrp(_DeviceObject, _Irp);
     }
 
-End:
+    DriverStats_RecordIoctl(KeQueryPerformanceCounter(NULL).QuadPart - start.QuadPart);
+
     //
     // Complete the I/O operation
     //
@@ -1040,8 +1316,10 @@ ControlDeviceCreateClose
 
 Routine Description:
 
-  Handles Create and Close IRPs
-  For the control device, simply succeed.
+  Handles Create, Cleanup and Close IRPs
+  For the control device, simply succeed. On cleanup, any ring mapping
+  created through the handle is torn down while still in the caller's
+  process context.
   For PortCls audio devices, call the original handler (if any) or pass to PortCls.
 
 Arguments:
@@ -1065,6 +1343,16 @@ Return Value:
     //
     if (g_ControlDeviceObject != NULL && _DeviceObject == g_ControlDeviceObject)
     {
+        PIO_STACK_LOCATION controlStack = IoGetCurrentIrpStackLocation(_Irp);
+
+        if (controlStack->MajorFunction == IRP_MJ_CLEANUP)
+        {
+            UserPcmSubmit_CancelFile(controlStack->FileObject);
+            UserPcmRoutes_ReleaseWatermarks(controlStack->FileObject);
+            (void)UserPcmRing_UnmapFile(controlStack->FileObject);
+            (void)UserDma_UnmapFile(controlStack->FileObject);
+        }
+
         // Control device - just succeed
         _Irp->IoStatus.Status = STATUS_SUCCESS;
         _Irp->IoStatus.Information = 0;
@@ -1089,6 +1377,10 @@ Return Value:
     {
         originalHandler = g_OriginalCloseHandler;
     }
+    else if (stack->MajorFunction == IRP_MJ_CLEANUP)
+    {
+        originalHandler = g_OriginalCleanupHandler;
+    }
 
     if (originalHandler != NULL)
     {
@@ -23,7 +23,8 @@ Abstract:
 CMiniportTopologySimpleAudioSample::CMiniportTopologySimpleAudioSample
 (
     _In_        PCFILTER_DESCRIPTOR    *FilterDesc,
-    _In_        USHORT                  DeviceMaxChannels
+    _In_        USHORT                  DeviceMaxChannels,
+    _In_        ULONG                   EndpointIndex
 )
 /*++
 
@@ -37,6 +38,8 @@ Arguments:
 
   DeviceMaxChannels - 
 
+  EndpointIndex - endpoint whose mixer registers the nodes of the filter use
+
 Return Value:
 
   void
@@ -55,6 +58,7 @@ Return Value:
     
     ASSERT(DeviceMaxChannels > 0);
     m_DeviceMaxChannels = DeviceMaxChannels;
+    m_ulEndpointIndex   = EndpointIndex;
 } // CMiniportTopologySimpleAudioSample
 
 CMiniportTopologySimpleAudioSample::~CMiniportTopologySimpleAudioSample
@@ -277,6 +281,7 @@ Return Value:
         case KSPROPERTY_AUDIO_VOLUMELEVEL:
             ntStatus = PropertyHandler_Volume(
                                 m_AdapterCommon,
+                                m_ulEndpointIndex,
                                 PropertyRequest,
                                 m_DeviceMaxChannels);
             break;
@@ -284,6 +289,7 @@ Return Value:
         case KSPROPERTY_AUDIO_MUTE:
             ntStatus = PropertyHandler_Mute(
                                 m_AdapterCommon,
+                                m_ulEndpointIndex,
                                 PropertyRequest,
                                 m_DeviceMaxChannels);
             break;
@@ -291,6 +297,7 @@ Return Value:
         case KSPROPERTY_AUDIO_PEAKMETER2:
             ntStatus = PropertyHandler_PeakMeter2(
                                 m_AdapterCommon,
+                                m_ulEndpointIndex,
                                 PropertyRequest,
                                 m_DeviceMaxChannels);
             break;
@@ -95,12 +95,14 @@ class CAdapterCommon :
 
         STDMETHODIMP_(BOOL)     MixerMuteRead
         (
+            _In_  ULONG           Endpoint,
             _In_  ULONG           Index,
             _In_  ULONG           Channel
         );
 
         STDMETHODIMP_(void)     MixerMuteWrite
         (
+            _In_  ULONG           Endpoint,
             _In_  ULONG           Index,
             _In_  ULONG           Channel,
             _In_  BOOL            Value
@@ -117,12 +119,14 @@ class CAdapterCommon :
 
         STDMETHODIMP_(LONG)     MixerVolumeRead
         ( 
+            _In_  ULONG           Endpoint,
             _In_  ULONG           Index,
             _In_  ULONG           Channel
         );
 
         STDMETHODIMP_(void)     MixerVolumeWrite
         ( 
+            _In_  ULONG           Endpoint,
             _In_  ULONG           Index,
             _In_  ULONG           Channel,
             _In_  LONG            Value 
@@ -130,10 +134,19 @@ class CAdapterCommon :
 
         STDMETHODIMP_(LONG)     MixerPeakMeterRead
         ( 
+            _In_  ULONG           Endpoint,
             _In_  ULONG           Index,
             _In_  ULONG           Channel
         );
 
+        STDMETHODIMP_(void)     MixerPeakMeterWrite
+        ( 
+            _In_  ULONG           Endpoint,
+            _In_  ULONG           Index,
+            _In_  ULONG           Channel,
+            _In_  LONG            Value 
+        );
+
         STDMETHODIMP_(NTSTATUS) WriteEtwEvent 
         ( 
             _In_ EPcMiniportEngineEvent    miniportEventType,
@@ -589,9 +602,10 @@ Return Value:
         DPF(D_ERROR, ("WdfDeviceMiniportCreate failed, 0x%x", ntStatus)),
         Done);
 
-    // Initialize HW.
+    // Initialize HW. Cache aligned, so the register blocks of the endpoints
+    // really are on cache lines of their own.
     // 
-    m_pHW = new (POOL_FLAG_NON_PAGED, SIMPLEAUDIOSAMPLE_POOLTAG)  CSimpleAudioSampleHW;
+    m_pHW = new (POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED, SIMPLEAUDIOSAMPLE_POOLTAG)  CSimpleAudioSampleHW;
     if (!m_pHW)
     {
         DPF(D_TERSE, ("Insufficient memory for Simple Audio Sample HW"));
@@ -1000,6 +1014,7 @@ Return Value:
 STDMETHODIMP_(BOOL)
 CAdapterCommon::MixerMuteRead
 (
+    _In_  ULONG               Endpoint,
     _In_  ULONG               Index,
     _In_  ULONG               Channel
 )
@@ -1011,6 +1026,8 @@ Routine Description:
 
 Arguments:
 
+  Endpoint - endpoint whose topology the node belongs to
+
   Index - node id
 
 Return Value:
@@ -1021,7 +1038,7 @@ Return Value:
 {
     if (m_pHW)
     {
-        return m_pHW->GetMixerMute(Index, Channel);
+        return m_pHW->GetMixerMute(Endpoint, Index, Channel);
     }
 
     return 0;
@@ -1032,6 +1049,7 @@ Return Value:
 STDMETHODIMP_(void)
 CAdapterCommon::MixerMuteWrite
 (
+    _In_  ULONG                   Endpoint,
     _In_  ULONG                   Index,
     _In_  ULONG                   Channel,
     _In_  BOOL                    Value
@@ -1044,6 +1062,8 @@ Routine Description:
 
 Arguments:
 
+  Endpoint - endpoint whose topology the node belongs to
+
   Index - node id
 
   Value - new mute settings
@@ -1056,7 +1076,7 @@ Return Value:
 {
     if (m_pHW)
     {
-        m_pHW->SetMixerMute(Index, Channel, Value);
+        m_pHW->SetMixerMute(Endpoint, Index, Channel, Value);
     }
 } // MixerMuteWrite
 
@@ -1126,6 +1146,7 @@ Return Value:
 STDMETHODIMP_(LONG)
 CAdapterCommon::MixerVolumeRead
 ( 
+    _In_  ULONG                   Endpoint,
     _In_  ULONG                   Index,
     _In_  ULONG                   Channel
 )
@@ -1137,6 +1158,8 @@ Routine Description:
 
 Arguments:
 
+  Endpoint - endpoint whose topology the node belongs to
+
   Index - node id
 
   Channel = which channel
@@ -1149,7 +1172,7 @@ Return Value:
 {
     if (m_pHW)
     {
-        return m_pHW->GetMixerVolume(Index, Channel);
+        return m_pHW->GetMixerVolume(Endpoint, Index, Channel);
     }
 
     return 0;
@@ -1160,6 +1183,7 @@ Return Value:
 STDMETHODIMP_(void)
 CAdapterCommon::MixerVolumeWrite
 ( 
+    _In_  ULONG                   Endpoint,
     _In_  ULONG                   Index,
     _In_  ULONG                   Channel,
     _In_  LONG                    Value
@@ -1172,6 +1196,8 @@ Routine Description:
 
 Arguments:
 
+  Endpoint - endpoint whose topology the node belongs to
+
   Index - node id
 
   Channel - which channel
@@ -1186,7 +1212,7 @@ Return Value:
 {
     if (m_pHW)
     {
-        m_pHW->SetMixerVolume(Index, Channel, Value);
+        m_pHW->SetMixerVolume(Endpoint, Index, Channel, Value);
     }
 } // MixerVolumeWrite
 
@@ -1195,6 +1221,7 @@ Return Value:
 STDMETHODIMP_(LONG)
 CAdapterCommon::MixerPeakMeterRead
 ( 
+    _In_  ULONG                   Endpoint,
     _In_  ULONG                   Index,
     _In_  ULONG                   Channel
 )
@@ -1206,6 +1233,8 @@ Routine Description:
 
 Arguments:
 
+  Endpoint - endpoint whose topology the node belongs to
+
   Index - node id
 
   Channel = which channel
@@ -1218,11 +1247,50 @@ Return Value:
 {
     if (m_pHW)
     {
-        return m_pHW->GetMixerPeakMeter(Index, Channel);
+        return m_pHW->GetMixerPeakMeter(Endpoint, Index, Channel);
     }
 
     return 0;
-} // MixerVolumeRead
+} // MixerPeakMeterRead
+
+//=============================================================================
+#pragma code_seg()
+STDMETHODIMP_(void)
+CAdapterCommon::MixerPeakMeterWrite
+( 
+    _In_  ULONG                   Endpoint,
+    _In_  ULONG                   Index,
+    _In_  ULONG                   Channel,
+    _In_  LONG                    Value
+)
+/*++
+
+Routine Description:
+
+  Report the peak level of captured audio to the mixer register array.
+  Callable from the capture DPC.
+
+Arguments:
+
+  Endpoint - endpoint whose topology the node belongs to
+
+  Index - node id
+
+  Channel - which channel
+
+  Value - peak level, 0 to PEAKMETER_SIGNED_MAXIMUM
+
+Return Value:
+
+    void
+
+--*/
+{
+    if (m_pHW)
+    {
+        m_pHW->SetMixerPeakMeter(Endpoint, Index, Channel, Value);
+    }
+} // MixerPeakMeterWrite
 
 //=============================================================================
 #pragma code_seg()
@@ -0,0 +1,371 @@
+/*++
+
+Module Name:
+
+    driverstats.cpp
+
+Abstract:
+
+    Per-CPU counters of the capture path.
+
+    Every processor has a set of counters of its own for each capture
+    endpoint, on cache lines of its own, so the submission path, the
+    notification DPCs and the control device bump them without sharing a
+    line with another processor. Updates are interlocked only because a
+    caller below DISPATCH_LEVEL may move to another processor halfway; the
+    line is not contended. IOCTL_MICYAUDIO_GET_STATS sums the sets up.
+
+    Each processor also keeps its own copy of the latency histograms
+    (lathist.h), which are not synchronized at all: a copy is only
+    recorded into at DISPATCH_LEVEL on its own processor, so nothing else
+    ever writes it. IOCTL_MICYAUDIO_GET_LATENCY merges the copies.
+--*/
+
+#include "definitions.h"
+#include "driverstats.h"
+#include "lathist.h"
+
+#define DRIVERSTATS_POOLTAG     'SDyM'
+
+C_ASSERT(MICYAUDIO_LATENCY_SUB_BITS == LAT_HIST_SUB_BITS);
+C_ASSERT(MICYAUDIO_LATENCY_MAX_BITS == LAT_HIST_MAX_BITS);
+C_ASSERT(MICYAUDIO_LATENCY_BUCKETS == LAT_HIST_BUCKETS);
+C_ASSERT(sizeof(MICYAUDIO_LATENCY_HISTOGRAM) == sizeof(LAT_HIST));
+C_ASSERT(FIELD_OFFSET(MICYAUDIO_LATENCY_HISTOGRAM, SumNs) == FIELD_OFFSET(LAT_HIST, Sum));
+C_ASSERT(FIELD_OFFSET(MICYAUDIO_LATENCY_HISTOGRAM, MaxNs) == FIELD_OFFSET(LAT_HIST, Max));
+C_ASSERT(FIELD_OFFSET(MICYAUDIO_LATENCY_HISTOGRAM, Buckets) == FIELD_OFFSET(LAT_HIST, Buckets));
+
+typedef struct DECLSPEC_CACHEALIGN _DRIVER_STATS_ENDPOINT {
+    volatile LONG64     sum[DriverStatCount];
+    volatile LONG64     highest[DriverStatMaxCount];
+} DRIVER_STATS_ENDPOINT, *PDRIVER_STATS_ENDPOINT;
+
+typedef struct DECLSPEC_CACHEALIGN _DRIVER_STATS_CPU {
+    volatile LONG64     ioctlCount;
+    volatile LONG64     ioctlLatency[MICYAUDIO_STATS_LATENCY_BUCKETS];
+    LAT_HIST            hist[DriverHistCount];
+} DRIVER_STATS_CPU, *PDRIVER_STATS_CPU;
+
+typedef struct _DRIVER_STATS_TABLE {
+    ULONG                   cpuCount;
+    ULONG                   endpointCount;
+    PDRIVER_STATS_CPU       cpus;           // [cpuCount]
+    PDRIVER_STATS_ENDPOINT  endpoints;      // [cpuCount * endpointCount], by processor first
+    LONGLONG                frequency;      // QPC
+} DRIVER_STATS_TABLE;
+
+static DRIVER_STATS_TABLE g_DriverStats = { 0 };
+
+//=============================================================================
+#pragma code_seg("PAGE")
+NTSTATUS
+DriverStats_Init
+(
+    _In_ ULONG EndpointCount
+)
+{
+    LARGE_INTEGER   frequency;
+    ULONG           cpuCount;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(&g_DriverStats, sizeof(g_DriverStats));
+
+    if (EndpointCount == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    // Processors that can be hot added later get their counters now.
+    cpuCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    g_DriverStats.cpus = (PDRIVER_STATS_CPU)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+                                                            (SIZE_T)cpuCount * sizeof(DRIVER_STATS_CPU),
+                                                            DRIVERSTATS_POOLTAG);
+    g_DriverStats.endpoints = (PDRIVER_STATS_ENDPOINT)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+                                                                      (SIZE_T)cpuCount * EndpointCount * sizeof(DRIVER_STATS_ENDPOINT),
+                                                                      DRIVERSTATS_POOLTAG);
+    if (g_DriverStats.cpus == NULL || g_DriverStats.endpoints == NULL)
+    {
+        DriverStats_Term();
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    (void)KeQueryPerformanceCounter(&frequency);
+    g_DriverStats.frequency     = frequency.QuadPart;
+    g_DriverStats.endpointCount = EndpointCount;
+    g_DriverStats.cpuCount      = cpuCount;
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+VOID
+DriverStats_Term()
+{
+    PAGED_CODE();
+
+    g_DriverStats.cpuCount = 0;
+    g_DriverStats.endpointCount = 0;
+
+    if (g_DriverStats.endpoints != NULL)
+    {
+        ExFreePoolWithTag(g_DriverStats.endpoints, DRIVERSTATS_POOLTAG);
+        g_DriverStats.endpoints = NULL;
+    }
+
+    if (g_DriverStats.cpus != NULL)
+    {
+        ExFreePoolWithTag(g_DriverStats.cpus, DRIVERSTATS_POOLTAG);
+        g_DriverStats.cpus = NULL;
+    }
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+ULONG
+DriverStats_CurrentCpu()
+{
+    ULONG cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+    return cpu < g_DriverStats.cpuCount ? cpu : cpu % g_DriverStats.cpuCount;
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+DriverStats_Add
+(
+    _In_ ULONG          EndpointIndex,
+    _In_ DRIVER_STAT    Stat,
+    _In_ ULONGLONG      Value
+)
+{
+    PDRIVER_STATS_ENDPOINT slot;
+
+    if (EndpointIndex >= g_DriverStats.endpointCount || Value == 0)
+    {
+        return;
+    }
+
+    slot = &g_DriverStats.endpoints[DriverStats_CurrentCpu() * g_DriverStats.endpointCount + EndpointIndex];
+    InterlockedAdd64(&slot->sum[Stat], (LONG64)Value);
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+DriverStats_Max
+(
+    _In_ ULONG              EndpointIndex,
+    _In_ DRIVER_STAT_MAX    Stat,
+    _In_ ULONGLONG          Value
+)
+{
+    PDRIVER_STATS_ENDPOINT  slot;
+    LONG64                  current;
+
+    if (EndpointIndex >= g_DriverStats.endpointCount)
+    {
+        return;
+    }
+
+    slot = &g_DriverStats.endpoints[DriverStats_CurrentCpu() * g_DriverStats.endpointCount + EndpointIndex];
+
+    // Usually below the maximum already, which costs only the read.
+    current = ReadNoFence64(&slot->highest[Stat]);
+    while ((ULONGLONG)current < Value)
+    {
+        LONG64 seen = InterlockedCompareExchange64(&slot->highest[Stat], (LONG64)Value, current);
+        if (seen == current)
+        {
+            break;
+        }
+        current = seen;
+    }
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+ULONGLONG
+DriverStats_TicksToNs
+(
+    _In_ LONGLONG Ticks
+)
+{
+    ULONGLONG ticks = (Ticks > 0) ? (ULONGLONG)Ticks : 0;
+    ULONGLONG frequency = (ULONGLONG)g_DriverStats.frequency;
+
+    // Split at whole seconds so the product cannot overflow.
+    return ticks / frequency * 1000000000 + ticks % frequency * 1000000000 / frequency;
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+DriverStats_RecordLatency
+(
+    _In_ DRIVER_HIST    Hist,
+    _In_ LONGLONG       Ticks
+)
+{
+    KIRQL oldIrql;
+
+    if (g_DriverStats.cpuCount == 0)
+    {
+        return;
+    }
+
+    // Pins the caller to the processor whose copy it records into.
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+    LatHist_Record(&g_DriverStats.cpus[DriverStats_CurrentCpu()].hist[Hist], DriverStats_TicksToNs(Ticks));
+    KeLowerIrql(oldIrql);
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+DriverStats_RecordIoctl
+(
+    _In_ LONGLONG Ticks
+)
+/*++
+
+Routine Description:
+
+  Counts a control device request that took Ticks of QPC to serve in the
+  latency bucket of its whole microseconds, see MICYAUDIO_STATS.
+
+--*/
+{
+    PDRIVER_STATS_CPU   slot;
+    ULONGLONG           us;
+    ULONG               bucket = 0;
+    ULONG               msb;
+
+    if (g_DriverStats.cpuCount == 0)
+    {
+        return;
+    }
+
+    us = (Ticks > 0) ? (ULONGLONG)Ticks * 1000000 / (ULONGLONG)g_DriverStats.frequency : 0;
+    if (_BitScanReverse64(&msb, us))
+    {
+        bucket = min(msb + 1, (ULONG)(MICYAUDIO_STATS_LATENCY_BUCKETS - 1));
+    }
+
+    slot = &g_DriverStats.cpus[DriverStats_CurrentCpu()];
+    InterlockedIncrement64(&slot->ioctlCount);
+    InterlockedIncrement64(&slot->ioctlLatency[bucket]);
+
+    DriverStats_RecordLatency(DriverHistIoctlTime, Ticks);
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+VOID
+DriverStats_Get
+(
+    _In_    ULONG               EndpointIndex,
+    _Inout_ PMICYAUDIO_STATS    Stats
+)
+/*++
+
+Routine Description:
+
+  Sums the counters up. Each is read on its own while the others keep
+  moving, so the result is not a snapshot of a single moment, but none
+  of the counters ever goes backwards.
+
+--*/
+{
+    ULONGLONG   sum[DriverStatCount] = { 0 };
+    ULONGLONG   highest[DriverStatMaxCount] = { 0 };
+    ULONG       cpu;
+    ULONG       i;
+
+    PAGED_CODE();
+
+    Stats->DpcMaxNs   = 0;
+    Stats->IoctlCount = 0;
+    RtlZeroMemory(Stats->IoctlLatency, sizeof(Stats->IoctlLatency));
+
+    for (cpu = 0; cpu < g_DriverStats.cpuCount; cpu++)
+    {
+        PDRIVER_STATS_CPU slot = &g_DriverStats.cpus[cpu];
+
+        Stats->IoctlCount += (ULONGLONG)ReadNoFence64(&slot->ioctlCount);
+        for (i = 0; i < MICYAUDIO_STATS_LATENCY_BUCKETS; i++)
+        {
+            Stats->IoctlLatency[i] += (ULONGLONG)ReadNoFence64(&slot->ioctlLatency[i]);
+        }
+
+        if (EndpointIndex < g_DriverStats.endpointCount)
+        {
+            PDRIVER_STATS_ENDPOINT endpoint = &g_DriverStats.endpoints[cpu * g_DriverStats.endpointCount + EndpointIndex];
+
+            for (i = 0; i < DriverStatCount; i++)
+            {
+                sum[i] += (ULONGLONG)ReadNoFence64(&endpoint->sum[i]);
+            }
+            for (i = 0; i < DriverStatMaxCount; i++)
+            {
+                highest[i] = max(highest[i], (ULONGLONG)ReadNoFence64(&endpoint->highest[i]));
+            }
+        }
+    }
+
+    Stats->BytesSubmitted = sum[DriverStatBytesSubmitted];
+    Stats->BytesDropped   = sum[DriverStatBytesDropped];
+    Stats->SilenceBytes   = sum[DriverStatSilenceBytes];
+    Stats->DpcCount       = sum[DriverStatDpcCount];
+    Stats->RingHighWater  = highest[DriverStatMaxRingBytes];
+
+    if (g_DriverStats.frequency != 0)
+    {
+        Stats->DpcMaxNs = highest[DriverStatMaxDpcTicks] * 1000000000 / (ULONGLONG)g_DriverStats.frequency;
+    }
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+VOID
+DriverStats_GetLatency
+(
+    _Out_   PMICYAUDIO_LATENCY  Latency,
+    _In_    ULONG               Flags
+)
+/*++
+
+Routine Description:
+
+  Merges the processors' copies while they keep recording. A copy is read
+  one counter at a time, so the merged histogram may be off by the values
+  recorded meanwhile; a reset may drop them or, racing with the owner's
+  update of a bucket, leave one behind to be counted again.
+
+--*/
+{
+    PAGED_CODE();
+
+    for (ULONG h = 0; h < DriverHistCount; h++)
+    {
+        PLAT_HIST merged = (PLAT_HIST)&Latency->Histograms[h];
+
+        LatHist_Reset(merged);
+
+        for (ULONG cpu = 0; cpu < g_DriverStats.cpuCount; cpu++)
+        {
+            PLAT_HIST hist = &g_DriverStats.cpus[cpu].hist[h];
+
+            LatHist_Merge(merged, hist);
+            if (Flags & MICYAUDIO_LATENCY_FLAG_RESET)
+            {
+                LatHist_Reset(hist);
+            }
+        }
+    }
+}
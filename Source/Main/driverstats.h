@@ -0,0 +1,90 @@
+/*++
+
+Module Name:
+
+    driverstats.h
+
+Abstract:
+
+    Per-CPU counters of the capture path, read with
+    IOCTL_MICYAUDIO_GET_STATS.
+--*/
+
+#ifndef _MICYAUDIO_DRIVERSTATS_H_
+#define _MICYAUDIO_DRIVERSTATS_H_
+
+#include "micyioctl.h"
+
+//
+// Counters of an endpoint that add up.
+//
+typedef enum _DRIVER_STAT
+{
+    DriverStatBytesSubmitted = 0,
+    DriverStatBytesDropped,
+    DriverStatSilenceBytes,
+    DriverStatDpcCount,
+    DriverStatCount
+} DRIVER_STAT;
+
+//
+// Counters of an endpoint that keep the highest value seen. DPC durations
+// are in QPC ticks, converted when read.
+//
+typedef enum _DRIVER_STAT_MAX
+{
+    DriverStatMaxDpcTicks = 0,
+    DriverStatMaxRingBytes,
+    DriverStatMaxCount
+} DRIVER_STAT_MAX;
+
+//
+// Latency histograms, MICYAUDIO_LATENCY_*.
+//
+typedef enum _DRIVER_HIST
+{
+    DriverHistDpcTime = MICYAUDIO_LATENCY_DPC_TIME,
+    DriverHistDpcLateness = MICYAUDIO_LATENCY_DPC_LATENESS,
+    DriverHistIoctlTime = MICYAUDIO_LATENCY_IOCTL_TIME,
+    DriverHistLockHold = MICYAUDIO_LATENCY_LOCK_HOLD,
+    DriverHistCount = MICYAUDIO_LATENCY_HISTOGRAMS
+} DRIVER_HIST;
+
+//
+// Allocates the counters for EndpointCount capture endpoints on every
+// processor the system can have. Without them (EndpointCount 0, or out of
+// memory) updates are ignored and reads return zeros. PASSIVE_LEVEL.
+//
+NTSTATUS DriverStats_Init(_In_ ULONG EndpointCount);
+
+VOID DriverStats_Term();
+
+//
+// Updates, any IRQL <= DISPATCH_LEVEL. Each touches only the current
+// processor's cache lines; an EndpointIndex out of range is ignored.
+//
+VOID DriverStats_Add(_In_ ULONG EndpointIndex, _In_ DRIVER_STAT Stat, _In_ ULONGLONG Value);
+
+VOID DriverStats_Max(_In_ ULONG EndpointIndex, _In_ DRIVER_STAT_MAX Stat, _In_ ULONGLONG Value);
+
+VOID DriverStats_RecordIoctl(_In_ LONGLONG Ticks);
+
+//
+// Records Ticks of QPC, 0 if negative, in the current processor's copy of
+// Hist. Any IRQL <= DISPATCH_LEVEL.
+//
+VOID DriverStats_RecordLatency(_In_ DRIVER_HIST Hist, _In_ LONGLONG Ticks);
+
+//
+// Sums the counters of EndpointIndex over all processors into Stats, all
+// but its StreamId.
+//
+VOID DriverStats_Get(_In_ ULONG EndpointIndex, _Inout_ PMICYAUDIO_STATS Stats);
+
+//
+// Merges every processor's histograms into Latency, clearing them as it
+// goes if Flags has MICYAUDIO_LATENCY_FLAG_RESET.
+//
+VOID DriverStats_GetLatency(_Out_ PMICYAUDIO_LATENCY Latency, _In_ ULONG Flags);
+
+#endif // _MICYAUDIO_DRIVERSTATS_H_
@@ -159,6 +159,67 @@ Return Value:
 
 } // ~CMiniportWaveRT
 
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+BOOLEAN
+IsFormatInDataRange
+(
+    _In_ PKSDATAFORMAT_WAVEFORMATEXTENSIBLE _pFormat,
+    _In_ PKSDATARANGE                       _pDataRange
+)
+/*++
+
+Routine Description:
+
+  Tells whether a supported device format lies within a data range. The
+  range's GUIDs may be wildcards; its audio limits are only checked when
+  it is a KSDATARANGE_AUDIO.
+
+--*/
+{
+    PAGED_CODE();
+
+    if (!IsEqualGUIDAligned(_pDataRange->MajorFormat, KSDATAFORMAT_TYPE_WILDCARD) &&
+        !IsEqualGUIDAligned(_pDataRange->MajorFormat, _pFormat->DataFormat.MajorFormat))
+    {
+        return FALSE;
+    }
+
+    if (!IsEqualGUIDAligned(_pDataRange->SubFormat, KSDATAFORMAT_SUBTYPE_WILDCARD) &&
+        !IsEqualGUIDAligned(_pDataRange->SubFormat, _pFormat->DataFormat.SubFormat))
+    {
+        return FALSE;
+    }
+
+    if (_pDataRange->FormatSize >= sizeof(KSDATARANGE_AUDIO))
+    {
+        PKSDATARANGE_AUDIO  pAudioRange = (PKSDATARANGE_AUDIO)_pDataRange;
+        PWAVEFORMATEX       pWaveFormat = &_pFormat->WaveFormatExt.Format;
+
+        // (ULONG)-1 channels means any number of channels.
+        if (pAudioRange->MaximumChannels != (ULONG)-1 &&
+            pWaveFormat->nChannels > pAudioRange->MaximumChannels)
+        {
+            return FALSE;
+        }
+
+        if (pWaveFormat->wBitsPerSample < pAudioRange->MinimumBitsPerSample ||
+            pWaveFormat->wBitsPerSample > pAudioRange->MaximumBitsPerSample)
+        {
+            return FALSE;
+        }
+
+        if (pWaveFormat->nSamplesPerSec < pAudioRange->MinimumSampleFrequency ||
+            pWaveFormat->nSamplesPerSec > pAudioRange->MaximumSampleFrequency)
+        {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
 //=============================================================================
 #pragma code_seg("PAGE")
 STDMETHODIMP_(NTSTATUS)
@@ -179,8 +240,9 @@ Routine Description:
   The DataRangeIntersection function determines the highest quality 
   intersection of two data ranges.
 
-  This sample just sets the ResultantFormat to be the only supported
-  format for the MicArray endpoint.
+  For the MicArray endpoint the ResultantFormat is the first entry of the
+  pin's supported device formats, which are listed best first, that lies
+  within both the client's range and the pin's range being intersected.
 
 Arguments:
 
@@ -191,8 +253,7 @@ Arguments:
                     property request. 
 
   MyDataRange -         Pin's data range to be compared with client's data 
-                        range. In this case we actually ignore our own data 
-                        range, because we know that we only support one range.
+                        range.
 
   OutputBufferLength -  Size of the buffer pointed to by the resultant format 
                         parameter. 
@@ -210,8 +271,6 @@ Arguments:
 
 --*/
 {
-    UNREFERENCED_PARAMETER(PinId);
-
     ULONG                   requiredSize;
 
     PAGED_CODE();
@@ -242,13 +301,22 @@ Arguments:
             return STATUS_BUFFER_TOO_SMALL;
         }
 
-        //Set ResultantFormat to be the only supported format for the MicArray endpoint. 
-        PKSDATAFORMAT_WAVEFORMATEXTENSIBLE resultantFormat;
-        resultantFormat = (PKSDATAFORMAT_WAVEFORMATEXTENSIBLE)ResultantFormat;
-        *resultantFormat = *MicArrayPinSupportedDeviceFormats;
-        *ResultantFormatLength = requiredSize;
+        PKSDATAFORMAT_WAVEFORMATEXTENSIBLE  pPinFormats = NULL;
+        ULONG                               cPinFormats = GetPinSupportedDeviceFormats(PinId, &pPinFormats);
 
-        return STATUS_SUCCESS;
+        for (ULONG iFormat = 0; iFormat < cPinFormats; iFormat++)
+        {
+            if (IsFormatInDataRange(&pPinFormats[iFormat], MyDataRange) &&
+                IsFormatInDataRange(&pPinFormats[iFormat], ClientDataRange))
+            {
+                *(PKSDATAFORMAT_WAVEFORMATEXTENSIBLE)ResultantFormat = pPinFormats[iFormat];
+                *ResultantFormatLength = requiredSize;
+
+                return STATUS_SUCCESS;
+            }
+        }
+
+        return STATUS_NO_MATCH;
     }
     else
     {
@@ -231,6 +231,12 @@ protected:
         return m_DeviceType == eSpeakerDevice ? TRUE : FALSE;
     }
 
+    // Position of this endpoint in g_CaptureEndpoints, passed as device context.
+    ULONG GetEndpointIndex()
+    {
+        return (ULONG)(ULONG_PTR)m_DeviceContext;
+    }
+
     BOOL IsSystemRenderPin(ULONG nPinId);
 
     BOOL IsSystemCapturePin(ULONG nPinId);
@@ -4,15 +4,14 @@
 #include "endpoints.h"
 #include "minwavert.h"
 #include "minwavertstream.h"
+#include "driverstats.h"
 #define MINWAVERTSTREAM_POOLTAG 'SRWM'
 
-#pragma warning (disable : 4127)
+// Stack staging for feeder audio that needs converting. A multiple of every
+// frame size from one to eight channels of any sample format.
+#define MINWAVERTSTREAM_CONVERT_BYTES   1152
 
-extern "C" {
-    ULONG UserPcmBuffer_Read(_Out_writes_bytes_(length) UCHAR* dst, _In_ ULONG length);
-    ULONG UserPcmBuffer_Count();
-    VOID UserPcmBuffer_Clear();
-}
+#pragma warning (disable : 4127)
 
 //=============================================================================
 // CMiniportWaveRTStream
@@ -103,9 +102,321 @@ Return Value:
     //
     KeFlushQueuedDpcs();
 
+    // PortCls frees the DMA buffer before releasing the stream; this only
+    // catches a stream torn down without it.
+    if (m_pUserDma)
+    {
+        FreeDirectBuffer();
+    }
+
+    // The DPC is done reading, so the reader and the ring can go now.
+    if (m_pUserPcmRing)
+    {
+        UserPcmRing_RemoveReader(m_pUserPcmRing, m_ulUserPcmReader);
+        UserPcmRing_Dereference(m_pUserPcmRing);
+        m_pUserPcmRing = NULL;
+    }
+
+    if (m_pResampler)
+    {
+        ExFreePoolWithTag(m_pResampler, MINWAVERTSTREAM_POOLTAG);
+        m_pResampler = NULL;
+    }
+
+    if (m_pConceal)
+    {
+        ExFreePoolWithTag(m_pConceal, MINWAVERTSTREAM_POOLTAG);
+        m_pConceal = NULL;
+    }
+
     DPF_ENTER(("[CMiniportWaveRTStream::~CMiniportWaveRTStream]"));
 } // ~CMiniportWaveRTStream
 
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+PCM_SAMPLE_FORMAT
+SampleFormatFromWaveFormat
+(
+    _In_ PWAVEFORMATEX pWfEx
+)
+/*++
+
+Routine Description:
+
+  Maps a stream format onto the sample formats pcmconvert.h handles. With
+  24 valid bits in a 32-bit container the samples are left justified, so
+  they convert as int32.
+
+--*/
+{
+    BOOL isPcm;
+    BOOL isFloat;
+
+    PAGED_CODE();
+
+    if (pWfEx->wFormatTag == WAVE_FORMAT_EXTENSIBLE &&
+        pWfEx->cbSize >= sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX))
+    {
+        PWAVEFORMATEXTENSIBLE pWfExt = (PWAVEFORMATEXTENSIBLE)pWfEx;
+
+        isPcm   = IsEqualGUIDAligned(pWfExt->SubFormat, KSDATAFORMAT_SUBTYPE_PCM);
+        isFloat = IsEqualGUIDAligned(pWfExt->SubFormat, KSDATAFORMAT_SUBTYPE_IEEE_FLOAT);
+    }
+    else
+    {
+        isPcm   = (pWfEx->wFormatTag == WAVE_FORMAT_PCM);
+        isFloat = (pWfEx->wFormatTag == WAVE_FORMAT_IEEE_FLOAT);
+    }
+
+    if (isFloat && pWfEx->wBitsPerSample == 32)
+    {
+        return PcmSampleFormatFloat32;
+    }
+
+    if (isPcm)
+    {
+        switch (pWfEx->wBitsPerSample)
+        {
+        case 16: return PcmSampleFormatInt16;
+        case 24: return PcmSampleFormatInt24;
+        case 32: return PcmSampleFormatInt32;
+        }
+    }
+
+    return PcmSampleFormatInvalid;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+VOID CMiniportWaveRTStream::AttachUserPcmRing()
+/*++
+
+Routine Description:
+
+  Takes this endpoint's feeder ring, sized from the route's capacity for the
+  format the feeder submits in, the route's latency target, scheduling
+  flags and jitter buffer mode, and sets up a resampler if the feeder's
+  rate differs from the stream's or the route asks for adaptive rate, and
+  the concealer the route asks for. Without memory for the concealer
+  underruns are zero-filled.
+
+  Called from Init and on STOP -> ACQUIRE, when the DPC is not running, so
+  the ring can be swapped without synchronizing with WriteBytes. The ring
+  held so far is let go first, with its resampler and concealer, so that a
+  stream alone on its ring does not keep the route from resizing it.
+  Attaching can fail, e.g. when every reader of the ring is taken or there
+  is no memory for the resampler; the stream then runs without a ring and
+  captures silence rather than failing to open or start.
+
+--*/
+{
+    NTSTATUS        ntStatus;
+    PUSER_PCM_RING  ring = NULL;
+    ULONG           reader;
+    USER_PCM_INPUT  input;
+    PRESAMPLER      resampler = NULL;
+    ULONG           resamplerFlags;
+    PPCM_CONCEAL    conceal = NULL;
+    PCM_CONCEAL_MODE concealMode;
+
+    PAGED_CODE();
+
+    m_DmaFormat = SampleFormatFromWaveFormat(&m_pWfExt->Format);
+
+    if (m_pUserPcmRing != NULL)
+    {
+        UserPcmRing_RemoveReader(m_pUserPcmRing, m_ulUserPcmReader);
+        UserPcmRing_Dereference(m_pUserPcmRing);
+        m_pUserPcmRing = NULL;
+    }
+
+    if (m_pResampler != NULL)
+    {
+        ExFreePoolWithTag(m_pResampler, MINWAVERTSTREAM_POOLTAG);
+        m_pResampler = NULL;
+    }
+
+    if (m_pConceal != NULL)
+    {
+        ExFreePoolWithTag(m_pConceal, MINWAVERTSTREAM_POOLTAG);
+        m_pConceal = NULL;
+    }
+
+    ntStatus = UserPcmRoute_AttachStream(m_pMiniport->GetEndpointIndex(),
+                                         m_pWfExt->Format.nSamplesPerSec,
+                                         m_pWfExt->Format.nChannels,
+                                         m_pWfExt->Format.nBlockAlign,
+                                         m_DmaFormat,
+                                         &ring,
+                                         &reader,
+                                         &input);
+    if (!NT_SUCCESS(ntStatus))
+    {
+        DPF(D_TERSE, ("No feeder ring for this stream, capturing silence: 0x%x", ntStatus));
+        return;
+    }
+
+    resamplerFlags = (input.Flags & MICYAUDIO_CONFIG_FLAG_ADAPTIVE_RATE) ? RESAMPLER_FLAG_ADJUSTABLE : 0;
+
+    if (input.SamplesPerSec != m_pWfExt->Format.nSamplesPerSec || resamplerFlags != 0)
+    {
+        ULONG size = Resampler_GetSize(input.SamplesPerSec,
+                                       m_pWfExt->Format.nSamplesPerSec,
+                                       m_pWfExt->Format.nChannels,
+                                       input.Quality,
+                                       resamplerFlags);
+
+        resampler = (PRESAMPLER)ExAllocatePool2(POOL_FLAG_NON_PAGED, size, MINWAVERTSTREAM_POOLTAG);
+        if (resampler == NULL)
+        {
+            UserPcmRing_RemoveReader(ring, reader);
+            UserPcmRing_Dereference(ring);
+            DPF(D_TERSE, ("No memory for the resampler, capturing silence"));
+            return;
+        }
+
+        (void)Resampler_Init(resampler,
+                             size,
+                             input.SamplesPerSec,
+                             m_pWfExt->Format.nSamplesPerSec,
+                             m_pWfExt->Format.nChannels,
+                             input.Quality,
+                             resamplerFlags);
+    }
+
+    concealMode = (PCM_CONCEAL_MODE)((input.Flags & MICYAUDIO_CONFIG_CONCEAL_MASK) >> MICYAUDIO_CONFIG_CONCEAL_SHIFT);
+
+    if (concealMode != PcmConcealModeSilence && m_DmaFormat != PcmSampleFormatInvalid)
+    {
+        ULONG size = PcmConceal_GetSize(m_pWfExt->Format.nSamplesPerSec, m_pWfExt->Format.nChannels);
+
+        if (size != 0)
+        {
+            conceal = (PPCM_CONCEAL)ExAllocatePool2(POOL_FLAG_NON_PAGED, size, MINWAVERTSTREAM_POOLTAG);
+        }
+
+        if (conceal != NULL)
+        {
+            (void)PcmConceal_Init(conceal,
+                                  size,
+                                  concealMode,
+                                  m_pWfExt->Format.nSamplesPerSec,
+                                  m_pWfExt->Format.nChannels);
+        }
+        else
+        {
+            DPF(D_TERSE, ("Underrun concealment not available, zero-filling"));
+        }
+    }
+
+    m_pUserPcmRing = ring;
+    m_ulUserPcmReader = reader;
+    m_pResampler = resampler;
+    m_pConceal = conceal;
+    m_UserPcmFormat = input.SampleFormat;
+    m_ulUserPcmBlockAlign = input.BlockAlign;
+    m_ulUserPcmSamplesPerSec = input.SamplesPerSec;
+    m_ulUserPcmTargetBytes = input.TargetBytes;
+    m_Core.LowLatency = (input.Flags & MICYAUDIO_CONFIG_FLAG_LOW_LATENCY) ? 1 : 0;
+    m_bAdaptiveRate = (resamplerFlags != 0) ? TRUE : FALSE;
+    DriftCtl_Reset(&m_DriftCtl);
+    m_bJitterBuffer = ((input.Flags & MICYAUDIO_CONFIG_FLAG_JITTER_BUFFER) && input.TargetBytes != 0) ? TRUE : FALSE;
+    JitBuf_Init(&m_JitBuf,
+                (double)input.TargetBytes / ((double)input.SamplesPerSec * input.BlockAlign),
+                (double)(input.CapacityBytes / 2) / ((double)input.SamplesPerSec * input.BlockAlign));
+
+    // Direct mode decides how the DMA buffer is allocated, so it only
+    // changes while the stream has none.
+    if (m_ulDmaBufferSize == 0)
+    {
+        m_bDirect = (input.Flags & MICYAUDIO_CONFIG_FLAG_DIRECT) ? TRUE : FALSE;
+    }
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+PMDL CMiniportWaveRTStream::AllocateDirectBuffer
+(
+    _In_ ULONG Size,
+    _In_ ULONG PacketBytes
+)
+/*++
+
+Routine Description:
+
+  Allocates the DMA buffer of a capture stream in direct mode and publishes
+  it in the endpoint's route for a feeder to map. Returns NULL, and leaves
+  the buffer to the port, if the stream is not in direct mode or another
+  stream of the endpoint already is; the stream then reads the ring.
+
+Arguments:
+
+  Size - buffer size, a whole number of blocks.
+
+  PacketBytes - size of a notification packet, 0 if not event driven.
+
+--*/
+{
+    NTSTATUS            ntStatus;
+    PUSER_DMA_BUFFER    buffer;
+
+    PAGED_CODE();
+
+    ASSERT(m_pUserDma == NULL);
+
+    if (!m_bCapture || !m_bDirect)
+    {
+        return NULL;
+    }
+
+    ntStatus = UserDma_Create(Size,
+                              PacketBytes,
+                              m_pWfExt->Format.nBlockAlign,
+                              m_pWfExt->Format.nSamplesPerSec,
+                              &buffer);
+    if (NT_SUCCESS(ntStatus))
+    {
+        ntStatus = UserPcmRoute_PublishDirect(m_pMiniport->GetEndpointIndex(), buffer);
+        if (!NT_SUCCESS(ntStatus))
+        {
+            UserDma_Dereference(buffer);
+        }
+    }
+
+    if (!NT_SUCCESS(ntStatus))
+    {
+        DPF(D_TERSE, ("Direct mode DMA buffer not available, reading the ring: 0x%x", ntStatus));
+        m_bDirect = FALSE;
+        return NULL;
+    }
+
+    m_pUserDma = buffer;
+    return UserDma_GetMdl(buffer);
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+VOID CMiniportWaveRTStream::FreeDirectBuffer()
+/*++
+
+Routine Description:
+
+  Withdraws the direct mode DMA buffer from the route and lets go of it. A
+  feeder that still has it mapped keeps the pages until it unmaps and
+  sees the stream as closed.
+
+--*/
+{
+    PAGED_CODE();
+
+    UserPcmRoute_WithdrawDirect(m_pUserDma);
+    UserDma_SetState(m_pUserDma, MICYAUDIO_DIRECT_STATE_CLOSED);
+    UserDma_Dereference(m_pUserDma);
+    m_pUserDma = NULL;
+    m_pDmaBuffer = NULL;
+}
+
 //=============================================================================
 #pragma code_seg("PAGE")
 
@@ -206,33 +517,38 @@ Return Value:
     m_ulDmaBufferSize = 0;
     m_pDmaBuffer = NULL;
     m_ulNotificationsPerBuffer = 0;
-    m_KsState = KSSTATE_STOP;
     m_pTimer = NULL;
     m_pDpc = NULL;
-    m_llPacketCounter = 0;
     m_ullPlayPosition = 0;
     m_ullWritePosition = 0;
     m_ullDmaTimeStamp = 0;
-    m_hnsElapsedTimeCarryForward = 0;
-    m_ullLastDPCTimeStamp = 0;
-    m_hnsDPCTimeCarryForward = 0;
+    m_bAdaptiveRate = FALSE;
+    DriftCtl_Init(&m_DriftCtl, RESAMPLER_MAX_ADJUSTMENT_PPM);
+    m_bJitterBuffer = FALSE;
+    JitBuf_Init(&m_JitBuf, 0.0, 0.0);
     m_ulDmaMovementRate = 0;
-    m_byteDisplacementCarryForward = 0;
     m_bLfxEnabled = FALSE;
     m_pbMuted = NULL;
     m_plVolumeLevel = NULL;
     m_plPeakMeter = NULL;
     m_pWfExt = NULL;
-    m_ullLinearPosition = 0;
-    m_ullPresentationPosition = 0;
+    m_pUserPcmRing = NULL;
+    m_ulUserPcmReader = 0;
+    m_ulUserPcmTargetBytes = 0;
+    m_UserPcmFormat = PcmSampleFormatInvalid;
+    m_ulUserPcmBlockAlign = 0;
+    m_ulUserPcmSamplesPerSec = 0;
+    m_DmaFormat = PcmSampleFormatInvalid;
+    m_bDirect = FALSE;
+    m_pUserDma = NULL;
+    for (ULONG i = 0; i < PCM_GAIN_MAX_CHANNELS; i++)
+    {
+        m_lGain[i] = PCM_GAIN_UNITY;
+    }
     m_ulContentId = 0;
-    m_ulCurrentWritePosition = 0;
     m_ulLastOsReadPacket = ULONG_MAX;
     m_ulLastOsWritePacket = ULONG_MAX;
-    m_IsCurrentWritePositionUpdated = 0;
     m_SignalProcessingMode = SignalProcessingMode;
-    m_bEoSReceived = FALSE;
-    m_bLastBufferRendered = FALSE;
 
     m_ulHostCaptureToneFrequency = IsEqualGUID(SignalProcessingMode, AUDIO_SIGNALPROCESSINGMODE_RAW) ? 1000 : 2000;
     m_dwHostCaptureToneAmplitude = 50;
@@ -241,7 +557,6 @@ Return Value:
 
     m_pPortStream = PortStream_;
     InitializeListHead(&m_NotificationList);
-    m_ulNotificationIntervalMs = 0;
 
     // Initialize the spinlock to synchronize position updates
     KeInitializeSpinLock(&m_PositionSpinLock);
@@ -276,6 +591,10 @@ Return Value:
     m_bCapture = Capture_;
     m_ulDmaMovementRate = pWfEx->nAvgBytesPerSec;
 
+    LARGE_INTEGER qpcFrequency;
+    (void)KeQueryPerformanceCounter(&qpcFrequency);
+    StreamCore_Init(&m_Core, (ULONGLONG)qpcFrequency.QuadPart, pWfEx->nSamplesPerSec, pWfEx->nBlockAlign);
+
     m_pDpc = (PRKDPC)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(KDPC), MINWAVERTSTREAM_POOLTAG);
     if (!m_pDpc)
     {
@@ -307,9 +626,14 @@ Return Value:
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
+    PcmMeter_Reset(&m_Meter, m_pWfExt->Format.nChannels);
+
     if (m_bCapture)
     {
         ReadRegistrySettings();
+
+        AttachUserPcmRing();
+
         //DWORD toneFrequency = 0;
         //DWORD toneAmplitude = 0;
         //DWORD toneDCOffset = 0;
@@ -475,8 +799,6 @@ NTSTATUS CMiniportWaveRTStream::AllocateBufferWithNotification
 {
     PAGED_CODE();
 
-    ULONG ulBufferDurationMs = 0;
-
     if ( (0 == RequestedSize_) || (RequestedSize_ < m_pWfExt->Format.nBlockAlign) )
     { 
         return STATUS_UNSUCCESSFUL; 
@@ -506,7 +828,14 @@ NTSTATUS CMiniportWaveRTStream::AllocateBufferWithNotification
     highAddress.HighPart = 0;
     highAddress.LowPart = MAXULONG;
 
-    PMDL pBufferMdl = m_pPortStream->AllocatePagesForMdl (highAddress, RequestedSize_);
+    // A direct mode feeder writes into the buffer itself, so it comes in
+    // pages of its own that can be mapped into the feeder.
+    PMDL pBufferMdl = AllocateDirectBuffer(RequestedSize_, RequestedSize_ / NotificationCount_);
+
+    if (NULL == pBufferMdl)
+    {
+        pBufferMdl = m_pPortStream->AllocatePagesForMdl (highAddress, RequestedSize_);
+    }
 
     if (NULL == pBufferMdl)
     {
@@ -528,11 +857,11 @@ NTSTATUS CMiniportWaveRTStream::AllocateBufferWithNotification
     //
     //  A WaveRT miniport driver should not require software access to the audio buffer itself."
     //   
-    m_pDmaBuffer = (BYTE*)m_pPortStream->MapAllocatedPages(pBufferMdl, MmCached);
+    m_pDmaBuffer = (m_pUserDma != NULL) ? UserDma_GetSystemAddress(m_pUserDma) :
+                   (BYTE*)m_pPortStream->MapAllocatedPages(pBufferMdl, MmCached);
     m_ulNotificationsPerBuffer = NotificationCount_;
     m_ulDmaBufferSize = RequestedSize_;
-    ulBufferDurationMs = (RequestedSize_ * 1000) / m_ulDmaMovementRate;
-    m_ulNotificationIntervalMs = ulBufferDurationMs / NotificationCount_;
+    StreamCore_SetBuffer(&m_Core, m_ulDmaBufferSize, m_ulDmaBufferSize / m_ulNotificationsPerBuffer);
 
     *AudioBufferMdl_ = pBufferMdl;
     *ActualSize_ = RequestedSize_;
@@ -554,7 +883,11 @@ VOID CMiniportWaveRTStream::FreeBufferWithNotification
 
     PAGED_CODE();
 
-    if (Mdl_ != NULL)
+    if (Mdl_ != NULL && m_pUserDma != NULL && Mdl_ == UserDma_GetMdl(m_pUserDma))
+    {
+        FreeDirectBuffer();
+    }
+    else if (Mdl_ != NULL)
     {
         if (m_pDmaBuffer != NULL)
         {
@@ -703,7 +1036,11 @@ _In_        ULONG       Size_
 
     PAGED_CODE();
 
-    if (Mdl_ != NULL)
+    if (Mdl_ != NULL && m_pUserDma != NULL && Mdl_ == UserDma_GetMdl(m_pUserDma))
+    {
+        FreeDirectBuffer();
+    }
+    else if (Mdl_ != NULL)
     {
         if (m_pDmaBuffer != NULL)
         {
@@ -742,7 +1079,12 @@ _Out_   MEMORY_CACHING_TYPE    *CacheType_
     highAddress.HighPart = 0;
     highAddress.LowPart = MAXULONG;
 
-    PMDL pBufferMdl = m_pPortStream->AllocatePagesForMdl(highAddress, RequestedSize_);
+    PMDL pBufferMdl = AllocateDirectBuffer(RequestedSize_, 0);
+
+    if (NULL == pBufferMdl)
+    {
+        pBufferMdl = m_pPortStream->AllocatePagesForMdl(highAddress, RequestedSize_);
+    }
 
     if (NULL == pBufferMdl)
     {
@@ -764,10 +1106,12 @@ _Out_   MEMORY_CACHING_TYPE    *CacheType_
     //
     //  A WaveRT miniport driver should not require software access to the audio buffer itself."
     //   
-    m_pDmaBuffer = (BYTE*)m_pPortStream->MapAllocatedPages(pBufferMdl, MmCached);
+    m_pDmaBuffer = (m_pUserDma != NULL) ? UserDma_GetSystemAddress(m_pUserDma) :
+                   (BYTE*)m_pPortStream->MapAllocatedPages(pBufferMdl, MmCached);
 
     m_ulDmaBufferSize = RequestedSize_;
     m_ulNotificationsPerBuffer = 0;
+    StreamCore_SetBuffer(&m_Core, m_ulDmaBufferSize, 0);
 
     *AudioBufferMdl_ = pBufferMdl;
     *ActualSize_ = RequestedSize_;
@@ -789,7 +1133,7 @@ NTSTATUS CMiniportWaveRTStream::GetPosition
     KIRQL oldIrql;
     KeAcquireSpinLock(&m_PositionSpinLock, &oldIrql);
 
-    if (m_KsState == KSSTATE_RUN)
+    if (m_Core.State == StreamCoreRun)
     {
         //
         // Get the current time and update position.
@@ -845,7 +1189,7 @@ NTSTATUS CMiniportWaveRTStream::GetReadPacket
 
     *Flags = 0;
 
-    if (m_KsState < KSSTATE_PAUSE)
+    if (m_Core.State < StreamCorePause)
     {
         return STATUS_INVALID_DEVICE_STATE;
     }
@@ -853,16 +1197,15 @@ NTSTATUS CMiniportWaveRTStream::GetReadPacket
     KIRQL oldIrql;
     KeAcquireSpinLock(&m_PositionSpinLock, &oldIrql);
 
-    LONGLONG packetCounter = m_llPacketCounter;
-    ULONGLONG ullLinearPosition = m_ullLinearPosition;
-    ULONGLONG hnsElapsedTimeCarryForward = m_hnsElapsedTimeCarryForward;
-    ULONGLONG ullDmaTimeStamp = m_ullDmaTimeStamp;
+    LONGLONG availablePacket;
+    LONGLONG timeOfAvailablePacketInQpc = 0;
+    BOOL stamped = StreamCore_GetCompletedPacket(&m_Core, &availablePacket, &timeOfAvailablePacketInQpc);
 
     KeReleaseSpinLock(&m_PositionSpinLock, oldIrql);
 
     // The 0-based number of the last completed packet
     // FUTURE-2014/10/27 Update to allow different numbers of packets per WaveRT buffer
-    availablePacketNumber = LODWORD(packetCounter - 1);  // Note this might be ULONG_MAX if called during the first packet
+    availablePacketNumber = LODWORD(availablePacket);  // Note this might be ULONG_MAX if called during the first packet
 
     // If no new packets are available...
     if (availablePacketNumber == m_ulLastOsReadPacket)
@@ -881,20 +1224,17 @@ NTSTATUS CMiniportWaveRTStream::GetReadPacket
     // Return next packet number to be read
     *PacketNumber = availablePacketNumber;
 
-    // Compute and return timestamp corresponding to the end of the available packet. In a real hardware
+    // Return the timestamp corresponding to the end of the available packet. In a real hardware
     // driver, the timestamp would be computed in a driver and hardware specific manner. In this sample
-    // driver, it is extrapolated from the sample driver's internal simulated position correlation
-    // [m_ullLinearPosition @ m_ullDmaTimeStamp] and the sample's internal 64-bit packet counter, subtracting
-    // 1 from the packet counter to compute the time at the start of that last completed packet.
-    ULONGLONG linearPositionOfAvailablePacket = packetCounter * (m_ulDmaBufferSize / m_ulNotificationsPerBuffer);
-    // Need to divide by (1000 * 10000 because m_ulDmaMovementRate is average bytes per sec
-    ULONGLONG carryForwardBytes = (hnsElapsedTimeCarryForward * m_ulDmaMovementRate) / 10000000;
-    ULONGLONG deltaLinearPosition = ullLinearPosition + carryForwardBytes - linearPositionOfAvailablePacket;
-    ULONGLONG deltaTimeInHns = deltaLinearPosition * 10000000 / m_ulDmaMovementRate;
-    ULONGLONG timeOfAvailablePacketInHns = ullDmaTimeStamp - deltaTimeInHns;
-    ULONGLONG timeOfAvailablePacketInQpc = timeOfAvailablePacketInHns * m_ullPerformanceCounterFrequency.QuadPart / 10000000;
-
-    *PerformanceCounterValue = timeOfAvailablePacketInQpc;
+    // driver, the DPC stamped the packet with the QPC value at which the virtual clock reached its end
+    // when it completed it, see pktstamp.h. The stamp is only missing if the OS asks before the first
+    // packet has completed.
+    if (!stamped)
+    {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    *PerformanceCounterValue = (ULONG64)timeOfAvailablePacketInQpc;
 
     // No flags are defined yet
     *Flags = 0;
@@ -918,7 +1258,6 @@ NTSTATUS CMiniportWaveRTStream::SetWritePacket
     _In_ ULONG      EosPacketLength
 )
 {
-    UNREFERENCED_PARAMETER(EosPacketLength);
     NTSTATUS ntStatus;
 
     // The call must be from event driven mode
@@ -930,7 +1269,7 @@ NTSTATUS CMiniportWaveRTStream::SetWritePacket
     ULONG oldLastOsWritePacket = m_ulLastOsWritePacket;
 
     // This function should not be called once EoS has been set.
-    if (m_bEoSReceived)
+    if (m_Core.EndOfStream)
     {
         return STATUS_INVALID_DEVICE_STATE;
     }
@@ -938,14 +1277,14 @@ NTSTATUS CMiniportWaveRTStream::SetWritePacket
     KIRQL oldIrql;
     KeAcquireSpinLock(&m_PositionSpinLock, &oldIrql);
     // 1-based count of completed packets, 0-based packet number of current packet
-    LONGLONG currentPacket = m_llPacketCounter;
+    LONGLONG currentPacket = m_Core.PacketCounter;
     KeReleaseSpinLock(&m_PositionSpinLock, oldIrql);
 
     // If not running, the current packet hasn't actually started transfering so OS should be writing
     // to the current packet. If running, then the current packing is already transfering to hardware
     // so the OS should write the packet after the current packet.
     ULONG expectedPacket = LODWORD(currentPacket);
-    if (m_KsState == KSSTATE_RUN)
+    if (m_Core.State == StreamCoreRun)
     {
         expectedPacket++;
     }
@@ -965,24 +1304,24 @@ NTSTATUS CMiniportWaveRTStream::SetWritePacket
     ULONG packetIndex = PacketNumber % m_ulNotificationsPerBuffer;
     ULONG ulCurrentWritePosition = packetIndex * packetSize;
 
-    // Check if EOS flag was passed
-    if (Flags & KSSTREAM_HEADER_OPTIONSF_ENDOFSTREAM)
+    // The last packet only holds EosPacketLength bytes; the stream stops
+    // at its end.
+    BOOLEAN endOfStream = (Flags & KSSTREAM_HEADER_OPTIONSF_ENDOFSTREAM) ? TRUE : FALSE;
+    if (endOfStream)
     {
-        return STATUS_INVALID_PARAMETER;
+        ulCurrentWritePosition += EosPacketLength;
     }
-    else
-    {
-        m_ulLastOsWritePacket = PacketNumber;
 
-        // This function sets the current write position to the specified byte in the DMA buffer.
-        // Will check if the write position is smaller than the DMA buffer size.
-        // Will not return an error when the passed in parameter is 0.
-        // Will also check if this function was called with the same write position(in event mode only)
-        // Underruning will also be checked via timer mechanism
-        KeAcquireSpinLock(&m_PositionSpinLock, &oldIrql);
-        ntStatus = SetCurrentWritePositionInternal(ulCurrentWritePosition);
-        KeReleaseSpinLock(&m_PositionSpinLock, oldIrql);
-    }
+    m_ulLastOsWritePacket = PacketNumber;
+
+    // This function sets the current write position to the specified byte in the DMA buffer.
+    // Will check if the write position is smaller than the DMA buffer size.
+    // Will not return an error when the passed in parameter is 0.
+    // Will also check if this function was called with the same write position(in event mode only)
+    // Underruning will also be checked via timer mechanism
+    KeAcquireSpinLock(&m_PositionSpinLock, &oldIrql);
+    ntStatus = SetCurrentWritePositionInternal(ulCurrentWritePosition, endOfStream);
+    KeReleaseSpinLock(&m_PositionSpinLock, oldIrql);
 
     if (!NT_SUCCESS(ntStatus))
     {
@@ -1030,14 +1369,14 @@ NTSTATUS CMiniportWaveRTStream::GetPacketCount
     KIRQL oldIrql;
     KeAcquireSpinLock(&m_PositionSpinLock, &oldIrql);
 
-    if (m_KsState == KSSTATE_RUN)
+    if (m_Core.State == StreamCoreRun)
     {
         // Get the current time and update simulated position.
         LARGE_INTEGER ilQPC = KeQueryPerformanceCounter(NULL);
         UpdatePosition(ilQPC);
     }
 
-    *pPacketCount = LODWORD(m_llPacketCounter);
+    *pPacketCount = LODWORD(m_Core.PacketCounter);
     KeReleaseSpinLock(&m_PositionSpinLock, oldIrql);
 
     return STATUS_SUCCESS;
@@ -1066,17 +1405,17 @@ NTSTATUS CMiniportWaveRTStream::GetPositions(
     //
     KeAcquireSpinLock(&m_PositionSpinLock, &oldIrql);
     ilQPC = KeQueryPerformanceCounter(NULL);
-    if (m_KsState == KSSTATE_RUN)
+    if (m_Core.State == StreamCoreRun)
     {
         UpdatePosition(ilQPC);
     }
     if (_pullLinearBufferPosition)
     {
-        *_pullLinearBufferPosition = m_ullLinearPosition;
+        *_pullLinearBufferPosition = m_Core.LinearPosition;
     }
     if (_pullPresentationPosition)
     {
-        *_pullPresentationPosition = m_ullPresentationPosition;
+        *_pullPresentationPosition = m_Core.PresentationPosition;
     }
     KeReleaseSpinLock(&m_PositionSpinLock, oldIrql);
     if (_pliQPCTime)
@@ -1113,18 +1452,20 @@ NTSTATUS CMiniportWaveRTStream::GetPresentationPosition(_Out_  KSAUDIO_PRESENTAT
 }
 
 #pragma code_seg()
-NTSTATUS CMiniportWaveRTStream::SetCurrentWritePositionInternal(_In_  ULONG _ulCurrentWritePosition)
+NTSTATUS CMiniportWaveRTStream::SetCurrentWritePositionInternal
+(
+    _In_  ULONG     _ulCurrentWritePosition,
+    _In_  BOOLEAN   _bEndOfStream
+)
 {
     DPF_ENTER(("[CMiniportWaveRTStream::SetCurrentWritePositionInternal]"));
 
-    ASSERT(m_bEoSReceived == FALSE);
+    ASSERT(!m_Core.EndOfStream);
 
-    if (m_bEoSReceived)
-    {
-        return STATUS_INVALID_DEVICE_REQUEST;
-    }
+    ULONG   previousWritePosition = m_Core.WriteOffset;
+    int     result = StreamCore_SetWriteOffset(&m_Core, _ulCurrentWritePosition, _bEndOfStream);
 
-    if (_ulCurrentWritePosition > m_ulDmaBufferSize)
+    if (result == STREAM_CORE_WRITE_REJECTED)
     {
         return STATUS_INVALID_DEVICE_REQUEST;
     }
@@ -1137,34 +1478,28 @@ NTSTATUS CMiniportWaveRTStream::SetCurrentWritePositionInternal(_In_  ULONG _ulC
     //Parameter 3: Target WaveRtBufferWritePosition received from portcls
     //Parameter 4: 0
     pAdapterComm->WriteEtwEvent(eMINIPORT_SET_WAVERT_BUFFER_WRITE_POSITION,
-        m_ullLinearPosition, // replace with the correct "Current linear buffer position"    
-        m_ulCurrentWritePosition,
+        m_Core.LinearPosition, // replace with the correct "Current linear buffer position"    
+        previousWritePosition,
         _ulCurrentWritePosition, // this is new write position
         0); // always zero
 
 //
 // Check for eMINIPORT_GLITCH_REPORT - Same WaveRT buffer write during event driven mode.
 //
-    if (m_ulNotificationIntervalMs > 0)
+    if (result == STREAM_CORE_WRITE_REPEATED)
     {
-        if (m_ulCurrentWritePosition == _ulCurrentWritePosition)
-        {
-            //Event type: eMINIPORT_GLITCH_REPORT
-            //Parameter 1: Current linear buffer position 
-            //Parameter 2: Previous WaveRtBufferWritePosition that the driver received 
-            //Parameter 3: Major glitch code: 3: Received same WaveRT buffer twice in a row during event driven mode
-            //Parameter 4: Minor code for the glitch cause
-            pAdapterComm->WriteEtwEvent(eMINIPORT_GLITCH_REPORT,
-                m_ullLinearPosition, // replace with the correct "Current linear buffer position"
-                m_ulCurrentWritePosition,
-                3, // received same WaveRT buffer twice in a row during event driven mode
-                _ulCurrentWritePosition);
-        }
+        //Event type: eMINIPORT_GLITCH_REPORT
+        //Parameter 1: Current linear buffer position 
+        //Parameter 2: Previous WaveRtBufferWritePosition that the driver received 
+        //Parameter 3: Major glitch code: 3: Received same WaveRT buffer twice in a row during event driven mode
+        //Parameter 4: Minor code for the glitch cause
+        pAdapterComm->WriteEtwEvent(eMINIPORT_GLITCH_REPORT,
+            m_Core.LinearPosition, // replace with the correct "Current linear buffer position"
+            previousWritePosition,
+            3, // received same WaveRT buffer twice in a row during event driven mode
+            _ulCurrentWritePosition);
     }
 
-    m_ulCurrentWritePosition = _ulCurrentWritePosition;
-    InterlockedExchange(&m_IsCurrentWritePositionUpdated, 1);
-
     return STATUS_SUCCESS;
 }
 
@@ -1178,29 +1513,33 @@ NTSTATUS CMiniportWaveRTStream::SetState
     NTSTATUS        ntStatus        = STATUS_SUCCESS;
     KIRQL oldIrql;
 
+    C_ASSERT((int)StreamCoreStop == (int)KSSTATE_STOP && (int)StreamCoreAcquire == (int)KSSTATE_ACQUIRE &&
+             (int)StreamCorePause == (int)KSSTATE_PAUSE && (int)StreamCoreRun == (int)KSSTATE_RUN);
+
     // Spew an event for a pin state change request from portcls
     //Event type: eMINIPORT_PIN_STATE
     switch (State_)
     {
         case KSSTATE_STOP:
-            if (m_KsState == KSSTATE_ACQUIRE)
+            if (m_Core.State == StreamCoreAcquire)
             {
                 // Acquire stream resources
             }
             KeAcquireSpinLock(&m_PositionSpinLock, &oldIrql);
-            // Reset DMA
-            m_llPacketCounter = 0;
+            // Reset DMA, the OS write position and EoS
+            StreamCore_Stop(&m_Core);
             m_ullPlayPosition = 0;
             m_ullWritePosition = 0;
-            m_ullLinearPosition = 0;
-            m_ullPresentationPosition = 0;
             
-            // Reset OS read/write positions
+            // Reset OS read/write packets
             m_ulLastOsReadPacket = ULONG_MAX;
-            m_ulCurrentWritePosition = 0;
             m_ulLastOsWritePacket = ULONG_MAX;
-            m_bEoSReceived = FALSE;
-            m_bLastBufferRendered = FALSE;
+
+            // The feeder starts over from position 0 in a new generation.
+            if (m_pUserDma)
+            {
+                UserDma_SetState(m_pUserDma, MICYAUDIO_DIRECT_STATE_STOPPED);
+            }
 
             KeReleaseSpinLock(&m_PositionSpinLock, oldIrql);
 
@@ -1212,79 +1551,110 @@ NTSTATUS CMiniportWaveRTStream::SetState
             break;
 
         case KSSTATE_ACQUIRE:
-            if (m_KsState == KSSTATE_STOP)
+            if (m_Core.State == StreamCoreStop)
             {
                 // Acquire stream resources
+
+                // Pick up buffering changes made with IOCTL_MICYAUDIO_SET_CONFIG
+                // since the stream was last stopped.
+                if (m_bCapture)
+                {
+                    AttachUserPcmRing();
+                }
             }
+            StreamCore_Acquire(&m_Core);
             break;
             
         case KSSTATE_PAUSE:
 
-            if (m_KsState > KSSTATE_PAUSE)
+            if (m_Core.State > StreamCorePause)
             {
                 //
                 // Run -> Pause
                 //
 
-                // Pause DMA
-                if (m_ulNotificationIntervalMs > 0)
+                // Pause DMA. The next packet boundary is a linear position,
+                // so nothing needs saving for the next RUN.
+                KeAcquireSpinLock(&m_PositionSpinLock, &oldIrql);
+                BOOLEAN timerArmed = StreamCore_BeginPause(&m_Core) ? TRUE : FALSE;
+                KeReleaseSpinLock(&m_PositionSpinLock, oldIrql);
+
+                if (timerArmed)
                 {
                     ExCancelTimer(m_pNotificationTimer, NULL);
                     KeFlushQueuedDpcs(); 
+                }
 
-                    // If pin is transitioning from RUN, save the time since last buffer completion event was sent 
-                    // so if the pin goes to RUN state again we can send the buffer completion event at correct time.
-                    if (m_ullLastDPCTimeStamp > 0)
-                    {
-                        LARGE_INTEGER qpc;
-                        LARGE_INTEGER qpcFrequency;
-                        LONGLONG  hnsCurrentTime;
-
-                        qpc = KeQueryPerformanceCounter(&qpcFrequency);
+                // A paused stream no longer holds the feeder back.
+                if (m_bCapture && m_pUserPcmRing)
+                {
+                    UserPcmRing_StopReader(m_pUserPcmRing, m_ulUserPcmReader);
+                }
 
-                        // Convert ticks to 100ns units.
-                        hnsCurrentTime = KSCONVERT_PERFORMANCE_TIME(m_ullPerformanceCounterFrequency.QuadPart, qpc);
-                        m_hnsDPCTimeCarryForward = hnsCurrentTime - m_ullLastDPCTimeStamp + m_hnsDPCTimeCarryForward;
-                    }
+                if (m_pUserDma)
+                {
+                    UserDma_SetState(m_pUserDma, MICYAUDIO_DIRECT_STATE_PAUSED);
                 }
             }
             // This call updates the linear buffer and presentation positions.
             GetPositions(NULL, NULL, NULL);
+
+            // The timer is cancelled, so a boundary that update reached is
+            // completed here, against the clock of the RUN that reached it.
+            KeAcquireSpinLock(&m_PositionSpinLock, &oldIrql);
+            StreamCore_Pause(&m_Core);
+            KeReleaseSpinLock(&m_PositionSpinLock, oldIrql);
             break;
 
         case KSSTATE_RUN:
             // Start DMA
-            // Clear any stale PCM data from the ring buffer when capture stream starts
+            // Skip any stale PCM data in the ring when the capture stream starts.
+            // A direct mode stream never reads the ring, so its reader stays
+            // idle and does not hold the feeder back.
+            if (m_pUserDma)
+            {
+                UserDma_SetState(m_pUserDma, MICYAUDIO_DIRECT_STATE_RUNNING);
+            }
+            else if (m_bCapture && m_pUserPcmRing)
+            {
+                UserPcmRing_StartReader(m_pUserPcmRing, m_ulUserPcmReader);
+            }
+            if (m_pResampler)
+            {
+                Resampler_Reset(m_pResampler);
+                Resampler_SetAdjustment(m_pResampler, 0);
+            }
+            if (m_pConceal)
+            {
+                PcmConceal_Reset(m_pConceal);
+            }
+            DriftCtl_Reset(&m_DriftCtl);
+            JitBuf_Reset(&m_JitBuf);
             if (m_bCapture)
             {
-                UserPcmBuffer_Clear();
+                // Start at the current setting rather than ramping to it.
+                (void)GetCaptureGain(m_lGain);
             }
             
             LARGE_INTEGER ullPerfCounterTemp;
             ullPerfCounterTemp = KeQueryPerformanceCounter(&m_ullPerformanceCounterFrequency);
-            m_ullLastDPCTimeStamp = m_ullDmaTimeStamp = KSCONVERT_PERFORMANCE_TIME(m_ullPerformanceCounterFrequency.QuadPart, ullPerfCounterTemp);
+            m_ullDmaTimeStamp = KSCONVERT_PERFORMANCE_TIME(m_ullPerformanceCounterFrequency.QuadPart, ullPerfCounterTemp);
 
-            if (m_ulNotificationIntervalMs > 0)
+            // The timer is one-shot: it is armed for the next packet
+            // boundary here and re-armed by every DPC, so the stream wakes
+            // up once per packet rather than every millisecond. This timer
+            // is used by Simple Audio Sample to emulate hardware; real
+            // hardware signals packet completion from its interrupt.
+            KeAcquireSpinLock(&m_PositionSpinLock, &oldIrql);
+            if (StreamCore_Run(&m_Core, ullPerfCounterTemp.QuadPart))
             {
-                // Set timer for 1 ms. This will cause DPC to run every 1 ms but driver will send out 
-                // notification events only after notification interval. This timer is used by Simple Audio Sample to 
-                // emulate hardware and send out notification event. Real hardware should not use this
-                // timer to fire notification event as it will drain power if the timer is running at 1 msec.
-                ExSetTimer
-                (
-                    m_pNotificationTimer,
-                    (-1) * HNSTIME_PER_MILLISECOND,
-                    HNSTIME_PER_MILLISECOND, // 1 ms 
-                    NULL
-                 );
-
+                ArmNotificationTimer(ullPerfCounterTemp);
             }
+            KeReleaseSpinLock(&m_PositionSpinLock, oldIrql);
 
             break;
     }
 
-    m_KsState = State_;
-
     return ntStatus;
 }
 
@@ -1318,29 +1688,13 @@ VOID CMiniportWaveRTStream::UpdatePosition
 {
     // Convert ticks to 100ns units.
     LONGLONG  hnsCurrentTime = KSCONVERT_PERFORMANCE_TIME(m_ullPerformanceCounterFrequency.QuadPart, ilQPC);
-    
-    // Calculate the time elapsed since the last call to GetPosition() or since the
-    // DMA engine started.  Note that the division by 10000 to convert to milliseconds
-    // may cause us to lose some of the time, so we will carry the remainder forward 
-    // to the next GetPosition() call.
-    //
-    ULONG TimeElapsedInMS = (ULONG)(hnsCurrentTime - m_ullDmaTimeStamp + m_hnsElapsedTimeCarryForward)/10000;
-    
-    // Carry forward the remainder of this division so we don't fall behind with our position too much.
-    //
-    m_hnsElapsedTimeCarryForward = (hnsCurrentTime - m_ullDmaTimeStamp + m_hnsElapsedTimeCarryForward) % 10000;
-    
-    // Calculate how many bytes in the DMA buffer would have been processed in the elapsed
-    // time.  Note that the division by 1000 to convert to milliseconds may cause us to 
-    // lose some bytes, so we will carry the remainder forward to the next GetPosition() call.
-    //
-    // need to divide by 1000 because m_ulDmaMovementRate is average bytes per sec.
 
-    ULONG ByteDisplacement = ((m_ulDmaMovementRate * TimeElapsedInMS) + m_byteDisplacementCarryForward) / 1000 ;
-    m_byteDisplacementCarryForward = ((m_ulDmaMovementRate * TimeElapsedInMS) + m_byteDisplacementCarryForward) % 1000;
-
-    // Increment presentation position even after last buffer is rendered.
-    m_ullPresentationPosition += ByteDisplacement;
+    // Bytes due since the last call, computed exactly from the clock's epoch
+    // so nothing is carried between calls and the position is always a
+    // whole number of blocks. They count towards the presentation position
+    // even after the last buffer is rendered.
+    //
+    ULONG ByteDisplacement = StreamCore_BytesDue(&m_Core, ilQPC.QuadPart);
 
     if (m_bCapture)
     {
@@ -1349,32 +1703,9 @@ VOID CMiniportWaveRTStream::UpdatePosition
     }
     else
     {
-
-        if (m_bEoSReceived)
-        {
-            // since EoS flag is set, we'll need to make sure not to read data beyond EOS position.
-            // If driver's current position is less than EoS position, then make sure not to read data beyond EoS.
-            if (m_ullWritePosition <= m_ulCurrentWritePosition)
-            {
-                ByteDisplacement = min(ByteDisplacement, m_ulCurrentWritePosition - (ULONG)m_ullWritePosition);
-            }
-            // If our current position is ahead of EoS position and we'll wrap around after new position then adjust
-            // new position if it crosses EoS.
-            else if ((m_ullWritePosition + ByteDisplacement) % m_ulDmaBufferSize < m_ullWritePosition)
-            {
-                if ((m_ullWritePosition + ByteDisplacement) % m_ulDmaBufferSize > m_ulCurrentWritePosition)
-                {
-                    ByteDisplacement = ByteDisplacement - (((ULONG)m_ullWritePosition + ByteDisplacement) % m_ulDmaBufferSize - m_ulCurrentWritePosition);
-                }
-            }
-        }
-
-        // If the last packet was rendered(read in the sample driver's case), send out an etw event.
-        if (m_bEoSReceived && !m_bLastBufferRendered
-            && (m_ullWritePosition + ByteDisplacement) % m_ulDmaBufferSize == m_ulCurrentWritePosition)
-        {
-            m_bLastBufferRendered = TRUE;
-        }
+        // Once EoS has been received, never read data beyond the EoS
+        // position, and mark the last buffer rendered on reaching it.
+        ByteDisplacement = StreamCore_ClampToEndOfStream(&m_Core, ByteDisplacement);
 
         if (!g_DoNotCreateDataFiles)
         {
@@ -1390,15 +1721,49 @@ VOID CMiniportWaveRTStream::UpdatePosition
         (m_ullWritePosition + ByteDisplacement) % m_ulDmaBufferSize;
     
     // m_ullDmaTimeStamp is updated in both GetPostion and GetLinearPosition calls
-    // so m_ullLinearPosition needs to be updated accordingly here
+    // so the linear position needs to be updated accordingly here
     //
-    m_ullLinearPosition += ByteDisplacement;
+    StreamCore_Move(&m_Core, ByteDisplacement);
+
+    // A direct mode feeder writes ahead of this position.
+    if (m_pUserDma != NULL)
+    {
+        UserDma_Publish(m_pUserDma, m_Core.LinearPosition, StreamCore_QpcOfLinearPosition(&m_Core));
+    }
     
     // Update the DMA time stamp for the next call to GetPosition()
     //
     m_ullDmaTimeStamp = hnsCurrentTime;
 }
 
+//=============================================================================
+#pragma code_seg()
+VOID CMiniportWaveRTStream::ArmNotificationTimer
+(
+    _In_ LARGE_INTEGER ilQPC
+)
+/*++
+
+Routine Description:
+
+  Arms the one-shot notification timer for the due time
+  StreamCore_ArmTimer picks, unless the stream left RUN or rendered its
+  last buffer. Called with m_PositionSpinLock held, after UpdatePosition.
+
+Arguments:
+
+  ilQPC - the QPC value UpdatePosition was last called with.
+
+--*/
+{
+    LONGLONG hnsDue;
+
+    if (StreamCore_ArmTimer(&m_Core, ilQPC.QuadPart, &hnsDue))
+    {
+        ExSetTimer(m_pNotificationTimer, -hnsDue, 0, NULL);
+    }
+}
+
 //=============================================================================
 #pragma code_seg()
 VOID CMiniportWaveRTStream::WriteBytes
@@ -1417,28 +1782,420 @@ ByteDisplacement - # of bytes to process.
 
 --*/
 {
-    ULONG bufferOffset = m_ullLinearPosition % m_ulDmaBufferSize;
+    ULONG   bufferOffset = m_Core.LinearPosition % m_ulDmaBufferSize;
+    ULONG   blockAlign = m_pWfExt->Format.nBlockAlign;
+    ULONG   channels = m_pWfExt->Format.nChannels;
+    ULONG   frames = ByteDisplacement / blockAlign;
+    ULONG   framesDone = 0;
+    LONG    gain[PCM_GAIN_MAX_CHANNELS];
+    BOOLEAN applyGain = FALSE;
+    ULONG   written = 0;
+    ULONG   silence = 0;
+    ULONG   endpoint = m_pMiniport->GetEndpointIndex();
+    PPCM_CONCEAL conceal = (m_pUserDma == NULL) ? m_pConceal : NULL;
+    BOOLEAN buffering = FALSE;
+
+    if (m_DmaFormat != PcmSampleFormatInvalid && frames > 0)
+    {
+        applyGain = GetCaptureGain(gain);
+    }
+
+    if (m_pUserDma != NULL)
+    {
+        // Direct mode: the feeder has already put whatever it managed to
+        // write in place; only the rest is filled in here.
+        written = UserDma_GetWritten(m_pUserDma, m_Core.LinearPosition, ByteDisplacement);
+        if (written < ByteDisplacement)
+        {
+            UserDma_AddSilence(m_pUserDma, ByteDisplacement - written);
+        }
+    }
+    else if (m_pUserPcmRing != NULL)
+    {
+        DriverStats_Max(endpoint, DriverStatMaxRingBytes, UserPcmRing_Count(m_pUserPcmRing, m_ulUserPcmReader));
+
+        if (m_bJitterBuffer)
+        {
+            buffering = UpdateJitterBuffer(ByteDisplacement);
+        }
+        else
+        {
+            (void)UserPcmRing_TrimToTarget(m_pUserPcmRing, m_ulUserPcmReader, m_ulUserPcmTargetBytes);
+        }
+
+        // While the jitter buffer holds the stream back nothing is read,
+        // so there is no rate to steer.
+        if (m_bAdaptiveRate && !buffering)
+        {
+            UpdateDriftControl(ByteDisplacement);
+        }
+    }
 
     // Consume user-provided PCM into the capture DMA buffer. If underflow,
-    // fill remaining with silence.
+    // fill remaining with concealment or silence.
     while (ByteDisplacement > 0)
     {
         ULONG runWrite = min(ByteDisplacement, m_ulDmaBufferSize - bufferOffset);
 
         ULONG copied = 0;
-        if (UserPcmBuffer_Count() > 0)
+        if (m_pUserDma != NULL)
         {
-            copied = UserPcmBuffer_Read(m_pDmaBuffer + bufferOffset, runWrite);
+            copied = min(runWrite, written);
+            written -= copied;
+        }
+        else if (m_pUserPcmRing != NULL && !buffering)
+        {
+            copied = ReadUserPcm(m_pDmaBuffer + bufferOffset, runWrite);
+        }
+
+        if (conceal != NULL && copied > 0)
+        {
+            PcmConceal_Feed(conceal, m_DmaFormat, m_pDmaBuffer + bufferOffset, copied / blockAlign);
         }
 
         if (copied < runWrite)
         {
-            RtlZeroMemory(m_pDmaBuffer + bufferOffset + copied, runWrite - copied);
+            ULONG concealed = 0;
+
+            if (conceal != NULL)
+            {
+                concealed = (runWrite - copied) / blockAlign * blockAlign;
+                PcmConceal_Fill(conceal, m_DmaFormat, m_pDmaBuffer + bufferOffset + copied, concealed / blockAlign);
+            }
+
+            RtlZeroMemory(m_pDmaBuffer + bufferOffset + copied + concealed, runWrite - copied - concealed);
+            silence += runWrite - copied;
+        }
+
+        if (applyGain)
+        {
+            ULONG   runFrames = runWrite / blockAlign;
+            LONG    from[PCM_GAIN_MAX_CHANNELS];
+            LONG    to[PCM_GAIN_MAX_CHANNELS];
+
+            // A change of volume ramps over the whole wakeup, which the DMA
+            // buffer wrap may split in two.
+            for (ULONG c = 0; c < channels; c++)
+            {
+                LONGLONG delta = (LONGLONG)gain[c] - m_lGain[c];
+
+                from[c] = m_lGain[c] + (LONG)(delta * framesDone / frames);
+                to[c]   = m_lGain[c] + (LONG)(delta * (framesDone + runFrames) / frames);
+            }
+
+            PcmGain_Apply(m_DmaFormat, m_pDmaBuffer + bufferOffset, channels, runFrames, from, to);
+            framesDone += runFrames;
+        }
+
+        if (m_DmaFormat != PcmSampleFormatInvalid)
+        {
+            PcmMeter_Accumulate(&m_Meter,
+                                m_DmaFormat,
+                                m_pDmaBuffer + bufferOffset,
+                                runWrite / blockAlign);
         }
 
         bufferOffset = (bufferOffset + runWrite) % m_ulDmaBufferSize;
         ByteDisplacement -= runWrite;
     }
+
+    if (applyGain)
+    {
+        RtlCopyMemory(m_lGain, gain, channels * sizeof(LONG));
+    }
+
+    DriverStats_Add(endpoint, DriverStatSilenceBytes, silence);
+
+    if (m_Meter.Frames > 0)
+    {
+        PublishLevels();
+    }
+}
+
+//=============================================================================
+#pragma code_seg()
+BOOLEAN CMiniportWaveRTStream::GetCaptureGain
+(
+    _Out_writes_(PCM_GAIN_MAX_CHANNELS) LONG * Gain
+)
+/*++
+
+Routine Description:
+
+  Reads the volume and mute of the topology nodes in front of the capture
+  pin and turns them into a Q30 gain per channel.
+
+Return Value:
+
+  TRUE if the audio needs the gain stage: some channel is not at unity now
+  or was not at the end of the last wakeup. FALSE also when the stream has
+  more channels than the gain stage takes.
+
+--*/
+{
+    PADAPTERCOMMON  pAdapterComm = m_pMiniport->GetAdapterCommObj();
+    ULONG           endpoint = m_pMiniport->GetEndpointIndex();
+    ULONG           channels = m_pWfExt->Format.nChannels;
+    BOOLEAN         needed = FALSE;
+
+    for (ULONG c = 0; c < PCM_GAIN_MAX_CHANNELS; c++)
+    {
+        Gain[c] = PCM_GAIN_UNITY;
+    }
+
+    if (pAdapterComm == NULL || channels > PCM_GAIN_MAX_CHANNELS)
+    {
+        return FALSE;
+    }
+
+    for (ULONG c = 0; c < channels; c++)
+    {
+        // The registers start out at -1/65536 dB, which the property
+        // handler would have normalized to 0 dB on a set.
+        m_plVolumeLevel[c] = VOLUME_NORMALIZE_IN_RANGE(pAdapterComm->MixerVolumeRead(endpoint, KSNODE_TOPO_VOLUME, c));
+        m_pbMuted[c]       = pAdapterComm->MixerMuteRead(endpoint, KSNODE_TOPO_MUTE, c);
+
+        Gain[c] = m_pbMuted[c] ? PCM_GAIN_SILENCE : PcmGain_FromVolume(m_plVolumeLevel[c]);
+
+        if (Gain[c] != PCM_GAIN_UNITY || m_lGain[c] != PCM_GAIN_UNITY)
+        {
+            needed = TRUE;
+        }
+    }
+
+    return needed;
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID CMiniportWaveRTStream::PublishLevels()
+/*++
+
+Routine Description:
+
+  Hands the levels measured over this wakeup to the endpoint's peak meter
+  node and to the control device, then starts a new measurement. Both keep
+  the highest peak until it is read, so a reader polling slower than the
+  stream wakes up still sees every transient; RMS is the latest wakeup's.
+
+--*/
+{
+    PADAPTERCOMMON  pAdapterComm = m_pMiniport->GetAdapterCommObj();
+    ULONG           channels = m_Meter.Channels;
+    ULONG           peak[PCM_METER_MAX_CHANNELS];
+    ULONG           rms[PCM_METER_MAX_CHANNELS];
+
+    for (ULONG c = 0; c < channels; c++)
+    {
+        peak[c] = PcmMeter_GetPeak(&m_Meter, c);
+        rms[c]  = PcmMeter_GetRms(&m_Meter, c);
+
+        m_plPeakMeter[c] = (LONG)peak[c];
+
+        if (pAdapterComm != NULL)
+        {
+            pAdapterComm->MixerPeakMeterWrite(m_pMiniport->GetEndpointIndex(), KSNODE_TOPO_PEAKMETER, c, (LONG)peak[c]);
+        }
+    }
+
+    UserPcmRoute_PublishLevels(m_pMiniport->GetEndpointIndex(), channels, peak, rms);
+
+    PcmMeter_Reset(&m_Meter, channels);
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID CMiniportWaveRTStream::UpdateDriftControl
+(
+    _In_ ULONG ByteDisplacement
+)
+/*++
+
+Routine Description:
+
+  Adaptive rate: measures how far the ring's fill is from the latency
+  target and retrims the resampler to steer it back, see driftctl.h. The
+  ring is empty after RUN, so the loop only starts once the feeder has
+  filled it to the target; starting on the empty ring would wind the loop
+  up against a deficit the feeder is about to make up anyway.
+
+Arguments:
+
+  ByteDisplacement - bytes of stream audio about to be produced, which is
+    the stream time since the previous update.
+
+--*/
+{
+    ULONG   count = UserPcmRing_Count(m_pUserPcmRing, m_ulUserPcmReader);
+    double  inBytesPerSec = (double)m_ulUserPcmSamplesPerSec * m_ulUserPcmBlockAlign;
+    LONG    trim;
+
+    if (!m_DriftCtl.Primed && count < m_ulUserPcmTargetBytes)
+    {
+        return;
+    }
+
+    trim = DriftCtl_Update(&m_DriftCtl,
+                           ((double)count - (double)m_ulUserPcmTargetBytes) / inBytesPerSec,
+                           (double)ByteDisplacement / ((double)m_pWfExt->Format.nSamplesPerSec * m_pWfExt->Format.nBlockAlign));
+
+    Resampler_SetAdjustment(m_pResampler, trim);
+}
+
+//=============================================================================
+#pragma code_seg()
+BOOLEAN CMiniportWaveRTStream::UpdateJitterBuffer
+(
+    _In_ ULONG ByteDisplacement
+)
+/*++
+
+Routine Description:
+
+  Jitter buffer mode: shows the jitter buffer the ring's fill and what this
+  wakeup is about to produce, drops whatever excess it asks to, and makes
+  its target the one the ring is held to, see jitbuf.h.
+
+Arguments:
+
+  ByteDisplacement - bytes of stream audio about to be produced.
+
+Return Value:
+
+  TRUE if the stream should read nothing this wakeup.
+
+--*/
+{
+    ULONG           count = UserPcmRing_Count(m_pUserPcmRing, m_ulUserPcmReader);
+    double          inBytesPerSec = (double)m_ulUserPcmSamplesPerSec * m_ulUserPcmBlockAlign;
+    JITBUF_ACTION   action;
+
+    action = JitBuf_Update(&m_JitBuf,
+                           (double)count / inBytesPerSec,
+                           (double)ByteDisplacement / ((double)m_pWfExt->Format.nSamplesPerSec * m_pWfExt->Format.nBlockAlign));
+
+    if (action == JitBufShrink)
+    {
+        (void)UserPcmRing_Skip(m_pUserPcmRing, m_ulUserPcmReader, (ULONG)(m_JitBuf.Excess * inBytesPerSec));
+    }
+
+    m_ulUserPcmTargetBytes = (ULONG)(m_JitBuf.Target * inBytesPerSec);
+
+    return (action == JitBufBuffer) ? TRUE : FALSE;
+}
+
+//=============================================================================
+#pragma code_seg()
+ULONG CMiniportWaveRTStream::ReadUserPcm
+(
+    _Out_writes_bytes_(Length) BYTE * Destination,
+    _In_ ULONG Length
+)
+/*++
+
+Routine Description:
+
+  Fills Destination from the feeder ring, converting from the feeder's
+  sample format and rate to the stream's on the way. Converted audio is
+  staged through small buffers on the stack a few hundred samples at a
+  time. With a resampler the audio goes ring -> float -> resampler -> stream
+  format; the resampler keeps whatever input it has not used yet, so
+  nothing is lost between calls.
+
+Arguments:
+
+  Destination - where the stream's audio goes, in the DMA buffer.
+
+  Length - bytes wanted, a whole number of frames.
+
+Return Value:
+
+  Number of bytes of Destination filled, a whole number of frames.
+
+--*/
+{
+    DECLSPEC_ALIGN(16) UCHAR staging[MINWAVERTSTREAM_CONVERT_BYTES];
+    DECLSPEC_ALIGN(16) float samples[MINWAVERTSTREAM_CONVERT_BYTES / sizeof(float)];
+    ULONG   channels = m_pWfExt->Format.nChannels;
+    ULONG   outBlockAlign = m_pWfExt->Format.nBlockAlign;
+    ULONG   inBlockAlign = m_ulUserPcmBlockAlign;
+    ULONG   framesWanted;
+    ULONG   framesDone = 0;
+
+    if (m_UserPcmFormat == m_DmaFormat && m_pResampler == NULL)
+    {
+        return UserPcmRing_Read(m_pUserPcmRing, m_ulUserPcmReader, Destination, Length);
+    }
+
+    if (inBlockAlign == 0 || inBlockAlign > sizeof(staging) ||
+        channels * sizeof(float) > sizeof(samples))
+    {
+        return 0;
+    }
+
+    framesWanted = Length / outBlockAlign;
+
+    while (framesDone < framesWanted)
+    {
+        ULONG frames;
+
+        if (m_pResampler != NULL)
+        {
+            frames = Resampler_Read(m_pResampler,
+                                    samples,
+                                    min(framesWanted - framesDone, (ULONG)(sizeof(samples) / sizeof(float)) / channels));
+            if (frames > 0)
+            {
+                PcmConvert(m_DmaFormat,
+                           Destination + framesDone * outBlockAlign,
+                           PcmSampleFormatFloat32,
+                           samples,
+                           frames * channels);
+
+                framesDone += frames;
+                continue;
+            }
+        }
+
+        // Only take whole frames, so a mapped feeder that has published part
+        // of a frame does not leave the ring misaligned.
+        frames = min(framesWanted - framesDone, (ULONG)sizeof(staging) / inBlockAlign);
+        frames = min(frames, UserPcmRing_Count(m_pUserPcmRing, m_ulUserPcmReader) / inBlockAlign);
+        if (m_pResampler != NULL)
+        {
+            // Take only about as much input as the output still wanted
+            // needs, so audio waits in the ring rather than in the resampler.
+            ULONG framesIn = (ULONG)(((ULONGLONG)(framesWanted - framesDone) * m_ulUserPcmSamplesPerSec +
+                                      m_pWfExt->Format.nSamplesPerSec - 1) / m_pWfExt->Format.nSamplesPerSec);
+
+            frames = min(frames, framesIn);
+            frames = min(frames, (ULONG)(sizeof(samples) / sizeof(float)) / channels);
+            frames = min(frames, Resampler_GetInputSpace(m_pResampler));
+        }
+        if (frames == 0)
+        {
+            break;
+        }
+
+        frames = UserPcmRing_Read(m_pUserPcmRing, m_ulUserPcmReader, staging, frames * inBlockAlign) / inBlockAlign;
+
+        if (m_pResampler != NULL)
+        {
+            PcmConvert(PcmSampleFormatFloat32, samples, m_UserPcmFormat, staging, frames * channels);
+            Resampler_Write(m_pResampler, samples, frames);
+            continue;
+        }
+
+        PcmConvert(m_DmaFormat,
+                   Destination + framesDone * outBlockAlign,
+                   m_UserPcmFormat,
+                   staging,
+                   frames * channels);
+
+        framesDone += frames;
+    }
+
+    return framesDone * outBlockAlign;
 }
 
 //=============================================================================
@@ -1459,7 +2216,7 @@ ByteDisplacement - # of bytes to process.
 
 --*/
 {
-    ULONG bufferOffset = m_ullLinearPosition % m_ulDmaBufferSize;
+    ULONG bufferOffset = m_Core.LinearPosition % m_ulDmaBufferSize;
 
     // Normally this will loop no more than once for a single wrap, but if
     // many bytes have been displaced then this may loops many times.
@@ -1574,7 +2331,10 @@ TimerNotifyRT
 {
     LARGE_INTEGER qpc;
     LARGE_INTEGER qpcFrequency;
-    BOOL bufferCompleted = FALSE;
+    LARGE_INTEGER entry = KeQueryPerformanceCounter(NULL);
+    LARGE_INTEGER done;
+    LONGLONG lateness;
+    int tick;
 
     UNREFERENCED_PARAMETER(Timer);
 
@@ -1591,54 +2351,26 @@ TimerNotifyRT
     KeAcquireSpinLock(&_this->m_PositionSpinLock, &oldIrql);
 
     qpc = KeQueryPerformanceCounter(&qpcFrequency);
-
-    // Convert ticks to 100ns units.
-    LONGLONG  hnsCurrentTime = KSCONVERT_PERFORMANCE_TIME(_this->m_ullPerformanceCounterFrequency.QuadPart, qpc);
-
-    // Calculate the time elapsed since the last we ran DPC that matched Notification interval. Note that the division by 10000 
-    // to convert to milliseconds may cause us to lose some of the time, so we will carry the remainder forward.
-
-    ULONG TimeElapsedInMS = (ULONG)(hnsCurrentTime - _this->m_ullLastDPCTimeStamp + _this->m_hnsDPCTimeCarryForward)/10000;
-
-    if (TimeElapsedInMS >= _this->m_ulNotificationIntervalMs)
-    {
-        // Carry forward the time greater than notification interval to adjust time to signal next buffer completion event accordingly.
-        _this->m_hnsDPCTimeCarryForward = hnsCurrentTime - _this->m_ullLastDPCTimeStamp + _this->m_hnsDPCTimeCarryForward - (_this->m_ulNotificationIntervalMs * 10000);
-        // Save the last time DPC ran at notification interval
-        _this->m_ullLastDPCTimeStamp = hnsCurrentTime;
-        bufferCompleted = TRUE;
-    }
-
-    if (!bufferCompleted && !_this->m_bEoSReceived)
-    {
-        goto End;
-    }
+    lateness = entry.QuadPart - _this->m_Core.TimerDueQpc;
 
     _this->UpdatePosition(qpc);
 
-    if (!_this->m_bEoSReceived)
-    {
-        _this->m_llPacketCounter++;
-    }
-
-    if (_this->m_KsState != KSSTATE_RUN)
-    {
-        goto End;
-    }
-    
-    PADAPTERCOMMON  pAdapterComm = _this->m_pMiniport->GetAdapterCommObj();
+    // Completes the packets the update reached and decides what to report.
+    tick = StreamCore_Tick(&_this->m_Core);
 
     // Simple buffer underrun detection.
-    if (!_this->IsCurrentWaveRTWritePositionUpdated() && !_this->m_bEoSReceived)
+    if (tick & STREAM_CORE_TICK_UNDERRUN)
     {
+        PADAPTERCOMMON  pAdapterComm = _this->m_pMiniport->GetAdapterCommObj();
+
         //Event type: eMINIPORT_GLITCH_REPORT
         //Parameter 1: Current linear buffer position 
         //Parameter 2: Previous WaveRtBufferWritePosition that the driver received 
         //Parameter 3: Major glitch code: 1:WaveRT buffer is underrun
         //Parameter 4: Minor code for the glitch cause
         pAdapterComm->WriteEtwEvent(eMINIPORT_GLITCH_REPORT, 
-                                    _this->m_ullLinearPosition,
-                                    _this->GetCurrentWaveRTWritePosition(),
+                                    _this->m_Core.LinearPosition,
+                                    _this->m_Core.WriteOffset,
                                     1,      // WaveRT buffer is underrun
                                     0); 
     }
@@ -1648,7 +2380,7 @@ TimerNotifyRT
     // 2. Driver consumed a partial buffer containing EoS for this stream
 
     if (!IsListEmpty(&_this->m_NotificationList) && 
-        (bufferCompleted || _this->m_bLastBufferRendered))
+        (tick & STREAM_CORE_TICK_SIGNAL))
     {
         PLIST_ENTRY leCurrent = _this->m_NotificationList.Flink;
         while (leCurrent != &_this->m_NotificationList)
@@ -1660,13 +2392,24 @@ TimerNotifyRT
         }
     }
 
-    if (_this->m_bLastBufferRendered)
+    // Not re-armed once the last buffer has rendered or the stream paused.
+    _this->ArmNotificationTimer(qpc);
+
+    done = KeQueryPerformanceCounter(NULL);
+
+    if (_this->m_bCapture)
     {
-        ExCancelTimer(_this->m_pNotificationTimer, NULL);
+        ULONG endpoint = _this->m_pMiniport->GetEndpointIndex();
+
+        DriverStats_Add(endpoint, DriverStatDpcCount, 1);
+        DriverStats_Max(endpoint, DriverStatMaxDpcTicks, (ULONGLONG)(done.QuadPart - qpc.QuadPart));
     }
 
-End:
     KeReleaseSpinLock(&_this->m_PositionSpinLock, oldIrql);
+
+    DriverStats_RecordLatency(DriverHistDpcTime, done.QuadPart - entry.QuadPart);
+    DriverStats_RecordLatency(DriverHistDpcLateness, lateness);
+    DriverStats_RecordLatency(DriverHistLockHold, done.QuadPart - qpc.QuadPart);
     return;
 }
 //=============================================================================
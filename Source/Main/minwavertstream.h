@@ -14,6 +14,11 @@ Abstract:
 #ifndef _SIMPLEAUDIOSAMPLE_MINWAVERTSTREAM_H_
 #define _SIMPLEAUDIOSAMPLE_MINWAVERTSTREAM_H_
 
+#include "userpcm.h"
+#include "streamcore.h"
+#include "driftctl.h"
+#include "jitbuf.h"
+
 //
 // Structure to store notifications events in a protected list
 //
@@ -48,9 +53,6 @@ protected:
     PPORTWAVERTSTREAM           m_pPortStream;
     LIST_ENTRY                  m_NotificationList;
     PEX_TIMER                   m_pNotificationTimer;
-    ULONG                       m_ulNotificationIntervalMs;
-    ULONG                       m_ulCurrentWritePosition;
-    LONG                        m_IsCurrentWritePositionUpdated;
     
 public:
     DECLARE_STD_UNKNOWN();
@@ -85,32 +87,40 @@ protected:
     ULONG                       m_ulDmaBufferSize;
     BYTE*                       m_pDmaBuffer;
     ULONG                       m_ulNotificationsPerBuffer;
-    KSSTATE                     m_KsState;
     PKTIMER                     m_pTimer;
     PRKDPC                      m_pDpc;
     ULONGLONG                   m_ullPlayPosition;
     ULONGLONG                   m_ullWritePosition;
-    ULONGLONG                   m_ullLinearPosition;
-    ULONGLONG                   m_ullPresentationPosition;
     ULONG                       m_ulLastOsReadPacket;
     ULONG                       m_ulLastOsWritePacket;
-    LONGLONG                    m_llPacketCounter;
     ULONGLONG                   m_ullDmaTimeStamp;
     LARGE_INTEGER               m_ullPerformanceCounterFrequency;
-    ULONGLONG                   m_hnsElapsedTimeCarryForward;
-    ULONGLONG                   m_ullLastDPCTimeStamp;
-    ULONGLONG                   m_hnsDPCTimeCarryForward;
-    ULONG                       m_byteDisplacementCarryForward;
+    STREAM_CORE                 m_Core;             // state, positions, packets and their timestamps, EoS and the timer
     ULONG                       m_ulDmaMovementRate;
     BOOL                        m_bLfxEnabled;
     PBOOL                       m_pbMuted;
     PLONG                       m_plVolumeLevel;
     PLONG                       m_plPeakMeter;
     PWAVEFORMATEXTENSIBLE       m_pWfExt;
+    PUSER_PCM_RING              m_pUserPcmRing;     // capture: feeder ring of this endpoint
+    ULONG                       m_ulUserPcmReader;  // capture: this stream's reader of the ring
+    ULONG                       m_ulUserPcmTargetBytes; // capture: latency the ring is trimmed to, 0 = off
+    PCM_SAMPLE_FORMAT           m_UserPcmFormat;    // capture: what the feeder writes into the ring
+    ULONG                       m_ulUserPcmBlockAlign; // capture: frame size in the ring
+    ULONG                       m_ulUserPcmSamplesPerSec; // capture: frame rate in the ring
+    PCM_SAMPLE_FORMAT           m_DmaFormat;        // stream format, PcmSampleFormatInvalid if not convertible
+    BOOLEAN                     m_bDirect;          // capture: the route asks for a direct mode DMA buffer
+    PUSER_DMA_BUFFER            m_pUserDma;         // capture: DMA buffer a direct mode feeder writes into, NULL if not direct
+    PRESAMPLER                  m_pResampler;       // capture: feeder rate -> stream rate, NULL if equal and not adaptive
+    BOOLEAN                     m_bAdaptiveRate;    // capture: trim m_pResampler to hold the ring at its target
+    DRIFTCTL                    m_DriftCtl;         // capture: the loop computing that trim
+    BOOLEAN                     m_bJitterBuffer;    // capture: pre-roll and adapt the ring's target to the feeder's jitter
+    JITBUF                      m_JitBuf;           // capture: what decides that
+    PPCM_CONCEAL                m_pConceal;         // capture: what underruns are filled with, NULL for silence
+    PCM_METER                   m_Meter;            // capture: levels of the audio produced this wakeup
+    LONG                        m_lGain[PCM_GAIN_MAX_CHANNELS]; // capture: Q30 gain reached by the last wakeup
     ULONG                       m_ulContentId;
     GUID                        m_SignalProcessingMode;
-    BOOLEAN                     m_bEoSReceived;
-    BOOLEAN                     m_bLastBufferRendered;
     KSPIN_LOCK                  m_PositionSpinLock;
     // Member variable as config params for tone generator
     ULONG                       m_ulHostCaptureToneFrequency;
@@ -132,17 +142,6 @@ public:
         _Out_  KSAUDIO_PRESENTATION_POSITION *_pPresentationPosition
     );
         
-    ULONG GetCurrentWaveRTWritePosition() 
-    {
-        return m_ulCurrentWritePosition;
-    };
-
-    // To support simple underrun validation.
-    BOOL IsCurrentWaveRTWritePositionUpdated() 
-    {
-        return InterlockedExchange(&m_IsCurrentWritePositionUpdated, 0) ? TRUE : FALSE;
-    };
-
     GUID GetSignalProcessingMode()
     {
         return m_SignalProcessingMode;
@@ -165,15 +164,44 @@ private:
     (
         _In_ ULONG ByteDisplacement
     );
+
+    ULONG ReadUserPcm
+    (
+        _Out_writes_bytes_(Length) BYTE * Destination,
+        _In_ ULONG Length
+    );
+
+    VOID UpdateDriftControl
+    (
+        _In_ ULONG ByteDisplacement
+    );
+
+    BOOLEAN UpdateJitterBuffer
+    (
+        _In_ ULONG ByteDisplacement
+    );
+
+    VOID PublishLevels();
+
+    BOOLEAN GetCaptureGain
+    (
+        _Out_writes_(PCM_GAIN_MAX_CHANNELS) LONG * Gain
+    );
     
     VOID UpdatePosition
     (
         _In_ LARGE_INTEGER ilQPC
     );
+
+    VOID ArmNotificationTimer
+    (
+        _In_ LARGE_INTEGER ilQPC
+    );
     
     NTSTATUS SetCurrentWritePositionInternal
     (
-        _In_  ULONG ulCurrentWritePosition
+        _In_  ULONG     ulCurrentWritePosition,
+        _In_  BOOLEAN   bEndOfStream
     );
     
     NTSTATUS GetPositions
@@ -184,6 +212,16 @@ private:
     );
 
     NTSTATUS ReadRegistrySettings();
+
+    VOID AttachUserPcmRing();
+
+    PMDL AllocateDirectBuffer
+    (
+        _In_ ULONG Size,
+        _In_ ULONG PacketBytes
+    );
+
+    VOID FreeDirectBuffer();
     
 };
 typedef CMiniportWaveRTStream *PCMiniportWaveRTStream;
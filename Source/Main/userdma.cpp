@@ -0,0 +1,519 @@
+/*++
+
+Module Name:
+
+    userdma.cpp
+
+Abstract:
+
+    Direct mode feed for the capture path.
+
+    A capture stream in direct mode has its DMA buffer allocated here instead
+    of by the port, in whole pages of its own, and publishes it in its
+    endpoint's route. A feeder maps the buffer and a position page with
+    IOCTL_MICYAUDIO_MAP_DIRECT and writes the stream's audio straight into
+    the buffer ahead of the stream's position, so nothing is copied on the
+    way in. The stream only checks how far the feeder got and zero-fills
+    what it has not written.
+
+    Buffers are reference counted: the stream, the route and a mapping each
+    hold one, so a feeder that is slow to unmap never sees its pages freed
+    under it.
+--*/
+
+#include "definitions.h"
+#include "userdma.h"
+
+#define USERDMA_POOLTAG         'DUyM'
+
+C_ASSERT(sizeof(MICYAUDIO_DIRECT_POSITION) <= PAGE_SIZE);
+C_ASSERT(FIELD_OFFSET(MICYAUDIO_DIRECT_POSITION, WritePosition) == 64);
+
+struct _USER_DMA_BUFFER {
+    volatile LONG               refCount;
+    ULONG                       bytes;
+    ULONG                       blockAlign;
+    PMDL                        mdl;            // the audio, handed to PortCls
+    PUCHAR                      systemAddress;
+    PMDL                        positionMdl;    // one page, MICYAUDIO_DIRECT_POSITION
+    PMICYAUDIO_DIRECT_POSITION  position;
+    FAST_MUTEX                  mapLock;        // map/unmap
+    PVOID                       userAddress;    // non-NULL while mapped
+    PVOID                       userPosition;
+    PEPROCESS                   userProcess;
+    PFILE_OBJECT                userFile;
+};
+
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+NTSTATUS
+UserDma_AllocatePages
+(
+    _In_    SIZE_T      Bytes,
+    _Out_   PMDL *      Mdl,
+    _Out_   PVOID *     SystemAddress
+)
+{
+    PHYSICAL_ADDRESS    lowAddress;
+    PHYSICAL_ADDRESS    highAddress;
+    PHYSICAL_ADDRESS    skipBytes;
+    PMDL                mdl;
+    PVOID               systemAddress;
+
+    PAGED_CODE();
+
+    *Mdl = NULL;
+    *SystemAddress = NULL;
+
+    lowAddress.QuadPart  = 0;
+    highAddress.QuadPart = (LONGLONG)-1;
+    skipBytes.QuadPart   = 0;
+
+    // Pages come back zeroed: silence in every supported format.
+    mdl = MmAllocatePagesForMdlEx(lowAddress,
+                                  highAddress,
+                                  skipBytes,
+                                  Bytes,
+                                  MmCached,
+                                  MM_ALLOCATE_FULLY_REQUIRED);
+    if (mdl == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    systemAddress = MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute);
+    if (systemAddress == NULL)
+    {
+        MmFreePagesFromMdl(mdl);
+        ExFreePool(mdl);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    *Mdl = mdl;
+    *SystemAddress = systemAddress;
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+VOID
+UserDma_FreePages
+(
+    _In_    PMDL        Mdl,
+    _In_    PVOID       SystemAddress
+)
+{
+    PAGED_CODE();
+
+    MmUnmapLockedPages(SystemAddress, Mdl);
+    MmFreePagesFromMdl(Mdl);
+    ExFreePool(Mdl);
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+NTSTATUS
+UserDma_Create
+(
+    _In_    ULONG               Bytes,
+    _In_    ULONG               PacketBytes,
+    _In_    ULONG               BlockAlign,
+    _In_    ULONG               SamplesPerSec,
+    _Out_   PUSER_DMA_BUFFER *  Buffer
+)
+/*++
+
+Routine Description:
+
+  Allocates a buffer with one reference, for the capture stream to hand to
+  PortCls as its DMA buffer.
+
+--*/
+{
+    NTSTATUS            ntStatus;
+    PUSER_DMA_BUFFER    buffer;
+    PVOID               position;
+
+    PAGED_CODE();
+
+    *Buffer = NULL;
+
+    if (Bytes == 0 || BlockAlign == 0 || Bytes % BlockAlign != 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    buffer = (PUSER_DMA_BUFFER)ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(USER_DMA_BUFFER), USERDMA_POOLTAG);
+    if (buffer == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ntStatus = UserDma_AllocatePages(Bytes, &buffer->mdl, (PVOID *)&buffer->systemAddress);
+    if (!NT_SUCCESS(ntStatus))
+    {
+        ExFreePoolWithTag(buffer, USERDMA_POOLTAG);
+        return ntStatus;
+    }
+
+    ntStatus = UserDma_AllocatePages(PAGE_SIZE, &buffer->positionMdl, &position);
+    if (!NT_SUCCESS(ntStatus))
+    {
+        UserDma_FreePages(buffer->mdl, buffer->systemAddress);
+        ExFreePoolWithTag(buffer, USERDMA_POOLTAG);
+        return ntStatus;
+    }
+
+    buffer->position   = (PMICYAUDIO_DIRECT_POSITION)position;
+    buffer->refCount   = 1;
+    buffer->bytes      = Bytes;
+    buffer->blockAlign = BlockAlign;
+    ExInitializeFastMutex(&buffer->mapLock);
+
+    buffer->position->State         = MICYAUDIO_DIRECT_STATE_STOPPED;
+    buffer->position->BufferBytes   = Bytes;
+    buffer->position->PacketBytes   = PacketBytes;
+    buffer->position->BlockAlign    = BlockAlign;
+    buffer->position->SamplesPerSec = SamplesPerSec;
+
+    *Buffer = buffer;
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+UserDma_Reference
+(
+    _In_ PUSER_DMA_BUFFER Buffer
+)
+{
+    InterlockedIncrement(&Buffer->refCount);
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+VOID
+UserDma_Dereference
+(
+    _In_ PUSER_DMA_BUFFER Buffer
+)
+/*++
+
+Routine Description:
+
+  Drops a reference and frees the buffer with the last one. PortCls has
+  given the pages back by the time the stream lets go of its reference, and
+  a mapping holds one of its own.
+
+--*/
+{
+    PAGED_CODE();
+
+    if (InterlockedDecrement(&Buffer->refCount) != 0)
+    {
+        return;
+    }
+
+    ASSERT(Buffer->userAddress == NULL);
+
+    UserDma_FreePages(Buffer->positionMdl, Buffer->position);
+    UserDma_FreePages(Buffer->mdl, Buffer->systemAddress);
+    ExFreePoolWithTag(Buffer, USERDMA_POOLTAG);
+}
+
+//=============================================================================
+#pragma code_seg()
+PMDL
+UserDma_GetMdl
+(
+    _In_ PUSER_DMA_BUFFER Buffer
+)
+{
+    return Buffer->mdl;
+}
+
+//=============================================================================
+#pragma code_seg()
+PUCHAR
+UserDma_GetSystemAddress
+(
+    _In_ PUSER_DMA_BUFFER Buffer
+)
+{
+    return Buffer->systemAddress;
+}
+
+//=============================================================================
+#pragma code_seg()
+ULONG
+UserDma_GetWritten
+(
+    _In_ PUSER_DMA_BUFFER   Buffer,
+    _In_ ULONGLONG          Position,
+    _In_ ULONG              Length
+)
+/*++
+
+Routine Description:
+
+  Stream side. The write position comes from user mode and is only trusted
+  as far as it is plausible: anything behind Position or more than a buffer
+  ahead of it counts as nothing written. The acquire load orders the reads
+  of the audio after it.
+
+--*/
+{
+    LONGLONG    ahead;
+    ULONG       written;
+
+    ahead = ReadAcquire64((LONG64 volatile *)&Buffer->position->WritePosition) - (LONGLONG)Position;
+    if (ahead <= 0 || ahead > (LONGLONG)Buffer->bytes)
+    {
+        return 0;
+    }
+
+    written = (ULONG)min((ULONGLONG)ahead, (ULONGLONG)Length);
+    return written - (written % Buffer->blockAlign);
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+UserDma_AddSilence
+(
+    _In_ PUSER_DMA_BUFFER   Buffer,
+    _In_ ULONG              Bytes
+)
+{
+    // Only the stream's DPC writes the driver's half of the page.
+    WriteNoFence64((LONG64 volatile *)&Buffer->position->SilenceBytes,
+                   ReadNoFence64((LONG64 volatile *)&Buffer->position->SilenceBytes) + Bytes);
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+UserDma_Publish
+(
+    _In_ PUSER_DMA_BUFFER   Buffer,
+    _In_ ULONGLONG          Position,
+    _In_ LONGLONG           Qpc
+)
+/*++
+
+Routine Description:
+
+  Stream side. Stores the QPC before the position it belongs to, so a
+  reader that sees the same position before and after reading ReadQpc has
+  the matching pair.
+
+--*/
+{
+    WriteNoFence64((LONG64 volatile *)&Buffer->position->ReadQpc, Qpc);
+    WriteRelease64((LONG64 volatile *)&Buffer->position->ReadPosition, (LONG64)Position);
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+UserDma_SetState
+(
+    _In_ PUSER_DMA_BUFFER   Buffer,
+    _In_ ULONG              State
+)
+{
+    if (State == MICYAUDIO_DIRECT_STATE_STOPPED)
+    {
+        InterlockedIncrement((LONG volatile *)&Buffer->position->Generation);
+        UserDma_Publish(Buffer, 0, 0);
+    }
+
+    InterlockedExchange((LONG volatile *)&Buffer->position->State, (LONG)State);
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+PVOID
+UserDma_MapPages
+(
+    _In_ PMDL Mdl
+)
+{
+    PVOID userAddress;
+
+    PAGED_CODE();
+
+    __try
+    {
+        userAddress = MmMapLockedPagesSpecifyCache(Mdl,
+                                                   UserMode,
+                                                   MmCached,
+                                                   NULL,
+                                                   FALSE,
+                                                   NormalPagePriority | MdlMappingNoExecute);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        userAddress = NULL;
+    }
+
+    return userAddress;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+NTSTATUS
+UserDma_MapToProcess
+(
+    _In_    PUSER_DMA_BUFFER            Buffer,
+    _In_    PFILE_OBJECT                FileObject,
+    _Out_   PMICYAUDIO_DIRECT_MAPPING   Mapping
+)
+/*++
+
+Routine Description:
+
+  Maps the buffer and its position page into the current process. The
+  file object keeps a reference to the buffer in FsContext2 until unmapped;
+  FsContext holds its ring mapping, if any.
+
+Arguments:
+
+  Buffer - buffer to map.
+
+  FileObject - handle instance that owns the mapping.
+
+  Mapping - receives the user-mode addresses.
+
+Return Value:
+
+  STATUS_DEVICE_BUSY if the buffer is already mapped or the handle already
+  has a buffer mapped.
+
+--*/
+{
+    NTSTATUS    ntStatus = STATUS_SUCCESS;
+    PVOID       userAddress = NULL;
+    PVOID       userPosition = NULL;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(Mapping, sizeof(*Mapping));
+
+    if (InterlockedCompareExchangePointer(&FileObject->FsContext2, Buffer, NULL) != NULL)
+    {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    ExAcquireFastMutex(&Buffer->mapLock);
+
+    if (Buffer->userAddress != NULL)
+    {
+        ntStatus = STATUS_DEVICE_BUSY;
+        goto Done;
+    }
+
+    userAddress = UserDma_MapPages(Buffer->mdl);
+    if (userAddress == NULL)
+    {
+        ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+        goto Done;
+    }
+
+    userPosition = UserDma_MapPages(Buffer->positionMdl);
+    if (userPosition == NULL)
+    {
+        MmUnmapLockedPages(userAddress, Buffer->mdl);
+        ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+        goto Done;
+    }
+
+    UserDma_Reference(Buffer);
+    Buffer->userAddress  = userAddress;
+    Buffer->userPosition = userPosition;
+    Buffer->userProcess  = PsGetCurrentProcess();
+    ObReferenceObject(Buffer->userProcess);
+    Buffer->userFile     = FileObject;
+
+    Mapping->BufferAddress   = (ULONG64)(ULONG_PTR)userAddress;
+    Mapping->PositionAddress = (ULONG64)(ULONG_PTR)userPosition;
+    Mapping->BufferBytes     = Buffer->bytes;
+
+Done:
+    ExReleaseFastMutex(&Buffer->mapLock);
+
+    if (!NT_SUCCESS(ntStatus))
+    {
+        InterlockedExchangePointer(&FileObject->FsContext2, NULL);
+    }
+
+    return ntStatus;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+NTSTATUS
+UserDma_UnmapFile
+(
+    _In_    PFILE_OBJECT                FileObject
+)
+/*++
+
+Routine Description:
+
+  Tears down the mapping created through FileObject, attaching to the
+  owning process when called from a different context.
+
+Return Value:
+
+  STATUS_INVALID_DEVICE_REQUEST if FileObject does not own a mapping.
+
+--*/
+{
+    PUSER_DMA_BUFFER    buffer;
+    KAPC_STATE          apcState;
+    BOOLEAN             attached = FALSE;
+
+    PAGED_CODE();
+
+    buffer = (PUSER_DMA_BUFFER)InterlockedExchangePointer(&FileObject->FsContext2, NULL);
+    if (buffer == NULL)
+    {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    ExAcquireFastMutex(&buffer->mapLock);
+
+    ASSERT(buffer->userFile == FileObject);
+
+    if (PsGetCurrentProcess() != buffer->userProcess)
+    {
+        KeStackAttachProcess(buffer->userProcess, &apcState);
+        attached = TRUE;
+    }
+
+    MmUnmapLockedPages(buffer->userPosition, buffer->positionMdl);
+    MmUnmapLockedPages(buffer->userAddress, buffer->mdl);
+
+    if (attached)
+    {
+        KeUnstackDetachProcess(&apcState);
+    }
+
+    ObDereferenceObject(buffer->userProcess);
+
+    buffer->userAddress  = NULL;
+    buffer->userPosition = NULL;
+    buffer->userProcess  = NULL;
+    buffer->userFile     = NULL;
+
+    ExReleaseFastMutex(&buffer->mapLock);
+
+    UserDma_Dereference(buffer);
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,87 @@
+/*++
+
+Module Name:
+
+    userdma.h
+
+Abstract:
+
+    Direct mode feed for the capture path (MICYAUDIO_CONFIG_FLAG_DIRECT):
+    the capture stream's DMA buffer and a position page, which a feeder maps
+    and writes the stream's audio into ahead of the stream's position.
+--*/
+
+#ifndef _MICYAUDIO_USERDMA_H_
+#define _MICYAUDIO_USERDMA_H_
+
+#include "micyioctl.h"
+
+typedef struct _USER_DMA_BUFFER USER_DMA_BUFFER, *PUSER_DMA_BUFFER;
+
+//-----------------------------------------------------------------------------
+// Buffers. Reference counted; a buffer is held by the capture stream whose
+// DMA buffer it is, by its endpoint's route and by a file object that has it
+// mapped, so the pages outlive the stream while a feeder still sees them.
+//-----------------------------------------------------------------------------
+
+//
+// Allocates a zeroed buffer of Bytes, a whole number of BlockAlign, with one
+// reference. PacketBytes is 0 for a stream that is not event driven.
+// PASSIVE_LEVEL.
+//
+NTSTATUS UserDma_Create
+(
+    _In_    ULONG               Bytes,
+    _In_    ULONG               PacketBytes,
+    _In_    ULONG               BlockAlign,
+    _In_    ULONG               SamplesPerSec,
+    _Out_   PUSER_DMA_BUFFER *  Buffer
+);
+
+VOID UserDma_Reference(_In_ PUSER_DMA_BUFFER Buffer);
+
+VOID UserDma_Dereference(_In_ PUSER_DMA_BUFFER Buffer);
+
+//
+// The pages handed to PortCls and their kernel mapping.
+//
+PMDL UserDma_GetMdl(_In_ PUSER_DMA_BUFFER Buffer);
+
+PUCHAR UserDma_GetSystemAddress(_In_ PUSER_DMA_BUFFER Buffer);
+
+//
+// Stream side, any IRQL <= DISPATCH_LEVEL. UserDma_GetWritten returns how
+// many of the Length bytes from linear position Position on the feeder has
+// written, in whole blocks; UserDma_AddSilence counts what the stream had
+// to zero-fill instead. UserDma_Publish reports the stream's position.
+//
+ULONG UserDma_GetWritten(_In_ PUSER_DMA_BUFFER Buffer, _In_ ULONGLONG Position, _In_ ULONG Length);
+
+VOID UserDma_AddSilence(_In_ PUSER_DMA_BUFFER Buffer, _In_ ULONG Bytes);
+
+VOID UserDma_Publish(_In_ PUSER_DMA_BUFFER Buffer, _In_ ULONGLONG Position, _In_ LONGLONG Qpc);
+
+//
+// MICYAUDIO_DIRECT_STATE_*. Going to STOPPED restarts the position from 0
+// in a new generation.
+//
+VOID UserDma_SetState(_In_ PUSER_DMA_BUFFER Buffer, _In_ ULONG State);
+
+//
+// Maps the buffer and its position page into the current process for
+// FileObject, which holds a reference until it unmaps or its handle is
+// cleaned up. PASSIVE_LEVEL, in the caller's process context.
+//
+NTSTATUS UserDma_MapToProcess
+(
+    _In_    PUSER_DMA_BUFFER            Buffer,
+    _In_    PFILE_OBJECT                FileObject,
+    _Out_   PMICYAUDIO_DIRECT_MAPPING   Mapping
+);
+
+NTSTATUS UserDma_UnmapFile
+(
+    _In_    PFILE_OBJECT                FileObject
+);
+
+#endif // _MICYAUDIO_USERDMA_H_
@@ -0,0 +1,2871 @@
+/*++
+
+Module Name:
+
+    userpcm.cpp
+
+Abstract:
+
+    User PCM feed for the capture path.
+
+    Each capture endpoint has a route holding a lock-free single-producer
+    ring (pcmring.h). Every capture stream of the endpoint reads the whole
+    ring through a reader cursor of its own, and the slowest running stream
+    decides how much room the producer has. The producer is either the control device IOCTL path,
+    serialized per ring by a fast mutex, or a single user-mode process that
+    has the ring pages mapped and publishes the write cursor itself, in which
+    case no syscall or copy happens per chunk.
+
+    A ring lives in whole pages allocated for an MDL: one control page
+    holding the cursors followed by the data area. Nothing else shares those
+    pages, so mapping them into a feeder exposes no other kernel memory.
+
+    Submissions with MICYAUDIO_CHUNK_FLAG_WAIT that do not fit are pended in
+    a cancel-safe queue on the ring, in submission order. The consumer only
+    checks whether the head of the queue now fits and, if so, queues a work
+    item that writes the pended audio at PASSIVE_LEVEL and completes the
+    requests that are done.
+--*/
+
+#pragma warning (disable : 4127)
+
+#include "definitions.h"
+#include "pcmring.h"
+#include "submitq.h"
+#include "userpcm.h"
+#include "driverstats.h"
+#include "ioparse.h"
+
+#define USERPCM_POOLTAG         'RPyM'
+#define USERPCM_CONTROL_BYTES   PAGE_SIZE
+
+//
+// InsertContext of IoCsqInsertIrpEx: requeue at the head of the wait queue.
+//
+#define USERPCM_INSERT_HEAD     ((PVOID)1)
+
+//
+// Routes store MICYAUDIO_SAMPLE_FORMAT_*, MICYAUDIO_RESAMPLER_QUALITY_* and
+// MICYAUDIO_CONFIG_CONCEAL_* and hand them to the stream as is.
+//
+C_ASSERT(MICYAUDIO_SAMPLE_FORMAT_NATIVE  == PcmSampleFormatInvalid);
+C_ASSERT(MICYAUDIO_SAMPLE_FORMAT_INT16   == PcmSampleFormatInt16);
+C_ASSERT(MICYAUDIO_SAMPLE_FORMAT_INT24   == PcmSampleFormatInt24);
+C_ASSERT(MICYAUDIO_SAMPLE_FORMAT_INT32   == PcmSampleFormatInt32);
+C_ASSERT(MICYAUDIO_SAMPLE_FORMAT_FLOAT32 == PcmSampleFormatFloat32);
+C_ASSERT(MICYAUDIO_RESAMPLER_QUALITY_DEFAULT == ResamplerQualityDefault);
+C_ASSERT(MICYAUDIO_RESAMPLER_QUALITY_LOW     == ResamplerQualityLow);
+C_ASSERT(MICYAUDIO_RESAMPLER_QUALITY_MEDIUM  == ResamplerQualityMedium);
+C_ASSERT(MICYAUDIO_RESAMPLER_QUALITY_HIGH    == ResamplerQualityHigh);
+C_ASSERT(MICYAUDIO_MAX_RATE_ADJUSTMENT_PPM   == RESAMPLER_MAX_ADJUSTMENT_PPM);
+C_ASSERT(MICYAUDIO_CONFIG_CONCEAL_SILENCE >> MICYAUDIO_CONFIG_CONCEAL_SHIFT == PcmConcealModeSilence);
+C_ASSERT(MICYAUDIO_CONFIG_CONCEAL_FADE    >> MICYAUDIO_CONFIG_CONCEAL_SHIFT == PcmConcealModeFade);
+C_ASSERT(MICYAUDIO_CONFIG_CONCEAL_REPEAT  >> MICYAUDIO_CONFIG_CONCEAL_SHIFT == PcmConcealModeRepeat);
+C_ASSERT(MICYAUDIO_CONFIG_CONCEAL_NOISE   >> MICYAUDIO_CONFIG_CONCEAL_SHIFT == PcmConcealModeNoise);
+
+//
+// State of a pended submission, kept in Irp->Tail.Overlay.DriverContext.
+// DriverContext[3] belongs to the cancel-safe queue. Progress within a
+// partially written chunk is recorded in its descriptor in the system buffer.
+//
+#define USERPCM_IRP_NEXT_CHUNK  0
+#define USERPCM_IRP_ACCEPTED    1
+#define USERPCM_IRP_DROPPED     2
+
+struct _USER_PCM_RING {
+    PCM_RING            ring;
+    volatile LONG       refCount;
+    ULONG               blockAlign;     // producer accepts whole blocks only
+    PCM_RING_READER     readers[PCM_RING_MAX_READERS];  // one per attached stream
+    volatile LONG       readerMask;     // readers[] in use, changed under producerLock
+    volatile LONG       activeMask;     // readers of running streams, holding the producer back
+    PCM_SAMPLE_FORMAT   contentFormat;  // what the ring holds, set by the first reader
+    ULONG               contentRate;
+    ULONG               contentChannels;
+    PMDL                mdl;            // control page followed by data pages
+    PUCHAR              systemAddress;
+    FAST_MUTEX          producerLock;   // kernel producers and map/unmap
+    PVOID               userAddress;    // non-NULL while mapped
+    PEPROCESS           userProcess;
+    PFILE_OBJECT        userFile;
+    volatile LONG       mapped;
+    ULONG               routeIndex;
+    BOOLEAN             retired;        // replaced in its route, producerLock
+    IO_CSQ              waitQueue;      // pended WAIT submissions, oldest first
+    KSPIN_LOCK          waitLock;
+    LIST_ENTRY          waitList;
+    volatile LONG       wakeBytes;      // free space the head waiter needs, 0 = none
+    PIO_WORKITEM        waitWorkItem;
+    volatile LONG       waitWorkQueued;
+    KSPIN_LOCK          watermarkLock;  // protects the watermark fields
+    volatile LONG       watermarksSet;
+    PFILE_OBJECT        watermarkFile;
+    PKEVENT             lowEvent;       // referenced, signaled on dropping below lowBytes
+    PKEVENT             highEvent;      // referenced, signaled on rising above highBytes
+    ULONG               lowBytes;
+    ULONG               highBytes;
+    BOOLEAN             lowArmed;
+    BOOLEAN             highArmed;
+};
+
+//
+// The capture streams of the endpoints write their levels into their routes
+// from DPCs on different processors, so every route gets cache lines of its
+// own.
+//
+typedef struct DECLSPEC_CACHEALIGN _USER_PCM_ROUTE {
+    PUSER_PCM_RING      ring;           // owns one reference
+    PUSER_DMA_BUFFER    direct;         // DMA buffer of the direct mode stream, owns one reference
+    ULONG               capacityMs;
+    ULONG               targetMs;
+    ULONG               flags;          // MICYAUDIO_CONFIG_FLAG_*
+    ULONG               sampleFormat;   // MICYAUDIO_SAMPLE_FORMAT_* the feeder submits
+    ULONG               sampleRate;     // 0 = the stream's
+    ULONG               quality;        // MICYAUDIO_RESAMPLER_QUALITY_*
+    volatile LONG       levelChannels;  // levels below are written lock-free by the stream
+    volatile LONG       levelPeak[MICYAUDIO_MAX_LEVEL_CHANNELS];
+    volatile LONG       levelRms[MICYAUDIO_MAX_LEVEL_CHANNELS];
+} USER_PCM_ROUTE, *PUSER_PCM_ROUTE;
+
+C_ASSERT(MICYAUDIO_MAX_LEVEL_CHANNELS == PCM_METER_MAX_CHANNELS);
+
+typedef struct _USER_PCM_ROUTE_TABLE {
+    KSPIN_LOCK          lock;           // protects routes[]
+    ULONG               count;
+    PUSER_PCM_ROUTE     routes;
+    PDRIVER_OBJECT      driverObject;   // owner of the rings' work items
+    FAST_MUTEX          attachLock;     // serializes streams attaching to routes
+} USER_PCM_ROUTE_TABLE;
+
+static USER_PCM_ROUTE_TABLE g_UserPcmRoutes = { 0 };
+
+//=============================================================================
+#pragma code_seg()
+static
+ULONG
+UserPcm_MsToBytes
+(
+    _In_ ULONG Ms,
+    _In_ ULONG BytesPerSec,
+    _In_ ULONG BlockAlign
+)
+{
+    ULONGLONG bytes = (ULONGLONG)BytesPerSec * Ms / 1000;
+
+    if (BlockAlign > 1)
+    {
+        bytes -= bytes % BlockAlign;
+    }
+
+    return (ULONG)min(bytes, (ULONGLONG)PCM_RING_MAX_CAPACITY);
+}
+
+IO_CSQ_INSERT_IRP_EX            UserPcmRing_CsqInsertIrp;
+IO_CSQ_REMOVE_IRP               UserPcmRing_CsqRemoveIrp;
+IO_CSQ_PEEK_NEXT_IRP            UserPcmRing_CsqPeekNextIrp;
+IO_CSQ_ACQUIRE_LOCK             UserPcmRing_CsqAcquireLock;
+IO_CSQ_RELEASE_LOCK             UserPcmRing_CsqReleaseLock;
+IO_CSQ_COMPLETE_CANCELED_IRP    UserPcmRing_CsqCompleteCanceledIrp;
+IO_WORKITEM_ROUTINE_EX          UserPcmRing_WaitWorker;
+
+static VOID UserPcmRing_RequeueWaiters(_In_ PUSER_PCM_RING Ring);
+
+//=============================================================================
+#pragma code_seg("PAGE")
+NTSTATUS
+UserPcmRing_Create
+(
+    _In_    ULONG               CapacityBytes,
+    _In_    ULONG               BlockAlign,
+    _Out_   PUSER_PCM_RING *    Ring
+)
+/*++
+
+Routine Description:
+
+  Allocates a ring with one reference. The capacity is rounded up to a power
+  of two of at least one page.
+
+--*/
+{
+    PUSER_PCM_RING      ring;
+    PHYSICAL_ADDRESS    lowAddress;
+    PHYSICAL_ADDRESS    highAddress;
+    PHYSICAL_ADDRESS    skipBytes;
+    SIZE_T              totalBytes;
+
+    PAGED_CODE();
+
+    *Ring = NULL;
+
+    if (CapacityBytes == 0)
+    {
+        CapacityBytes = UserPcm_MsToBytes(USERPCM_DEFAULT_CAPACITY_MS,
+                                          USERPCM_DEFAULT_BYTES_PER_SEC,
+                                          USERPCM_DEFAULT_BLOCK_ALIGN);
+    }
+    CapacityBytes = PcmRing_RoundCapacity(CapacityBytes);
+    if (CapacityBytes < PAGE_SIZE)
+    {
+        CapacityBytes = PAGE_SIZE;
+    }
+    totalBytes = USERPCM_CONTROL_BYTES + (SIZE_T)CapacityBytes;
+
+    // Reader cursors are cache aligned, so the ring must be too.
+    ring = (PUSER_PCM_RING)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+                                           sizeof(USER_PCM_RING),
+                                           USERPCM_POOLTAG);
+    if (ring == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    lowAddress.QuadPart  = 0;
+    highAddress.QuadPart = (LONGLONG)-1;
+    skipBytes.QuadPart   = 0;
+
+    // Pages come back zeroed, so both cursors start at 0.
+    ring->mdl = MmAllocatePagesForMdlEx(lowAddress,
+                                        highAddress,
+                                        skipBytes,
+                                        totalBytes,
+                                        MmCached,
+                                        MM_ALLOCATE_FULLY_REQUIRED);
+    if (ring->mdl == NULL)
+    {
+        ExFreePoolWithTag(ring, USERPCM_POOLTAG);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ring->systemAddress = (PUCHAR)MmGetSystemAddressForMdlSafe(
+        ring->mdl,
+        NormalPagePriority | MdlMappingNoExecute);
+    if (ring->systemAddress == NULL)
+    {
+        MmFreePagesFromMdl(ring->mdl);
+        ExFreePool(ring->mdl);
+        ExFreePoolWithTag(ring, USERPCM_POOLTAG);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ring->waitWorkItem = (PIO_WORKITEM)ExAllocatePool2(POOL_FLAG_NON_PAGED, IoSizeofWorkItem(), USERPCM_POOLTAG);
+    if (ring->waitWorkItem == NULL)
+    {
+        MmUnmapLockedPages(ring->systemAddress, ring->mdl);
+        MmFreePagesFromMdl(ring->mdl);
+        ExFreePool(ring->mdl);
+        ExFreePoolWithTag(ring, USERPCM_POOLTAG);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    IoInitializeWorkItem(g_UserPcmRoutes.driverObject, ring->waitWorkItem);
+
+    KeInitializeSpinLock(&ring->waitLock);
+    InitializeListHead(&ring->waitList);
+    KeInitializeSpinLock(&ring->watermarkLock);
+    (void)IoCsqInitializeEx(&ring->waitQueue,
+                            UserPcmRing_CsqInsertIrp,
+                            UserPcmRing_CsqRemoveIrp,
+                            UserPcmRing_CsqPeekNextIrp,
+                            UserPcmRing_CsqAcquireLock,
+                            UserPcmRing_CsqReleaseLock,
+                            UserPcmRing_CsqCompleteCanceledIrp);
+
+    PcmRing_Attach(&ring->ring,
+                   (PPCM_RING_CONTROL)ring->systemAddress,
+                   ring->systemAddress + USERPCM_CONTROL_BYTES,
+                   CapacityBytes);
+    ring->refCount   = 1;
+    ring->blockAlign = BlockAlign ? BlockAlign : 1;
+    ExInitializeFastMutex(&ring->producerLock);
+
+    *Ring = ring;
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+UserPcmRing_Reference
+(
+    _In_ PUSER_PCM_RING Ring
+)
+{
+    InterlockedIncrement(&Ring->refCount);
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+VOID
+UserPcmRing_Dereference
+(
+    _In_ PUSER_PCM_RING Ring
+)
+/*++
+
+Routine Description:
+
+  Drops a reference and frees the ring with the last one. A mapping holds a
+  reference, so the ring can never be freed while a feeder still sees it.
+
+--*/
+{
+    PAGED_CODE();
+
+    if (InterlockedDecrement(&Ring->refCount) != 0)
+    {
+        return;
+    }
+
+    ASSERT(Ring->userAddress == NULL);
+    ASSERT(IsListEmpty(&Ring->waitList));
+
+    if (Ring->lowEvent != NULL)
+    {
+        ObDereferenceObject(Ring->lowEvent);
+    }
+    if (Ring->highEvent != NULL)
+    {
+        ObDereferenceObject(Ring->highEvent);
+    }
+
+    IoUninitializeWorkItem(Ring->waitWorkItem);
+    ExFreePoolWithTag(Ring->waitWorkItem, USERPCM_POOLTAG);
+    MmUnmapLockedPages(Ring->systemAddress, Ring->mdl);
+    MmFreePagesFromMdl(Ring->mdl);
+    ExFreePool(Ring->mdl);
+    ExFreePoolWithTag(Ring, USERPCM_POOLTAG);
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+VOID
+UserPcmRing_CheckWatermarks
+(
+    _In_ PUSER_PCM_RING Ring
+)
+/*++
+
+Routine Description:
+
+  Signals the registered watermark events, any IRQL <= DISPATCH_LEVEL.
+  Each event is signaled once per crossing: the low event when the fill
+  drops below its threshold, after which it is rearmed by the fill being
+  seen at or above it again, and the other way round for the high event.
+  Called by the consumer after every read and by kernel producers after
+  every write; a mapped producer's writes are seen on the next read.
+
+--*/
+{
+    ULONG count;
+    KIRQL oldIrql;
+
+    if (InterlockedCompareExchange(&Ring->watermarksSet, 0, 0) == 0)
+    {
+        return;
+    }
+
+    count = PcmRing_Count(&Ring->ring);
+
+    KeAcquireSpinLock(&Ring->watermarkLock, &oldIrql);
+
+    if (Ring->lowEvent != NULL)
+    {
+        if (count >= Ring->lowBytes)
+        {
+            Ring->lowArmed = TRUE;
+        }
+        else if (Ring->lowArmed)
+        {
+            Ring->lowArmed = FALSE;
+            KeSetEvent(Ring->lowEvent, IO_SOUND_INCREMENT, FALSE);
+        }
+    }
+
+    if (Ring->highEvent != NULL)
+    {
+        if (count <= Ring->highBytes)
+        {
+            Ring->highArmed = TRUE;
+        }
+        else if (Ring->highArmed)
+        {
+            Ring->highArmed = FALSE;
+            KeSetEvent(Ring->highEvent, IO_SOUND_INCREMENT, FALSE);
+        }
+    }
+
+    KeReleaseSpinLock(&Ring->watermarkLock, oldIrql);
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+VOID
+UserPcmRing_TakeWatermarks
+(
+    _In_    PUSER_PCM_RING  Ring,
+    _Out_   PKEVENT *       LowEvent,
+    _Out_   PKEVENT *       HighEvent
+)
+/*++
+
+Routine Description:
+
+  Removes the ring's watermarks and hands the caller the references on
+  their events. Non-paged because it takes the watermark lock.
+
+--*/
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&Ring->watermarkLock, &oldIrql);
+    InterlockedExchange(&Ring->watermarksSet, 0);
+    *LowEvent           = Ring->lowEvent;
+    *HighEvent          = Ring->highEvent;
+    Ring->lowEvent      = NULL;
+    Ring->highEvent     = NULL;
+    Ring->watermarkFile = NULL;
+    KeReleaseSpinLock(&Ring->watermarkLock, oldIrql);
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+NTSTATUS
+UserPcmRing_ExchangeWatermarks
+(
+    _In_    PUSER_PCM_RING  Ring,
+    _In_    PFILE_OBJECT    FileObject,
+    _In_    ULONG           LowBytes,
+    _In_    ULONG           HighBytes,
+    _Inout_ PKEVENT *       LowEvent,
+    _Inout_ PKEVENT *       HighEvent
+)
+/*++
+
+Routine Description:
+
+  Installs the referenced events *LowEvent and *HighEvent as FileObject's
+  watermarks and returns the ones they replace in their place. Non-paged
+  because it takes the watermark lock.
+
+Return Value:
+
+  STATUS_DEVICE_BUSY if another handle owns the ring's watermarks; the
+  events are then left with the caller.
+
+--*/
+{
+    PKEVENT oldLowEvent;
+    PKEVENT oldHighEvent;
+    KIRQL   oldIrql;
+
+    KeAcquireSpinLock(&Ring->watermarkLock, &oldIrql);
+
+    if (Ring->watermarkFile != NULL && Ring->watermarkFile != FileObject)
+    {
+        KeReleaseSpinLock(&Ring->watermarkLock, oldIrql);
+        return STATUS_DEVICE_BUSY;
+    }
+
+    oldLowEvent         = Ring->lowEvent;
+    oldHighEvent        = Ring->highEvent;
+    Ring->lowEvent      = *LowEvent;
+    Ring->highEvent     = *HighEvent;
+    Ring->lowBytes      = LowBytes;
+    Ring->highBytes     = HighBytes;
+    Ring->lowArmed      = TRUE;
+    Ring->highArmed     = TRUE;
+    Ring->watermarkFile = (*LowEvent != NULL || *HighEvent != NULL) ? FileObject : NULL;
+    InterlockedExchange(&Ring->watermarksSet, Ring->watermarkFile != NULL ? 1 : 0);
+
+    KeReleaseSpinLock(&Ring->watermarkLock, oldIrql);
+
+    *LowEvent  = oldLowEvent;
+    *HighEvent = oldHighEvent;
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+VOID
+UserPcmRing_MoveWatermarks
+(
+    _In_ PUSER_PCM_RING Fresh,
+    _In_ PUSER_PCM_RING Current
+)
+/*++
+
+Routine Description:
+
+  Moves Current's watermarks, with the references on their events, to
+  Fresh, which nobody else sees yet. The thresholds are clamped to Fresh's
+  capacity. Non-paged because it takes the watermark lock.
+
+--*/
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&Current->watermarkLock, &oldIrql);
+    Fresh->watermarkFile    = Current->watermarkFile;
+    Fresh->lowEvent         = Current->lowEvent;
+    Fresh->highEvent        = Current->highEvent;
+    Fresh->lowBytes         = min(Current->lowBytes, Fresh->ring.Capacity);
+    Fresh->highBytes        = min(Current->highBytes, Fresh->ring.Capacity - 1);
+    Fresh->lowArmed         = TRUE;
+    Fresh->highArmed        = TRUE;
+    Fresh->watermarksSet    = Current->watermarksSet;
+    Current->watermarkFile  = NULL;
+    Current->lowEvent       = NULL;
+    Current->highEvent      = NULL;
+    InterlockedExchange(&Current->watermarksSet, 0);
+    KeReleaseSpinLock(&Current->watermarkLock, oldIrql);
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+ULONG
+UserPcmRing_WriteLocked
+(
+    _In_                        PUSER_PCM_RING  Ring,
+    _In_reads_bytes_(Length)    const UCHAR *   Source,
+    _In_                        ULONG           Length
+)
+{
+    ULONG written;
+
+    PAGED_CODE();
+
+    if (Ring->mapped)
+    {
+        return 0;
+    }
+
+    // Whole blocks only, also when the submission ends in a partial one,
+    // so the ring never goes out of frame alignment.
+    Length = SubmitQ_WritableBytes(&Ring->ring, Length, Ring->blockAlign);
+
+    written = PcmRing_Write(&Ring->ring, Source, Length);
+    UserPcmRing_CheckWatermarks(Ring);
+
+    return written;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+ULONG
+UserPcmRing_Write
+(
+    _In_                        PUSER_PCM_RING  Ring,
+    _In_reads_bytes_(Length)    const UCHAR *   Source,
+    _In_                        ULONG           Length
+)
+/*++
+
+Routine Description:
+
+  Kernel producer. Returns the number of bytes accepted. Only whole blocks
+  that fit in the free space are written, so neither an overflow nor a
+  Length that is not a multiple of the block size leaves the ring
+  misaligned; the rest is dropped since the producer never moves the read
+  cursor. Accepts nothing while a user-mode producer owns the ring.
+
+--*/
+{
+    ULONG written;
+
+    PAGED_CODE();
+
+    if (Source == NULL || Length == 0)
+    {
+        return 0;
+    }
+
+    ExAcquireFastMutex(&Ring->producerLock);
+    written = UserPcmRing_WriteLocked(Ring, Source, Length);
+    ExReleaseFastMutex(&Ring->producerLock);
+
+    return written;
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+BOOLEAN
+UserPcmRing_HasWaiters
+(
+    _In_ PUSER_PCM_RING Ring
+)
+/*++
+
+Routine Description:
+
+  Producer side. Tells whether any request is pended on Ring's wait queue.
+  Non-paged because it takes the queue's spin lock.
+
+--*/
+{
+    KIRQL   oldIrql;
+    BOOLEAN waiters;
+
+    KeAcquireSpinLock(&Ring->waitLock, &oldIrql);
+    waiters = IsListEmpty(&Ring->waitList) ? FALSE : TRUE;
+    KeReleaseSpinLock(&Ring->waitLock, oldIrql);
+
+    return waiters;
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+VOID
+UserPcmRing_WakeWaiters
+(
+    _In_ PUSER_PCM_RING Ring
+)
+/*++
+
+Routine Description:
+
+  Consumer side, any IRQL <= DISPATCH_LEVEL. Hands the wait queue to the
+  work item once the head waiter's chunk fits. Called after every change
+  that frees space, and by a producer right after it pends a request, so a
+  wake-up racing with the pend is not lost.
+
+--*/
+{
+    LONG need = InterlockedCompareExchange(&Ring->wakeBytes, 0, 0);
+
+    if (!SubmitQ_HeadFits(&Ring->ring, (ULONG)need))
+    {
+        return;
+    }
+
+    if (InterlockedCompareExchange(&Ring->waitWorkQueued, 1, 0) != 0)
+    {
+        return;
+    }
+
+    // The work item keeps the ring alive until it has run.
+    UserPcmRing_Reference(Ring);
+    IoQueueWorkItemEx(Ring->waitWorkItem, UserPcmRing_WaitWorker, DelayedWorkQueue, Ring);
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+VOID
+UserPcmRing_Release
+(
+    _In_ PUSER_PCM_RING Ring
+)
+/*++
+
+Routine Description:
+
+  Consumer side. Hands what every running stream has read back to the
+  producer, then wakes waiters and checks watermarks against the new fill.
+
+--*/
+{
+    PcmRing_Release(&Ring->ring,
+                    Ring->readers,
+                    (ULONG)InterlockedCompareExchange(&Ring->activeMask, 0, 0));
+    UserPcmRing_WakeWaiters(Ring);
+    UserPcmRing_CheckWatermarks(Ring);
+}
+
+//=============================================================================
+#pragma code_seg()
+ULONG
+UserPcmRing_Read
+(
+    _In_                        PUSER_PCM_RING  Ring,
+    _In_                        ULONG           Reader,
+    _Out_writes_bytes_(Length)  UCHAR *         Destination,
+    _In_                        ULONG           Length
+)
+{
+    ULONG copied;
+
+    ASSERT(Reader < PCM_RING_MAX_READERS);
+
+    if (Destination == NULL || Length == 0)
+    {
+        return 0;
+    }
+
+    copied = PcmRing_ReaderRead(&Ring->ring, &Ring->readers[Reader], Destination, Length);
+    UserPcmRing_Release(Ring);
+
+    return copied;
+}
+
+//=============================================================================
+#pragma code_seg()
+ULONG
+UserPcmRing_Count
+(
+    _In_ PUSER_PCM_RING Ring,
+    _In_ ULONG          Reader
+)
+{
+    ASSERT(Reader < PCM_RING_MAX_READERS);
+
+    return PcmRing_ReaderCount(&Ring->ring, &Ring->readers[Reader]);
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+UserPcmRing_StartReader
+(
+    _In_ PUSER_PCM_RING Ring,
+    _In_ ULONG          Reader
+)
+/*++
+
+Routine Description:
+
+  Called when the stream owning Reader starts running. The reader skips
+  whatever the feeder has queued so far and from now on holds the producer
+  back. If no other stream is running, that drops the queued audio for the
+  producer too.
+
+--*/
+{
+    ASSERT(Reader < PCM_RING_MAX_READERS);
+
+    PcmRing_ReaderDiscard(&Ring->ring, &Ring->readers[Reader]);
+    InterlockedOr(&Ring->activeMask, 1L << Reader);
+    UserPcmRing_Release(Ring);
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+UserPcmRing_StopReader
+(
+    _In_ PUSER_PCM_RING Ring,
+    _In_ ULONG          Reader
+)
+/*++
+
+Routine Description:
+
+  Called when the stream owning Reader stops running, so it no longer holds
+  the producer back. The streams still running move the producer's cursor
+  up to the slowest of them.
+
+--*/
+{
+    ASSERT(Reader < PCM_RING_MAX_READERS);
+
+    InterlockedAnd(&Ring->activeMask, ~(1L << Reader));
+    UserPcmRing_Release(Ring);
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+VOID
+UserPcmRing_RemoveReader
+(
+    _In_ PUSER_PCM_RING Ring,
+    _In_ ULONG          Reader
+)
+{
+    PAGED_CODE();
+
+    ASSERT(Reader < PCM_RING_MAX_READERS);
+
+    UserPcmRing_StopReader(Ring, Reader);
+
+    ExAcquireFastMutex(&Ring->producerLock);
+    InterlockedAnd(&Ring->readerMask, ~(1L << Reader));
+    ExReleaseFastMutex(&Ring->producerLock);
+}
+
+//=============================================================================
+#pragma code_seg()
+ULONG
+UserPcmRing_TrimToTarget
+(
+    _In_ PUSER_PCM_RING Ring,
+    _In_ ULONG          Reader,
+    _In_ ULONG          TargetBytes
+)
+/*++
+
+Routine Description:
+
+  Consumer side. Keeps a feeder that runs ahead from building up latency.
+  Trimming only starts above twice the target so that a feeder submitting
+  chunks around the target size is not clipped on every submission. Only
+  whole blocks are dropped, and only for this reader.
+
+--*/
+{
+    ULONG count;
+
+    ASSERT(Reader < PCM_RING_MAX_READERS);
+
+    if (TargetBytes == 0)
+    {
+        return 0;
+    }
+
+    count = PcmRing_ReaderCount(&Ring->ring, &Ring->readers[Reader]);
+    if (count <= 2 * TargetBytes)
+    {
+        return 0;
+    }
+
+    return UserPcmRing_Skip(Ring, Reader, count - TargetBytes);
+}
+
+//=============================================================================
+#pragma code_seg()
+ULONG
+UserPcmRing_Skip
+(
+    _In_ PUSER_PCM_RING Ring,
+    _In_ ULONG          Reader,
+    _In_ ULONG          Length
+)
+{
+    ULONG skipped;
+
+    ASSERT(Reader < PCM_RING_MAX_READERS);
+
+    Length -= Length % Ring->blockAlign;
+    if (Length == 0)
+    {
+        return 0;
+    }
+
+    skipped = PcmRing_ReaderSkip(&Ring->ring, &Ring->readers[Reader], Length);
+    UserPcmRing_Release(Ring);
+
+    return skipped;
+}
+
+//=============================================================================
+#pragma code_seg()
+BOOLEAN
+UserPcmRing_IsMapped
+(
+    _In_ PUSER_PCM_RING Ring
+)
+{
+    return Ring->mapped ? TRUE : FALSE;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+NTSTATUS
+UserPcmRing_MapToProcess
+(
+    _In_    PUSER_PCM_RING              Ring,
+    _In_    PFILE_OBJECT                FileObject,
+    _Out_   PMICYAUDIO_RING_MAPPING     Mapping
+)
+/*++
+
+Routine Description:
+
+  Maps the ring's control and data pages into the current process and makes
+  FileObject the ring's producer. The cursors are left as they are, so the
+  feeder continues from whatever the IOCTL path had already queued. The
+  file object keeps a reference to the ring in FsContext until unmapped.
+
+Arguments:
+
+  Ring - ring to map.
+
+  FileObject - handle instance that owns the mapping.
+
+  Mapping - receives the user-mode layout of the ring.
+
+Return Value:
+
+  STATUS_DEVICE_BUSY if the ring is already mapped or the handle already has
+  a mapping.
+
+--*/
+{
+    NTSTATUS    ntStatus = STATUS_SUCCESS;
+    PVOID       userAddress = NULL;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(Mapping, sizeof(*Mapping));
+
+    // Claim the handle's single mapping slot.
+    if (InterlockedCompareExchangePointer(&FileObject->FsContext, Ring, NULL) != NULL)
+    {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    ExAcquireFastMutex(&Ring->producerLock);
+
+    if (Ring->mapped)
+    {
+        ntStatus = STATUS_DEVICE_BUSY;
+        goto Done;
+    }
+
+    __try
+    {
+        userAddress = MmMapLockedPagesSpecifyCache(Ring->mdl,
+                                                   UserMode,
+                                                   MmCached,
+                                                   NULL,
+                                                   FALSE,
+                                                   NormalPagePriority | MdlMappingNoExecute);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        userAddress = NULL;
+    }
+
+    if (userAddress == NULL)
+    {
+        ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+        goto Done;
+    }
+
+    UserPcmRing_Reference(Ring);
+    Ring->userAddress = userAddress;
+    Ring->userProcess = PsGetCurrentProcess();
+    ObReferenceObject(Ring->userProcess);
+    Ring->userFile    = FileObject;
+    InterlockedExchange(&Ring->mapped, TRUE);
+
+    Mapping->BaseAddress    = (ULONG64)(ULONG_PTR)userAddress;
+    Mapping->ControlOffset  = 0;
+    Mapping->DataOffset     = USERPCM_CONTROL_BYTES;
+    Mapping->Capacity       = Ring->ring.Capacity;
+
+Done:
+    ExReleaseFastMutex(&Ring->producerLock);
+
+    if (!NT_SUCCESS(ntStatus))
+    {
+        InterlockedExchangePointer(&FileObject->FsContext, NULL);
+    }
+
+    return ntStatus;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+NTSTATUS
+UserPcmRing_UnmapFile
+(
+    _In_    PFILE_OBJECT                FileObject
+)
+/*++
+
+Routine Description:
+
+  Tears down the mapping created through FileObject and gives the producer
+  role back to the IOCTL path. Attaches to the owning process when called
+  from a different context (e.g. cleanup of a duplicated handle).
+
+Return Value:
+
+  STATUS_INVALID_DEVICE_REQUEST if FileObject does not own a mapping.
+
+--*/
+{
+    PUSER_PCM_RING  ring;
+    KAPC_STATE      apcState;
+    BOOLEAN         attached = FALSE;
+
+    PAGED_CODE();
+
+    ring = (PUSER_PCM_RING)InterlockedExchangePointer(&FileObject->FsContext, NULL);
+    if (ring == NULL)
+    {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    ExAcquireFastMutex(&ring->producerLock);
+
+    ASSERT(ring->userFile == FileObject);
+
+    if (PsGetCurrentProcess() != ring->userProcess)
+    {
+        KeStackAttachProcess(ring->userProcess, &apcState);
+        attached = TRUE;
+    }
+
+    MmUnmapLockedPages(ring->userAddress, ring->mdl);
+
+    if (attached)
+    {
+        KeUnstackDetachProcess(&apcState);
+    }
+
+    ObDereferenceObject(ring->userProcess);
+
+    ring->userAddress = NULL;
+    ring->userProcess = NULL;
+    ring->userFile    = NULL;
+    InterlockedExchange(&ring->mapped, FALSE);
+
+    ExReleaseFastMutex(&ring->producerLock);
+
+    UserPcmRing_Dereference(ring);
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+VOID
+UserPcmRing_DropWatermarks
+(
+    _In_ PUSER_PCM_RING Ring
+)
+{
+    PKEVENT lowEvent;
+    PKEVENT highEvent;
+
+    PAGED_CODE();
+
+    UserPcmRing_TakeWatermarks(Ring, &lowEvent, &highEvent);
+
+    if (lowEvent != NULL)
+    {
+        ObDereferenceObject(lowEvent);
+    }
+    if (highEvent != NULL)
+    {
+        ObDereferenceObject(highEvent);
+    }
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+NTSTATUS
+UserPcmRing_SetWatermarks
+(
+    _In_    PUSER_PCM_RING                  Ring,
+    _In_    PFILE_OBJECT                    FileObject,
+    _In_    const MICYAUDIO_WATERMARKS *    Watermarks
+)
+/*++
+
+Routine Description:
+
+  Registers, replaces or, with both event handles zero, removes the ring's
+  watermark events. The handles are resolved in the caller's process. A
+  ring has one set of watermarks, owned by the handle that registered them
+  until it removes them or is closed. Events are signaled at once if the
+  ring is already past a threshold. The caller holds the producer lock, so
+  the ring cannot be retired meanwhile.
+
+Arguments:
+
+  Ring - ring the watermarks apply to.
+
+  FileObject - handle instance registering the watermarks.
+
+  Watermarks - thresholds and event handles.
+
+Return Value:
+
+  STATUS_DEVICE_BUSY if another handle owns the ring's watermarks.
+
+--*/
+{
+    NTSTATUS    ntStatus = STATUS_SUCCESS;
+    PKEVENT     lowEvent = NULL;
+    PKEVENT     highEvent = NULL;
+
+    PAGED_CODE();
+
+    if (Watermarks->Reserved != 0 ||
+        (Watermarks->LowEvent != 0 &&
+            (Watermarks->LowBytes == 0 || Watermarks->LowBytes > Ring->ring.Capacity)) ||
+        (Watermarks->HighEvent != 0 &&
+            Watermarks->HighBytes >= Ring->ring.Capacity) ||
+        (Watermarks->LowEvent != 0 && Watermarks->HighEvent != 0 &&
+            Watermarks->LowBytes > Watermarks->HighBytes))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (Watermarks->LowEvent != 0)
+    {
+        ntStatus = ObReferenceObjectByHandle((HANDLE)(ULONG_PTR)Watermarks->LowEvent,
+                                             EVENT_MODIFY_STATE,
+                                             *ExEventObjectType,
+                                             UserMode,
+                                             (PVOID *)&lowEvent,
+                                             NULL);
+        IF_FAILED_JUMP(ntStatus, Done);
+    }
+
+    if (Watermarks->HighEvent != 0)
+    {
+        ntStatus = ObReferenceObjectByHandle((HANDLE)(ULONG_PTR)Watermarks->HighEvent,
+                                             EVENT_MODIFY_STATE,
+                                             *ExEventObjectType,
+                                             UserMode,
+                                             (PVOID *)&highEvent,
+                                             NULL);
+        IF_FAILED_JUMP(ntStatus, Done);
+    }
+
+    // The ring takes the new references, and the replaced ones come back
+    // to be released.
+    ntStatus = UserPcmRing_ExchangeWatermarks(Ring,
+                                              FileObject,
+                                              Watermarks->LowBytes,
+                                              Watermarks->HighBytes,
+                                              &lowEvent,
+                                              &highEvent);
+    IF_FAILED_JUMP(ntStatus, Done);
+
+    UserPcmRing_CheckWatermarks(Ring);
+
+Done:
+    if (lowEvent != NULL)
+    {
+        ObDereferenceObject(lowEvent);
+    }
+    if (highEvent != NULL)
+    {
+        ObDereferenceObject(highEvent);
+    }
+
+    return ntStatus;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+NTSTATUS
+UserPcmRoutes_Init
+(
+    _In_    PDRIVER_OBJECT      DriverObject,
+    _In_    ULONG               RouteCount,
+    _In_    ULONG               CapacityMs,
+    _In_    ULONG               TargetMs
+)
+/*++
+
+Routine Description:
+
+  Creates one route per capture endpoint, each with a ring sized for the
+  default format so feeders can start submitting before the first stream is
+  opened. Out of range settings fall back to the defaults.
+
+--*/
+{
+    NTSTATUS ntStatus = STATUS_SUCCESS;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(&g_UserPcmRoutes, sizeof(g_UserPcmRoutes));
+    KeInitializeSpinLock(&g_UserPcmRoutes.lock);
+    ExInitializeFastMutex(&g_UserPcmRoutes.attachLock);
+    g_UserPcmRoutes.driverObject = DriverObject;
+
+    if (RouteCount == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    g_UserPcmRoutes.routes = (PUSER_PCM_ROUTE)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+                                                              RouteCount * sizeof(USER_PCM_ROUTE),
+                                                              USERPCM_POOLTAG);
+    if (g_UserPcmRoutes.routes == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    g_UserPcmRoutes.count = RouteCount;
+
+    if (CapacityMs < MICYAUDIO_MIN_CAPACITY_MS || CapacityMs > MICYAUDIO_MAX_CAPACITY_MS)
+    {
+        CapacityMs = USERPCM_DEFAULT_CAPACITY_MS;
+    }
+    if (TargetMs > CapacityMs / 2)
+    {
+        TargetMs = USERPCM_DEFAULT_TARGET_MS;
+    }
+
+    for (ULONG i = 0; i < RouteCount; i++)
+    {
+        g_UserPcmRoutes.routes[i].capacityMs = CapacityMs;
+        g_UserPcmRoutes.routes[i].targetMs   = TargetMs;
+
+        ntStatus = UserPcmRing_Create(UserPcm_MsToBytes(CapacityMs,
+                                                        USERPCM_DEFAULT_BYTES_PER_SEC,
+                                                        USERPCM_DEFAULT_BLOCK_ALIGN),
+                                      USERPCM_DEFAULT_BLOCK_ALIGN,
+                                      &g_UserPcmRoutes.routes[i].ring);
+        if (!NT_SUCCESS(ntStatus))
+        {
+            UserPcmRoutes_Term();
+            break;
+        }
+        g_UserPcmRoutes.routes[i].ring->routeIndex = i;
+    }
+
+    return ntStatus;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+VOID
+UserPcmRoutes_Term()
+{
+    PAGED_CODE();
+
+    if (g_UserPcmRoutes.routes == NULL)
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < g_UserPcmRoutes.count; i++)
+    {
+        if (g_UserPcmRoutes.routes[i].ring != NULL)
+        {
+            UserPcmRing_Dereference(g_UserPcmRoutes.routes[i].ring);
+            g_UserPcmRoutes.routes[i].ring = NULL;
+        }
+        if (g_UserPcmRoutes.routes[i].direct != NULL)
+        {
+            UserDma_Dereference(g_UserPcmRoutes.routes[i].direct);
+            g_UserPcmRoutes.routes[i].direct = NULL;
+        }
+    }
+
+    ExFreePoolWithTag(g_UserPcmRoutes.routes, USERPCM_POOLTAG);
+    g_UserPcmRoutes.routes = NULL;
+    g_UserPcmRoutes.count  = 0;
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+ULONG
+UserPcmRoute_IndexFromStreamId
+(
+    _In_ ULONG StreamId
+)
+{
+    return StreamId == 0 ? 0 : StreamId - 1;
+}
+
+//=============================================================================
+#pragma code_seg()
+BOOLEAN
+UserPcmRoute_IsValidStreamId
+(
+    _In_ ULONG StreamId
+)
+{
+    return UserPcmRoute_IndexFromStreamId(StreamId) < g_UserPcmRoutes.count ? TRUE : FALSE;
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+PUSER_PCM_RING
+UserPcmRoute_ReferenceRing
+(
+    _In_ ULONG Index
+)
+{
+    PUSER_PCM_RING  ring = NULL;
+    KIRQL           oldIrql;
+
+    if (Index >= g_UserPcmRoutes.count)
+    {
+        return NULL;
+    }
+
+    KeAcquireSpinLock(&g_UserPcmRoutes.lock, &oldIrql);
+    ring = g_UserPcmRoutes.routes[Index].ring;
+    if (ring != NULL)
+    {
+        UserPcmRing_Reference(ring);
+    }
+    KeReleaseSpinLock(&g_UserPcmRoutes.lock, oldIrql);
+
+    return ring;
+}
+
+//=============================================================================
+#pragma code_seg()
+PUSER_PCM_RING
+UserPcmRoute_Lookup
+(
+    _In_ ULONG StreamId
+)
+{
+    return UserPcmRoute_ReferenceRing(UserPcmRoute_IndexFromStreamId(StreamId));
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+VOID
+UserPcmRoute_GetSettings
+(
+    _In_    ULONG           Index,
+    _Out_   PULONG          CapacityMs,
+    _Out_   PULONG          TargetMs,
+    _Out_   PUSER_PCM_INPUT Input
+)
+/*++
+
+Routine Description:
+
+  Reads the route's buffering settings and the feeder format it was given
+  in one consistent snapshot. Only the format fields of Input are set.
+
+--*/
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&g_UserPcmRoutes.lock, &oldIrql);
+    *CapacityMs          = g_UserPcmRoutes.routes[Index].capacityMs;
+    *TargetMs            = g_UserPcmRoutes.routes[Index].targetMs;
+    Input->Flags         = g_UserPcmRoutes.routes[Index].flags;
+    Input->SampleFormat  = (PCM_SAMPLE_FORMAT)g_UserPcmRoutes.routes[Index].sampleFormat;
+    Input->SamplesPerSec = g_UserPcmRoutes.routes[Index].sampleRate;
+    Input->Quality       = (RESAMPLER_QUALITY)g_UserPcmRoutes.routes[Index].quality;
+    KeReleaseSpinLock(&g_UserPcmRoutes.lock, oldIrql);
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+VOID
+UserPcmRoute_ReplaceRing
+(
+    _In_ ULONG          Index,
+    _In_ PUSER_PCM_RING Current,
+    _In_ PUSER_PCM_RING Fresh
+)
+/*++
+
+Routine Description:
+
+  Makes Fresh the route's ring in place of Current. The route's reference
+  moves with it: the caller has already taken one on Fresh and drops the
+  one on Current.
+
+--*/
+{
+    KIRQL oldIrql;
+
+    UNREFERENCED_PARAMETER(Current);
+
+    KeAcquireSpinLock(&g_UserPcmRoutes.lock, &oldIrql);
+    ASSERT(g_UserPcmRoutes.routes[Index].ring == Current);
+    g_UserPcmRoutes.routes[Index].ring = Fresh;
+    KeReleaseSpinLock(&g_UserPcmRoutes.lock, oldIrql);
+}
+
+//=============================================================================
+#pragma code_seg()
+NTSTATUS
+UserPcmRoute_PublishDirect
+(
+    _In_ ULONG              EndpointIndex,
+    _In_ PUSER_DMA_BUFFER   Buffer
+)
+/*++
+
+Routine Description:
+
+  Makes Buffer the DMA buffer feeders of the endpoint map with
+  IOCTL_MICYAUDIO_MAP_DIRECT. The route takes a reference of its own.
+
+Return Value:
+
+  STATUS_DEVICE_BUSY if another stream of the endpoint is in direct mode.
+
+--*/
+{
+    NTSTATUS    ntStatus = STATUS_SUCCESS;
+    KIRQL       oldIrql;
+
+    if (EndpointIndex >= g_UserPcmRoutes.count)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KeAcquireSpinLock(&g_UserPcmRoutes.lock, &oldIrql);
+    if (g_UserPcmRoutes.routes[EndpointIndex].direct != NULL)
+    {
+        ntStatus = STATUS_DEVICE_BUSY;
+    }
+    else
+    {
+        UserDma_Reference(Buffer);
+        g_UserPcmRoutes.routes[EndpointIndex].direct = Buffer;
+    }
+    KeReleaseSpinLock(&g_UserPcmRoutes.lock, oldIrql);
+
+    return ntStatus;
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+UserPcmRoute_WithdrawDirect
+(
+    _In_ PUSER_DMA_BUFFER   Buffer
+)
+/*++
+
+Routine Description:
+
+  Undoes UserPcmRoute_PublishDirect, if Buffer is still published, and
+  drops the route's reference. Non-paged like PublishDirect because it
+  takes the route lock; the caller is at PASSIVE_LEVEL, as releasing the
+  reference requires.
+
+--*/
+{
+    BOOLEAN withdrawn = FALSE;
+    KIRQL   oldIrql;
+
+    KeAcquireSpinLock(&g_UserPcmRoutes.lock, &oldIrql);
+    for (ULONG i = 0; i < g_UserPcmRoutes.count; i++)
+    {
+        if (g_UserPcmRoutes.routes[i].direct == Buffer)
+        {
+            g_UserPcmRoutes.routes[i].direct = NULL;
+            withdrawn = TRUE;
+            break;
+        }
+    }
+    KeReleaseSpinLock(&g_UserPcmRoutes.lock, oldIrql);
+
+    if (withdrawn)
+    {
+        UserDma_Dereference(Buffer);
+    }
+}
+
+//=============================================================================
+#pragma code_seg()
+PUSER_DMA_BUFFER
+UserPcmRoute_LookupDirect
+(
+    _In_ ULONG StreamId
+)
+{
+    PUSER_DMA_BUFFER    buffer = NULL;
+    ULONG               index = UserPcmRoute_IndexFromStreamId(StreamId);
+    KIRQL               oldIrql;
+
+    if (index >= g_UserPcmRoutes.count)
+    {
+        return NULL;
+    }
+
+    KeAcquireSpinLock(&g_UserPcmRoutes.lock, &oldIrql);
+    buffer = g_UserPcmRoutes.routes[index].direct;
+    if (buffer != NULL)
+    {
+        UserDma_Reference(buffer);
+    }
+    KeReleaseSpinLock(&g_UserPcmRoutes.lock, oldIrql);
+
+    return buffer;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+ULONG
+UserPcmRing_AddReaderLocked
+(
+    _In_ PUSER_PCM_RING Ring
+)
+/*++
+
+Routine Description:
+
+  Claims a free reader slot. The reader is not running yet, so it does not
+  hold the producer back until UserPcmRing_StartReader. The caller holds
+  the producer lock.
+
+Return Value:
+
+  Index of the reader, PCM_RING_MAX_READERS if all are in use.
+
+--*/
+{
+    PAGED_CODE();
+
+    for (ULONG i = 0; i < PCM_RING_MAX_READERS; i++)
+    {
+        if ((Ring->readerMask & (1L << i)) == 0)
+        {
+            PcmRing_ReaderDiscard(&Ring->ring, &Ring->readers[i]);
+            Ring->readers[i].Laps = 0;
+            InterlockedOr(&Ring->readerMask, 1L << i);
+            return i;
+        }
+    }
+
+    return PCM_RING_MAX_READERS;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+ULONG
+UserPcmRing_AddFirstReaderLocked
+(
+    _In_ PUSER_PCM_RING         Ring,
+    _In_ ULONG                  Channels,
+    _In_ const USER_PCM_INPUT * Input
+)
+/*++
+
+Routine Description:
+
+  Adds the first reader of a ring, which decides what the ring holds until
+  the last reader is gone. The caller holds the producer lock, or is the
+  only one who knows the ring.
+
+--*/
+{
+    ULONG reader;
+
+    PAGED_CODE();
+
+    ASSERT(Ring->readerMask == 0);
+
+    Ring->contentFormat   = Input->SampleFormat;
+    Ring->contentRate     = Input->SamplesPerSec;
+    Ring->contentChannels = Channels;
+
+    reader = UserPcmRing_AddReaderLocked(Ring);
+    ASSERT(reader < PCM_RING_MAX_READERS);
+
+    return reader;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+NTSTATUS
+UserPcmRing_ShareInput
+(
+    _In_    PUSER_PCM_RING      Ring,
+    _In_    ULONG               SamplesPerSec,
+    _In_    ULONG               Channels,
+    _In_    ULONG               BlockAlign,
+    _In_    PCM_SAMPLE_FORMAT   StreamFormat,
+    _Inout_ PUSER_PCM_INPUT     Input
+)
+/*++
+
+Routine Description:
+
+  Describes the audio in a ring other streams are already reading to one
+  more stream. The ring keeps the format and rate the first stream set it
+  up with, and the new stream converts from those like it would from a
+  feeder's format. It needs the same channel count, and the very same
+  format and rate if it cannot convert.
+
+Return Value:
+
+  STATUS_DEVICE_BUSY if the stream cannot take the audio in the ring.
+
+--*/
+{
+    ULONG resamplerFlags;
+
+    PAGED_CODE();
+
+    if (Ring->contentChannels != Channels)
+    {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    if (Ring->contentFormat == PcmSampleFormatInvalid || StreamFormat == PcmSampleFormatInvalid)
+    {
+        if (Ring->contentFormat != StreamFormat ||
+            Ring->blockAlign != BlockAlign ||
+            Ring->contentRate != SamplesPerSec)
+        {
+            return STATUS_DEVICE_BUSY;
+        }
+        Input->Flags &= ~MICYAUDIO_CONFIG_FLAG_ADAPTIVE_RATE;
+    }
+
+    Input->SampleFormat  = Ring->contentFormat;
+    Input->BlockAlign    = Ring->blockAlign;
+    Input->SamplesPerSec = Ring->contentRate;
+
+    resamplerFlags = (Input->Flags & MICYAUDIO_CONFIG_FLAG_ADAPTIVE_RATE) ? RESAMPLER_FLAG_ADJUSTABLE : 0;
+
+    if ((Input->SamplesPerSec != SamplesPerSec || resamplerFlags != 0) &&
+        Resampler_GetSize(Input->SamplesPerSec, SamplesPerSec, Channels, Input->Quality, resamplerFlags) == 0)
+    {
+        if (Input->SamplesPerSec != SamplesPerSec)
+        {
+            return STATUS_DEVICE_BUSY;
+        }
+        Input->Flags &= ~MICYAUDIO_CONFIG_FLAG_ADAPTIVE_RATE;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+NTSTATUS
+UserPcmRoute_AttachStream
+(
+    _In_    ULONG               EndpointIndex,
+    _In_    ULONG               SamplesPerSec,
+    _In_    ULONG               Channels,
+    _In_    ULONG               BlockAlign,
+    _In_    PCM_SAMPLE_FORMAT   StreamFormat,
+    _Out_   PUSER_PCM_RING *    Ring,
+    _Out_   PULONG              Reader,
+    _Out_   PUSER_PCM_INPUT     Input
+)
+/*++
+
+Routine Description:
+
+  Hands the endpoint's ring and a reader of it to a capture stream, together
+  with the format and rate the feeder submits in and the route's target
+  fill converted to bytes of that format. If the current ring does not have
+  the route's capacity for that format it is replaced by a fresh one,
+  unless a feeder has it mapped, in which case the mapping wins and the
+  current ring is kept. Audio queued in a replaced ring is dropped; a
+  stream skips what is queued on RUN anyway. Submissions pended on it are
+  carried over to the new ring.
+
+  While other streams are reading the ring it is neither replaced nor
+  changed; the stream shares the audio in the format and rate it holds.
+
+Arguments:
+
+  EndpointIndex - position of the endpoint in g_CaptureEndpoints.
+
+  SamplesPerSec - frame rate of the stream format.
+
+  Channels - channel count of the stream format.
+
+  BlockAlign - frame size of the stream format.
+
+  StreamFormat - sample format of the stream, PcmSampleFormatInvalid if it
+    cannot be converted to.
+
+  Ring - receives a referenced ring.
+
+  Reader - receives the stream's reader of the ring, see UserPcmRing_Read.
+
+  Input - receives the format of the audio in the ring, the target fill and
+    the route's flags, less adaptive rate if the stream cannot resample.
+
+Return Value:
+
+  STATUS_DEVICE_BUSY if other streams are reading the ring in a format the
+  stream cannot take.
+
+--*/
+{
+    NTSTATUS        ntStatus = STATUS_SUCCESS;
+    PUSER_PCM_RING  current;
+    PUSER_PCM_RING  fresh = NULL;
+    ULONG           capacityBytes;
+    ULONG           capacityMs;
+    ULONG           targetMs;
+    ULONG           inputBytesPerSec;
+    ULONG           resamplerFlags;
+
+    PAGED_CODE();
+
+    *Ring = NULL;
+    *Reader = PCM_RING_MAX_READERS;
+    RtlZeroMemory(Input, sizeof(*Input));
+
+    if (EndpointIndex >= g_UserPcmRoutes.count)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ExAcquireFastMutex(&g_UserPcmRoutes.attachLock);
+
+    UserPcmRoute_GetSettings(EndpointIndex, &capacityMs, &targetMs, Input);
+
+    current = UserPcmRoute_ReferenceRing(EndpointIndex);
+    if (current == NULL)
+    {
+        ntStatus = STATUS_INVALID_PARAMETER;
+        goto Done;
+    }
+
+    // Streams already reading the ring keep it as it is. Attaching is
+    // serialized, so nobody can join between this check and the ring
+    // possibly being replaced below; streams can only leave.
+    if (InterlockedCompareExchange(&current->readerMask, 0, 0) != 0)
+    {
+        ExAcquireFastMutex(&current->producerLock);
+
+        ntStatus = UserPcmRing_ShareInput(current, SamplesPerSec, Channels, BlockAlign, StreamFormat, Input);
+        if (NT_SUCCESS(ntStatus))
+        {
+            *Reader = UserPcmRing_AddReaderLocked(current);
+            if (*Reader == PCM_RING_MAX_READERS)
+            {
+                ntStatus = STATUS_DEVICE_BUSY;
+            }
+        }
+
+        ExReleaseFastMutex(&current->producerLock);
+
+        if (!NT_SUCCESS(ntStatus))
+        {
+            DPF(D_TERSE, ("UserPcm: cannot share the ring of endpoint %u, 0x%x", EndpointIndex, ntStatus));
+            UserPcmRing_Dereference(current);
+            goto Done;
+        }
+
+        Input->TargetBytes = UserPcm_MsToBytes(targetMs,
+                                               Input->SamplesPerSec * Input->BlockAlign,
+                                               Input->BlockAlign);
+        // The ring may predate the route's current capacity.
+        Input->CapacityBytes = min(UserPcm_MsToBytes(capacityMs,
+                                                     Input->SamplesPerSec * Input->BlockAlign,
+                                                     Input->BlockAlign),
+                                   current->ring.Capacity);
+        *Ring = current;
+        goto Done;
+    }
+
+    if (Input->SampleFormat == PcmSampleFormatInvalid || StreamFormat == PcmSampleFormatInvalid)
+    {
+        Input->SampleFormat = StreamFormat;
+        Input->BlockAlign   = BlockAlign;
+    }
+    else
+    {
+        Input->BlockAlign   = Channels * PcmConvert_SampleBytes(Input->SampleFormat);
+    }
+
+    // Rate conversion runs in float, so it needs a convertible stream format.
+    if ((Input->Flags & MICYAUDIO_CONFIG_FLAG_ADAPTIVE_RATE) && StreamFormat == PcmSampleFormatInvalid)
+    {
+        DPF(D_TERSE, ("UserPcm: no adaptive rate for this stream format on endpoint %u", EndpointIndex));
+        Input->Flags &= ~MICYAUDIO_CONFIG_FLAG_ADAPTIVE_RATE;
+    }
+
+    resamplerFlags = (Input->Flags & MICYAUDIO_CONFIG_FLAG_ADAPTIVE_RATE) ? RESAMPLER_FLAG_ADJUSTABLE : 0;
+
+    if (Input->SamplesPerSec == 0 ||
+        StreamFormat == PcmSampleFormatInvalid ||
+        Resampler_GetSize(Input->SamplesPerSec, SamplesPerSec, Channels, Input->Quality, resamplerFlags) == 0)
+    {
+        if (Input->SamplesPerSec != 0 && Input->SamplesPerSec != SamplesPerSec)
+        {
+            DPF(D_TERSE, ("UserPcm: cannot resample %u Hz to %u Hz on endpoint %u",
+                          Input->SamplesPerSec, SamplesPerSec, EndpointIndex));
+        }
+        Input->SamplesPerSec = SamplesPerSec;
+    }
+    inputBytesPerSec = Input->SamplesPerSec * Input->BlockAlign;
+
+    capacityBytes        = UserPcm_MsToBytes(capacityMs, inputBytesPerSec, Input->BlockAlign);
+    Input->TargetBytes   = UserPcm_MsToBytes(targetMs, inputBytesPerSec, Input->BlockAlign);
+    Input->CapacityBytes = capacityBytes;
+
+    if (current->ring.Capacity != PcmRing_RoundCapacity(max(capacityBytes, (ULONG)PAGE_SIZE)))
+    {
+        ntStatus = UserPcmRing_Create(capacityBytes, Input->BlockAlign, &fresh);
+        if (!NT_SUCCESS(ntStatus))
+        {
+            UserPcmRing_Dereference(current);
+            goto Done;
+        }
+    }
+
+    // The producer lock keeps a feeder from mapping the old ring while it is
+    // being replaced.
+    ExAcquireFastMutex(&current->producerLock);
+
+    if (fresh == NULL || current->mapped)
+    {
+        current->blockAlign = Input->BlockAlign ? Input->BlockAlign : 1;
+        *Reader = UserPcmRing_AddFirstReaderLocked(current, Channels, Input);
+        ExReleaseFastMutex(&current->producerLock);
+
+        if (fresh != NULL)
+        {
+            UserPcmRing_Dereference(fresh);
+        }
+
+        *Ring = current;
+        goto Done;
+    }
+
+    // The route takes the creation reference, the stream gets its own.
+    UserPcmRing_Reference(fresh);
+    fresh->routeIndex = EndpointIndex;
+    *Reader = UserPcmRing_AddFirstReaderLocked(fresh, Channels, Input);
+
+    // Watermarks belong to the route's ring, whichever that is. Nobody
+    // sees the fresh ring before it is published below.
+    UserPcmRing_MoveWatermarks(fresh, current);
+
+    UserPcmRoute_ReplaceRing(EndpointIndex, current, fresh);
+
+    // Producers that looked the old ring up before the swap go back to the
+    // route once they get the lock.
+    current->retired = TRUE;
+
+    ExReleaseFastMutex(&current->producerLock);
+
+    // Move submissions pended on the old ring over to the new one.
+    UserPcmRing_RequeueWaiters(current);
+
+    // Drop the route's reference and ours on the old ring.
+    UserPcmRing_Dereference(current);
+    UserPcmRing_Dereference(current);
+
+    *Ring = fresh;
+
+Done:
+    ExReleaseFastMutex(&g_UserPcmRoutes.attachLock);
+
+    return ntStatus;
+}
+
+
+//=============================================================================
+#pragma code_seg()
+NTSTATUS
+UserPcmRoute_SetConfig
+(
+    _In_ const MICYAUDIO_STREAM_CONFIG * Config
+)
+/*++
+
+Routine Description:
+
+  Updates the buffering of a route. The target and flags apply from the next
+  time a stream attaches, as does the capacity, which is what makes resizing safe:
+  a running stream keeps draining the ring it already holds.
+
+Return Value:
+
+  STATUS_INVALID_PARAMETER for an unknown stream or out of range values.
+
+--*/
+{
+    KIRQL oldIrql;
+    ULONG index;
+
+    if (!UserPcmRoute_IsValidStreamId(Config->StreamId) ||
+        (Config->Flags & ~MICYAUDIO_CONFIG_FLAGS_VALID) != 0 ||
+        Config->CapacityMs < MICYAUDIO_MIN_CAPACITY_MS ||
+        Config->CapacityMs > MICYAUDIO_MAX_CAPACITY_MS ||
+        Config->TargetMs > Config->CapacityMs / 2 ||
+        ((Config->Flags & (MICYAUDIO_CONFIG_FLAG_ADAPTIVE_RATE | MICYAUDIO_CONFIG_FLAG_JITTER_BUFFER)) &&
+         Config->TargetMs == 0))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    index = UserPcmRoute_IndexFromStreamId(Config->StreamId);
+
+    KeAcquireSpinLock(&g_UserPcmRoutes.lock, &oldIrql);
+    g_UserPcmRoutes.routes[index].capacityMs = Config->CapacityMs;
+    g_UserPcmRoutes.routes[index].targetMs   = Config->TargetMs;
+    g_UserPcmRoutes.routes[index].flags      = Config->Flags;
+    KeReleaseSpinLock(&g_UserPcmRoutes.lock, oldIrql);
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg()
+NTSTATUS
+UserPcmRoute_GetConfig
+(
+    _Inout_ PMICYAUDIO_STREAM_CONFIG Config
+)
+{
+    KIRQL oldIrql;
+    ULONG index;
+
+    if (!UserPcmRoute_IsValidStreamId(Config->StreamId))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    index = UserPcmRoute_IndexFromStreamId(Config->StreamId);
+
+    KeAcquireSpinLock(&g_UserPcmRoutes.lock, &oldIrql);
+    Config->CapacityMs = g_UserPcmRoutes.routes[index].capacityMs;
+    Config->TargetMs   = g_UserPcmRoutes.routes[index].targetMs;
+    Config->Flags      = g_UserPcmRoutes.routes[index].flags;
+    KeReleaseSpinLock(&g_UserPcmRoutes.lock, oldIrql);
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg()
+NTSTATUS
+UserPcmRoute_SetInputFormat
+(
+    _In_ const MICYAUDIO_INPUT_FORMAT * Format
+)
+/*++
+
+Routine Description:
+
+  Records the sample format and rate the feeder submits for a route. Applies
+  from the next time a stream attaches, like the buffering. Whether the rate
+  can be converted is only known then, as it depends on the stream's rate.
+
+Return Value:
+
+  STATUS_INVALID_PARAMETER for an unknown stream or format.
+
+--*/
+{
+    KIRQL oldIrql;
+    ULONG index;
+
+    if (!UserPcmRoute_IsValidStreamId(Format->StreamId) ||
+        Format->SampleFormat > MICYAUDIO_SAMPLE_FORMAT_FLOAT32 ||
+        (Format->SampleRate != 0 &&
+         (Format->SampleRate < MICYAUDIO_MIN_SAMPLE_RATE ||
+          Format->SampleRate > MICYAUDIO_MAX_SAMPLE_RATE)) ||
+        Format->Quality > MICYAUDIO_RESAMPLER_QUALITY_HIGH)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    index = UserPcmRoute_IndexFromStreamId(Format->StreamId);
+
+    KeAcquireSpinLock(&g_UserPcmRoutes.lock, &oldIrql);
+    g_UserPcmRoutes.routes[index].sampleFormat = Format->SampleFormat;
+    g_UserPcmRoutes.routes[index].sampleRate   = Format->SampleRate;
+    g_UserPcmRoutes.routes[index].quality      = Format->Quality;
+    KeReleaseSpinLock(&g_UserPcmRoutes.lock, oldIrql);
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg()
+NTSTATUS
+UserPcmRoute_GetInputFormat
+(
+    _Inout_ PMICYAUDIO_INPUT_FORMAT Format
+)
+{
+    KIRQL oldIrql;
+    ULONG index;
+
+    if (!UserPcmRoute_IsValidStreamId(Format->StreamId))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    index = UserPcmRoute_IndexFromStreamId(Format->StreamId);
+
+    KeAcquireSpinLock(&g_UserPcmRoutes.lock, &oldIrql);
+    Format->SampleFormat = g_UserPcmRoutes.routes[index].sampleFormat;
+    Format->SampleRate   = g_UserPcmRoutes.routes[index].sampleRate;
+    Format->Quality      = g_UserPcmRoutes.routes[index].quality;
+    KeReleaseSpinLock(&g_UserPcmRoutes.lock, oldIrql);
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+UserPcmRoute_PublishLevels
+(
+    _In_ ULONG          EndpointIndex,
+    _In_ ULONG          Channels,
+    _In_reads_(Channels) const ULONG * Peak,
+    _In_reads_(Channels) const ULONG * Rms
+)
+/*++
+
+Routine Description:
+
+  Publishes what a capture stream measured over one wakeup. Called from the
+  stream's DPC path, so the route is updated without its lock: every value
+  is a single interlocked LONG. Peaks only ever rise here and are cleared by
+  UserPcmRoute_GetLevels; RMS values are replaced.
+
+--*/
+{
+    PUSER_PCM_ROUTE route;
+
+    if (EndpointIndex >= g_UserPcmRoutes.count)
+    {
+        return;
+    }
+
+    route = &g_UserPcmRoutes.routes[EndpointIndex];
+
+    if (Channels > MICYAUDIO_MAX_LEVEL_CHANNELS)
+    {
+        Channels = MICYAUDIO_MAX_LEVEL_CHANNELS;
+    }
+
+    for (ULONG c = 0; c < Channels; c++)
+    {
+        LONG current = ReadNoFence(&route->levelPeak[c]);
+
+        while ((LONG)Peak[c] > current)
+        {
+            LONG previous = InterlockedCompareExchange(&route->levelPeak[c], (LONG)Peak[c], current);
+            if (previous == current)
+            {
+                break;
+            }
+            current = previous;
+        }
+
+        InterlockedExchange(&route->levelRms[c], (LONG)Rms[c]);
+    }
+
+    InterlockedExchange(&route->levelChannels, (LONG)Channels);
+}
+
+//=============================================================================
+#pragma code_seg()
+NTSTATUS
+UserPcmRoute_GetLevels
+(
+    _Inout_ PMICYAUDIO_LEVELS Levels
+)
+{
+    PUSER_PCM_ROUTE route;
+    ULONG           channels;
+
+    if (!UserPcmRoute_IsValidStreamId(Levels->StreamId))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    route    = &g_UserPcmRoutes.routes[UserPcmRoute_IndexFromStreamId(Levels->StreamId)];
+    channels = (ULONG)ReadNoFence(&route->levelChannels);
+
+    RtlZeroMemory(Levels->Peak, sizeof(Levels->Peak));
+    RtlZeroMemory(Levels->Rms, sizeof(Levels->Rms));
+
+    Levels->Channels = channels;
+    for (ULONG c = 0; c < channels; c++)
+    {
+        Levels->Peak[c] = (ULONG)InterlockedExchange(&route->levelPeak[c], 0);
+        Levels->Rms[c]  = (ULONG)ReadNoFence(&route->levelRms[c]);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+NTSTATUS
+UserPcmRoute_GetStats
+(
+    _Inout_ PMICYAUDIO_STATS Stats
+)
+{
+    PAGED_CODE();
+
+    if (!UserPcmRoute_IsValidStreamId(Stats->StreamId))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    DriverStats_Get(UserPcmRoute_IndexFromStreamId(Stats->StreamId), Stats);
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg()
+NTSTATUS
+UserPcmRing_CsqInsertIrp
+(
+    _In_ PIO_CSQ    Csq,
+    _In_ PIRP       Irp,
+    _In_ PVOID      InsertContext
+)
+{
+    PUSER_PCM_RING ring = CONTAINING_RECORD(Csq, USER_PCM_RING, waitQueue);
+
+    if (InsertContext == USERPCM_INSERT_HEAD)
+    {
+        InsertHeadList(&ring->waitList, &Irp->Tail.Overlay.ListEntry);
+    }
+    else
+    {
+        InsertTailList(&ring->waitList, &Irp->Tail.Overlay.ListEntry);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+UserPcmRing_CsqRemoveIrp
+(
+    _In_ PIO_CSQ    Csq,
+    _In_ PIRP       Irp
+)
+{
+    UNREFERENCED_PARAMETER(Csq);
+
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+}
+
+//=============================================================================
+#pragma code_seg()
+PIRP
+UserPcmRing_CsqPeekNextIrp
+(
+    _In_     PIO_CSQ    Csq,
+    _In_opt_ PIRP       Irp,
+    _In_opt_ PVOID      PeekContext
+)
+/*++
+
+Routine Description:
+
+  PeekContext, if not NULL, is the file object whose requests are wanted.
+
+--*/
+{
+    PUSER_PCM_RING  ring = CONTAINING_RECORD(Csq, USER_PCM_RING, waitQueue);
+    PLIST_ENTRY     entry = (Irp != NULL) ? Irp->Tail.Overlay.ListEntry.Flink : ring->waitList.Flink;
+
+    while (entry != &ring->waitList)
+    {
+        PIRP next = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+
+        if (PeekContext == NULL ||
+            IoGetCurrentIrpStackLocation(next)->FileObject == (PFILE_OBJECT)PeekContext)
+        {
+            return next;
+        }
+
+        entry = entry->Flink;
+    }
+
+    return NULL;
+}
+
+//=============================================================================
+#pragma code_seg()
+_IRQL_raises_(DISPATCH_LEVEL)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Acquires_lock_(CONTAINING_RECORD(Csq, USER_PCM_RING, waitQueue)->waitLock)
+VOID
+UserPcmRing_CsqAcquireLock
+(
+    _In_                                PIO_CSQ Csq,
+    _Out_ _At_(*Irql, _IRQL_saves_)     PKIRQL  Irql
+)
+{
+    PUSER_PCM_RING ring = CONTAINING_RECORD(Csq, USER_PCM_RING, waitQueue);
+
+    KeAcquireSpinLock(&ring->waitLock, Irql);
+}
+
+//=============================================================================
+#pragma code_seg()
+_IRQL_requires_(DISPATCH_LEVEL)
+_Releases_lock_(CONTAINING_RECORD(Csq, USER_PCM_RING, waitQueue)->waitLock)
+VOID
+UserPcmRing_CsqReleaseLock
+(
+    _In_                    PIO_CSQ Csq,
+    _In_ _IRQL_restores_    KIRQL   Irql
+)
+{
+    PUSER_PCM_RING ring = CONTAINING_RECORD(Csq, USER_PCM_RING, waitQueue);
+
+    KeReleaseSpinLock(&ring->waitLock, Irql);
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+UserPcmRing_CsqCompleteCanceledIrp
+(
+    _In_ PIO_CSQ    Csq,
+    _In_ PIRP       Irp
+)
+/*++
+
+Routine Description:
+
+  Audio written before the request was cancelled stays in the ring.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(Csq);
+
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+ULONG
+UserPcmSubmit_GetChunkCount
+(
+    _In_ PIRP Irp
+)
+{
+    PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+
+    PAGED_CODE();
+
+    if (stack->Parameters.DeviceIoControl.IoControlCode == IOCTL_MICYAUDIO_SET_AUDIO_DATA)
+    {
+        return 1;
+    }
+
+    return ((const MICYAUDIO_BATCH_HEADER *)Irp->AssociatedIrp.SystemBuffer)->ChunkCount;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+VOID
+UserPcmSubmit_GetChunk
+(
+    _In_    PIRP        Irp,
+    _In_    ULONG       Index,
+    _Out_   PMICY_CHUNK Chunk
+)
+/*++
+
+Routine Description:
+
+  Returns chunk Index of a submission that has already been validated.
+
+--*/
+{
+    PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(Irp);
+
+    PAGED_CODE();
+
+    if (stack->Parameters.DeviceIoControl.IoControlCode == IOCTL_MICYAUDIO_SET_AUDIO_DATA)
+    {
+        (void)MicyParseSetAudioData(Irp->AssociatedIrp.SystemBuffer,
+                                    stack->Parameters.DeviceIoControl.InputBufferLength,
+                                    Chunk);
+    }
+    else
+    {
+        MicyGetBatchChunk(Irp->AssociatedIrp.SystemBuffer, Index, Chunk);
+    }
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+VOID
+UserPcmSubmit_ConsumeChunk
+(
+    _In_    PIRP        Irp,
+    _In_    ULONG       Index,
+    _In_    ULONG       Length
+)
+/*++
+
+Routine Description:
+
+  Records that the first Length bytes of batch chunk Index have been
+  written. The system buffer is the driver's own copy of the input, so the
+  descriptor itself is advanced.
+
+--*/
+{
+    PMICYAUDIO_CHUNK_DESCRIPTOR descriptor;
+
+    PAGED_CODE();
+
+    descriptor = (PMICYAUDIO_CHUNK_DESCRIPTOR)((PMICYAUDIO_BATCH_HEADER)Irp->AssociatedIrp.SystemBuffer + 1) + Index;
+
+    ASSERT(Length <= descriptor->Length);
+
+    descriptor->Offset += Length;
+    descriptor->Length -= Length;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+ULONG
+UserPcmSubmit_Finish
+(
+    _In_ PIRP Irp
+)
+/*++
+
+Routine Description:
+
+  Stores the MICYAUDIO_SUBMIT_RESULT of a submission that has been fully
+  handled in its system buffer, if the caller asked for it.
+
+Return Value:
+
+  Number of output bytes.
+
+--*/
+{
+    PIO_STACK_LOCATION      stack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG_PTR *             context = (ULONG_PTR *)Irp->Tail.Overlay.DriverContext;
+    MICYAUDIO_SUBMIT_RESULT result;
+
+    PAGED_CODE();
+
+    result.BytesAccepted = (ULONG)context[USERPCM_IRP_ACCEPTED];
+    result.BytesDropped  = (ULONG)context[USERPCM_IRP_DROPPED];
+
+    // The input has been consumed, so the shared system buffer can carry the
+    // optional result back.
+    if (stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(MICYAUDIO_SUBMIT_RESULT))
+    {
+        return 0;
+    }
+
+    RtlCopyMemory(Irp->AssociatedIrp.SystemBuffer, &result, sizeof(result));
+    return sizeof(result);
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+VOID
+UserPcmSubmit_Complete
+(
+    _In_ PIRP Irp
+)
+{
+    PAGED_CODE();
+
+    Irp->IoStatus.Information = UserPcmSubmit_Finish(Irp);
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+NTSTATUS
+UserPcmSubmit_Advance
+(
+    _In_ PIRP               Irp,
+    _In_ PUSER_PCM_RING     Ring,
+    _In_ BOOLEAN            Resumed
+)
+/*++
+
+Routine Description:
+
+  Writes the submission's chunks, starting at the next unwritten one, for as
+  long as they are for Ring. The caller holds Ring's producer lock. A WAIT
+  chunk that does not fit pends the request on Ring; any other chunk keeps
+  what fits and drops the rest.
+
+Arguments:
+
+  Irp - submission request.
+
+  Ring - ring of the route the next chunk is for.
+
+  Resumed - Irp was just taken from the head of Ring's wait queue and goes
+            ahead of the other waiters. Otherwise a WAIT chunk queues behind
+            them so a feeder's audio stays in submission order.
+
+Return Value:
+
+  STATUS_SUCCESS - every chunk has been handled.
+
+  STATUS_PENDING - Irp is queued on Ring and must not be touched.
+
+  STATUS_RETRY - the next chunk is for another route, or Ring is no longer
+                 its route's ring.
+
+--*/
+{
+    ULONG_PTR *     context = (ULONG_PTR *)Irp->Tail.Overlay.DriverContext;
+    ULONG           chunkCount = UserPcmSubmit_GetChunkCount(Irp);
+    MICY_CHUNK      chunk;
+    ULONG           index;
+    ULONG           written;
+    ULONG           need;
+    BOOLEAN         wait;
+
+    PAGED_CODE();
+
+    while (context[USERPCM_IRP_NEXT_CHUNK] < chunkCount)
+    {
+        index = (ULONG)context[USERPCM_IRP_NEXT_CHUNK];
+        UserPcmSubmit_GetChunk(Irp, index, &chunk);
+
+        if (Ring->retired ||
+            UserPcmRoute_IndexFromStreamId(chunk.StreamId) != Ring->routeIndex)
+        {
+            return STATUS_RETRY;
+        }
+
+        wait = (chunk.Flags & MICYAUDIO_CHUNK_FLAG_WAIT) ? TRUE : FALSE;
+
+        if (SubmitQ_QueuesBehind(wait, Resumed, UserPcmRing_HasWaiters(Ring)))
+        {
+            (void)IoCsqInsertIrpEx(&Ring->waitQueue, Irp, NULL, NULL);
+            UserPcmRing_WakeWaiters(Ring);
+            return STATUS_PENDING;
+        }
+
+        written = UserPcmRing_WriteLocked(Ring, chunk.Data, chunk.Length);
+        context[USERPCM_IRP_ACCEPTED] += written;
+        DriverStats_Add(Ring->routeIndex, DriverStatBytesSubmitted, written);
+
+        // A mapped ring is fed through the mapping, so nothing waits on it.
+        need = SubmitQ_WakeBytes(chunk.Length,
+                                 written,
+                                 (wait && !Ring->mapped) ? TRUE : FALSE,
+                                 Ring->ring.Capacity,
+                                 Ring->blockAlign);
+        if (need != 0)
+        {
+            UserPcmSubmit_ConsumeChunk(Irp, index, written);
+
+            (void)IoCsqInsertIrpEx(&Ring->waitQueue, Irp, NULL, USERPCM_INSERT_HEAD);
+            InterlockedExchange(&Ring->wakeBytes, (LONG)need);
+            UserPcmRing_WakeWaiters(Ring);
+            return STATUS_PENDING;
+        }
+
+        context[USERPCM_IRP_DROPPED] += chunk.Length - written;
+        DriverStats_Add(Ring->routeIndex, DriverStatBytesDropped, chunk.Length - written);
+        context[USERPCM_IRP_NEXT_CHUNK] = index + 1;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+NTSTATUS
+UserPcmSubmit_Continue
+(
+    _In_ PIRP Irp
+)
+/*++
+
+Routine Description:
+
+  Writes the rest of a submission, taking each chunk's route ring in turn.
+
+Return Value:
+
+  STATUS_SUCCESS when done, STATUS_PENDING if Irp has been queued.
+
+--*/
+{
+    ULONG_PTR *     context = (ULONG_PTR *)Irp->Tail.Overlay.DriverContext;
+    ULONG           chunkCount = UserPcmSubmit_GetChunkCount(Irp);
+    NTSTATUS        ntStatus;
+    MICY_CHUNK      chunk;
+    PUSER_PCM_RING  ring;
+
+    PAGED_CODE();
+
+    while (context[USERPCM_IRP_NEXT_CHUNK] < chunkCount)
+    {
+        UserPcmSubmit_GetChunk(Irp, (ULONG)context[USERPCM_IRP_NEXT_CHUNK], &chunk);
+
+        ring = UserPcmRoute_Lookup(chunk.StreamId);
+        if (ring == NULL)
+        {
+            context[USERPCM_IRP_DROPPED] += chunk.Length;
+            DriverStats_Add(UserPcmRoute_IndexFromStreamId(chunk.StreamId), DriverStatBytesDropped, chunk.Length);
+            context[USERPCM_IRP_NEXT_CHUNK]++;
+            continue;
+        }
+
+        ExAcquireFastMutex(&ring->producerLock);
+        ntStatus = UserPcmSubmit_Advance(Irp, ring, FALSE);
+        ExReleaseFastMutex(&ring->producerLock);
+
+        UserPcmRing_Dereference(ring);
+
+        if (ntStatus == STATUS_PENDING)
+        {
+            return STATUS_PENDING;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+NTSTATUS
+UserPcmSubmit_Dispatch
+(
+    _In_    PIRP        Irp,
+    _Out_   PULONG      BytesTransferred
+)
+/*++
+
+Routine Description:
+
+  Handles IOCTL_MICYAUDIO_SET_AUDIO_DATA and IOCTL_MICYAUDIO_SUBMIT_BATCH.
+  The whole submission is rejected if it is malformed or names an unknown
+  stream.
+
+Arguments:
+
+  Irp - request, METHOD_BUFFERED.
+
+  BytesTransferred - receives the output length when the request is not
+                     pended.
+
+Return Value:
+
+  STATUS_PENDING if Irp has been queued; it is then completed by the ring's
+  wait worker, or cancelled. Otherwise the caller completes Irp.
+
+--*/
+{
+    PIO_STACK_LOCATION  stack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG               ioControlCode = stack->Parameters.DeviceIoControl.IoControlCode;
+    ULONG               inputBufferLength = stack->Parameters.DeviceIoControl.InputBufferLength;
+    PVOID               systemBuffer = Irp->AssociatedIrp.SystemBuffer;
+    NTSTATUS            ntStatus;
+    MICY_CHUNK          chunk;
+    ULONG               chunkCount = 1;
+    PUSER_PCM_RING      ring;
+
+    PAGED_CODE();
+
+    *BytesTransferred = 0;
+
+    // For METHOD_BUFFERED, systemBuffer is valid if either input or output length > 0
+    if (systemBuffer == NULL || inputBufferLength == 0)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (ioControlCode == IOCTL_MICYAUDIO_SET_AUDIO_DATA)
+    {
+        ntStatus = MicyParseSetAudioData(systemBuffer, inputBufferLength, &chunk);
+    }
+    else
+    {
+        ntStatus = MicyParseBatch(systemBuffer, inputBufferLength, &chunkCount);
+    }
+    if (!NT_SUCCESS(ntStatus))
+    {
+        return ntStatus;
+    }
+
+    for (ULONG i = 0; i < chunkCount; i++)
+    {
+        UserPcmSubmit_GetChunk(Irp, i, &chunk);
+
+        if (!UserPcmRoute_IsValidStreamId(chunk.StreamId))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    // A process that mapped the ring is its only producer.
+    if (ioControlCode == IOCTL_MICYAUDIO_SET_AUDIO_DATA)
+    {
+        ring = UserPcmRoute_Lookup(chunk.StreamId);
+        if (ring != NULL)
+        {
+            ntStatus = UserPcmRing_IsMapped(ring) ? STATUS_DEVICE_BUSY : STATUS_SUCCESS;
+            UserPcmRing_Dereference(ring);
+            if (!NT_SUCCESS(ntStatus))
+            {
+                return ntStatus;
+            }
+        }
+    }
+
+    Irp->Tail.Overlay.DriverContext[USERPCM_IRP_NEXT_CHUNK] = NULL;
+    Irp->Tail.Overlay.DriverContext[USERPCM_IRP_ACCEPTED]   = NULL;
+    Irp->Tail.Overlay.DriverContext[USERPCM_IRP_DROPPED]    = NULL;
+
+    if (UserPcmSubmit_Continue(Irp) == STATUS_PENDING)
+    {
+        return STATUS_PENDING;
+    }
+
+    *BytesTransferred = UserPcmSubmit_Finish(Irp);
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+VOID
+UserPcmRing_WaitWorker
+(
+    _In_     PVOID          IoObject,
+    _In_opt_ PVOID          Context,
+    _In_     PIO_WORKITEM   IoWorkItem
+)
+/*++
+
+Routine Description:
+
+  Queued by the consumer once the head waiter fits. Serves the wait queue
+  from the head until a request no longer fits, then completes the requests
+  that are done and moves those with chunks for other routes on.
+
+--*/
+{
+    PUSER_PCM_RING  ring = (PUSER_PCM_RING)Context;
+    LIST_ENTRY      ready;
+    PIRP            irp;
+    NTSTATUS        ntStatus;
+
+    UNREFERENCED_PARAMETER(IoObject);
+    UNREFERENCED_PARAMETER(IoWorkItem);
+
+    PAGED_CODE();
+
+    InterlockedExchange(&ring->waitWorkQueued, 0);
+    InitializeListHead(&ready);
+
+    ExAcquireFastMutex(&ring->producerLock);
+
+    for (;;)
+    {
+        irp = IoCsqRemoveNextIrp(&ring->waitQueue, NULL);
+        if (irp == NULL)
+        {
+            InterlockedExchange(&ring->wakeBytes, 0);
+            break;
+        }
+
+        ntStatus = UserPcmSubmit_Advance(irp, ring, TRUE);
+        if (ntStatus == STATUS_PENDING)
+        {
+            break;
+        }
+
+        irp->IoStatus.Status = ntStatus;
+        InsertTailList(&ready, &irp->Tail.Overlay.ListEntry);
+    }
+
+    ExReleaseFastMutex(&ring->producerLock);
+
+    while (!IsListEmpty(&ready))
+    {
+        irp = CONTAINING_RECORD(RemoveHeadList(&ready), IRP, Tail.Overlay.ListEntry);
+
+        if (irp->IoStatus.Status == STATUS_RETRY &&
+            UserPcmSubmit_Continue(irp) == STATUS_PENDING)
+        {
+            continue;
+        }
+
+        UserPcmSubmit_Complete(irp);
+    }
+
+    UserPcmRing_Dereference(ring);
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+static
+VOID
+UserPcmRing_RequeueWaiters
+(
+    _In_ PUSER_PCM_RING Ring
+)
+/*++
+
+Routine Description:
+
+  Moves the requests pended on a ring that has just been retired to the
+  route's new ring, oldest first.
+
+--*/
+{
+    LIST_ENTRY  moved;
+    PIRP        irp;
+
+    PAGED_CODE();
+
+    ASSERT(Ring->retired);
+
+    InitializeListHead(&moved);
+
+    while ((irp = IoCsqRemoveNextIrp(&Ring->waitQueue, NULL)) != NULL)
+    {
+        InsertTailList(&moved, &irp->Tail.Overlay.ListEntry);
+    }
+    InterlockedExchange(&Ring->wakeBytes, 0);
+
+    while (!IsListEmpty(&moved))
+    {
+        irp = CONTAINING_RECORD(RemoveHeadList(&moved), IRP, Tail.Overlay.ListEntry);
+
+        if (UserPcmSubmit_Continue(irp) != STATUS_PENDING)
+        {
+            UserPcmSubmit_Complete(irp);
+        }
+    }
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+VOID
+UserPcmSubmit_CancelFile
+(
+    _In_ PFILE_OBJECT FileObject
+)
+/*++
+
+Routine Description:
+
+  Cancels the requests FileObject still has pended, on IRP_MJ_CLEANUP.
+
+--*/
+{
+    PUSER_PCM_RING  ring;
+    PIRP            irp;
+
+    PAGED_CODE();
+
+    for (ULONG i = 0; i < g_UserPcmRoutes.count; i++)
+    {
+        ring = UserPcmRoute_ReferenceRing(i);
+        if (ring == NULL)
+        {
+            continue;
+        }
+
+        while ((irp = IoCsqRemoveNextIrp(&ring->waitQueue, FileObject)) != NULL)
+        {
+            irp->IoStatus.Status = STATUS_CANCELLED;
+            irp->IoStatus.Information = 0;
+            IoCompleteRequest(irp, IO_NO_INCREMENT);
+        }
+
+        UserPcmRing_Dereference(ring);
+    }
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+NTSTATUS
+UserPcmRoute_SetWatermarks
+(
+    _In_    PFILE_OBJECT                    FileObject,
+    _In_    const MICYAUDIO_WATERMARKS *    Watermarks
+)
+/*++
+
+Routine Description:
+
+  IOCTL_MICYAUDIO_SET_WATERMARKS. Applies the watermarks to the route's
+  current ring; they follow the route when a stream resizes it.
+
+--*/
+{
+    NTSTATUS        ntStatus;
+    PUSER_PCM_RING  ring;
+
+    PAGED_CODE();
+
+    for (;;)
+    {
+        ring = UserPcmRoute_Lookup(Watermarks->StreamId);
+        if (ring == NULL)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        ExAcquireFastMutex(&ring->producerLock);
+        ntStatus = ring->retired ? STATUS_RETRY
+                                 : UserPcmRing_SetWatermarks(ring, FileObject, Watermarks);
+        ExReleaseFastMutex(&ring->producerLock);
+
+        UserPcmRing_Dereference(ring);
+
+        if (ntStatus != STATUS_RETRY)
+        {
+            return ntStatus;
+        }
+    }
+}
+
+//=============================================================================
+#pragma code_seg("PAGE")
+VOID
+UserPcmRoutes_ReleaseWatermarks
+(
+    _In_ PFILE_OBJECT FileObject
+)
+/*++
+
+Routine Description:
+
+  Removes the watermarks FileObject registered, on IRP_MJ_CLEANUP.
+
+--*/
+{
+    PUSER_PCM_RING ring;
+
+    PAGED_CODE();
+
+    for (ULONG i = 0; i < g_UserPcmRoutes.count; i++)
+    {
+        ring = UserPcmRoute_ReferenceRing(i);
+        if (ring == NULL)
+        {
+            continue;
+        }
+
+        ExAcquireFastMutex(&ring->producerLock);
+        if (ring->watermarkFile == FileObject)
+        {
+            UserPcmRing_DropWatermarks(ring);
+        }
+        ExReleaseFastMutex(&ring->producerLock);
+
+        UserPcmRing_Dereference(ring);
+    }
+}
+#pragma code_seg()
@@ -0,0 +1,256 @@
+/*++
+
+Module Name:
+
+    userpcm.h
+
+Abstract:
+
+    User PCM feed for the capture path. Feeders submit PCM through the
+    control device (or write it directly into a mapped ring) and every capture
+    stream of the endpoint reads all of it from its DPC.
+--*/
+
+#ifndef _MICYAUDIO_USERPCM_H_
+#define _MICYAUDIO_USERPCM_H_
+
+#include "micyioctl.h"
+#include "pcmconceal.h"
+#include "pcmconvert.h"
+#include "pcmgain.h"
+#include "pcmmeter.h"
+#include "resampler.h"
+#include "userdma.h"
+
+//
+// Defaults for the UserPcmCapacityMs and UserPcmTargetMs registry values.
+// Until a stream sizes a ring from its own format, rings are sized for
+// 48 kHz, 32-bit stereo.
+//
+#define USERPCM_DEFAULT_CAPACITY_MS     80
+#define USERPCM_DEFAULT_TARGET_MS       0
+#define USERPCM_DEFAULT_BYTES_PER_SEC   (48000 * 2 * 4)
+#define USERPCM_DEFAULT_BLOCK_ALIGN     (2 * 4)
+
+typedef struct _USER_PCM_RING USER_PCM_RING, *PUSER_PCM_RING;
+
+//-----------------------------------------------------------------------------
+// Rings. Reference counted; a ring is held by its route, by the capture
+// streams reading it and by a file object that has it mapped.
+//-----------------------------------------------------------------------------
+
+NTSTATUS UserPcmRing_Create
+(
+    _In_    ULONG               CapacityBytes,
+    _In_    ULONG               BlockAlign,
+    _Out_   PUSER_PCM_RING *    Ring
+);
+
+VOID UserPcmRing_Reference(_In_ PUSER_PCM_RING Ring);
+
+VOID UserPcmRing_Dereference(_In_ PUSER_PCM_RING Ring);
+
+//
+// Producer side. Serialized against other kernel producers and against the
+// ring being handed to a user-mode producer. Only whole blocks are accepted.
+// IRQL <= APC_LEVEL.
+//
+ULONG UserPcmRing_Write
+(
+    _In_                        PUSER_PCM_RING  Ring,
+    _In_reads_bytes_(Length)    const UCHAR *   Source,
+    _In_                        ULONG           Length
+);
+
+//
+// Consumer side. Each capture stream reads through the reader it got from
+// UserPcmRoute_AttachStream and sees every byte the feeder writes. Called
+// from the capture DPC, lock-free.
+//
+ULONG UserPcmRing_Read
+(
+    _In_                        PUSER_PCM_RING  Ring,
+    _In_                        ULONG           Reader,
+    _Out_writes_bytes_(Length)  UCHAR *         Destination,
+    _In_                        ULONG           Length
+);
+
+ULONG UserPcmRing_Count(_In_ PUSER_PCM_RING Ring, _In_ ULONG Reader);
+
+//
+// A reader holds the producer back from RUN until it stops. Starting skips
+// whatever is queued. IRQL <= DISPATCH_LEVEL.
+//
+VOID UserPcmRing_StartReader(_In_ PUSER_PCM_RING Ring, _In_ ULONG Reader);
+
+VOID UserPcmRing_StopReader(_In_ PUSER_PCM_RING Ring, _In_ ULONG Reader);
+
+//
+// Gives the reader back when its stream lets go of the ring. PASSIVE_LEVEL.
+//
+VOID UserPcmRing_RemoveReader(_In_ PUSER_PCM_RING Ring, _In_ ULONG Reader);
+
+//
+// Consumer side. Drops the reader's oldest audio back down to TargetBytes
+// once more than twice TargetBytes is queued. Returns the bytes dropped.
+//
+ULONG UserPcmRing_TrimToTarget(_In_ PUSER_PCM_RING Ring, _In_ ULONG Reader, _In_ ULONG TargetBytes);
+
+//
+// Consumer side. Drops up to Length bytes, whole blocks, of the reader's
+// oldest audio. Returns the bytes dropped.
+//
+ULONG UserPcmRing_Skip(_In_ PUSER_PCM_RING Ring, _In_ ULONG Reader, _In_ ULONG Length);
+
+BOOLEAN UserPcmRing_IsMapped(_In_ PUSER_PCM_RING Ring);
+
+//
+// Shared-memory producer. The ring pages are mapped into the current process
+// and FileObject becomes the ring's only producer until it unmaps or its
+// handle is cleaned up. A handle maps at most one ring at a time.
+// PASSIVE_LEVEL, in the caller's process context.
+//
+NTSTATUS UserPcmRing_MapToProcess
+(
+    _In_    PUSER_PCM_RING              Ring,
+    _In_    PFILE_OBJECT                FileObject,
+    _Out_   PMICYAUDIO_RING_MAPPING     Mapping
+);
+
+NTSTATUS UserPcmRing_UnmapFile
+(
+    _In_    PFILE_OBJECT                FileObject
+);
+
+//-----------------------------------------------------------------------------
+// Routes. One per capture endpoint, indexed by the endpoint's position in
+// g_CaptureEndpoints. Feeders address a route by StreamId: 0 and 1 both
+// select the first endpoint, N selects endpoint N - 1.
+//-----------------------------------------------------------------------------
+
+NTSTATUS UserPcmRoutes_Init
+(
+    _In_    PDRIVER_OBJECT      DriverObject,
+    _In_    ULONG               RouteCount,
+    _In_    ULONG               CapacityMs,
+    _In_    ULONG               TargetMs
+);
+
+VOID UserPcmRoutes_Term();
+
+BOOLEAN UserPcmRoute_IsValidStreamId(_In_ ULONG StreamId);
+
+//
+// Returns a referenced ring, or NULL if StreamId does not name a route.
+//
+PUSER_PCM_RING UserPcmRoute_Lookup(_In_ ULONG StreamId);
+
+//
+// The DMA buffer of the endpoint's direct mode capture stream, see
+// MICYAUDIO_CONFIG_FLAG_DIRECT. At most one per endpoint: publishing fails
+// with STATUS_DEVICE_BUSY while another is published. The lookup returns a
+// referenced buffer, or NULL if there is none.
+//
+NTSTATUS UserPcmRoute_PublishDirect(_In_ ULONG EndpointIndex, _In_ PUSER_DMA_BUFFER Buffer);
+
+VOID UserPcmRoute_WithdrawDirect(_In_ PUSER_DMA_BUFFER Buffer);
+
+PUSER_DMA_BUFFER UserPcmRoute_LookupDirect(_In_ ULONG StreamId);
+
+//
+// Watermark events, see IOCTL_MICYAUDIO_SET_WATERMARKS. Registered in the
+// caller's process context; released when the registering handle is closed.
+//
+NTSTATUS UserPcmRoute_SetWatermarks
+(
+    _In_    PFILE_OBJECT                    FileObject,
+    _In_    const MICYAUDIO_WATERMARKS *    Watermarks
+);
+
+VOID UserPcmRoutes_ReleaseWatermarks(_In_ PFILE_OBJECT FileObject);
+
+NTSTATUS UserPcmRoute_SetConfig(_In_ const MICYAUDIO_STREAM_CONFIG * Config);
+
+NTSTATUS UserPcmRoute_GetConfig(_Inout_ PMICYAUDIO_STREAM_CONFIG Config);
+
+NTSTATUS UserPcmRoute_SetInputFormat(_In_ const MICYAUDIO_INPUT_FORMAT * Format);
+
+NTSTATUS UserPcmRoute_GetInputFormat(_Inout_ PMICYAUDIO_INPUT_FORMAT Format);
+
+//
+// Levels measured by the endpoint's capture stream, published from its DPC
+// path at any IRQL <= DISPATCH_LEVEL. Peaks are held until
+// UserPcmRoute_GetLevels reads them.
+//
+VOID
+UserPcmRoute_PublishLevels
+(
+    _In_ ULONG          EndpointIndex,
+    _In_ ULONG          Channels,
+    _In_reads_(Channels) const ULONG * Peak,
+    _In_reads_(Channels) const ULONG * Rms
+);
+
+NTSTATUS UserPcmRoute_GetLevels(_Inout_ PMICYAUDIO_LEVELS Levels);
+
+//
+// Counters of the endpoint Stats->StreamId names, see driverstats.h.
+// PASSIVE_LEVEL.
+//
+NTSTATUS UserPcmRoute_GetStats(_Inout_ PMICYAUDIO_STATS Stats);
+
+//
+// What a capture stream needs to know about the audio in its ring.
+//
+typedef struct _USER_PCM_INPUT
+{
+    PCM_SAMPLE_FORMAT   SampleFormat;
+    ULONG               SamplesPerSec;
+    ULONG               BlockAlign;
+    RESAMPLER_QUALITY   Quality;
+    ULONG               TargetBytes;    // latency the ring is trimmed to, 0 = off
+    ULONG               CapacityBytes;  // audio the route asks the ring to hold
+    ULONG               Flags;          // MICYAUDIO_CONFIG_FLAG_*
+} USER_PCM_INPUT, *PUSER_PCM_INPUT;
+
+//
+// Called by a capture stream at Init and whenever it leaves KSSTATE_STOP,
+// after removing the reader it had. Returns a referenced ring for the
+// endpoint and a reader of it, replacing the route's ring with one sized
+// from the route's capacity for the feeder's format unless a feeder
+// currently has it mapped or other streams are reading it, and describes
+// what the ring holds. Streams sharing a ring share its format and rate.
+// StreamFormat is PcmSampleFormatInvalid if the stream format cannot be
+// converted, in which case the ring always holds the stream format. The
+// rate is only converted when a resampler supports the pair of rates.
+//
+NTSTATUS UserPcmRoute_AttachStream
+(
+    _In_    ULONG               EndpointIndex,
+    _In_    ULONG               SamplesPerSec,
+    _In_    ULONG               Channels,
+    _In_    ULONG               BlockAlign,
+    _In_    PCM_SAMPLE_FORMAT   StreamFormat,
+    _Out_   PUSER_PCM_RING *    Ring,
+    _Out_   PULONG              Reader,
+    _Out_   PUSER_PCM_INPUT     Input
+);
+
+//-----------------------------------------------------------------------------
+// Control device submissions (IOCTL_MICYAUDIO_SET_AUDIO_DATA and
+// IOCTL_MICYAUDIO_SUBMIT_BATCH). PASSIVE_LEVEL.
+//-----------------------------------------------------------------------------
+
+//
+// Returns STATUS_PENDING if the request has been queued until its WAIT
+// chunks fit; otherwise the caller completes it with BytesTransferred.
+//
+NTSTATUS UserPcmSubmit_Dispatch
+(
+    _In_    PIRP                Irp,
+    _Out_   PULONG              BytesTransferred
+);
+
+VOID UserPcmSubmit_CancelFile(_In_ PFILE_OBJECT FileObject);
+
+#endif // _MICYAUDIO_USERPCM_H_
@@ -193,6 +193,7 @@ Return Value:
 BOOL
 CSimpleAudioSampleHW::GetMixerMute
 (
+    _In_  ULONG                   ulEndpoint,
     _In_  ULONG                   ulNode,
     _In_  ULONG                   ulChannel
 )
@@ -204,6 +205,8 @@ Routine Description:
 
 Arguments:
 
+  ulEndpoint - endpoint whose topology the node belongs to
+
   ulNode - topology node id
   
   ulChannel - which channel are we reading?
@@ -216,9 +219,9 @@ Return Value:
 {
     UNREFERENCED_PARAMETER(ulChannel);
     
-    if (ulNode < MAX_TOPOLOGY_NODES)
+    if (ulEndpoint < MAX_MIXER_ENDPOINTS && ulNode < MAX_TOPOLOGY_NODES)
     {
-        return m_MuteControls[ulNode];
+        return m_Mixer[ulEndpoint].MuteControls[ulNode];
     }
 
     return 0;
@@ -248,6 +251,7 @@ Return Value:
 LONG
 CSimpleAudioSampleHW::GetMixerVolume
 (   
+    _In_  ULONG                   ulEndpoint,
     _In_  ULONG                   ulNode,
     _In_  ULONG                   ulChannel
 )
@@ -259,6 +263,8 @@ Routine Description:
 
 Arguments:
 
+  ulEndpoint - endpoint whose topology the node belongs to
+
   ulNode - topology node id
 
   ulChannel - which channel are we reading?
@@ -271,9 +277,9 @@ Return Value:
 {
     UNREFERENCED_PARAMETER(ulChannel);
 
-    if (ulNode < MAX_TOPOLOGY_NODES)
+    if (ulEndpoint < MAX_MIXER_ENDPOINTS && ulNode < MAX_TOPOLOGY_NODES)
     {
-        return m_VolumeControls[ulNode];
+        return m_Mixer[ulEndpoint].VolumeControls[ulNode];
     }
 
     return 0;
@@ -283,6 +289,7 @@ Return Value:
 LONG
 CSimpleAudioSampleHW::GetMixerPeakMeter
 (   
+    _In_  ULONG                   ulEndpoint,
     _In_  ULONG                   ulNode,
     _In_  ULONG                   ulChannel
 )
@@ -290,10 +297,14 @@ CSimpleAudioSampleHW::GetMixerPeakMeter
 
 Routine Description:
 
-  Gets the HW (!) peak meter for Simple Audio Sample.
+  Gets the HW (!) peak meter for Simple Audio Sample: the highest level
+  the capture streams have reported since the last read. Reading clears the
+  register, like a hardware peak hold.
 
 Arguments:
 
+  ulEndpoint - endpoint whose topology the node belongs to
+
   ulNode - topology node id
 
   ulChannel - which channel are we reading?
@@ -304,15 +315,67 @@ Return Value:
 
 --*/
 {
-    UNREFERENCED_PARAMETER(ulChannel);
-
-    if (ulNode < MAX_TOPOLOGY_NODES)
+    if (ulEndpoint < MAX_MIXER_ENDPOINTS && ulNode < MAX_TOPOLOGY_NODES && ulChannel < MAX_PEAKMETER_CHANNELS)
     {
-        return m_PeakMeterControls[ulNode];
+        return InterlockedExchange(&m_Mixer[ulEndpoint].PeakMeterControls[ulNode][ulChannel], 0);
     }
 
     return 0;
-} // GetMixerVolume
+} // GetMixerPeakMeter
+
+//=============================================================================
+void
+CSimpleAudioSampleHW::SetMixerPeakMeter
+(   
+    _In_  ULONG                   ulEndpoint,
+    _In_  ULONG                   ulNode,
+    _In_  ULONG                   ulChannel,
+    _In_  LONG                    lPeak
+)
+/*++
+
+Routine Description:
+
+  Raises the HW (!) peak meter to lPeak if it is lower. Called from the
+  capture DPC, so it takes no lock.
+
+Arguments:
+
+  ulEndpoint - endpoint whose topology the node belongs to
+
+  ulNode - topology node id
+
+  ulChannel - which channel are we setting?
+
+  lPeak - peak level of the audio just captured
+
+Return Value:
+
+    void
+
+--*/
+{
+    LONG volatile * plRegister;
+    LONG            lCurrent;
+
+    if (ulEndpoint >= MAX_MIXER_ENDPOINTS || ulNode >= MAX_TOPOLOGY_NODES || ulChannel >= MAX_PEAKMETER_CHANNELS)
+    {
+        return;
+    }
+
+    plRegister = &m_Mixer[ulEndpoint].PeakMeterControls[ulNode][ulChannel];
+    lCurrent = ReadNoFence(plRegister);
+
+    while (lPeak > lCurrent)
+    {
+        LONG lPrevious = InterlockedCompareExchange(plRegister, lPeak, lCurrent);
+        if (lPrevious == lCurrent)
+        {
+            break;
+        }
+        lCurrent = lPrevious;
+    }
+} // SetMixerPeakMeter
 
 //=============================================================================
 #pragma code_seg("PAGE")
@@ -322,7 +385,7 @@ CSimpleAudioSampleHW::MixerReset()
 
 Routine Description:
 
-  Resets the mixer registers.
+  Resets the mixer registers of every endpoint.
 
 Arguments:
 
@@ -334,13 +397,15 @@ Return Value:
 {
     PAGED_CODE();
     
-    RtlFillMemory(m_VolumeControls, sizeof(LONG) * MAX_TOPOLOGY_NODES, 0xFF);
-    // Endpoints are not muted by default.
-    RtlZeroMemory(m_MuteControls, sizeof(BOOL) * MAX_TOPOLOGY_NODES);
-
-    for (ULONG i=0; i<MAX_TOPOLOGY_NODES; ++i)
+    for (ULONG i = 0; i < MAX_MIXER_ENDPOINTS; i++)
     {
-        m_PeakMeterControls[i] = PEAKMETER_SIGNED_MAXIMUM/2;
+        PMIXER_REGISTERS pMixer = &m_Mixer[i];
+
+        RtlFillMemory(pMixer->VolumeControls, sizeof(LONG) * MAX_TOPOLOGY_NODES, 0xFF);
+        // Endpoints are not muted by default.
+        RtlZeroMemory(pMixer->MuteControls, sizeof(BOOL) * MAX_TOPOLOGY_NODES);
+
+        RtlZeroMemory((PVOID)pMixer->PeakMeterControls, sizeof(pMixer->PeakMeterControls));
     }
     
     // BUGBUG change this depending on the topology
@@ -352,6 +417,7 @@ Return Value:
 void
 CSimpleAudioSampleHW::SetMixerMute
 (
+    _In_  ULONG                   ulEndpoint,
     _In_  ULONG                   ulNode,
     _In_  ULONG                   ulChannel,
     _In_  BOOL                    fMute
@@ -364,6 +430,8 @@ Routine Description:
 
 Arguments:
 
+  ulEndpoint - endpoint whose topology the node belongs to
+
   ulNode - topology node id
 
   ulChannel - which channel are we setting?
@@ -378,9 +446,9 @@ Return Value:
 {
     UNREFERENCED_PARAMETER(ulChannel);
 
-    if (ulNode < MAX_TOPOLOGY_NODES)
+    if (ulEndpoint < MAX_MIXER_ENDPOINTS && ulNode < MAX_TOPOLOGY_NODES)
     {
-        m_MuteControls[ulNode] = fMute;
+        m_Mixer[ulEndpoint].MuteControls[ulNode] = fMute;
     }
 } // SetMixerMute
 
@@ -413,6 +481,7 @@ Return Value:
 void  
 CSimpleAudioSampleHW::SetMixerVolume
 (   
+    _In_  ULONG                   ulEndpoint,
     _In_  ULONG                   ulNode,
     _In_  ULONG                   ulChannel,
     _In_  LONG                    lVolume
@@ -425,6 +494,8 @@ Routine Description:
 
 Arguments:
 
+  ulEndpoint - endpoint whose topology the node belongs to
+
   ulNode - topology node id
 
   ulChannel - which channel are we setting?
@@ -439,8 +510,8 @@ Return Value:
 {
     UNREFERENCED_PARAMETER(ulChannel);
 
-    if (ulNode < MAX_TOPOLOGY_NODES)
+    if (ulEndpoint < MAX_MIXER_ENDPOINTS && ulNode < MAX_TOPOLOGY_NODES)
     {
-        m_VolumeControls[ulNode] = lVolume;
+        m_Mixer[ulEndpoint].VolumeControls[ulNode] = lVolume;
     }
 } // SetMixerVolume
@@ -16,27 +16,47 @@ Abstract:
 #ifndef _SIMPLEAUDIOSAMPLE_HW_H_
 #define _SIMPLEAUDIOSAMPLE_HW_H_
 
+#include "micyioctl.h"
+
 //=============================================================================
 // Defines
 //=============================================================================
 // BUGBUG we should dynamically allocate this...
 #define MAX_TOPOLOGY_NODES      20
 
+// Channels a peak meter node keeps a level for.
+#define MAX_PEAKMETER_CHANNELS  8
+
+// Endpoints with a topology of their own.
+#define MAX_MIXER_ENDPOINTS     MICYAUDIO_MAX_ENDPOINTS
+
+//
+// Mixer registers of one endpoint's topology. The capture streams of
+// different endpoints update their peak meters from DPCs on different
+// processors, so every endpoint gets cache lines of its own.
+//
+typedef struct DECLSPEC_CACHEALIGN _MIXER_REGISTERS
+{
+    BOOL                        MuteControls[MAX_TOPOLOGY_NODES];
+    LONG                        VolumeControls[MAX_TOPOLOGY_NODES];
+    // Peak since the last read, fed by the capture streams. Lock-free: a
+    // stream raises a level with compare-exchange, a read swaps in 0.
+    LONG volatile               PeakMeterControls[MAX_TOPOLOGY_NODES][MAX_PEAKMETER_CHANNELS];
+} MIXER_REGISTERS, *PMIXER_REGISTERS;
+
 //=============================================================================
 // Classes
 //=============================================================================
 ///////////////////////////////////////////////////////////////////////////////
 // CSimpleAudioSampleHW
 // This class represents virtual Simple Audio Sample HW. An array representing volume
-// registers and mute registers.
+// registers and mute registers, one set per endpoint.
 
 class CSimpleAudioSampleHW
 {
 public:
 protected:
-    BOOL                        m_MuteControls[MAX_TOPOLOGY_NODES];
-    LONG                        m_VolumeControls[MAX_TOPOLOGY_NODES];
-    LONG                        m_PeakMeterControls[MAX_TOPOLOGY_NODES];
+    MIXER_REGISTERS             m_Mixer[MAX_MIXER_ENDPOINTS];
     ULONG                       m_ulMux;            // Mux selection
     BOOL                        m_bDevSpecific;
     INT                         m_iDevSpecific;
@@ -65,11 +85,13 @@ public:
     );
     BOOL                        GetMixerMute
     (
+        _In_  ULONG               ulEndpoint,
         _In_  ULONG               ulNode,
         _In_  ULONG               ulChannel
     );
     void                        SetMixerMute
     (
+        _In_  ULONG               ulEndpoint,
         _In_  ULONG               ulNode,
         _In_  ULONG               ulChannel,
         _In_  BOOL                fMute
@@ -81,11 +103,13 @@ public:
     );
     LONG                        GetMixerVolume
     (   
+        _In_  ULONG               ulEndpoint,
         _In_  ULONG               ulNode,
         _In_  ULONG               ulChannel
     );
     void                        SetMixerVolume
     (   
+        _In_  ULONG               ulEndpoint,
         _In_  ULONG               ulNode,
         _In_  ULONG               ulChannel,
         _In_  LONG                lVolume
@@ -93,9 +117,17 @@ public:
     
     LONG                        GetMixerPeakMeter
     (   
+        _In_  ULONG               ulEndpoint,
         _In_  ULONG               ulNode,
         _In_  ULONG               ulChannel
     );
+    void                        SetMixerPeakMeter
+    (   
+        _In_  ULONG               ulEndpoint,
+        _In_  ULONG               ulNode,
+        _In_  ULONG               ulChannel,
+        _In_  LONG                lPeak
+    );
 
 protected:
 private:
@@ -0,0 +1,177 @@
+/*++
+
+Module Name:
+
+    ioparse.cpp
+
+Abstract:
+
+    Validation of control device submissions. Every length and offset comes
+    from user mode, so all range checks are written as subtractions from a
+    length already known to be in range; nothing here can overflow.
+--*/
+#include "definitions.h"
+#include "ioparse.h"
+
+//=============================================================================
+#pragma code_seg()
+NTSTATUS
+MicyParseSetAudioData
+(
+    _In_reads_bytes_(BufferLength)  const VOID *    Buffer,
+    _In_                            ULONG           BufferLength,
+    _Out_                           PMICY_CHUNK     Chunk
+)
+/*++
+
+Routine Description:
+
+  Validates an IOCTL_MICYAUDIO_SET_AUDIO_DATA input buffer. DataSize may be
+  smaller than what follows the header; trailing bytes are ignored.
+
+Arguments:
+
+  Buffer - system buffer of the request.
+
+  BufferLength - input length of the request.
+
+  Chunk - receives the PCM described by the header.
+
+Return Value:
+
+  STATUS_INVALID_PARAMETER if the header is truncated, DataSize is zero or
+  larger than the bytes actually supplied.
+
+--*/
+{
+    const MICYAUDIO_SET_AUDIO_DATA * header = (const MICYAUDIO_SET_AUDIO_DATA *)Buffer;
+
+    RtlZeroMemory(Chunk, sizeof(*Chunk));
+
+    if (Buffer == NULL || BufferLength < MICYAUDIO_SET_AUDIO_DATA_HEADER_SIZE)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (header->DataSize == 0 ||
+        header->DataSize > BufferLength - MICYAUDIO_SET_AUDIO_DATA_HEADER_SIZE)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Chunk->StreamId = header->StreamId;
+    Chunk->Flags    = 0;
+    Chunk->Data     = header->AudioData;
+    Chunk->Length   = header->DataSize;
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg()
+NTSTATUS
+MicyParseBatch
+(
+    _In_reads_bytes_(BufferLength)  const VOID *    Buffer,
+    _In_                            ULONG           BufferLength,
+    _Out_                           PULONG          ChunkCount
+)
+/*++
+
+Routine Description:
+
+  Validates an IOCTL_MICYAUDIO_SUBMIT_BATCH input buffer: the header, the
+  descriptor array and that every descriptor lies within the payload. Only
+  after this succeeds may MicyGetBatchChunk be used on the buffer.
+
+Arguments:
+
+  Buffer - system buffer of the request.
+
+  BufferLength - input length of the request.
+
+  ChunkCount - receives the number of descriptors.
+
+Return Value:
+
+  STATUS_INVALID_PARAMETER on any malformed header or descriptor.
+
+--*/
+{
+    const MICYAUDIO_BATCH_HEADER *      header = (const MICYAUDIO_BATCH_HEADER *)Buffer;
+    const MICYAUDIO_CHUNK_DESCRIPTOR *  descriptors;
+    ULONG                               payloadLength;
+
+    *ChunkCount = 0;
+
+    if (Buffer == NULL || BufferLength < sizeof(MICYAUDIO_BATCH_HEADER))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (header->Reserved != 0 ||
+        header->ChunkCount == 0 ||
+        header->ChunkCount > MICYAUDIO_MAX_BATCH_CHUNKS)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // ChunkCount is bounded above, so the product cannot overflow.
+    if (header->ChunkCount * sizeof(MICYAUDIO_CHUNK_DESCRIPTOR) >
+        BufferLength - sizeof(MICYAUDIO_BATCH_HEADER))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    descriptors   = (const MICYAUDIO_CHUNK_DESCRIPTOR *)(header + 1);
+    payloadLength = BufferLength -
+                    sizeof(MICYAUDIO_BATCH_HEADER) -
+                    header->ChunkCount * sizeof(MICYAUDIO_CHUNK_DESCRIPTOR);
+
+    for (ULONG i = 0; i < header->ChunkCount; i++)
+    {
+        const MICYAUDIO_CHUNK_DESCRIPTOR * descriptor = &descriptors[i];
+
+        if ((descriptor->Flags & ~MICYAUDIO_CHUNK_FLAGS_VALID) != 0 ||
+            descriptor->Length == 0 ||
+            descriptor->Offset > payloadLength ||
+            descriptor->Length > payloadLength - descriptor->Offset)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    *ChunkCount = header->ChunkCount;
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+MicyGetBatchChunk
+(
+    _In_                            const VOID *    Buffer,
+    _In_                            ULONG           Index,
+    _Out_                           PMICY_CHUNK     Chunk
+)
+/*++
+
+Routine Description:
+
+  Returns chunk Index of a batch already accepted by MicyParseBatch.
+
+--*/
+{
+    const MICYAUDIO_BATCH_HEADER *      header = (const MICYAUDIO_BATCH_HEADER *)Buffer;
+    const MICYAUDIO_CHUNK_DESCRIPTOR *  descriptors = (const MICYAUDIO_CHUNK_DESCRIPTOR *)(header + 1);
+    const UCHAR *                       payload = (const UCHAR *)(descriptors + header->ChunkCount);
+
+    ASSERT(Index < header->ChunkCount);
+
+    Chunk->StreamId = descriptors[Index].StreamId;
+    Chunk->Flags    = descriptors[Index].Flags;
+    Chunk->Data     = payload + descriptors[Index].Offset;
+    Chunk->Length   = descriptors[Index].Length;
+}
+#pragma code_seg()
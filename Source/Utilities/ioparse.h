@@ -0,0 +1,54 @@
+/*++
+
+Module Name:
+
+    ioparse.h
+
+Abstract:
+
+    Validation of control device submissions (micyioctl.h). The functions
+    here only look at the buffer they are given, have no side effects and
+    can run at any IRQL.
+--*/
+
+#ifndef _MICYAUDIO_IOPARSE_H_
+#define _MICYAUDIO_IOPARSE_H_
+
+#include "micyioctl.h"
+
+//
+// One validated chunk of PCM, pointing into the submitted buffer.
+//
+typedef struct _MICY_CHUNK
+{
+    ULONG           StreamId;
+    ULONG           Flags;
+    const UCHAR *   Data;
+    ULONG           Length;
+} MICY_CHUNK, *PMICY_CHUNK;
+
+NTSTATUS
+MicyParseSetAudioData
+(
+    _In_reads_bytes_(BufferLength)  const VOID *    Buffer,
+    _In_                            ULONG           BufferLength,
+    _Out_                           PMICY_CHUNK     Chunk
+);
+
+NTSTATUS
+MicyParseBatch
+(
+    _In_reads_bytes_(BufferLength)  const VOID *    Buffer,
+    _In_                            ULONG           BufferLength,
+    _Out_                           PULONG          ChunkCount
+);
+
+VOID
+MicyGetBatchChunk
+(
+    _In_                            const VOID *    Buffer,
+    _In_                            ULONG           Index,
+    _Out_                           PMICY_CHUNK     Chunk
+);
+
+#endif // _MICYAUDIO_IOPARSE_H_
@@ -663,6 +663,7 @@ NTSTATUS
 PropertyHandler_Volume
 (
     _In_  PADAPTERCOMMON        AdapterCommon,
+    _In_  ULONG                 Endpoint,
     _In_  PPCPROPERTY_REQUEST   PropertyRequest,
     _In_  ULONG                 MaxChannels
 )
@@ -676,6 +677,8 @@ Arguments:
 
   AdapterCommon - interface to the common adapter object.
   
+  Endpoint - endpoint whose topology the node belongs to.
+
   PropertyRequest - property request structure.
 
   MaxChannels - # of supported channels.
@@ -724,6 +727,7 @@ Return Value:
                 *plVolume = 
                     AdapterCommon->MixerVolumeRead
                     (
+                        Endpoint,
                         PropertyRequest->Node, 
                         ulChannel == ALL_CHANNELS_ID ? 0 : ulChannel
                     );
@@ -737,6 +741,7 @@ Return Value:
                     {
                         AdapterCommon->MixerVolumeWrite
                         (
+                            Endpoint,
                             PropertyRequest->Node, 
                             i, 
                             VOLUME_NORMALIZE_IN_RANGE(*plVolume)
@@ -747,6 +752,7 @@ Return Value:
                 {
                     AdapterCommon->MixerVolumeWrite
                     (
+                        Endpoint,
                         PropertyRequest->Node, 
                         ulChannel, 
                         VOLUME_NORMALIZE_IN_RANGE(*plVolume)
@@ -770,6 +776,7 @@ NTSTATUS
 PropertyHandler_Mute
 (
     _In_  PADAPTERCOMMON        AdapterCommon,
+    _In_  ULONG                 Endpoint,
     _In_  PPCPROPERTY_REQUEST   PropertyRequest,
     _In_  ULONG                 MaxChannels
 )
@@ -783,6 +790,8 @@ Arguments:
 
   AdapterCommon - interface to the common adapter object.
   
+  Endpoint - endpoint whose topology the node belongs to.
+
   PropertyRequest - property request structure.
 
   MaxChannels - # of supported channels.
@@ -831,6 +840,7 @@ Return Value:
                 *pfMute = 
                     AdapterCommon->MixerMuteRead
                     (
+                        Endpoint,
                         PropertyRequest->Node,
                         ulChannel == ALL_CHANNELS_ID ? 0 : ulChannel
                     );
@@ -844,6 +854,7 @@ Return Value:
                     {
                         AdapterCommon->MixerMuteWrite
                         (
+                            Endpoint,
                             PropertyRequest->Node,
                             i,
                             (*pfMute) ? TRUE : FALSE
@@ -854,6 +865,7 @@ Return Value:
                 {
                     AdapterCommon->MixerMuteWrite
                     (
+                        Endpoint,
                         PropertyRequest->Node,
                         ulChannel,
                         (*pfMute) ? TRUE : FALSE
@@ -877,6 +889,7 @@ NTSTATUS
 PropertyHandler_PeakMeter2
 (
     _In_  PADAPTERCOMMON        AdapterCommon,
+    _In_  ULONG                 Endpoint,
     _In_  PPCPROPERTY_REQUEST   PropertyRequest,
     _In_  ULONG                 MaxChannels
 )
@@ -890,6 +903,8 @@ Arguments:
 
   AdapterCommon - interface to the common adapter object.
   
+  Endpoint - endpoint whose topology the node belongs to.
+
   PropertyRequest - property request structure.
 
   MaxChannels - # of supported channels.
@@ -939,6 +954,7 @@ Return Value:
                     PEAKMETER_NORMALIZE_IN_RANGE(
                         AdapterCommon->MixerPeakMeterRead
                         (
+                            Endpoint,
                             PropertyRequest->Node, 
                             ulChannel == ALL_CHANNELS_ID ? 0 : ulChannel
                         ));
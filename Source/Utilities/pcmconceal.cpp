@@ -0,0 +1,765 @@
+/*++
+
+Module Name:
+
+    pcmconceal.cpp
+
+Abstract:
+
+    Underrun concealment for the capture path, see pcmconceal.h.
+
+    Everything is done on 32-bit PCM; other formats are converted a block at
+    a time, as pcmgain.cpp does. Gains are Q30 like pcmgain.h's, applied
+    with a plain multiply and shift: they never exceed unity, so only the
+    sum of a crossfade can need saturating.
+--*/
+#if defined(_WIN32)
+#include <ntdef.h>
+#endif
+#include <string.h>
+#include "pcmconceal.h"
+
+#if !defined(_WIN32)
+typedef int64_t         LONGLONG;
+typedef uint64_t        ULONGLONG;
+#endif
+
+//
+// Samples converted to int32 per pass for formats other than int32.
+//
+#define PCMCONCEAL_BLOCK_SAMPLES    256
+
+#define PCMCONCEAL_UNITY            0x40000000
+
+//
+// Pitch periods searched, and the stretch of history right before the gap
+// that each candidate is compared over.
+//
+#define PCMCONCEAL_MIN_PERIOD_US    2500
+#define PCMCONCEAL_MAX_PERIOD_MS    20
+#define PCMCONCEAL_WINDOW_MS        5
+
+//
+// The search runs on the history decimated by a whole factor to at least
+// this rate, which is below twice this rate, so it never takes more than
+// PCMCONCEAL_SEARCH_MAX samples.
+//
+#define PCMCONCEAL_SEARCH_RATE      8000
+#define PCMCONCEAL_SEARCH_MAX       (2 * PCMCONCEAL_SEARCH_RATE * (PCMCONCEAL_MAX_PERIOD_MS + PCMCONCEAL_WINDOW_MS) / 1000)
+
+//
+// History kept: the longest period, the window before it and the quarter
+// period the loop's seam is crossfaded over.
+//
+#define PCMCONCEAL_HISTORY_MS       (PCMCONCEAL_MAX_PERIOD_MS + PCMCONCEAL_WINDOW_MS + PCMCONCEAL_MAX_PERIOD_MS / 4)
+
+//
+// Envelopes. Fade and noise fade the loop out over PCMCONCEAL_FADE_MS;
+// repeat holds it for PCMCONCEAL_HOLD_MS and then fades it out over
+// PCMCONCEAL_DECAY_MS. The feeder's audio fades back in over
+// PCMCONCEAL_FADE_MS.
+//
+#define PCMCONCEAL_FADE_MS          5
+#define PCMCONCEAL_HOLD_MS          10
+#define PCMCONCEAL_DECAY_MS         50
+
+//
+// Loudest comfort noise, as a mean |sample| (about -42 dBFS): a floor above
+// that is the audio itself, e.g. a steady tone, not its background.
+//
+#define PCMCONCEAL_NOISE_MAX        (0x7FFFFFFF / 128)
+
+//
+// The noise floor is measured over windows of this much audio fed, however
+// the wakeups split it.
+//
+#define PCMCONCEAL_FLOOR_MS         10
+
+struct _PCM_CONCEAL
+{
+    PCM_CONCEAL_MODE    Mode;
+    ULONG               SampleRate;
+    ULONG               Channels;
+    ULONG               Capacity;       // frames of history
+    ULONG               MaxPeriod;      // frames
+    ULONG               FadeFrames;
+    ULONG               HoldFrames;
+    ULONG               DecayFrames;
+    ULONG               FloorWindow;    // frames
+    ULONG               Count;          // frames of history held
+    ULONG               Next;           // where the next frame fed goes
+    BOOLEAN             Concealing;     // a gap started and has not been faded out of yet
+    BOOLEAN             Resuming;       // the feeder is back and fading in
+    ULONG               Elapsed;        // frames of concealment generated in this gap
+    ULONG               Resumed;        // frames faded in since the feeder came back
+    ULONG               Period;         // frames in Loop
+    ULONG               Position;       // next frame of Loop
+    ULONG               Seed;           // noise generator
+    ULONG               Floor[PCM_CONCEAL_MAX_CHANNELS];   // noise floor, mean |sample|
+    ULONGLONG           FloorSum[PCM_CONCEAL_MAX_CHANNELS];  // |sample| so far in this window
+    ULONG               FloorFrames;    // frames so far in this window
+    ULONG               Noise[PCM_CONCEAL_MAX_CHANNELS];   // comfort noise amplitude for this gap
+    LONG *              History;        // [Capacity][Channels], a ring
+    LONG *              Loop;           // [MaxPeriod][Channels]
+};
+
+//=============================================================================
+#pragma code_seg()
+static
+LONG
+PcmConceal_Saturate
+(
+    LONGLONG    Value
+)
+{
+    if (Value > 0x7FFFFFFF)
+    {
+        return 0x7FFFFFFF;
+    }
+    if (Value < -0x7FFFFFFF - 1)
+    {
+        return -0x7FFFFFFF - 1;
+    }
+    return (LONG)Value;
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+const LONG *
+PcmConceal_HistoryFrame
+(
+    PPCM_CONCEAL    Conceal,
+    ULONG           Back
+)
+/*++
+
+Routine Description:
+
+  The frame Back frames before the next one to be fed, 1 <= Back <= Count.
+
+--*/
+{
+    ULONG index = (Conceal->Next + Conceal->Capacity - Back) % Conceal->Capacity;
+
+    return Conceal->History + index * Conceal->Channels;
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+ULONG
+PcmConceal_FindPeriod
+(
+    PPCM_CONCEAL    Conceal
+)
+/*++
+
+Routine Description:
+
+  Finds the lag, within the periods searched and what the history holds,
+  at which the end of the history best matches itself: the largest
+  normalized autocorrelation c^2 / e over a positive c, computed on the
+  channels' sum decimated to about PCMCONCEAL_SEARCH_RATE. Audio with no
+  such lag, e.g. noise, loops over the longest period the history allows.
+
+Return Value:
+
+  The period in frames, 0 if the history is too short to loop at all.
+
+--*/
+{
+    float   x[PCMCONCEAL_SEARCH_MAX];
+    ULONG   decimation = Conceal->SampleRate / PCMCONCEAL_SEARCH_RATE;
+    ULONG   window;
+    ULONG   minLag;
+    ULONG   maxLag;
+    ULONG   longest;
+    ULONG   samples;
+    ULONG   index;
+    ULONG   bestLag = 0;
+    double  bestC2 = 0.0;
+    double  bestEnergy = 1.0;
+
+    if (decimation == 0)
+    {
+        decimation = 1;
+    }
+
+    // The loop takes a period plus a quarter of one.
+    longest = Conceal->Count * 4 / 5;
+    if (longest > Conceal->MaxPeriod)
+    {
+        longest = Conceal->MaxPeriod;
+    }
+
+    window = Conceal->SampleRate * PCMCONCEAL_WINDOW_MS / 1000 / decimation;
+    minLag = (Conceal->SampleRate * (PCMCONCEAL_MIN_PERIOD_US / 100) / 10000 + decimation - 1) / decimation;
+    maxLag = longest / decimation;
+
+    if (Conceal->Count / decimation < window + maxLag)
+    {
+        maxLag = (Conceal->Count / decimation > window) ? Conceal->Count / decimation - window : 0;
+    }
+
+    if (maxLag < minLag)
+    {
+        return longest;
+    }
+
+    // Oldest first; x[samples - 1] ends with the newest frame.
+    samples = window + maxLag;
+    index = (Conceal->Next + Conceal->Capacity - samples * decimation) % Conceal->Capacity;
+    for (ULONG i = 0; i < samples; i++)
+    {
+        float sum = 0.0f;
+
+        for (ULONG d = 0; d < decimation; d++)
+        {
+            const LONG * frame = Conceal->History + index * Conceal->Channels;
+
+            for (ULONG c = 0; c < Conceal->Channels; c++)
+            {
+                sum += (float)frame[c];
+            }
+            index = (index + 1 < Conceal->Capacity) ? index + 1 : 0;
+        }
+        x[i] = sum;
+    }
+
+    for (ULONG lag = minLag; lag <= maxLag; lag++)
+    {
+        double correlation = 0.0;
+        double energy = 0.0;
+
+        for (ULONG i = samples - window; i < samples; i++)
+        {
+            correlation += (double)x[i] * x[i - lag];
+            energy      += (double)x[i - lag] * x[i - lag];
+        }
+
+        if (correlation > 0.0 && energy > 0.0 &&
+            correlation * correlation * bestEnergy > bestC2 * energy)
+        {
+            bestLag    = lag;
+            bestC2     = correlation * correlation;
+            bestEnergy = energy;
+        }
+    }
+
+    return (bestLag != 0) ? bestLag * decimation : longest;
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+BOOLEAN
+PcmConceal_Start
+(
+    PPCM_CONCEAL    Conceal
+)
+/*++
+
+Routine Description:
+
+  Starts concealing a gap: copies the last period of the history into the
+  loop, with its last quarter crossfaded from the frames right before the
+  gap into the ones right before the period, so that the loop's end runs
+  into its start as the audio once did.
+
+Return Value:
+
+  FALSE if there is not enough history to conceal from.
+
+--*/
+{
+    ULONG period = PcmConceal_FindPeriod(Conceal);
+    ULONG seam = period / 4;
+    ULONG channels = Conceal->Channels;
+
+    if (period == 0)
+    {
+        return FALSE;
+    }
+
+    for (ULONG k = 0; k < period - seam; k++)
+    {
+        memcpy(Conceal->Loop + k * channels,
+               PcmConceal_HistoryFrame(Conceal, period - k),
+               channels * sizeof(LONG));
+    }
+
+    for (ULONG j = 0; j < seam; j++)
+    {
+        const LONG *    last = PcmConceal_HistoryFrame(Conceal, seam - j);
+        const LONG *    earlier = PcmConceal_HistoryFrame(Conceal, period + seam - j);
+        LONG *          out = Conceal->Loop + (period - seam + j) * channels;
+        LONG            w = (LONG)((ULONGLONG)PCMCONCEAL_UNITY * (j + 1) / (seam + 1));
+
+        for (ULONG c = 0; c < channels; c++)
+        {
+            out[c] = PcmConceal_Saturate((((LONGLONG)last[c] * (PCMCONCEAL_UNITY - w)) >> 30) +
+                                         (((LONGLONG)earlier[c] * w) >> 30));
+        }
+    }
+
+    // Uniform noise in +-2 * floor has a mean |sample| of floor. The level
+    // is the one before the gap, even if the floor moves while fading in.
+    for (ULONG c = 0; c < channels; c++)
+    {
+        Conceal->Noise[c] = 2 * ((Conceal->Floor[c] < PCMCONCEAL_NOISE_MAX) ? Conceal->Floor[c] : PCMCONCEAL_NOISE_MAX);
+    }
+
+    Conceal->Period     = period;
+    Conceal->Position   = 0;
+    Conceal->Elapsed    = 0;
+    Conceal->Concealing = TRUE;
+    Conceal->Resuming   = FALSE;
+
+    return TRUE;
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+LONG
+PcmConceal_Ramp
+(
+    ULONG   Done,
+    ULONG   Length
+)
+/*++
+
+Routine Description:
+
+  Q30 gain falling from unity to 0 over Length frames, Done frames in.
+
+--*/
+{
+    if (Done >= Length)
+    {
+        return 0;
+    }
+    return PCMCONCEAL_UNITY - (LONG)((ULONGLONG)PCMCONCEAL_UNITY * Done / Length);
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+VOID
+PcmConceal_Generate
+(
+    PPCM_CONCEAL    Conceal,
+    LONG *          Samples,
+    ULONG           Frames
+)
+/*++
+
+Routine Description:
+
+  Writes the next Frames frames of concealment: the loop under its
+  envelope, plus the comfort noise in noise mode. Once both gains are
+  down to what they stay at, the rest is silence or noise without any
+  further envelope work.
+
+--*/
+{
+    ULONG channels = Conceal->Channels;
+
+    for (ULONG f = 0; f < Frames; f++)
+    {
+        const LONG *    loop = Conceal->Loop + Conceal->Position * channels;
+        LONG            loopGain;
+        LONG            noiseGain = 0;
+
+        if (Conceal->Mode == PcmConcealModeRepeat)
+        {
+            loopGain = (Conceal->Elapsed < Conceal->HoldFrames) ?
+                       PCMCONCEAL_UNITY :
+                       PcmConceal_Ramp(Conceal->Elapsed - Conceal->HoldFrames, Conceal->DecayFrames);
+        }
+        else
+        {
+            loopGain = PcmConceal_Ramp(Conceal->Elapsed, Conceal->FadeFrames);
+        }
+
+        if (Conceal->Mode == PcmConcealModeNoise)
+        {
+            noiseGain = PCMCONCEAL_UNITY - loopGain;
+        }
+        else if (loopGain == 0)
+        {
+            memset(Samples + f * channels, 0, (size_t)(Frames - f) * channels * sizeof(LONG));
+            Conceal->Elapsed = (Conceal->Elapsed + (Frames - f) > Conceal->Elapsed) ?
+                               Conceal->Elapsed + (Frames - f) : 0xFFFFFFFF;
+            return;
+        }
+
+        for (ULONG c = 0; c < channels; c++)
+        {
+            LONGLONG value = ((LONGLONG)loop[c] * loopGain) >> 30;
+
+            if (noiseGain != 0)
+            {
+                LONGLONG noise;
+
+                Conceal->Seed = Conceal->Seed * 1664525 + 1013904223;
+                noise = ((LONGLONG)(LONG)Conceal->Seed * Conceal->Noise[c]) >> 31;
+                value += (noise * noiseGain) >> 30;
+            }
+
+            Samples[f * channels + c] = PcmConceal_Saturate(value);
+        }
+
+        Conceal->Position = (Conceal->Position + 1 < Conceal->Period) ? Conceal->Position + 1 : 0;
+        if (Conceal->Elapsed != 0xFFFFFFFF)
+        {
+            Conceal->Elapsed++;
+        }
+    }
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+ULONG
+PcmConceal_FadeIn
+(
+    PPCM_CONCEAL    Conceal,
+    LONG *          Samples,
+    ULONG           Frames
+)
+/*++
+
+Routine Description:
+
+  Crossfades the feeder's audio in from the concealment, which carries on
+  underneath until the fade is done.
+
+Return Value:
+
+  Number of frames at the start of Samples that were changed.
+
+--*/
+{
+    ULONG   channels = Conceal->Channels;
+    ULONG   frames = Conceal->FadeFrames - Conceal->Resumed;
+    LONG    generated[PCM_CONCEAL_MAX_CHANNELS];
+
+    if (frames > Frames)
+    {
+        frames = Frames;
+    }
+
+    for (ULONG f = 0; f < frames; f++)
+    {
+        LONG    w = (LONG)((ULONGLONG)PCMCONCEAL_UNITY * (Conceal->Resumed + 1) / (Conceal->FadeFrames + 1));
+        LONG *  frame = Samples + f * channels;
+
+        PcmConceal_Generate(Conceal, generated, 1);
+
+        for (ULONG c = 0; c < channels; c++)
+        {
+            frame[c] = PcmConceal_Saturate((((LONGLONG)frame[c] * w) >> 30) +
+                                           (((LONGLONG)generated[c] * (PCMCONCEAL_UNITY - w)) >> 30));
+        }
+
+        Conceal->Resumed++;
+    }
+
+    if (Conceal->Resumed >= Conceal->FadeFrames)
+    {
+        Conceal->Resuming   = FALSE;
+        Conceal->Concealing = FALSE;
+    }
+
+    return frames;
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+VOID
+PcmConceal_Remember
+(
+    PPCM_CONCEAL    Conceal,
+    const LONG *    Samples,
+    ULONG           Frames
+)
+/*++
+
+Routine Description:
+
+  Adds Frames frames to the history and updates the noise floor: at the
+  end of every PCMCONCEAL_FLOOR_MS window, the window's mean |sample| if
+  that is lower, otherwise the floor rises by up to its own size per
+  second, so it follows the quietest stretches of the audio and recovers
+  within seconds when the background gets louder.
+
+--*/
+{
+    ULONG channels = Conceal->Channels;
+    ULONG measured = 0;
+    ULONG first = 0;
+
+    while (measured < Frames)
+    {
+        ULONG count = Conceal->FloorWindow - Conceal->FloorFrames;
+
+        if (count > Frames - measured)
+        {
+            count = Frames - measured;
+        }
+
+        for (ULONG c = 0; c < channels; c++)
+        {
+            ULONGLONG sum = 0;
+
+            for (ULONG f = measured; f < measured + count; f++)
+            {
+                LONG s = Samples[f * channels + c];
+
+                sum += (s < 0) ? (ULONGLONG)(-(LONGLONG)s) : (ULONGLONG)s;
+            }
+
+            Conceal->FloorSum[c] += sum;
+        }
+
+        Conceal->FloorFrames += count;
+        measured += count;
+
+        if (Conceal->FloorFrames == Conceal->FloorWindow)
+        {
+            for (ULONG c = 0; c < channels; c++)
+            {
+                ULONGLONG mean   = Conceal->FloorSum[c] / Conceal->FloorWindow;
+                ULONGLONG raised = Conceal->Floor[c] +
+                                   (ULONGLONG)Conceal->Floor[c] * Conceal->FloorWindow / Conceal->SampleRate + 1;
+
+                Conceal->Floor[c]    = (ULONG)((mean < raised) ? mean : raised);
+                Conceal->FloorSum[c] = 0;
+            }
+
+            Conceal->FloorFrames = 0;
+        }
+    }
+
+    // Only the newest Capacity frames matter.
+    if (Frames > Conceal->Capacity)
+    {
+        first = Frames - Conceal->Capacity;
+    }
+
+    while (first < Frames)
+    {
+        ULONG count = Conceal->Capacity - Conceal->Next;
+
+        if (count > Frames - first)
+        {
+            count = Frames - first;
+        }
+
+        memcpy(Conceal->History + Conceal->Next * channels,
+               Samples + first * channels,
+               (size_t)count * channels * sizeof(LONG));
+
+        Conceal->Next = (Conceal->Next + count) % Conceal->Capacity;
+        Conceal->Count = (Conceal->Count + count < Conceal->Capacity) ? Conceal->Count + count : Conceal->Capacity;
+        first += count;
+    }
+}
+
+//=============================================================================
+#pragma code_seg()
+ULONG
+PcmConceal_GetSize
+(
+    ULONG               SampleRate,
+    ULONG               Channels
+)
+{
+    ULONG capacity;
+    ULONG maxPeriod;
+
+    if (SampleRate < PCM_CONCEAL_MIN_RATE || SampleRate > PCM_CONCEAL_MAX_RATE ||
+        Channels == 0 || Channels > PCM_CONCEAL_MAX_CHANNELS)
+    {
+        return 0;
+    }
+
+    capacity  = SampleRate * PCMCONCEAL_HISTORY_MS / 1000;
+    maxPeriod = SampleRate * PCMCONCEAL_MAX_PERIOD_MS / 1000;
+
+    return (ULONG)((sizeof(PCM_CONCEAL) + 15) & ~15) +
+           (capacity + maxPeriod) * Channels * (ULONG)sizeof(LONG);
+}
+
+//=============================================================================
+#pragma code_seg()
+BOOLEAN
+PcmConceal_Init
+(
+    PPCM_CONCEAL        Conceal,
+    ULONG               Size,
+    PCM_CONCEAL_MODE    Mode,
+    ULONG               SampleRate,
+    ULONG               Channels
+)
+{
+    ULONG needed = PcmConceal_GetSize(SampleRate, Channels);
+
+    if (needed == 0 || Size < needed || (ULONG)Mode >= PcmConcealModeCount)
+    {
+        return FALSE;
+    }
+
+    Conceal->Mode        = Mode;
+    Conceal->SampleRate  = SampleRate;
+    Conceal->Channels    = Channels;
+    Conceal->Capacity    = SampleRate * PCMCONCEAL_HISTORY_MS / 1000;
+    Conceal->MaxPeriod   = SampleRate * PCMCONCEAL_MAX_PERIOD_MS / 1000;
+    Conceal->FadeFrames  = SampleRate * PCMCONCEAL_FADE_MS / 1000;
+    Conceal->HoldFrames  = SampleRate * PCMCONCEAL_HOLD_MS / 1000;
+    Conceal->DecayFrames = SampleRate * PCMCONCEAL_DECAY_MS / 1000;
+    Conceal->FloorWindow = SampleRate * PCMCONCEAL_FLOOR_MS / 1000;
+    Conceal->History     = (LONG *)((unsigned char *)Conceal + ((sizeof(PCM_CONCEAL) + 15) & ~15));
+    Conceal->Loop        = Conceal->History + Conceal->Capacity * Channels;
+
+    PcmConceal_Reset(Conceal);
+
+    return TRUE;
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+PcmConceal_Reset
+(
+    PPCM_CONCEAL        Conceal
+)
+{
+    Conceal->Count      = 0;
+    Conceal->Next       = 0;
+    Conceal->Concealing = FALSE;
+    Conceal->Resuming   = FALSE;
+    Conceal->Elapsed    = 0;
+    Conceal->Resumed    = 0;
+    Conceal->Period     = 0;
+    Conceal->Position   = 0;
+    Conceal->Seed       = 1;
+
+    // The first window of audio fed sets the floor.
+    for (ULONG c = 0; c < PCM_CONCEAL_MAX_CHANNELS; c++)
+    {
+        Conceal->Floor[c]    = 0xFFFFFFFF;
+        Conceal->FloorSum[c] = 0;
+    }
+    Conceal->FloorFrames = 0;
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+PcmConceal_Feed
+(
+    PPCM_CONCEAL        Conceal,
+    PCM_SAMPLE_FORMAT   Format,
+    VOID *              Samples,
+    ULONG               Frames
+)
+{
+    ULONG channels = Conceal->Channels;
+    ULONG frameBytes = channels * PcmConvert_SampleBytes(Format);
+
+    if (Conceal->Mode == PcmConcealModeSilence || frameBytes == 0 || Frames == 0)
+    {
+        return;
+    }
+
+    if (Conceal->Concealing && !Conceal->Resuming)
+    {
+        Conceal->Resuming = TRUE;
+        Conceal->Resumed  = 0;
+    }
+
+    if (Format == PcmSampleFormatInt32)
+    {
+        if (Conceal->Resuming)
+        {
+            PcmConceal_FadeIn(Conceal, (LONG *)Samples, Frames);
+        }
+        PcmConceal_Remember(Conceal, (const LONG *)Samples, Frames);
+        return;
+    }
+
+    while (Frames > 0)
+    {
+        LONG  block[PCMCONCEAL_BLOCK_SAMPLES];
+        ULONG count = (Frames < PCMCONCEAL_BLOCK_SAMPLES / channels) ? Frames : PCMCONCEAL_BLOCK_SAMPLES / channels;
+
+        PcmConvert(PcmSampleFormatInt32, block, Format, Samples, count * channels);
+
+        if (Conceal->Resuming)
+        {
+            ULONG changed = PcmConceal_FadeIn(Conceal, block, count);
+
+            PcmConvert(Format, Samples, PcmSampleFormatInt32, block, changed * channels);
+        }
+
+        PcmConceal_Remember(Conceal, block, count);
+
+        Samples = (unsigned char *)Samples + count * frameBytes;
+        Frames -= count;
+    }
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+PcmConceal_Fill
+(
+    PPCM_CONCEAL        Conceal,
+    PCM_SAMPLE_FORMAT   Format,
+    VOID *              Samples,
+    ULONG               Frames
+)
+{
+    ULONG channels = Conceal->Channels;
+    ULONG frameBytes = channels * PcmConvert_SampleBytes(Format);
+
+    if (frameBytes == 0 || Frames == 0)
+    {
+        return;
+    }
+
+    // Running dry again while fading in carries on with the same gap.
+    if (Conceal->Resuming)
+    {
+        Conceal->Resuming = FALSE;
+    }
+    else if (Conceal->Mode == PcmConcealModeSilence ||
+             (!Conceal->Concealing && !PcmConceal_Start(Conceal)))
+    {
+        memset(Samples, 0, (size_t)Frames * frameBytes);
+        return;
+    }
+
+    if (Format == PcmSampleFormatInt32)
+    {
+        PcmConceal_Generate(Conceal, (LONG *)Samples, Frames);
+        return;
+    }
+
+    while (Frames > 0)
+    {
+        LONG  block[PCMCONCEAL_BLOCK_SAMPLES];
+        ULONG count = (Frames < PCMCONCEAL_BLOCK_SAMPLES / channels) ? Frames : PCMCONCEAL_BLOCK_SAMPLES / channels;
+
+        PcmConceal_Generate(Conceal, block, count);
+        PcmConvert(Format, Samples, PcmSampleFormatInt32, block, count * channels);
+
+        Samples = (unsigned char *)Samples + count * frameBytes;
+        Frames -= count;
+    }
+}
+#pragma code_seg()
@@ -0,0 +1,128 @@
+/*++
+
+Module Name:
+
+    pcmconceal.h
+
+Abstract:
+
+    Concealment of short feeder underruns in the capture path.
+
+    When the feeder falls behind, the capture stream has to put something in
+    the DMA buffer. Zeros cut the audio off mid-waveform, which clicks and
+    makes voice activity detectors drop out. The concealer instead keeps the
+    last few tens of milliseconds the stream delivered and, when a gap
+    starts, plays on from them:
+
+      Fade      the last pitch period repeated, fading to silence over 5 ms
+      Repeat    the last pitch period repeated at full level for 10 ms, then
+                fading out by 60 ms, as ITU-T G.711 Appendix I does
+      Noise     the last pitch period crossfading over 5 ms into white
+                noise at the measured noise floor, capped at about -42 dBFS,
+                for as long as the gap lasts
+
+    The pitch period is found by normalized autocorrelation of the history,
+    decimated to about 8 kHz, over periods from 2.5 to 20 ms. The period is
+    copied into a loop whose tail crossfades into its head, so repeating it
+    has no seam. When the feeder's audio comes back it crossfades from the
+    concealment over 5 ms, whatever the concealment had got to.
+
+    Every call works on the frames it is given plus, once per gap, the
+    period search and loop, both bounded by the history length. Nothing is
+    allocated: PcmConceal_GetSize tells how much memory a configuration
+    needs and PcmConceal_Init lays the concealer out in it.
+--*/
+
+#ifndef _MICYAUDIO_PCMCONCEAL_H_
+#define _MICYAUDIO_PCMCONCEAL_H_
+
+#include "pcmconvert.h"
+
+#if !defined(_WIN32)
+typedef uint8_t         BOOLEAN;
+#define TRUE            1
+#define FALSE           0
+#endif
+
+//
+// Values match the MICYAUDIO_CONFIG_CONCEAL_* field of the stream flags in
+// micyioctl.h.
+//
+typedef enum _PCM_CONCEAL_MODE
+{
+    PcmConcealModeSilence   = 0,    // zeros, no history kept
+    PcmConcealModeFade      = 1,
+    PcmConcealModeRepeat    = 2,
+    PcmConcealModeNoise     = 3,
+    PcmConcealModeCount
+} PCM_CONCEAL_MODE;
+
+#define PCM_CONCEAL_MIN_RATE        8000
+#define PCM_CONCEAL_MAX_RATE        192000
+#define PCM_CONCEAL_MAX_CHANNELS    8
+
+typedef struct _PCM_CONCEAL PCM_CONCEAL, *PPCM_CONCEAL;
+
+//
+// Bytes needed for a concealer, 0 if the configuration is not supported.
+//
+ULONG
+PcmConceal_GetSize
+(
+    ULONG               SampleRate,
+    ULONG               Channels
+);
+
+//
+// Lays a concealer out in Size bytes of memory aligned for LONG. Returns
+// FALSE if the configuration is not supported or Size is too small.
+//
+BOOLEAN
+PcmConceal_Init
+(
+    PPCM_CONCEAL        Conceal,
+    ULONG               Size,
+    PCM_CONCEAL_MODE    Mode,
+    ULONG               SampleRate,
+    ULONG               Channels
+);
+
+//
+// Forgets the history, as if the stream had only ever been silent.
+//
+VOID
+PcmConceal_Reset
+(
+    PPCM_CONCEAL        Conceal
+);
+
+//
+// Takes Frames interleaved frames of the feeder's audio, in place, right
+// after the last frames fed or filled: remembers them and, if a gap has
+// just ended, crossfades them in from the concealment. Any IRQL.
+//
+VOID
+PcmConceal_Feed
+(
+    PPCM_CONCEAL        Conceal,
+    PCM_SAMPLE_FORMAT   Format,
+    VOID *              Samples,
+    ULONG               Frames
+);
+
+//
+// Writes Frames interleaved frames of concealment for a gap in the
+// feeder's audio, right after the last frames fed or filled. Zeros in
+// silence mode and before any audio has been fed; does nothing for an
+// unknown format. Any IRQL.
+//
+VOID
+PcmConceal_Fill
+(
+    PPCM_CONCEAL        Conceal,
+    PCM_SAMPLE_FORMAT   Format,
+    VOID *              Samples,
+    ULONG               Frames
+);
+
+#endif // _MICYAUDIO_PCMCONCEAL_H_
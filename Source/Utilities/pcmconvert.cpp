@@ -0,0 +1,451 @@
+/*++
+
+Module Name:
+
+    pcmconvert.cpp
+
+Abstract:
+
+    Sample format conversion, see pcmconvert.h. Each format has one kernel
+    into and one out of 32-bit integer PCM; any other pair goes through a
+    small int32 block on the stack.
+--*/
+#if defined(_WIN32)
+#include <ntdef.h>
+#endif
+#include <string.h>
+#include "pcmconvert.h"
+
+#if defined(_M_X64) || (defined(__x86_64__) && defined(__SSE2__))
+#define PCMCONVERT_SSE2
+#include <emmintrin.h>
+#elif defined(_M_ARM64) || (defined(__aarch64__) && defined(__ARM_NEON))
+#define PCMCONVERT_NEON
+#if defined(_MSC_VER)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
+//
+// Samples converted per pass when neither side is int32.
+//
+#define PCMCONVERT_BLOCK_SAMPLES    128
+
+#define PCMCONVERT_FLOAT_SCALE      2147483648.0f
+#define PCMCONVERT_FLOAT_INV_SCALE  (1.0f / 2147483648.0f)
+
+//=============================================================================
+// Scalar kernels
+//=============================================================================
+
+#pragma code_seg()
+static
+LONG
+PcmConvert_FloatSampleToInt32
+(
+    float   Value
+)
+{
+    if (Value != Value)
+    {
+        Value = 0.0f;
+    }
+    if (Value < -1.0f)
+    {
+        Value = -1.0f;
+    }
+    if (Value > 1.0f)
+    {
+        Value = 1.0f;
+    }
+
+    Value *= PCMCONVERT_FLOAT_SCALE;
+
+    return (Value >= PCMCONVERT_FLOAT_SCALE) ? 0x7FFFFFFF : (LONG)Value;
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+VOID
+PcmConvert_ToInt32Scalar
+(
+    PCM_SAMPLE_FORMAT   SourceFormat,
+    LONG *              Destination,
+    const VOID *        Source,
+    ULONG               First,
+    ULONG               Samples
+)
+/*++
+
+Routine Description:
+
+  Converts samples [First, Samples) of Source to int32. The vector kernels
+  use it for the tail that does not fill a vector.
+
+--*/
+{
+    ULONG i;
+
+    switch (SourceFormat)
+    {
+    case PcmSampleFormatInt16:
+        for (i = First; i < Samples; i++)
+        {
+            Destination[i] = (LONG)((ULONG)(LONG)((const SHORT *)Source)[i] << 16);
+        }
+        break;
+
+    case PcmSampleFormatInt24:
+        for (i = First; i < Samples; i++)
+        {
+            const UCHAR * sample = (const UCHAR *)Source + i * 3;
+
+            Destination[i] = (LONG)((ULONG)sample[0] << 8 |
+                                    (ULONG)sample[1] << 16 |
+                                    (ULONG)sample[2] << 24);
+        }
+        break;
+
+    case PcmSampleFormatInt32:
+        memcpy(Destination + First, (const LONG *)Source + First, (Samples - First) * sizeof(LONG));
+        break;
+
+    case PcmSampleFormatFloat32:
+        for (i = First; i < Samples; i++)
+        {
+            Destination[i] = PcmConvert_FloatSampleToInt32(((const float *)Source)[i]);
+        }
+        break;
+
+    default:
+        memset(Destination + First, 0, (Samples - First) * sizeof(LONG));
+        break;
+    }
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+VOID
+PcmConvert_FromInt32Scalar
+(
+    PCM_SAMPLE_FORMAT   DestinationFormat,
+    VOID *              Destination,
+    const LONG *        Source,
+    ULONG               First,
+    ULONG               Samples
+)
+{
+    ULONG i;
+
+    switch (DestinationFormat)
+    {
+    case PcmSampleFormatInt16:
+        for (i = First; i < Samples; i++)
+        {
+            ((SHORT *)Destination)[i] = (SHORT)(Source[i] >> 16);
+        }
+        break;
+
+    case PcmSampleFormatInt24:
+        for (i = First; i < Samples; i++)
+        {
+            UCHAR * sample = (UCHAR *)Destination + i * 3;
+            ULONG   value  = (ULONG)Source[i];
+
+            sample[0] = (UCHAR)(value >> 8);
+            sample[1] = (UCHAR)(value >> 16);
+            sample[2] = (UCHAR)(value >> 24);
+        }
+        break;
+
+    case PcmSampleFormatInt32:
+        memcpy((LONG *)Destination + First, Source + First, (Samples - First) * sizeof(LONG));
+        break;
+
+    case PcmSampleFormatFloat32:
+        for (i = First; i < Samples; i++)
+        {
+            ((float *)Destination)[i] = (float)Source[i] * PCMCONVERT_FLOAT_INV_SCALE;
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+//=============================================================================
+// Vector kernels. Each converts whole vectors and leaves the tail to the
+// scalar kernel.
+//=============================================================================
+
+#pragma code_seg()
+static
+VOID
+PcmConvert_ToInt32
+(
+    PCM_SAMPLE_FORMAT   SourceFormat,
+    LONG *              Destination,
+    const VOID *        Source,
+    ULONG               Samples
+)
+{
+    ULONG i = 0;
+
+#if defined(PCMCONVERT_SSE2)
+    if (SourceFormat == PcmSampleFormatInt16)
+    {
+        const __m128i zero = _mm_setzero_si128();
+
+        for (; i + 8 <= Samples; i += 8)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i *)((const SHORT *)Source + i));
+
+            // Interleaving zeros below each sample shifts it into the top half.
+            _mm_storeu_si128((__m128i *)(Destination + i),     _mm_unpacklo_epi16(zero, x));
+            _mm_storeu_si128((__m128i *)(Destination + i + 4), _mm_unpackhi_epi16(zero, x));
+        }
+    }
+    else if (SourceFormat == PcmSampleFormatFloat32)
+    {
+        const __m128 lower = _mm_set1_ps(-1.0f);
+        const __m128 upper = _mm_set1_ps(1.0f);
+        const __m128 scale = _mm_set1_ps(PCMCONVERT_FLOAT_SCALE);
+
+        for (; i + 4 <= Samples; i += 4)
+        {
+            __m128  v = _mm_loadu_ps((const float *)Source + i);
+            __m128i x;
+
+            v = _mm_and_ps(v, _mm_cmpord_ps(v, v));
+            v = _mm_min_ps(_mm_max_ps(v, lower), upper);
+            v = _mm_mul_ps(v, scale);
+
+            // cvttps2dq turns +2^31 into 0x80000000; flip it to 0x7FFFFFFF.
+            x = _mm_cvttps_epi32(v);
+            x = _mm_xor_si128(x, _mm_castps_si128(_mm_cmpge_ps(v, scale)));
+
+            _mm_storeu_si128((__m128i *)(Destination + i), x);
+        }
+    }
+#elif defined(PCMCONVERT_NEON)
+    if (SourceFormat == PcmSampleFormatInt16)
+    {
+        for (; i + 8 <= Samples; i += 8)
+        {
+            int16x8_t x = vld1q_s16((const int16_t *)Source + i);
+
+            vst1q_s32((int32_t *)Destination + i,     vshll_n_s16(vget_low_s16(x), 16));
+            vst1q_s32((int32_t *)Destination + i + 4, vshll_n_s16(vget_high_s16(x), 16));
+        }
+    }
+    else if (SourceFormat == PcmSampleFormatFloat32)
+    {
+        const float32x4_t lower = vdupq_n_f32(-1.0f);
+        const float32x4_t upper = vdupq_n_f32(1.0f);
+        const float32x4_t scale = vdupq_n_f32(PCMCONVERT_FLOAT_SCALE);
+
+        for (; i + 4 <= Samples; i += 4)
+        {
+            float32x4_t v = vld1q_f32((const float *)Source + i);
+
+            v = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(v), vceqq_f32(v, v)));
+            v = vminq_f32(vmaxq_f32(v, lower), upper);
+
+            // fcvtzs truncates and saturates +2^31 to 0x7FFFFFFF by itself.
+            vst1q_s32((int32_t *)Destination + i, vcvtq_s32_f32(vmulq_f32(v, scale)));
+        }
+    }
+#endif
+
+    PcmConvert_ToInt32Scalar(SourceFormat, Destination, Source, i, Samples);
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+VOID
+PcmConvert_FromInt32
+(
+    PCM_SAMPLE_FORMAT   DestinationFormat,
+    VOID *              Destination,
+    const LONG *        Source,
+    ULONG               Samples
+)
+{
+    ULONG i = 0;
+
+#if defined(PCMCONVERT_SSE2)
+    if (DestinationFormat == PcmSampleFormatInt16)
+    {
+        for (; i + 8 <= Samples; i += 8)
+        {
+            __m128i a = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(Source + i)), 16);
+            __m128i b = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(Source + i + 4)), 16);
+
+            // Already in range, so the saturating pack is exact.
+            _mm_storeu_si128((__m128i *)((SHORT *)Destination + i), _mm_packs_epi32(a, b));
+        }
+    }
+    else if (DestinationFormat == PcmSampleFormatFloat32)
+    {
+        const __m128 scale = _mm_set1_ps(PCMCONVERT_FLOAT_INV_SCALE);
+
+        for (; i + 4 <= Samples; i += 4)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i *)(Source + i));
+
+            _mm_storeu_ps((float *)Destination + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+        }
+    }
+#elif defined(PCMCONVERT_NEON)
+    if (DestinationFormat == PcmSampleFormatInt16)
+    {
+        for (; i + 8 <= Samples; i += 8)
+        {
+            int32x4_t a = vld1q_s32((const int32_t *)Source + i);
+            int32x4_t b = vld1q_s32((const int32_t *)Source + i + 4);
+
+            vst1q_s16((int16_t *)Destination + i, vcombine_s16(vshrn_n_s32(a, 16), vshrn_n_s32(b, 16)));
+        }
+    }
+    else if (DestinationFormat == PcmSampleFormatFloat32)
+    {
+        const float32x4_t scale = vdupq_n_f32(PCMCONVERT_FLOAT_INV_SCALE);
+
+        for (; i + 4 <= Samples; i += 4)
+        {
+            int32x4_t x = vld1q_s32((const int32_t *)Source + i);
+
+            vst1q_f32((float *)Destination + i, vmulq_f32(vcvtq_f32_s32(x), scale));
+        }
+    }
+#endif
+
+    PcmConvert_FromInt32Scalar(DestinationFormat, Destination, Source, i, Samples);
+}
+
+//=============================================================================
+#pragma code_seg()
+ULONG
+PcmConvert_SampleBytes
+(
+    PCM_SAMPLE_FORMAT   Format
+)
+{
+    switch (Format)
+    {
+    case PcmSampleFormatInt16:      return 2;
+    case PcmSampleFormatInt24:      return 3;
+    case PcmSampleFormatInt32:      return 4;
+    case PcmSampleFormatFloat32:    return 4;
+    default:                        return 0;
+    }
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+PcmConvert
+(
+    PCM_SAMPLE_FORMAT   DestinationFormat,
+    VOID *              Destination,
+    PCM_SAMPLE_FORMAT   SourceFormat,
+    const VOID *        Source,
+    ULONG               Samples
+)
+{
+    LONG block[PCMCONVERT_BLOCK_SAMPLES];
+
+    if (DestinationFormat == SourceFormat)
+    {
+        if (Destination != Source)
+        {
+            memcpy(Destination, Source, (size_t)Samples * PcmConvert_SampleBytes(SourceFormat));
+        }
+        return;
+    }
+
+    if (DestinationFormat == PcmSampleFormatInt32)
+    {
+        PcmConvert_ToInt32(SourceFormat, (LONG *)Destination, Source, Samples);
+        return;
+    }
+
+    if (SourceFormat == PcmSampleFormatInt32)
+    {
+        PcmConvert_FromInt32(DestinationFormat, Destination, (const LONG *)Source, Samples);
+        return;
+    }
+
+    for (ULONG done = 0; done < Samples; )
+    {
+        ULONG count = Samples - done;
+
+        if (count > PCMCONVERT_BLOCK_SAMPLES)
+        {
+            count = PCMCONVERT_BLOCK_SAMPLES;
+        }
+
+        PcmConvert_ToInt32(SourceFormat,
+                           block,
+                           (const UCHAR *)Source + (size_t)done * PcmConvert_SampleBytes(SourceFormat),
+                           count);
+        PcmConvert_FromInt32(DestinationFormat,
+                             (UCHAR *)Destination + (size_t)done * PcmConvert_SampleBytes(DestinationFormat),
+                             block,
+                             count);
+        done += count;
+    }
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+PcmConvert_Reference
+(
+    PCM_SAMPLE_FORMAT   DestinationFormat,
+    VOID *              Destination,
+    PCM_SAMPLE_FORMAT   SourceFormat,
+    const VOID *        Source,
+    ULONG               Samples
+)
+{
+    LONG block[PCMCONVERT_BLOCK_SAMPLES];
+
+    if (DestinationFormat == SourceFormat)
+    {
+        if (Destination != Source)
+        {
+            memcpy(Destination, Source, (size_t)Samples * PcmConvert_SampleBytes(SourceFormat));
+        }
+        return;
+    }
+
+    for (ULONG done = 0; done < Samples; )
+    {
+        ULONG count = Samples - done;
+
+        if (count > PCMCONVERT_BLOCK_SAMPLES)
+        {
+            count = PCMCONVERT_BLOCK_SAMPLES;
+        }
+
+        PcmConvert_ToInt32Scalar(SourceFormat,
+                                 block,
+                                 (const UCHAR *)Source + (size_t)done * PcmConvert_SampleBytes(SourceFormat),
+                                 0,
+                                 count);
+        PcmConvert_FromInt32Scalar(DestinationFormat,
+                                   (UCHAR *)Destination + (size_t)done * PcmConvert_SampleBytes(DestinationFormat),
+                                   block,
+                                   0,
+                                   count);
+        done += count;
+    }
+}
+#pragma code_seg()
@@ -0,0 +1,100 @@
+/*++
+
+Module Name:
+
+    pcmconvert.h
+
+Abstract:
+
+    Sample format conversion between the PCM formats feeders produce and
+    the formats a capture endpoint exposes.
+
+    Every conversion is defined through 32-bit integer PCM, full scale at
+    2^31, so every kernel produces the same bits:
+
+      int16 / int24 -> int32    shift left into the top bits
+      int32 -> int16 / int24    arithmetic shift right (truncates the low bits)
+      float32 -> int32          NaN becomes 0, then clamped to [-1, 1], scaled
+                                by 2^31 and truncated toward zero; +1.0
+                                saturates to 0x7FFFFFFF
+      int32 -> float32          nearest float, scaled by 2^-31
+
+    The vector kernels (SSE2 on x64, NEON on ARM64) must match
+    PcmConvert_Reference bit for bit. Packed 24-bit samples are not aligned
+    to a vector lane and are only converted by the scalar code.
+
+    Interleaving does not matter to the conversion, so everything is
+    expressed in samples rather than frames.
+
+    The driver is only built for x64 and ARM64, where kernel code may use
+    SSE and NEON registers without saving any state. AVX2 would need
+    KeSaveExtendedProcessorState around every call from the DPC, which costs
+    more than it saves on the few hundred samples converted per wakeup, so
+    it is not used.
+--*/
+
+#ifndef _MICYAUDIO_PCMCONVERT_H_
+#define _MICYAUDIO_PCMCONVERT_H_
+
+#if !defined(_WIN32)
+#include <stdint.h>
+
+typedef int16_t         SHORT;
+typedef int32_t         LONG;
+typedef uint32_t        ULONG;
+typedef uint8_t         UCHAR;
+typedef void            VOID;
+#endif
+
+//
+// Values match MICYAUDIO_SAMPLE_FORMAT_* in micyioctl.h.
+//
+typedef enum _PCM_SAMPLE_FORMAT
+{
+    PcmSampleFormatInvalid  = 0,
+    PcmSampleFormatInt16    = 1,
+    PcmSampleFormatInt24    = 2,    // packed, 3 bytes little endian
+    PcmSampleFormatInt32    = 3,
+    PcmSampleFormatFloat32  = 4,
+    PcmSampleFormatCount
+} PCM_SAMPLE_FORMAT;
+
+//
+// Size of one sample, 0 for an unknown format.
+//
+ULONG
+PcmConvert_SampleBytes
+(
+    PCM_SAMPLE_FORMAT   Format
+);
+
+//
+// Converts Samples samples from Source to Destination using the fastest
+// kernel available on this processor. Buffers need no alignment beyond
+// their sample size and must not overlap, except that they may be the same
+// buffer when both formats are the same. Any IRQL.
+//
+VOID
+PcmConvert
+(
+    PCM_SAMPLE_FORMAT   DestinationFormat,
+    VOID *              Destination,
+    PCM_SAMPLE_FORMAT   SourceFormat,
+    const VOID *        Source,
+    ULONG               Samples
+);
+
+//
+// Scalar reference implementation that defines the results of PcmConvert.
+//
+VOID
+PcmConvert_Reference
+(
+    PCM_SAMPLE_FORMAT   DestinationFormat,
+    VOID *              Destination,
+    PCM_SAMPLE_FORMAT   SourceFormat,
+    const VOID *        Source,
+    ULONG               Samples
+);
+
+#endif // _MICYAUDIO_PCMCONVERT_H_
@@ -0,0 +1,429 @@
+/*++
+
+Module Name:
+
+    pcmgain.cpp
+
+Abstract:
+
+    Fixed point gain and gain ramps, see pcmgain.h.
+--*/
+#if defined(_WIN32)
+#include <ntdef.h>
+#endif
+#include "pcmgain.h"
+
+#if defined(_M_X64) || (defined(__x86_64__) && defined(__SSE2__))
+#define PCMGAIN_SSE2
+#include <emmintrin.h>
+#elif defined(_M_ARM64) || (defined(__aarch64__) && defined(__ARM_NEON))
+#define PCMGAIN_NEON
+#if defined(_MSC_VER)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
+#if !defined(_WIN32)
+typedef int64_t         LONGLONG;
+typedef uint64_t        ULONGLONG;
+#define FORCEINLINE     static inline __attribute__((always_inline))
+#endif
+
+//
+// Samples converted to int32 per pass for formats other than int32.
+//
+#define PCMGAIN_BLOCK_SAMPLES       256
+
+//
+// Volume levels are in 1/65536 dB; the table has an entry every 0.5 dB down
+// to -96 dB.
+//
+#define PCMGAIN_TABLE_STEP          0x8000
+#define PCMGAIN_TABLE_ENTRIES       193
+
+//
+// round(2^30 * 10^(-n / 40)), the Q30 gain of -n/2 dB.
+//
+static const LONG g_PcmGainTable[PCMGAIN_TABLE_ENTRIES] =
+{
+    1073741824, 1013677647,  956973408,  903441154,  852903448,  805192776,
+     760150998,  717628817,  677485290,  639587356,  603809400,  570032831,
+     538145694,  508042296,  479622855,  452793173,  427464319,  403552340,
+     380977976,  359666402,  339546978,  320553018,  302621563,  285693178,
+     269711752,  254624313,  240380852,  226934158,  214239660,  202255281,
+     190941298,  180260209,  170176611,  160657080,  151670064,  143185773,
+     135176087,  127614455,  120475814,  113736503,  107374182,  101367765,
+      95697341,   90344115,   85290345,   80519278,   76015100,   71762882,
+      67748529,   63958736,   60380940,   57003283,   53814569,   50804230,
+      47962285,   45279317,   42746432,   40355234,   38097798,   35966640,
+      33954698,   32055302,   30262156,   28569318,   26971175,   25462431,
+      24038085,   22693416,   21423966,   20225528,   19094130,   18026021,
+      17017661,   16065708,   15167006,   14318577,   13517609,   12761445,
+      12047581,   11373650,   10737418,   10136776,    9569734,    9034412,
+       8529034,    8051928,    7601510,    7176288,    6774853,    6395874,
+       6038094,    5700328,    5381457,    5080423,    4796229,    4527932,
+       4274643,    4035523,    3809780,    3596664,    3395470,    3205530,
+       3026216,    2856932,    2697118,    2546243,    2403809,    2269342,
+       2142397,    2022553,    1909413,    1802602,    1701766,    1606571,
+       1516701,    1431858,    1351761,    1276145,    1204758,    1137365,
+       1073742,    1013678,     956973,     903441,     852903,     805193,
+        760151,     717629,     677485,     639587,     603809,     570033,
+        538146,     508042,     479623,     452793,     427464,     403552,
+        380978,     359666,     339547,     320553,     302622,     285693,
+        269712,     254624,     240381,     226934,     214240,     202255,
+        190941,     180260,     170177,     160657,     151670,     143186,
+        135176,     127614,     120476,     113737,     107374,     101368,
+         95697,      90344,      85290,      80519,      76015,      71763,
+         67749,      63959,      60381,      57003,      53815,      50804,
+         47962,      45279,      42746,      40355,      38098,      35967,
+         33955,      32055,      30262,      28569,      26971,      25462,
+         24038,      22693,      21424,      20226,      19094,      18026,
+         17018
+};
+
+//=============================================================================
+#pragma code_seg()
+static
+LONG
+PcmGain_Sample
+(
+    LONG    Sample,
+    LONG    Gain
+)
+/*++
+
+Routine Description:
+
+  One sample: the magnitude times the gain, rounded half away from zero,
+  limited to what the sign allows and signed again. The vector kernels
+  follow the same steps and produce the same bits.
+
+--*/
+{
+    ULONG       sign = (Sample < 0) ? 0xFFFFFFFF : 0;
+    ULONG       magnitude = ((ULONG)Sample ^ sign) - sign;
+    ULONG       limit = 0x7FFFFFFF - sign;
+    ULONGLONG   product = ((ULONGLONG)magnitude * (ULONG)Gain + (1 << 29)) >> 30;
+
+    if (product > limit)
+    {
+        product = limit;
+    }
+
+    return (LONG)(((ULONG)product ^ sign) - sign);
+}
+
+#if defined(PCMGAIN_SSE2)
+//=============================================================================
+#pragma code_seg()
+FORCEINLINE
+__m128i
+PcmGain_Vector
+(
+    __m128i Sample,
+    __m128i Gain
+)
+{
+    const __m128i round = _mm_set_epi32(0, 1 << 29, 0, 1 << 29);
+    const __m128i bias = _mm_set1_epi32((int)0x80000000);
+    __m128i sign = _mm_srai_epi32(Sample, 31);
+    __m128i magnitude = _mm_sub_epi32(_mm_xor_si128(Sample, sign), sign);
+    __m128i limit = _mm_sub_epi32(_mm_set1_epi32(0x7FFFFFFF), sign);
+    __m128i even;
+    __m128i odd;
+    __m128i product;
+    __m128i over;
+
+    // A gain is below 2.0, so both products fit in 32 bits after the shift
+    // and the odd lanes can simply be moved up over the even ones.
+    even = _mm_srli_epi64(_mm_add_epi64(_mm_mul_epu32(magnitude, Gain), round), 30);
+    odd  = _mm_srli_epi64(_mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(magnitude, 32),
+                                                      _mm_srli_epi64(Gain, 32)), round), 30);
+    product = _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+
+    // Unsigned product > limit, with the signed compare SSE2 has.
+    over = _mm_cmpgt_epi32(_mm_xor_si128(product, bias), _mm_xor_si128(limit, bias));
+    product = _mm_or_si128(_mm_and_si128(over, limit), _mm_andnot_si128(over, product));
+
+    return _mm_sub_epi32(_mm_xor_si128(product, sign), sign);
+}
+#elif defined(PCMGAIN_NEON)
+//=============================================================================
+#pragma code_seg()
+FORCEINLINE
+int32x4_t
+PcmGain_Vector
+(
+    int32x4_t   Sample,
+    int32x4_t   Gain
+)
+{
+    uint32x4_t  sign = vreinterpretq_u32_s32(vshrq_n_s32(Sample, 31));
+    uint32x4_t  magnitude = vsubq_u32(veorq_u32(vreinterpretq_u32_s32(Sample), sign), sign);
+    uint32x4_t  limit = vsubq_u32(vdupq_n_u32(0x7FFFFFFF), sign);
+    uint32x4_t  gain = vreinterpretq_u32_s32(Gain);
+    uint32x4_t  product;
+
+    // Rounding narrowing shifts. The products are below 2^32 after the
+    // shift, so the limit is applied on the 32-bit result.
+    product = vcombine_u32(vqrshrn_n_u64(vmull_u32(vget_low_u32(magnitude), vget_low_u32(gain)), 30),
+                           vqrshrn_n_u64(vmull_high_u32(magnitude, gain), 30));
+    product = vminq_u32(product, limit);
+
+    return vreinterpretq_s32_u32(vsubq_u32(veorq_u32(product, sign), sign));
+}
+#endif
+
+#if defined(PCMGAIN_SSE2) || defined(PCMGAIN_NEON)
+
+//
+// Most vectors one iteration of the vector kernel covers, for 7 channels.
+//
+#define PCMGAIN_MAX_VECTORS         7
+
+//
+// Expands Op for every vector index the kernel may use; see pcmmeter.cpp.
+// Guarding each use by v < Vectors, a constant, keeps the gains and their
+// increments in registers.
+//
+#define PCMGAIN_FOR_EACH_VECTOR(Op) \
+    Op(0) Op(1) Op(2) Op(3) Op(4) Op(5) Op(6)
+
+#if defined(PCMGAIN_SSE2)
+#define PCMGAIN_VECTOR              __m128i
+#define PCMGAIN_LOAD(v)                                                                     \
+    if ((v) < Vectors)                                                                      \
+    {                                                                                       \
+        g[v] = _mm_loadu_si128((const __m128i *)(gain + 4 * (v)));                          \
+        d[v] = _mm_loadu_si128((const __m128i *)(increment + 4 * (v)));                     \
+    }
+#define PCMGAIN_STEP(v)                                                                     \
+    if ((v) < Vectors)                                                                      \
+    {                                                                                       \
+        __m128i x = _mm_loadu_si128((const __m128i *)(Samples + done + 4 * (v)));           \
+        _mm_storeu_si128((__m128i *)(Samples + done + 4 * (v)), PcmGain_Vector(x, g[v]));   \
+        g[v] = _mm_add_epi32(g[v], d[v]);                                                   \
+    }
+#else
+#define PCMGAIN_VECTOR              int32x4_t
+#define PCMGAIN_LOAD(v)                                                                     \
+    if ((v) < Vectors)                                                                      \
+    {                                                                                       \
+        g[v] = vld1q_s32((const int32_t *)(gain + 4 * (v)));                                \
+        d[v] = vld1q_s32((const int32_t *)(increment + 4 * (v)));                           \
+    }
+#define PCMGAIN_STEP(v)                                                                     \
+    if ((v) < Vectors)                                                                      \
+    {                                                                                       \
+        int32x4_t x = vld1q_s32((const int32_t *)(Samples + done + 4 * (v)));               \
+        vst1q_s32((int32_t *)(Samples + done + 4 * (v)), PcmGain_Vector(x, g[v]));          \
+        g[v] = vaddq_s32(g[v], d[v]);                                                       \
+    }
+#endif
+
+//=============================================================================
+#pragma code_seg()
+template <ULONG Vectors>
+static
+ULONG
+PcmGain_Int32Vector
+(
+    LONG *          Samples,
+    ULONG           Channels,
+    ULONG           Count,
+    const LONG *    StartGain,
+    const LONG *    Step
+)
+/*++
+
+Routine Description:
+
+  Vector kernel covering Vectors vectors per iteration, chosen so an
+  iteration spans a whole number of frames: lane j of vector v then always
+  holds channel (4 * v + j) % Channels, and its gain only needs that
+  channel's step times the frames of an iteration added each time round.
+
+Return Value:
+
+  Number of samples processed, a whole number of iterations.
+
+--*/
+{
+    const ULONG     lanes = Vectors * 4;
+    const LONG      framesPerIteration = (LONG)(lanes / Channels);
+    ULONG           done = 0;
+    LONG            gain[PCMGAIN_MAX_VECTORS * 4];
+    LONG            increment[PCMGAIN_MAX_VECTORS * 4];
+    PCMGAIN_VECTOR  g[PCMGAIN_MAX_VECTORS];
+    PCMGAIN_VECTOR  d[PCMGAIN_MAX_VECTORS];
+
+    for (ULONG i = 0; i < lanes; i++)
+    {
+        ULONG c = i % Channels;
+
+        gain[i]      = StartGain[c] + Step[c] * (LONG)(i / Channels);
+        increment[i] = Step[c] * framesPerIteration;
+    }
+
+    PCMGAIN_FOR_EACH_VECTOR(PCMGAIN_LOAD)
+
+    for (; done + lanes <= Count; done += lanes)
+    {
+        PCMGAIN_FOR_EACH_VECTOR(PCMGAIN_STEP)
+    }
+
+    return done;
+}
+#endif
+
+//=============================================================================
+#pragma code_seg()
+static
+VOID
+PcmGain_Int32
+(
+    LONG *          Samples,
+    ULONG           Channels,
+    ULONG           Frames,
+    const LONG *    StartGain,
+    const LONG *    Step
+)
+/*++
+
+Routine Description:
+
+  Applies the ramps to 32-bit PCM: 4 vectors per iteration for 1, 2, 4 or
+  8 channels, and 3, 5, 3 or 7 vectors for 3, 5, 6 or 7 channels, the
+  fewest that span whole frames. What is left over is a whole number of
+  frames and goes through the scalar code.
+
+Arguments:
+
+  Step - per channel, what the gain changes by from one frame to the next.
+
+--*/
+{
+    ULONG   samples = Frames * Channels;
+    ULONG   done = 0;
+
+#if defined(PCMGAIN_SSE2) || defined(PCMGAIN_NEON)
+    switch (Channels)
+    {
+        case 1:
+        case 2:
+        case 4:
+        case 8:
+            done = PcmGain_Int32Vector<4>(Samples, Channels, samples, StartGain, Step);
+            break;
+        case 3:
+        case 6:
+            done = PcmGain_Int32Vector<3>(Samples, Channels, samples, StartGain, Step);
+            break;
+        case 5:
+            done = PcmGain_Int32Vector<5>(Samples, Channels, samples, StartGain, Step);
+            break;
+        case 7:
+            done = PcmGain_Int32Vector<7>(Samples, Channels, samples, StartGain, Step);
+            break;
+    }
+#endif
+
+    for (ULONG frame = done / Channels; done < samples; frame++)
+    {
+        for (ULONG c = 0; c < Channels; c++, done++)
+        {
+            Samples[done] = PcmGain_Sample(Samples[done], StartGain[c] + Step[c] * (LONG)frame);
+        }
+    }
+}
+
+//=============================================================================
+#pragma code_seg()
+LONG
+PcmGain_FromVolume
+(
+    LONG                Volume
+)
+{
+    ULONG   offset;
+    ULONG   index;
+    ULONG   fraction;
+
+    if (Volume >= 0)
+    {
+        return PCM_GAIN_UNITY;
+    }
+
+    offset   = (ULONG)0 - (ULONG)Volume;
+    index    = offset / PCMGAIN_TABLE_STEP;
+    fraction = offset % PCMGAIN_TABLE_STEP;
+
+    if (index >= PCMGAIN_TABLE_ENTRIES - 1)
+    {
+        return g_PcmGainTable[PCMGAIN_TABLE_ENTRIES - 1];
+    }
+
+    // The table falls steadily, so the next entry is always the smaller one.
+    return g_PcmGainTable[index] -
+           (LONG)(((ULONGLONG)(g_PcmGainTable[index] - g_PcmGainTable[index + 1]) * fraction) / PCMGAIN_TABLE_STEP);
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+PcmGain_Apply
+(
+    PCM_SAMPLE_FORMAT   Format,
+    VOID *              Samples,
+    ULONG               Channels,
+    ULONG               Frames,
+    const LONG *        StartGain,
+    const LONG *        EndGain
+)
+{
+    ULONG   frameBytes = Channels * PcmConvert_SampleBytes(Format);
+    LONG    start[PCM_GAIN_MAX_CHANNELS];
+    LONG    step[PCM_GAIN_MAX_CHANNELS];
+
+    if (Channels == 0 || Channels > PCM_GAIN_MAX_CHANNELS || frameBytes == 0 || Frames == 0)
+    {
+        return;
+    }
+
+    for (ULONG c = 0; c < Channels; c++)
+    {
+        LONG from = (StartGain[c] < 0) ? 0 : StartGain[c];
+        LONG to   = (EndGain[c] < 0) ? 0 : EndGain[c];
+
+        // Truncating keeps every frame's gain between the two ends.
+        start[c] = from;
+        step[c]  = (LONG)(((LONGLONG)to - from) / (LONGLONG)Frames);
+    }
+
+    if (Format == PcmSampleFormatInt32)
+    {
+        PcmGain_Int32((LONG *)Samples, Channels, Frames, start, step);
+        return;
+    }
+
+    while (Frames > 0)
+    {
+        LONG  block[PCMGAIN_BLOCK_SAMPLES];
+        ULONG count = (Frames < PCMGAIN_BLOCK_SAMPLES / Channels) ? Frames : PCMGAIN_BLOCK_SAMPLES / Channels;
+
+        PcmConvert(PcmSampleFormatInt32, block, Format, Samples, count * Channels);
+        PcmGain_Int32(block, Channels, count, start, step);
+        PcmConvert(Format, Samples, PcmSampleFormatInt32, block, count * Channels);
+
+        for (ULONG c = 0; c < Channels; c++)
+        {
+            start[c] += step[c] * (LONG)count;
+        }
+
+        Samples = (unsigned char *)Samples + count * frameBytes;
+        Frames -= count;
+    }
+}
+#pragma code_seg()
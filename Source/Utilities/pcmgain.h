@@ -0,0 +1,67 @@
+/*++
+
+Module Name:
+
+    pcmgain.h
+
+Abstract:
+
+    Gain for interleaved PCM, in the fixed point the volume nodes map to.
+
+    Gains are Q30: PCM_GAIN_UNITY is exactly 1.0 and the largest gain just
+    under 2.0. Every sample is multiplied in 64 bits, rounded half away from
+    zero and saturated to the 32-bit range, so a gain of exactly unity
+    leaves the audio bit for bit unchanged.
+
+    A gain can ramp linearly from one value per channel to another over the
+    frames of a call, which is how the capture stream moves between volume
+    settings without the steps a listener hears as zipper noise. The ramp
+    is per frame, so the channels of a frame always get the same point of
+    their ramps.
+
+    The kernel works on 32-bit PCM (SSE2 on x64, NEON on ARM64); other
+    sample formats are converted to 32-bit PCM with PcmConvert a block at a
+    time and back.
+--*/
+
+#ifndef _MICYAUDIO_PCMGAIN_H_
+#define _MICYAUDIO_PCMGAIN_H_
+
+#include "pcmconvert.h"
+
+#define PCM_GAIN_MAX_CHANNELS       8
+
+#define PCM_GAIN_SILENCE            0
+#define PCM_GAIN_UNITY              0x40000000
+#define PCM_GAIN_MAXIMUM            0x7FFFFFFF
+
+//
+// Q30 gain of a volume level in 1/65536 dB, as KSPROPERTY_AUDIO_VOLUMELEVEL
+// has it. Levels are looked up in a table of 0.5 dB steps from 0 dB down to
+// -96 dB and interpolated in between; levels above 0 dB are unity and levels
+// below -96 dB are -96 dB.
+//
+LONG
+PcmGain_FromVolume
+(
+    LONG                Volume
+);
+
+//
+// Multiplies Frames interleaved frames of Channels channels, at most
+// PCM_GAIN_MAX_CHANNELS, in place. Channel c ramps linearly from
+// StartGain[c] on the first frame towards EndGain[c], which the frame after
+// the last one would get. Does nothing for an unknown format. Any IRQL.
+//
+VOID
+PcmGain_Apply
+(
+    PCM_SAMPLE_FORMAT   Format,
+    VOID *              Samples,
+    ULONG               Channels,
+    ULONG               Frames,
+    const LONG *        StartGain,
+    const LONG *        EndGain
+);
+
+#endif // _MICYAUDIO_PCMGAIN_H_
@@ -0,0 +1,337 @@
+/*++
+
+Module Name:
+
+    pcmmeter.cpp
+
+Abstract:
+
+    Peak and RMS metering, see pcmmeter.h.
+--*/
+#if defined(_WIN32)
+#include <ntdef.h>
+#endif
+#include <string.h>
+#include "pcmmeter.h"
+
+#if defined(_M_X64) || (defined(__x86_64__) && defined(__SSE2__))
+#define PCMMETER_SSE2
+#include <emmintrin.h>
+#elif defined(_M_ARM64) || (defined(__aarch64__) && defined(__ARM_NEON))
+#define PCMMETER_NEON
+#if defined(_MSC_VER)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
+//
+// Samples converted to int32 per pass for formats other than int32.
+//
+#define PCMMETER_BLOCK_SAMPLES      256
+
+#define PCMMETER_INV_SCALE          (1.0f / 2147483648.0f)
+
+
+#if defined(PCMMETER_SSE2) || defined(PCMMETER_NEON)
+
+//
+// Most vectors one iteration of the vector kernel loads, for 7 channels.
+//
+#define PCMMETER_MAX_VECTORS        7
+
+//
+// Expands Op for every vector index the kernel may use. Each use is guarded
+// by v < Vectors, a constant, so the unused ones compile away and every
+// accumulator is only ever indexed by a constant, which keeps them all in
+// registers.
+//
+#define PCMMETER_FOR_EACH_VECTOR(Op) \
+    Op(0) Op(1) Op(2) Op(3) Op(4) Op(5) Op(6)
+
+#if defined(PCMMETER_SSE2)
+#define PCMMETER_VECTOR             __m128
+#define PCMMETER_ZERO(v)            if ((v) < Vectors) { p[v] = _mm_setzero_ps(); q[v] = _mm_setzero_ps(); }
+#define PCMMETER_STEP(v)                                                                    \
+    if ((v) < Vectors)                                                                      \
+    {                                                                                       \
+        __m128 x = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(Source + done + 4 * (v)))); \
+        p[v] = _mm_max_ps(p[v], _mm_andnot_ps(sign, x));                                    \
+        q[v] = _mm_add_ps(q[v], _mm_mul_ps(x, x));                                          \
+    }
+#define PCMMETER_STORE(v)           if ((v) < Vectors) { _mm_storeu_ps(peak + 4 * (v), p[v]); _mm_storeu_ps(sum + 4 * (v), q[v]); }
+#else
+#define PCMMETER_VECTOR             float32x4_t
+#define PCMMETER_ZERO(v)            if ((v) < Vectors) { p[v] = vdupq_n_f32(0.0f); q[v] = vdupq_n_f32(0.0f); }
+#define PCMMETER_STEP(v)                                                                    \
+    if ((v) < Vectors)                                                                      \
+    {                                                                                       \
+        float32x4_t x = vcvtq_f32_s32(vld1q_s32((const int32_t *)(Source + done + 4 * (v)))); \
+        p[v] = vmaxq_f32(p[v], vabsq_f32(x));                                               \
+        q[v] = vfmaq_f32(q[v], x, x);                                                       \
+    }
+#define PCMMETER_STORE(v)           if ((v) < Vectors) { vst1q_f32(peak + 4 * (v), p[v]); vst1q_f32(sum + 4 * (v), q[v]); }
+#endif
+
+//=============================================================================
+#pragma code_seg()
+template <ULONG Vectors>
+static
+ULONG
+PcmMeter_Int32Vector
+(
+    PPCM_METER      Meter,
+    const LONG *    Source,
+    ULONG           Samples
+)
+/*++
+
+Routine Description:
+
+  Vector kernel loading Vectors vectors per iteration, chosen so an
+  iteration spans a whole number of frames: lane j of vector v then always
+  holds channel (4 * v + j) % Channels and the lanes are only folded into
+  channels at the end. Samples are not scaled to full scale 1.0 until then
+  either; a float holds the sum of squares of any realistic packet of
+  full-scale int32 samples with room to spare.
+
+Return Value:
+
+  Number of samples measured, a whole number of iterations.
+
+--*/
+{
+    const ULONG     step = Vectors * 4;
+    ULONG           done = 0;
+    float           peak[PCMMETER_MAX_VECTORS * 4];
+    float           sum[PCMMETER_MAX_VECTORS * 4];
+    PCMMETER_VECTOR p[PCMMETER_MAX_VECTORS];
+    PCMMETER_VECTOR q[PCMMETER_MAX_VECTORS];
+#if defined(PCMMETER_SSE2)
+    const __m128    sign = _mm_set1_ps(-0.0f);
+#endif
+
+    PCMMETER_FOR_EACH_VECTOR(PCMMETER_ZERO)
+
+    for (; done + step <= Samples; done += step)
+    {
+        PCMMETER_FOR_EACH_VECTOR(PCMMETER_STEP)
+    }
+
+    PCMMETER_FOR_EACH_VECTOR(PCMMETER_STORE)
+
+    for (ULONG i = 0; i < step; i++)
+    {
+        ULONG c = i % Meter->Channels;
+
+        if (peak[i] * PCMMETER_INV_SCALE > Meter->Peak[c])
+        {
+            Meter->Peak[c] = peak[i] * PCMMETER_INV_SCALE;
+        }
+        Meter->SumSquares[c] += (double)sum[i] * PCMMETER_INV_SCALE * PCMMETER_INV_SCALE;
+    }
+
+    return done;
+}
+#endif
+
+//=============================================================================
+#pragma code_seg()
+static
+VOID
+PcmMeter_Int32
+(
+    PPCM_METER      Meter,
+    const LONG *    Source,
+    ULONG           Frames
+)
+/*++
+
+Routine Description:
+
+  Measures whole frames of interleaved 32-bit PCM: 4 vectors per iteration
+  for 1, 2, 4 or 8 channels, which also keeps several additions in flight,
+  and 3, 5, 3 or 7 vectors for 3, 5, 6 or 7 channels. What is left over is
+  a whole number of frames and goes through the scalar code.
+
+--*/
+{
+    ULONG   channels = Meter->Channels;
+    ULONG   samples = Frames * channels;
+    ULONG   done = 0;
+
+#if defined(PCMMETER_SSE2) || defined(PCMMETER_NEON)
+    switch (channels)
+    {
+        case 1:
+        case 2:
+        case 4:
+        case 8:
+            done = PcmMeter_Int32Vector<4>(Meter, Source, samples);
+            break;
+        case 3:
+        case 6:
+            done = PcmMeter_Int32Vector<3>(Meter, Source, samples);
+            break;
+        case 5:
+            done = PcmMeter_Int32Vector<5>(Meter, Source, samples);
+            break;
+        case 7:
+            done = PcmMeter_Int32Vector<7>(Meter, Source, samples);
+            break;
+    }
+#endif
+
+    for (ULONG c = 0; done < samples; done++)
+    {
+        float x = (float)Source[done] * PCMMETER_INV_SCALE;
+        float a = (x < 0.0f) ? -x : x;
+
+        if (a > Meter->Peak[c])
+        {
+            Meter->Peak[c] = a;
+        }
+        Meter->SumSquares[c] += x * x;
+
+        if (++c == channels)
+        {
+            c = 0;
+        }
+    }
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+ULONG
+PcmMeter_ToLevel
+(
+    double  Value
+)
+{
+    if (Value >= 1.0)
+    {
+        return 0x7FFFFFFF;
+    }
+
+    return (Value > 0.0) ? (ULONG)(Value * 2147483647.0) : 0;
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+PcmMeter_Reset
+(
+    PPCM_METER          Meter,
+    ULONG               Channels
+)
+{
+    memset(Meter, 0, sizeof(*Meter));
+
+    Meter->Channels = (Channels > PCM_METER_MAX_CHANNELS) ? PCM_METER_MAX_CHANNELS : Channels;
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+PcmMeter_Accumulate
+(
+    PPCM_METER          Meter,
+    PCM_SAMPLE_FORMAT   Format,
+    const VOID *        Source,
+    ULONG               Frames
+)
+{
+    ULONG channels = Meter->Channels;
+    ULONG frameBytes = channels * PcmConvert_SampleBytes(Format);
+
+    if (channels == 0 || frameBytes == 0)
+    {
+        return;
+    }
+
+    Meter->Frames += Frames;
+
+    if (Format == PcmSampleFormatInt32)
+    {
+        PcmMeter_Int32(Meter, (const LONG *)Source, Frames);
+        return;
+    }
+
+    while (Frames > 0)
+    {
+        LONG  block[PCMMETER_BLOCK_SAMPLES];
+        ULONG count = (Frames < PCMMETER_BLOCK_SAMPLES / channels) ? Frames : PCMMETER_BLOCK_SAMPLES / channels;
+
+        PcmConvert(PcmSampleFormatInt32, block, Format, Source, count * channels);
+        PcmMeter_Int32(Meter, block, count);
+
+        Source = (const unsigned char *)Source + count * frameBytes;
+        Frames -= count;
+    }
+}
+
+//=============================================================================
+#pragma code_seg()
+ULONG
+PcmMeter_GetPeak
+(
+    PPCM_METER          Meter,
+    ULONG               Channel
+)
+{
+    if (Channel >= Meter->Channels)
+    {
+        return 0;
+    }
+
+    return PcmMeter_ToLevel(Meter->Peak[Channel]);
+}
+
+//=============================================================================
+#pragma code_seg()
+ULONG
+PcmMeter_GetRms
+(
+    PPCM_METER          Meter,
+    ULONG               Channel
+)
+/*++
+
+Routine Description:
+
+  sqrt(SumSquares / Frames), by Newton's method from an estimate that is
+  never below the root, so it converges from above in a few steps.
+
+--*/
+{
+    double mean;
+    double root;
+
+    if (Channel >= Meter->Channels || Meter->Frames == 0)
+    {
+        return 0;
+    }
+
+    mean = Meter->SumSquares[Channel] / Meter->Frames;
+    if (mean <= 0.0)
+    {
+        return 0;
+    }
+
+    // Samples are within [-1, 1], so mean <= 1 and the root is >= mean.
+    root = 1.0;
+    for (int i = 0; i < 64; i++)
+    {
+        double next = 0.5 * (root + mean / root);
+        if (next >= root)
+        {
+            break;
+        }
+        root = next;
+    }
+
+    return PcmMeter_ToLevel(root);
+}
+#pragma code_seg()
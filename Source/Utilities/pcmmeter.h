@@ -0,0 +1,83 @@
+/*++
+
+Module Name:
+
+    pcmmeter.h
+
+Abstract:
+
+    Per-channel peak and RMS metering of interleaved PCM.
+
+    A meter accumulates the largest absolute sample and the sum of squares
+    of every channel over whatever audio is fed to it, until it is read and
+    reset. Levels are linear, full scale 1.0, and are reported as 0 to
+    0x7FFFFFFF like KSPROPERTY_AUDIO_PEAKMETER2 values.
+
+    The kernel works on 32-bit PCM, converted to float in registers (SSE2 on
+    x64, NEON on ARM64) four samples per vector. Each iteration loads a
+    whole number of frames, so every lane always holds the same channel and
+    the lanes are only folded into channels once per call. Other sample
+    formats are converted to 32-bit PCM with PcmConvert a block at a time
+    first.
+--*/
+
+#ifndef _MICYAUDIO_PCMMETER_H_
+#define _MICYAUDIO_PCMMETER_H_
+
+#include "pcmconvert.h"
+
+#define PCM_METER_MAX_CHANNELS      8
+
+typedef struct _PCM_METER
+{
+    ULONG       Channels;
+    ULONG       Frames;                                 // measured since reset
+    float       Peak[PCM_METER_MAX_CHANNELS];           // largest |sample|
+    double      SumSquares[PCM_METER_MAX_CHANNELS];
+} PCM_METER, *PPCM_METER;
+
+//
+// Starts a new measurement over Channels channels, at most
+// PCM_METER_MAX_CHANNELS. Any IRQL.
+//
+VOID
+PcmMeter_Reset
+(
+    PPCM_METER          Meter,
+    ULONG               Channels
+);
+
+//
+// Adds Frames interleaved frames of Format to the measurement. Does nothing
+// for an unknown format. Any IRQL.
+//
+VOID
+PcmMeter_Accumulate
+(
+    PPCM_METER          Meter,
+    PCM_SAMPLE_FORMAT   Format,
+    const VOID *        Source,
+    ULONG               Frames
+);
+
+//
+// Peak of Channel since the last reset, 0 to 0x7FFFFFFF.
+//
+ULONG
+PcmMeter_GetPeak
+(
+    PPCM_METER          Meter,
+    ULONG               Channel
+);
+
+//
+// RMS level of Channel since the last reset, 0 to 0x7FFFFFFF.
+//
+ULONG
+PcmMeter_GetRms
+(
+    PPCM_METER          Meter,
+    ULONG               Channel
+);
+
+#endif // _MICYAUDIO_PCMMETER_H_
@@ -0,0 +1,623 @@
+/*++
+
+Module Name:
+
+    resampler.cpp
+
+Abstract:
+
+    Streaming polyphase sample-rate converter, see resampler.h.
+
+    The filter is designed here rather than taken from tables, so any pair
+    of supported rates works. Kernel code has no math library, so the few
+    functions the design needs (sin, sqrt and the Bessel function I0) are
+    evaluated by series; they only run once per Resampler_Init.
+--*/
+#if defined(_WIN32)
+#include <ntdef.h>
+#endif
+#include <string.h>
+#include "resampler.h"
+
+#if defined(_M_X64) || (defined(__x86_64__) && defined(__SSE2__))
+#define RESAMPLER_SSE2
+#include <emmintrin.h>
+#elif defined(_M_ARM64) || (defined(__aarch64__) && defined(__ARM_NEON))
+#define RESAMPLER_NEON
+#if defined(_MSC_VER)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
+//
+// Input frames queued per call beyond the filter's own history.
+//
+#define RESAMPLER_BLOCK_FRAMES      256
+
+#define RESAMPLER_PI                3.14159265358979323846
+
+//
+// Taps per phase are a multiple of this, so the dot product needs no tail.
+//
+#define RESAMPLER_TAP_MULTIPLE      8
+
+//
+// Fewest phases an adjustable converter is built with. Interpolating
+// linearly between phases 1/128 of an input frame apart keeps the error
+// below -95 dB up to 10 kHz at 48 kHz.
+//
+#define RESAMPLER_ADJUSTABLE_MIN_PHASES 128
+
+typedef struct _RESAMPLER_PRESET
+{
+    ULONG   Taps;           // per phase, before widening for decimation
+    double  Beta;           // Kaiser window shape
+    double  Rolloff;        // cutoff as a fraction of the lower Nyquist
+} RESAMPLER_PRESET;
+
+static const RESAMPLER_PRESET g_ResamplerPresets[ResamplerQualityCount] =
+{
+    { 32, 8.0,  0.90 },     // ResamplerQualityDefault
+    { 16, 6.0,  0.80 },     // ResamplerQualityLow
+    { 32, 8.0,  0.90 },     // ResamplerQualityMedium
+    { 64, 10.0, 0.94 },     // ResamplerQualityHigh
+};
+
+struct _RESAMPLER
+{
+    ULONG       Up;             // L, output frames per M input frames
+    ULONG       Down;           // M
+    ULONG       Channels;
+    ULONG       Taps;           // N, per phase
+    ULONG       Capacity;       // frames of history per channel
+    ULONG       Count;          // frames of history queued
+    ULONG       Position;       // first history frame under the filter
+    ULONG       Flags;          // RESAMPLER_FLAG_*
+    ULONGLONG   Phase;          // current phase in 32.32 fixed point, < Up
+    ULONGLONG   Step;           // phase advance per output frame, Down trimmed
+    float *     Coefficients;   // [Up][Taps], each phase time-reversed
+    float *     History;        // [Channels][Capacity]
+};
+
+//=============================================================================
+// Filter design
+//=============================================================================
+
+#pragma code_seg()
+static
+ULONG
+Resampler_Gcd
+(
+    ULONG   A,
+    ULONG   B
+)
+{
+    while (B != 0)
+    {
+        ULONG t = A % B;
+        A = B;
+        B = t;
+    }
+    return A;
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+double
+Resampler_Sin
+(
+    double  X
+)
+/*++
+
+Routine Description:
+
+  sin(X), reduced to [-pi/2, pi/2] and evaluated by its Taylor series, good
+  to about 1e-10 there.
+
+--*/
+{
+    double x2;
+    double term;
+    double sum;
+    LONGLONG turns = (LONGLONG)(X / (2.0 * RESAMPLER_PI) + (X >= 0 ? 0.5 : -0.5));
+
+    X -= (double)turns * 2.0 * RESAMPLER_PI;
+
+    if (X > RESAMPLER_PI / 2)
+    {
+        X = RESAMPLER_PI - X;
+    }
+    else if (X < -RESAMPLER_PI / 2)
+    {
+        X = -RESAMPLER_PI - X;
+    }
+
+    x2   = X * X;
+    term = X;
+    sum  = X;
+    for (int k = 1; k <= 7; k++)
+    {
+        term *= -x2 / ((2 * k) * (2 * k + 1));
+        sum  += term;
+    }
+
+    return sum;
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+double
+Resampler_Sqrt
+(
+    double  X
+)
+{
+    double y;
+
+    if (X <= 0.0)
+    {
+        return 0.0;
+    }
+
+    y = (X > 1.0) ? X : 1.0;
+    for (int i = 0; i < 64; i++)
+    {
+        double next = 0.5 * (y + X / y);
+        if (next >= y)
+        {
+            break;
+        }
+        y = next;
+    }
+
+    return y;
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+double
+Resampler_BesselI0
+(
+    double  X
+)
+{
+    double half = X / 2.0;
+    double term = 1.0;
+    double sum  = 1.0;
+
+    for (int k = 1; k < 100; k++)
+    {
+        term *= (half / k) * (half / k);
+        sum  += term;
+        if (term < sum * 1e-14)
+        {
+            break;
+        }
+    }
+
+    return sum;
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+BOOLEAN
+Resampler_GetShape
+(
+    ULONG               InputRate,
+    ULONG               OutputRate,
+    ULONG               Channels,
+    RESAMPLER_QUALITY   Quality,
+    ULONG               Flags,
+    ULONG *             Up,
+    ULONG *             Down,
+    ULONG *             Taps,
+    ULONG *             Capacity
+)
+{
+    ULONG gcd;
+    ULONG widen;
+
+    if (InputRate < RESAMPLER_MIN_RATE || InputRate > RESAMPLER_MAX_RATE ||
+        OutputRate < RESAMPLER_MIN_RATE || OutputRate > RESAMPLER_MAX_RATE ||
+        Channels == 0 || Channels > RESAMPLER_MAX_CHANNELS ||
+        (ULONG)Quality >= ResamplerQualityCount ||
+        (Flags & ~RESAMPLER_FLAG_ADJUSTABLE) != 0)
+    {
+        return FALSE;
+    }
+
+    gcd   = Resampler_Gcd(InputRate, OutputRate);
+    *Up   = OutputRate / gcd;
+    *Down = InputRate / gcd;
+
+    if (*Up > RESAMPLER_MAX_PHASES)
+    {
+        return FALSE;
+    }
+
+    // An adjustable converter interpolates between neighbouring phases, so
+    // scale L and M together until the phases are close enough.
+    if ((Flags & RESAMPLER_FLAG_ADJUSTABLE) && *Up < RESAMPLER_ADJUSTABLE_MIN_PHASES)
+    {
+        ULONG scale = (RESAMPLER_ADJUSTABLE_MIN_PHASES + *Up - 1) / *Up;
+
+        *Up   *= scale;
+        *Down *= scale;
+    }
+
+    // When decimating, the cutoff drops by Up/Down, so the filter needs
+    // proportionally more taps for the same transition band.
+    widen     = (*Down + *Up - 1) / *Up;
+    *Taps     = g_ResamplerPresets[Quality].Taps * widen;
+    *Taps     = (*Taps + RESAMPLER_TAP_MULTIPLE - 1) / RESAMPLER_TAP_MULTIPLE * RESAMPLER_TAP_MULTIPLE;
+    *Capacity = (*Taps - 1 + RESAMPLER_BLOCK_FRAMES + 3) & ~3UL;
+
+    return TRUE;
+}
+
+//=============================================================================
+#pragma code_seg()
+static
+VOID
+Resampler_Design
+(
+    PRESAMPLER          Resampler,
+    RESAMPLER_QUALITY   Quality
+)
+/*++
+
+Routine Description:
+
+  Fills in the coefficients of a Kaiser-windowed sinc lowpass at Up times
+  the input rate, scaled by Up so each phase has unity gain, then splits it
+  into phases.
+
+--*/
+{
+    const RESAMPLER_PRESET * preset = &g_ResamplerPresets[Quality];
+    ULONG   up     = Resampler->Up;
+    ULONG   taps   = Resampler->Taps;
+    ULONG   length = up * taps;
+    double  center = (length - 1) / 2.0;
+    double  cutoff = preset->Rolloff * 0.5 / (double)((up > Resampler->Down) ? up : Resampler->Down);
+    double  i0Beta = Resampler_BesselI0(preset->Beta);
+    double  sum    = 0.0;
+    double  scale;
+
+    for (ULONG j = 0; j < length; j++)
+    {
+        double t = (double)j - center;
+        double r = t / (length / 2.0);
+        double sinc;
+        double h;
+
+        sinc = (t == 0.0) ? 2.0 * cutoff :
+               Resampler_Sin(2.0 * RESAMPLER_PI * cutoff * t) / (RESAMPLER_PI * t);
+        h    = sinc * Resampler_BesselI0(preset->Beta * Resampler_Sqrt(1.0 - r * r)) / i0Beta;
+
+        // Phase j % up, tap j / up, stored time-reversed.
+        Resampler->Coefficients[(j % up) * taps + (taps - 1 - j / up)] = (float)h;
+        sum += h;
+    }
+
+    scale = (double)up / sum;
+    for (ULONG j = 0; j < length; j++)
+    {
+        Resampler->Coefficients[j] = (float)(Resampler->Coefficients[j] * scale);
+    }
+}
+
+//=============================================================================
+// Streaming
+//=============================================================================
+
+#pragma code_seg()
+static
+float
+Resampler_Dot
+(
+    const float *   Coefficients,
+    const float *   History,
+    ULONG           Taps
+)
+{
+#if defined(RESAMPLER_SSE2)
+    __m128 a0 = _mm_setzero_ps();
+    __m128 a1 = _mm_setzero_ps();
+
+    for (ULONG k = 0; k < Taps; k += 8)
+    {
+        a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_load_ps(Coefficients + k),     _mm_loadu_ps(History + k)));
+        a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_load_ps(Coefficients + k + 4), _mm_loadu_ps(History + k + 4)));
+    }
+
+    a0 = _mm_add_ps(a0, a1);
+    a0 = _mm_add_ps(a0, _mm_movehl_ps(a0, a0));
+    a0 = _mm_add_ss(a0, _mm_shuffle_ps(a0, a0, 1));
+
+    return _mm_cvtss_f32(a0);
+#elif defined(RESAMPLER_NEON)
+    float32x4_t a0 = vdupq_n_f32(0.0f);
+    float32x4_t a1 = vdupq_n_f32(0.0f);
+
+    for (ULONG k = 0; k < Taps; k += 8)
+    {
+        a0 = vfmaq_f32(a0, vld1q_f32(Coefficients + k),     vld1q_f32(History + k));
+        a1 = vfmaq_f32(a1, vld1q_f32(Coefficients + k + 4), vld1q_f32(History + k + 4));
+    }
+
+    return vaddvq_f32(vaddq_f32(a0, a1));
+#else
+    float a[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+    for (ULONG k = 0; k < Taps; k += 4)
+    {
+        a[0] += Coefficients[k]     * History[k];
+        a[1] += Coefficients[k + 1] * History[k + 1];
+        a[2] += Coefficients[k + 2] * History[k + 2];
+        a[3] += Coefficients[k + 3] * History[k + 3];
+    }
+
+    return (a[0] + a[1]) + (a[2] + a[3]);
+#endif
+}
+
+//=============================================================================
+#pragma code_seg()
+ULONG
+Resampler_GetSize
+(
+    ULONG               InputRate,
+    ULONG               OutputRate,
+    ULONG               Channels,
+    RESAMPLER_QUALITY   Quality,
+    ULONG               Flags
+)
+{
+    ULONG up;
+    ULONG down;
+    ULONG taps;
+    ULONG capacity;
+
+    if (!Resampler_GetShape(InputRate, OutputRate, Channels, Quality, Flags, &up, &down, &taps, &capacity))
+    {
+        return 0;
+    }
+
+    return (ULONG)((sizeof(RESAMPLER) + 15) & ~15) +
+           (up * taps + Channels * capacity) * (ULONG)sizeof(float);
+}
+
+//=============================================================================
+#pragma code_seg()
+BOOLEAN
+Resampler_Init
+(
+    PRESAMPLER          Resampler,
+    ULONG               Size,
+    ULONG               InputRate,
+    ULONG               OutputRate,
+    ULONG               Channels,
+    RESAMPLER_QUALITY   Quality,
+    ULONG               Flags
+)
+{
+    ULONG up;
+    ULONG down;
+    ULONG taps;
+    ULONG capacity;
+
+    if (Size < Resampler_GetSize(InputRate, OutputRate, Channels, Quality, Flags) ||
+        !Resampler_GetShape(InputRate, OutputRate, Channels, Quality, Flags, &up, &down, &taps, &capacity))
+    {
+        return FALSE;
+    }
+
+    Resampler->Up           = up;
+    Resampler->Down         = down;
+    Resampler->Channels     = Channels;
+    Resampler->Taps         = taps;
+    Resampler->Capacity     = capacity;
+    Resampler->Flags        = Flags;
+    Resampler->Step         = (ULONGLONG)down << 32;
+    Resampler->Coefficients = (float *)((unsigned char *)Resampler + ((sizeof(RESAMPLER) + 15) & ~15));
+    Resampler->History      = Resampler->Coefficients + up * taps;
+
+    Resampler_Design(Resampler, Quality);
+    Resampler_Reset(Resampler);
+
+    return TRUE;
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+Resampler_SetAdjustment
+(
+    PRESAMPLER          Resampler,
+    LONG                PartsPerBillion
+)
+/*++
+
+Routine Description:
+
+  Sets the phase step to Down * (1 + PartsPerBillion / 10^9) in 32.32 fixed
+  point. The trim is computed per unit of Down first so nothing overflows;
+  the rounding that costs is below 10^-9 of the ratio.
+
+--*/
+{
+    const LONG  limit = RESAMPLER_MAX_ADJUSTMENT_PPM * 1000;
+    LONGLONG    trim;
+
+    if (!(Resampler->Flags & RESAMPLER_FLAG_ADJUSTABLE))
+    {
+        return;
+    }
+
+    if (PartsPerBillion > limit)
+    {
+        PartsPerBillion = limit;
+    }
+    else if (PartsPerBillion < -limit)
+    {
+        PartsPerBillion = -limit;
+    }
+
+    trim = (LONGLONG)PartsPerBillion * 4294967296LL / 1000000000;
+
+    Resampler->Step = ((ULONGLONG)Resampler->Down << 32) + (ULONGLONG)(trim * (LONGLONG)Resampler->Down);
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+Resampler_Reset
+(
+    PRESAMPLER          Resampler
+)
+/*++
+
+Routine Description:
+
+  Clears the history to Taps - 1 frames of silence, which lets the first
+  output frame be computed as soon as one input frame has arrived.
+
+--*/
+{
+    memset(Resampler->History, 0, (size_t)Resampler->Channels * Resampler->Capacity * sizeof(float));
+
+    Resampler->Count    = Resampler->Taps - 1;
+    Resampler->Position = 0;
+    Resampler->Phase    = 0;
+}
+
+//=============================================================================
+#pragma code_seg()
+ULONG
+Resampler_GetInputSpace
+(
+    PRESAMPLER          Resampler
+)
+{
+    ULONG consumed = (Resampler->Position < Resampler->Count) ? Resampler->Position : Resampler->Count;
+
+    return Resampler->Capacity - (Resampler->Count - consumed);
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+Resampler_Write
+(
+    PRESAMPLER          Resampler,
+    const float *       Source,
+    ULONG               Frames
+)
+{
+    ULONG channels = Resampler->Channels;
+
+    if (Frames > Resampler_GetInputSpace(Resampler))
+    {
+        Frames = Resampler_GetInputSpace(Resampler);
+    }
+
+    // Slide the history still needed back to the start of each row. When
+    // decimating, Position may already be past the queued input; those
+    // frames are then skipped as they arrive.
+    if (Resampler->Count + Frames > Resampler->Capacity)
+    {
+        ULONG shift = (Resampler->Position < Resampler->Count) ? Resampler->Position : Resampler->Count;
+
+        for (ULONG c = 0; c < channels; c++)
+        {
+            float * row = Resampler->History + c * Resampler->Capacity;
+
+            memmove(row, row + shift, (Resampler->Count - shift) * sizeof(float));
+        }
+
+        Resampler->Count    -= shift;
+        Resampler->Position -= shift;
+    }
+
+    for (ULONG c = 0; c < channels; c++)
+    {
+        float *         row = Resampler->History + c * Resampler->Capacity + Resampler->Count;
+        const float *   in  = Source + c;
+
+        for (ULONG i = 0; i < Frames; i++, in += channels)
+        {
+            row[i] = *in;
+        }
+    }
+
+    Resampler->Count += Frames;
+}
+
+//=============================================================================
+#pragma code_seg()
+ULONG
+Resampler_Read
+(
+    PRESAMPLER          Resampler,
+    float *             Destination,
+    ULONG               Frames
+)
+{
+    ULONG channels = Resampler->Channels;
+    ULONG taps     = Resampler->Taps;
+    ULONG up       = Resampler->Up;
+    ULONG produced = 0;
+    ULONG span;
+
+    // Interpolating into the last phase reaches one frame further.
+    span = taps + ((Resampler->Flags & RESAMPLER_FLAG_ADJUSTABLE) ? 1 : 0);
+
+    while (produced < Frames && Resampler->Position + span <= Resampler->Count)
+    {
+        ULONG           phase        = (ULONG)(Resampler->Phase >> 32);
+        ULONG           fraction     = (ULONG)Resampler->Phase;
+        const float *   coefficients = Resampler->Coefficients + phase * taps;
+        const float *   history      = Resampler->History + Resampler->Position;
+        ULONGLONG       next;
+
+        if (fraction == 0)
+        {
+            for (ULONG c = 0; c < channels; c++)
+            {
+                *Destination++ = Resampler_Dot(coefficients, history + c * Resampler->Capacity, taps);
+            }
+        }
+        else
+        {
+            // The phase after the last is phase 0 one input frame later.
+            const float *   nextCoefficients = (phase + 1 < up) ? coefficients + taps : Resampler->Coefficients;
+            const float *   nextHistory      = (phase + 1 < up) ? history : history + 1;
+            float           weight           = (float)fraction * (1.0f / 4294967296.0f);
+
+            for (ULONG c = 0; c < channels; c++)
+            {
+                float a = Resampler_Dot(coefficients,     history     + c * Resampler->Capacity, taps);
+                float b = Resampler_Dot(nextCoefficients, nextHistory + c * Resampler->Capacity, taps);
+
+                *Destination++ = a + (b - a) * weight;
+            }
+        }
+
+        // Whole phases carry into input frames, the fraction stays.
+        next                 = Resampler->Phase + Resampler->Step;
+        Resampler->Position += (ULONG)(next >> 32) / up;
+        Resampler->Phase     = ((ULONGLONG)((ULONG)(next >> 32) % up) << 32) | (ULONG)next;
+        produced++;
+    }
+
+    return produced;
+}
+#pragma code_seg()
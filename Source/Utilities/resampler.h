@@ -0,0 +1,173 @@
+/*++
+
+Module Name:
+
+    resampler.h
+
+Abstract:
+
+    Streaming polyphase sample-rate converter for the capture path.
+
+    Rates are converted by the exact rational ratio L/M (output/input,
+    reduced), so a stream never drifts from its nominal rate. The prototype
+    is a Kaiser-windowed sinc with its cutoff just below the lower of the two
+    Nyquist frequencies, split into L phases of N taps each. Every output
+    frame is one N-tap dot product per channel, on planar history so the
+    dot product runs over contiguous memory (SSE2 on x64, NEON on ARM64).
+
+    The converter keeps its input history and phase between calls, so audio
+    can be pushed and pulled in pieces of any size without seams. Latency is
+    about N/2 input frames.
+
+    An adjustable converter can also be trimmed away from the nominal ratio
+    by up to RESAMPLER_MAX_ADJUSTMENT_PPM, which is how a stream locks a
+    feeder's clock to its own. The phase then advances in 32.32 fixed point
+    and every output frame interpolates linearly between the two nearest
+    phases; the bank is built with at least 128 phases so that interpolation
+    stays below the filter's own stopband. With no trim the fraction is
+    always zero. The output is then the same as a fixed converter's when L
+    is already at least 128; a bank scaled up to 128 phases delays it by
+    less than 1/(2L) of an input frame more.
+
+    The caller owns the memory: Resampler_GetSize tells how much a
+    configuration needs and Resampler_Init builds the filter in it. Init does
+    floating point work proportional to L * N and belongs at PASSIVE_LEVEL;
+    everything else runs at any IRQL.
+--*/
+
+#ifndef _MICYAUDIO_RESAMPLER_H_
+#define _MICYAUDIO_RESAMPLER_H_
+
+#if !defined(_WIN32)
+#include <stdint.h>
+
+typedef int64_t         LONGLONG;
+typedef uint64_t        ULONGLONG;
+typedef int32_t         LONG;
+typedef uint32_t        ULONG;
+typedef uint8_t         BOOLEAN;
+typedef void            VOID;
+#define TRUE            1
+#define FALSE           0
+#endif
+
+//
+// Values match MICYAUDIO_RESAMPLER_QUALITY_* in micyioctl.h. Taps and latency
+// are for interpolation; decimation widens the filter by the ratio. THD+N
+// is for a 1 kHz tone going from 44.1 kHz to 48 kHz.
+//
+typedef enum _RESAMPLER_QUALITY
+{
+    ResamplerQualityDefault = 0,    // medium
+    ResamplerQualityLow     = 1,    // 16 taps,  ~8 frames latency, THD+N ~ -70 dB
+    ResamplerQualityMedium  = 2,    // 32 taps, ~16 frames latency, THD+N ~ -90 dB
+    ResamplerQualityHigh    = 3,    // 64 taps, ~32 frames latency, THD+N ~ -120 dB
+    ResamplerQualityCount
+} RESAMPLER_QUALITY;
+
+#define RESAMPLER_MIN_RATE          8000
+#define RESAMPLER_MAX_RATE          192000
+#define RESAMPLER_MAX_CHANNELS      8
+
+//
+// Largest L the converter accepts. Covers every pair of the usual rates,
+// e.g. 11025 -> 48000 is 640/147.
+//
+#define RESAMPLER_MAX_PHASES        1024
+
+//
+// Flags for Resampler_GetSize and Resampler_Init.
+//
+#define RESAMPLER_FLAG_ADJUSTABLE   0x00000001  // allow Resampler_SetAdjustment
+
+//
+// Largest trim Resampler_SetAdjustment applies, either way.
+//
+#define RESAMPLER_MAX_ADJUSTMENT_PPM    500
+
+typedef struct _RESAMPLER RESAMPLER, *PRESAMPLER;
+
+//
+// Bytes needed for a converter, 0 if the configuration is not supported.
+//
+ULONG
+Resampler_GetSize
+(
+    ULONG               InputRate,
+    ULONG               OutputRate,
+    ULONG               Channels,
+    RESAMPLER_QUALITY   Quality,
+    ULONG               Flags
+);
+
+//
+// Builds a converter in Size bytes of 16-byte aligned memory. Returns FALSE
+// if the configuration is not supported or Size is too small.
+//
+BOOLEAN
+Resampler_Init
+(
+    PRESAMPLER          Resampler,
+    ULONG               Size,
+    ULONG               InputRate,
+    ULONG               OutputRate,
+    ULONG               Channels,
+    RESAMPLER_QUALITY   Quality,
+    ULONG               Flags
+);
+
+//
+// Trims an adjustable converter's ratio by PartsPerBillion, clamped to
+// RESAMPLER_MAX_ADJUSTMENT_PPM. Positive values consume input faster than
+// nominal, negative values slower. Takes effect from the next output frame
+// and is kept across Resampler_Reset. Ignored for a fixed converter.
+//
+VOID
+Resampler_SetAdjustment
+(
+    PRESAMPLER          Resampler,
+    LONG                PartsPerBillion
+);
+
+//
+// Forgets all history, as if the converter had just been initialized.
+//
+VOID
+Resampler_Reset
+(
+    PRESAMPLER          Resampler
+);
+
+//
+// Number of input frames Resampler_Write accepts right now.
+//
+ULONG
+Resampler_GetInputSpace
+(
+    PRESAMPLER          Resampler
+);
+
+//
+// Queues up to Resampler_GetInputSpace interleaved float frames.
+//
+VOID
+Resampler_Write
+(
+    PRESAMPLER          Resampler,
+    const float *       Source,
+    ULONG               Frames
+);
+
+//
+// Produces up to Frames interleaved float frames from the queued input.
+// Returns the number produced; fewer than asked means more input is needed.
+//
+ULONG
+Resampler_Read
+(
+    PRESAMPLER          Resampler,
+    float *             Destination,
+    ULONG               Frames
+);
+
+#endif // _MICYAUDIO_RESAMPLER_H_
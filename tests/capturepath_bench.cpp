@@ -0,0 +1,171 @@
+/*++
+
+Module Name:
+
+    capturepath_bench.cpp
+
+Abstract:
+
+    Cost per 10 ms packet of moving feeder audio into the capture DMA
+    buffer. An iteration is one packet of 48 kHz stereo: the feeder writes
+    it into the ring, then the copy loop of WriteBytes takes it out into a
+    DMA buffer whose size is not a multiple of the packet, so the copy
+    regularly splits at the end of the buffer, converting the feeder's
+    format to the stream's the way ReadUserPcm does, through a stack
+    staging buffer. packet_budget_ppm is the CPU time in parts per million of
+    the 10 ms the packet lasts.
+--*/
+
+#include <benchmark/benchmark.h>
+
+#include <string.h>
+#include <vector>
+
+#include "pcmring.h"
+#include "pcmconvert.h"
+#include "testutil.h"
+
+namespace
+{
+
+const ULONG kFrames = 480;
+const ULONG kChannels = 2;
+const ULONG kConvertBytes = 1152;       // MINWAVERTSTREAM_CONVERT_BYTES
+
+class CapturePath
+{
+public:
+    CapturePath(PCM_SAMPLE_FORMAT FeederFormat, PCM_SAMPLE_FORMAT StreamFormat)
+        : m_FeederFormat(FeederFormat),
+          m_StreamFormat(StreamFormat),
+          m_InBlockAlign(kChannels * PcmConvert_SampleBytes(FeederFormat)),
+          m_OutBlockAlign(kChannels * PcmConvert_SampleBytes(StreamFormat)),
+          m_Data(64 * 1024),
+          m_Packet(kFrames * m_InBlockAlign),
+          m_Dma(kFrames * m_OutBlockAlign * 5 / 2),
+          m_Offset(0)
+    {
+        TestRandom random(1);
+
+        for (UCHAR & b : m_Packet)
+        {
+            b = (UCHAR)random.Next();
+        }
+        if (FeederFormat == PcmSampleFormatFloat32)
+        {
+            for (size_t i = 0; i < m_Packet.size(); i += 4)
+            {
+                float x = (float)(random.Unit() * 2.0 - 1.0);
+
+                memcpy(&m_Packet[i], &x, sizeof(x));
+            }
+        }
+
+        PcmRing_Attach(&m_Ring, &m_Control, m_Data.data(), (ULONG)m_Data.size());
+    }
+
+    //
+    // The feeder's submission and the DPC's share of WriteBytes.
+    //
+    void Packet()
+    {
+        ULONG displacement = kFrames * m_OutBlockAlign;
+
+        PcmRing_Write(&m_Ring, m_Packet.data(), (ULONG)m_Packet.size());
+
+        while (displacement > 0)
+        {
+            ULONG runWrite = std::min(displacement, (ULONG)m_Dma.size() - m_Offset);
+            ULONG copied = ReadUserPcm(m_Dma.data() + m_Offset, runWrite);
+
+            if (copied < runWrite)
+            {
+                memset(m_Dma.data() + m_Offset + copied, 0, runWrite - copied);
+            }
+
+            m_Offset = (m_Offset + runWrite) % (ULONG)m_Dma.size();
+            displacement -= runWrite;
+        }
+    }
+
+    const UCHAR * Dma() const { return m_Dma.data(); }
+
+private:
+    ULONG Read(UCHAR * Destination, ULONG Length)
+    {
+        ULONG copied = PcmRing_ReaderRead(&m_Ring, &m_Reader, Destination, Length);
+
+        PcmRing_Release(&m_Ring, &m_Reader, 0x1);
+        return copied;
+    }
+
+    ULONG ReadUserPcm(UCHAR * Destination, ULONG Length)
+    {
+        alignas(16) UCHAR staging[kConvertBytes];
+        ULONG framesWanted = Length / m_OutBlockAlign;
+        ULONG framesDone = 0;
+
+        if (m_FeederFormat == m_StreamFormat)
+        {
+            return Read(Destination, Length);
+        }
+
+        while (framesDone < framesWanted)
+        {
+            ULONG frames = std::min(framesWanted - framesDone, kConvertBytes / m_InBlockAlign);
+
+            frames = std::min(frames, PcmRing_ReaderCount(&m_Ring, &m_Reader) / m_InBlockAlign);
+            if (frames == 0)
+            {
+                break;
+            }
+
+            frames = Read(staging, frames * m_InBlockAlign) / m_InBlockAlign;
+            PcmConvert(m_StreamFormat, Destination + framesDone * m_OutBlockAlign, m_FeederFormat, staging, frames * kChannels);
+            framesDone += frames;
+        }
+
+        return framesDone * m_OutBlockAlign;
+    }
+
+    PCM_SAMPLE_FORMAT   m_FeederFormat;
+    PCM_SAMPLE_FORMAT   m_StreamFormat;
+    ULONG               m_InBlockAlign;
+    ULONG               m_OutBlockAlign;
+    std::vector<UCHAR>  m_Data;
+    std::vector<UCHAR>  m_Packet;
+    std::vector<UCHAR>  m_Dma;
+    ULONG               m_Offset;
+    PCM_RING_CONTROL    m_Control;
+    PCM_RING            m_Ring;
+    PCM_RING_READER     m_Reader = {};
+};
+
+void BM_WriteBytes(benchmark::State & State)
+{
+    CapturePath path((PCM_SAMPLE_FORMAT)State.range(0), (PCM_SAMPLE_FORMAT)State.range(1));
+    double      start = TestThreadSeconds();
+
+    for (auto _ : State)
+    {
+        path.Packet();
+        benchmark::DoNotOptimize(path.Dma());
+        benchmark::ClobberMemory();
+    }
+
+    State.SetItemsProcessed((int64_t)State.iterations() * kFrames);
+    // Share of the 10 ms a packet lasts.
+    State.counters["packet_budget_ppm"] = (TestThreadSeconds() - start) / (double)State.iterations() / 0.010 * 1e6;
+}
+
+} // namespace
+
+BENCHMARK(BM_WriteBytes)
+    ->Name("CapturePath/WriteBytes")
+    ->ArgNames({ "feeder", "stream" })
+    ->Args({ PcmSampleFormatInt32,   PcmSampleFormatInt32 })
+    ->Args({ PcmSampleFormatInt16,   PcmSampleFormatInt16 })
+    ->Args({ PcmSampleFormatInt16,   PcmSampleFormatInt32 })
+    ->Args({ PcmSampleFormatFloat32, PcmSampleFormatInt16 })
+    ->Args({ PcmSampleFormatFloat32, PcmSampleFormatInt32 })
+    ->Args({ PcmSampleFormatInt24,   PcmSampleFormatFloat32 });
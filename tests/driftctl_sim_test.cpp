@@ -0,0 +1,228 @@
+/*++
+
+Module Name:
+
+    driftctl_sim_test.cpp
+
+Abstract:
+
+    Simulation of the adaptive rate mode: a feeder whose clock drifts from
+    the stream's by up to +-300 ppm delivers bursts into the ring, and a
+    capture DPC every 10 ms does what UpdateDriftControl and ReadUserPcm
+    do, steering the real resampler with the real control loop
+    (driftctl.h). After the loop has settled the simulation reports the
+    steady-state fill error, how far the fill strays and the trim the loop
+    converged on, and checks the ring never ran dry or overflowed.
+
+    MICY_DRIFT_MINUTES sets the simulated time per run, default 20.
+--*/
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+
+#include "resampler.h"
+#include "driftctl.h"
+#include "testutil.h"
+
+namespace
+{
+
+struct DriftResult
+{
+    double      MeanErrorMs;        // steady state
+    double      MaxErrorMs;         // steady state, either way, as the DPC sees it
+    double      MaxFilteredMs;      // the same through the loop's error filter
+    double      MeanTrimPpm;        // steady state
+    double      SettleSeconds;      // until the error stays within bounds
+    ULONGLONG   Underruns;          // DPCs short of input after the start
+    ULONGLONG   Overflows;          // feeder frames that did not fit
+    double      BoundMs;            // half a burst, the jitter and some slack
+};
+
+DriftResult Simulate(double DriftPpm, ULONG InputRate, double ChunkMs, double JitterMs, uint64_t Seed)
+{
+    const ULONG     outputRate = 48000;
+    const ULONG     packet = outputRate / 100;
+    const double    dpcSeconds = 0.010;
+    const double    targetSeconds = 0.040;
+    const ULONG     capacity = InputRate / 5;           // 200 ms
+    double          minutes = (double)TestEnvU64("MICY_DRIFT_MINUTES", 20);
+    ULONGLONG       dpcs = (ULONGLONG)(minutes * 60.0 / dpcSeconds);
+    ULONGLONG       steady = dpcs / 2;
+    ULONG           size = Resampler_GetSize(InputRate, outputRate, 1, ResamplerQualityLow, RESAMPLER_FLAG_ADJUSTABLE);
+    PRESAMPLER      resampler = (PRESAMPLER)aligned_alloc(16, (size + 15) & ~15u);
+    DRIFTCTL        control;
+    TestRandom      random(Seed);
+    ULONG           chunk = (ULONG)(InputRate * ChunkMs / 1000.0);
+    double          feederSeconds = (double)chunk / (InputRate * (1.0 + DriftPpm * 1e-6));
+    double          nextChunk = 0.0;
+    ULONG           ring;                               // frames queued
+    std::vector<float> input(InputRate / 10, 0.25f);
+    std::vector<float> output(packet);
+    ULONG           targetFrames = (ULONG)(targetSeconds * InputRate);
+    double          bound = (ChunkMs / 2 + JitterMs + 2.0) / 1000.0;
+    double          errorSum = 0.0;
+    double          trimSum = 0.0;
+    double          lastOutside = 0.0;
+    bool            filled = false;
+    DriftResult     result = {};
+
+    Resampler_Init(resampler, size, InputRate, outputRate, 1, ResamplerQualityLow, RESAMPLER_FLAG_ADJUSTABLE);
+    DriftCtl_Init(&control, RESAMPLER_MAX_ADJUSTMENT_PPM);
+
+    // The feeder writes the latency target ahead before it starts pacing.
+    ring = targetFrames;
+
+    for (ULONGLONG k = 0; k < dpcs; k++)
+    {
+        double  now = (double)k * dpcSeconds;
+        ULONG   done = 0;
+        LONG    trim = 0;
+        double  error;
+
+        // Bursts the feeder's clock says are due, each landing a little late.
+        while (nextChunk + random.Unit() * JitterMs / 1000.0 <= now)
+        {
+            ULONG fits = std::min(chunk, capacity - ring);
+
+            ring += fits;
+            result.Overflows += chunk - fits;
+            nextChunk += feederSeconds;
+        }
+
+        // UpdateDriftControl: the loop starts once the ring reached target.
+        error = ((double)ring - (double)targetFrames) / InputRate;
+        if (control.Primed || ring >= targetFrames)
+        {
+            trim = DriftCtl_Update(&control, error, dpcSeconds);
+            Resampler_SetAdjustment(resampler, trim);
+            filled = true;
+        }
+
+        // ReadUserPcm: pull a packet, feeding the resampler only as much
+        // input as the output still wanted needs.
+        while (done < packet)
+        {
+            ULONG frames = Resampler_Read(resampler, output.data() + done, packet - done);
+            ULONG framesIn;
+
+            done += frames;
+            if (done == packet)
+            {
+                break;
+            }
+
+            framesIn = (ULONG)(((ULONGLONG)(packet - done) * InputRate + outputRate - 1) / outputRate);
+            framesIn = std::min(framesIn, ring);
+            framesIn = std::min(framesIn, (ULONG)input.size());
+            framesIn = std::min(framesIn, Resampler_GetInputSpace(resampler));
+            if (framesIn == 0)
+            {
+                break;
+            }
+
+            Resampler_Write(resampler, input.data(), framesIn);
+            ring -= framesIn;
+        }
+
+        if (filled && done < packet)
+        {
+            result.Underruns++;
+        }
+
+        if (filled && fabs(control.Filtered) > bound)
+        {
+            lastOutside = now;
+        }
+
+        if (k >= steady)
+        {
+            errorSum += error;
+            trimSum += trim;
+            result.MaxErrorMs = std::max(result.MaxErrorMs, fabs(error) * 1000.0);
+            result.MaxFilteredMs = std::max(result.MaxFilteredMs, fabs(control.Filtered) * 1000.0);
+        }
+    }
+
+    free(resampler);
+
+    result.MeanErrorMs = errorSum / (double)(dpcs - steady) * 1000.0;
+    result.MeanTrimPpm = trimSum / (double)(dpcs - steady) / 1000.0;
+    result.SettleSeconds = lastOutside;
+    result.BoundMs = bound * 1000.0;
+
+    printf("  %+5.0f ppm, %6u Hz, %2.0f ms bursts +%2.0f ms: settled %4.0f s, fill error mean %+6.3f ms max %5.2f ms (filtered %4.2f ms), "
+           "trim %+7.1f ppm, %llu underruns, %llu frames overflowed\n",
+           DriftPpm, InputRate, ChunkMs, JitterMs, result.SettleSeconds,
+           result.MeanErrorMs, result.MaxErrorMs, result.MaxFilteredMs, result.MeanTrimPpm,
+           (unsigned long long)result.Underruns, (unsigned long long)result.Overflows);
+
+    return result;
+}
+
+void ExpectLocked(const DriftResult & Result, double DriftPpm)
+{
+    double minutes = (double)TestEnvU64("MICY_DRIFT_MINUTES", 20);
+
+    EXPECT_LT(fabs(Result.MeanErrorMs), 1.0);
+    EXPECT_LT(Result.MaxFilteredMs, Result.BoundMs);
+
+    // Unfiltered, the fill a DPC sees depends on whether the last burst
+    // landed just before it or just after.
+    EXPECT_LT(Result.MaxErrorMs, Result.BoundMs * 2);
+    EXPECT_NEAR(DriftPpm, Result.MeanTrimPpm, 20.0);
+    EXPECT_LT(Result.SettleSeconds, minutes * 60.0 / 2);
+    EXPECT_EQ(0u, Result.Underruns);
+    EXPECT_EQ(0u, Result.Overflows);
+}
+
+} // namespace
+
+TEST(DriftCtlSim, LocksOnto300PpmEitherWay)
+{
+    for (double ppm : { -300.0, 0.0, 300.0 })
+    {
+        ExpectLocked(Simulate(ppm, 48000, 10.0, 0.0, 1), ppm);
+    }
+}
+
+TEST(DriftCtlSim, ResamplingFeedersWithJitteredBursts)
+{
+    ExpectLocked(Simulate(300.0, 44100, 20.0, 5.0, 2), 300.0);
+    ExpectLocked(Simulate(-300.0, 16000, 10.0, 3.0, 3), -300.0);
+    ExpectLocked(Simulate(150.0, 22050, 5.0, 2.0, 4), 150.0);
+}
+
+TEST(DriftCtl, TrimIsClampedAndDoesNotWindUp)
+{
+    DRIFTCTL control;
+
+    DriftCtl_Init(&control, 500);
+
+    // A large error pins the trim at the limit without integrating.
+    for (int i = 0; i < 1000; i++)
+    {
+        EXPECT_EQ(500000, DriftCtl_Update(&control, 1.0, 0.01));
+    }
+    EXPECT_LT(control.Accumulated, 5000.0);
+
+    // Once the error turns, the trim comes off the limit as soon as the
+    // filtered error allows: Kp * filtered < limit after about 43 s.
+    int dpcs = 0;
+
+    while (DriftCtl_Update(&control, -0.001, 0.01) >= 500000 && dpcs < 100000)
+    {
+        dpcs++;
+    }
+    EXPECT_LT(dpcs, 4500);
+
+    DriftCtl_Reset(&control);
+    EXPECT_FALSE(control.Primed);
+    EXPECT_EQ(0.0, control.Accumulated);
+    EXPECT_EQ(0, DriftCtl_Update(&control, 0.0, 0.01));
+}
@@ -0,0 +1,165 @@
+/*++
+
+Module Name:
+
+    fuzz_driver.cpp
+
+Abstract:
+
+    Stand-alone main() for the fuzz targets when libFuzzer is not
+    available. Replays every file named on the command line, then runs
+    -runs=N (default 100000) inputs made by mutating a few well-formed
+    submissions: flipped bytes, 32-bit fields overwritten with boundary
+    values, truncation and extension. Deterministic for a given -seed=N.
+--*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "definitions.h"
+#include "micyioctl.h"
+#include "testutil.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * Data, size_t Size);
+
+namespace
+{
+
+std::vector<uint8_t> SeedSetAudioData()
+{
+    std::vector<uint8_t> input(MICYAUDIO_SET_AUDIO_DATA_HEADER_SIZE + 64);
+    ULONG header[2] = { 1, 64 };
+
+    memcpy(input.data(), header, sizeof(header));
+    return input;
+}
+
+std::vector<uint8_t> SeedBatch()
+{
+    MICYAUDIO_BATCH_HEADER      header = { 3, 0 };
+    MICYAUDIO_CHUNK_DESCRIPTOR  descriptors[3] =
+    {
+        { 1, 0,  32, 0 },
+        { 2, 32, 32, MICYAUDIO_CHUNK_FLAG_WAIT },
+        { 1, 16, 48, 0 },
+    };
+    std::vector<uint8_t> input(sizeof(header) + sizeof(descriptors) + 64);
+
+    memcpy(input.data(), &header, sizeof(header));
+    memcpy(input.data() + sizeof(header), descriptors, sizeof(descriptors));
+    return input;
+}
+
+void Mutate(std::vector<uint8_t> & Input, TestRandom & Random)
+{
+    static const ULONG interesting[] =
+    {
+        0, 1, 2, 3, 4, 7, 8, 15, 16, 63, 64, 255, 256, 257,
+        MICYAUDIO_MAX_BATCH_CHUNKS, MICYAUDIO_MAX_BATCH_CHUNKS + 1,
+        0x7FFFFFFF, 0x80000000, 0xFFFFFFF0, 0xFFFFFFFE, 0xFFFFFFFF
+    };
+    ULONG edits = Random.Range(1, 4);
+
+    for (ULONG i = 0; i < edits; i++)
+    {
+        switch (Random.Range(0, 4))
+        {
+        case 0:
+            if (!Input.empty())
+            {
+                Input[Random.Range(0, (ULONG)Input.size() - 1)] ^= (uint8_t)(1 << Random.Range(0, 7));
+            }
+            break;
+        case 1:
+        case 2:
+            if (Input.size() >= 4)
+            {
+                // Fields are 4 byte aligned; favour those.
+                ULONG offset = Random.Range(0, (ULONG)Input.size() / 4 - 1) * 4;
+                ULONG value  = interesting[Random.Range(0, sizeof(interesting) / sizeof(interesting[0]) - 1)];
+
+                memcpy(&Input[offset], &value, sizeof(value));
+            }
+            break;
+        case 3:
+            Input.resize(Random.Range(0, (ULONG)Input.size()));
+            break;
+        default:
+            Input.resize(Input.size() + Random.Range(1, 64), (uint8_t)Random.Next());
+            break;
+        }
+    }
+}
+
+bool ReplayFile(const char * Path)
+{
+    FILE *                  file = fopen(Path, "rb");
+    std::vector<uint8_t>    input;
+    int                     c;
+
+    if (file == NULL)
+    {
+        fprintf(stderr, "cannot open %s\n", Path);
+        return false;
+    }
+
+    while ((c = fgetc(file)) != EOF)
+    {
+        input.push_back((uint8_t)c);
+    }
+    fclose(file);
+
+    LLVMFuzzerTestOneInput(input.data(), input.size());
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char ** argv)
+{
+    uint64_t    runs = 100000;
+    uint64_t    seed = 1;
+    ULONG       replayed = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "-runs=", 6) == 0)
+        {
+            runs = strtoull(argv[i] + 6, NULL, 0);
+        }
+        else if (strncmp(argv[i], "-seed=", 6) == 0)
+        {
+            seed = strtoull(argv[i] + 6, NULL, 0);
+        }
+        else if (argv[i][0] != '-')
+        {
+            if (!ReplayFile(argv[i]))
+            {
+                return 1;
+            }
+            replayed++;
+        }
+    }
+
+    TestRandom                          random(seed);
+    std::vector<std::vector<uint8_t>>   seeds = { SeedSetAudioData(), SeedBatch() };
+
+    for (auto & input : seeds)
+    {
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+
+    for (uint64_t run = 0; run < runs; run++)
+    {
+        std::vector<uint8_t> input = seeds[run % seeds.size()];
+
+        Mutate(input, random);
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+    }
+
+    printf("%u files replayed, %llu mutated inputs run\n", replayed, (unsigned long long)runs);
+    return 0;
+}
@@ -0,0 +1,59 @@
+/*++
+
+Module Name:
+
+    definitions.h
+
+Abstract:
+
+    Host stand-in for Source/Inc/definitions.h. The Utilities sources that
+    build on the host include definitions.h only for the basic kernel types,
+    status codes and annotations below; tests put this directory ahead of
+    Source/Inc so they get these instead of the WDK headers.
+--*/
+
+#ifndef _MICYAUDIO_HOST_DEFINITIONS_H_
+#define _MICYAUDIO_HOST_DEFINITIONS_H_
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef int32_t         NTSTATUS;
+typedef int16_t         SHORT;
+typedef int32_t         LONG;
+typedef uint32_t        ULONG;
+typedef ULONG *         PULONG;
+typedef int64_t         LONGLONG;
+typedef uint64_t        ULONGLONG;
+typedef uint64_t        ULONG64;
+typedef uint8_t         UCHAR;
+typedef UCHAR *         PUCHAR;
+typedef uint8_t         BOOLEAN;
+typedef void            VOID;
+
+#define TRUE                            1
+#define FALSE                           0
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000DL)
+#define NT_SUCCESS(Status)              (((NTSTATUS)(Status)) >= 0)
+
+#define FIELD_OFFSET(type, field)       offsetof(type, field)
+#define RtlZeroMemory(d, n)             memset((d), 0, (n))
+#define RtlCopyMemory(d, s, n)          memcpy((d), (s), (n))
+#define ASSERT(e)                       assert(e)
+
+#define METHOD_BUFFERED                 0
+#define FILE_ANY_ACCESS                 0
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+    (((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+#define _In_
+#define _Out_
+#define _Inout_
+#define _In_reads_bytes_(size)
+#define _Out_writes_bytes_(size)
+
+#endif // _MICYAUDIO_HOST_DEFINITIONS_H_
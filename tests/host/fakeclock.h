@@ -0,0 +1,87 @@
+/*++
+
+Module Name:
+
+    fakeclock.h
+
+Abstract:
+
+    Deterministic stand-ins for KeQueryPerformanceCounter and the one-shot
+    EX_TIMER the stream arms with ExSetTimer. Time only moves when the test
+    moves it, so a replay gives the same result on every host and runs as
+    fast as the code under test allows.
+--*/
+
+#ifndef _MICYAUDIO_FAKECLOCK_H_
+#define _MICYAUDIO_FAKECLOCK_H_
+
+#include <stdint.h>
+
+#define FAKE_HNS_PER_SECOND     10000000ll
+
+//
+// QPC counter. Starts at Start, which may stand for a long uptime.
+//
+class FakeClock
+{
+public:
+    FakeClock(uint64_t Frequency, int64_t Start) : m_Frequency(Frequency), m_Now(Start) {}
+
+    uint64_t Frequency() const { return m_Frequency; }
+    int64_t Now() const { return m_Now; }
+
+    // Never moves backwards.
+    void AdvanceTo(int64_t Qpc)
+    {
+        if (Qpc > m_Now)
+        {
+            m_Now = Qpc;
+        }
+    }
+
+    void Advance(int64_t Ticks) { AdvanceTo(m_Now + Ticks); }
+
+    int64_t TicksOfSeconds(double Seconds) const { return (int64_t)(Seconds * (double)m_Frequency); }
+
+private:
+    uint64_t    m_Frequency;
+    int64_t     m_Now;
+};
+
+//
+// One-shot timer: Set takes ExSetTimer's DueTime, negative for relative
+// 100 ns units, and the timer is due at the first QPC tick at or after it.
+// A set timer that has not fired yet is replaced, as ExSetTimer does.
+//
+class FakeTimer
+{
+public:
+    explicit FakeTimer(const FakeClock & Clock) : m_Clock(Clock), m_Armed(false), m_DueQpc(0), m_Sets(0) {}
+
+    void Set(int64_t DueTime)
+    {
+        uint64_t hns = (DueTime < 0) ? (uint64_t)-DueTime : 0;
+
+        m_DueQpc = m_Clock.Now() +
+                   (int64_t)((hns * m_Clock.Frequency() + FAKE_HNS_PER_SECOND - 1) / FAKE_HNS_PER_SECOND);
+        m_Armed = true;
+        m_Sets++;
+    }
+
+    void Cancel() { m_Armed = false; }
+
+    bool Armed() const { return m_Armed; }
+    int64_t DueQpc() const { return m_DueQpc; }
+    uint64_t Sets() const { return m_Sets; }
+
+    // The DPC is about to run: the timer is no longer set.
+    void Fire() { m_Armed = false; }
+
+private:
+    const FakeClock &   m_Clock;
+    bool                m_Armed;
+    int64_t             m_DueQpc;
+    uint64_t            m_Sets;
+};
+
+#endif // _MICYAUDIO_FAKECLOCK_H_
@@ -0,0 +1,338 @@
+/*++
+
+Module Name:
+
+    fakeportstream.h
+
+Abstract:
+
+    Host stand-in for the timing side of a CMiniportWaveRTStream, driven by
+    FakeClock instead of a kernel and an audio engine.
+
+    The decisions of SetState, the position update, SetWritePacket and the
+    TimerNotifyRT DPC are the stream core's (streamcore.h), so FakePortStream
+    only wraps it the way the driver does: it calls the same core routines
+    in the same order, arms a FakeTimer where the driver arms its
+    EX_TIMER, and counts the events it would signal and the glitches it
+    would report instead of signalling and reporting them. The locking and
+    the audio are left out, so a test can replay hours of a stream's
+    position and packet timing in seconds. The test plays the audio engine
+    and the kernel: it calls the methods as PortCls would and runs
+    TimerNotify once the clock has reached the timer's due time plus
+    whatever dispatch latency it simulates.
+--*/
+
+#ifndef _MICYAUDIO_FAKEPORTSTREAM_H_
+#define _MICYAUDIO_FAKEPORTSTREAM_H_
+
+#include "definitions.h"
+#include "streamcore.h"
+#include "fakeclock.h"
+
+#ifndef STATUS_UNSUCCESSFUL
+#define STATUS_UNSUCCESSFUL             ((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_DEVICE_REQUEST   ((NTSTATUS)0xC0000010L)
+#define STATUS_DATA_OVERRUN             ((NTSTATUS)0xC000003CL)
+#define STATUS_DATA_LATE_ERROR          ((NTSTATUS)0xC000009EL)
+#define STATUS_NOT_SUPPORTED            ((NTSTATUS)0xC00000BBL)
+#define STATUS_DEVICE_NOT_READY         ((NTSTATUS)0xC00000A3L)
+#define STATUS_INVALID_DEVICE_STATE     ((NTSTATUS)0xC0000184L)
+#endif
+
+typedef enum
+{
+    KSSTATE_STOP,
+    KSSTATE_ACQUIRE,
+    KSSTATE_PAUSE,
+    KSSTATE_RUN
+} KSSTATE;
+
+class FakePortStream
+{
+public:
+    FakePortStream(FakeClock & Clock, ULONG SamplesPerSec, ULONG BlockAlign, BOOLEAN LowLatency, BOOLEAN Capture = TRUE)
+        : Wakeups(0),
+          Signals(0),
+          Underruns(0),
+          RepeatedWrites(0),
+          MaxLatenessTicks(0),
+          m_Clock(Clock),
+          m_Timer(Clock),
+          m_bCapture(Capture),
+          m_ulBlockAlign(BlockAlign),
+          m_ulNotificationsPerBuffer(0),
+          m_ulLastOsReadPacket(MAXULONG),
+          m_ulLastOsWritePacket(MAXULONG)
+    {
+        StreamCore_Init(&m_Core, Clock.Frequency(), SamplesPerSec, BlockAlign);
+        m_Core.LowLatency = LowLatency ? 1 : 0;
+    }
+
+    //
+    // Buffer allocation, without the buffer: only the sizes matter here.
+    //
+    NTSTATUS AllocateBufferWithNotification(ULONG NotificationCount, ULONG RequestedSize, ULONG * ActualSize)
+    {
+        if (RequestedSize == 0 || RequestedSize < m_ulBlockAlign)
+        {
+            return STATUS_UNSUCCESSFUL;
+        }
+
+        if (NotificationCount == 0 || RequestedSize % NotificationCount != 0)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        RequestedSize -= RequestedSize % m_ulBlockAlign;
+
+        m_ulNotificationsPerBuffer = NotificationCount;
+        StreamCore_SetBuffer(&m_Core, RequestedSize, RequestedSize / NotificationCount);
+
+        *ActualSize = RequestedSize;
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS SetState(KSSTATE State)
+    {
+        switch (State)
+        {
+            case KSSTATE_STOP:
+                StreamCore_Stop(&m_Core);
+                m_ulLastOsReadPacket = MAXULONG;
+                m_ulLastOsWritePacket = MAXULONG;
+                break;
+
+            case KSSTATE_ACQUIRE:
+                StreamCore_Acquire(&m_Core);
+                break;
+
+            case KSSTATE_PAUSE:
+                if (m_Core.State > StreamCorePause && StreamCore_BeginPause(&m_Core))
+                {
+                    m_Timer.Cancel();
+                }
+                GetPositions(NULL, NULL, NULL);
+                StreamCore_Pause(&m_Core);
+                break;
+
+            case KSSTATE_RUN:
+                if (StreamCore_Run(&m_Core, m_Clock.Now()))
+                {
+                    ArmNotificationTimer(m_Clock.Now());
+                }
+                break;
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS GetReadPacket(ULONG * PacketNumber, ULONG * Flags, ULONG64 * PerformanceCounterValue, BOOLEAN * MoreData)
+    {
+        LONGLONG    availablePacket;
+        LONGLONG    timeOfAvailablePacketInQpc = 0;
+        ULONG       availablePacketNumber;
+        int         stamped;
+
+        if (m_ulNotificationsPerBuffer == 0)
+        {
+            return STATUS_NOT_SUPPORTED;
+        }
+
+        *Flags = 0;
+
+        if (m_Core.State < StreamCorePause)
+        {
+            return STATUS_INVALID_DEVICE_STATE;
+        }
+
+        stamped = StreamCore_GetCompletedPacket(&m_Core, &availablePacket, &timeOfAvailablePacketInQpc);
+        availablePacketNumber = (ULONG)availablePacket;
+
+        if (availablePacketNumber == m_ulLastOsReadPacket)
+        {
+            return STATUS_DEVICE_NOT_READY;
+        }
+
+        *PacketNumber = availablePacketNumber;
+
+        if (!stamped)
+        {
+            return STATUS_DEVICE_NOT_READY;
+        }
+
+        *PerformanceCounterValue = (ULONG64)timeOfAvailablePacketInQpc;
+        *MoreData = FALSE;
+        m_ulLastOsReadPacket = availablePacketNumber;
+
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Render: the OS wrote packet PacketNumber, only EosPacketLength bytes
+    // of it if EndOfStream is set.
+    //
+    NTSTATUS SetWritePacket(ULONG PacketNumber, BOOLEAN EndOfStream, ULONG EosPacketLength)
+    {
+        ULONG   expectedPacket;
+        LONG    deltaFromExpectedPacket;
+        ULONG   packetSize;
+        ULONG   offset;
+        int     result;
+
+        if (m_ulNotificationsPerBuffer == 0)
+        {
+            return STATUS_NOT_SUPPORTED;
+        }
+
+        if (m_Core.EndOfStream)
+        {
+            return STATUS_INVALID_DEVICE_STATE;
+        }
+
+        expectedPacket = (ULONG)m_Core.PacketCounter;
+        if (m_Core.State == StreamCoreRun)
+        {
+            expectedPacket++;
+        }
+
+        deltaFromExpectedPacket = (LONG)(PacketNumber - expectedPacket);
+        if (deltaFromExpectedPacket < 0)
+        {
+            return STATUS_DATA_LATE_ERROR;
+        }
+        else if (deltaFromExpectedPacket > 0)
+        {
+            return STATUS_DATA_OVERRUN;
+        }
+
+        packetSize = m_Core.BufferBytes / m_ulNotificationsPerBuffer;
+        offset = (PacketNumber % m_ulNotificationsPerBuffer) * packetSize;
+        if (EndOfStream)
+        {
+            offset += EosPacketLength;
+        }
+
+        result = StreamCore_SetWriteOffset(&m_Core, offset, EndOfStream);
+        if (result == STREAM_CORE_WRITE_REJECTED)
+        {
+            return STATUS_INVALID_DEVICE_REQUEST;
+        }
+        if (result == STREAM_CORE_WRITE_REPEATED)
+        {
+            RepeatedWrites++;
+        }
+
+        m_ulLastOsWritePacket = PacketNumber;
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS GetPositions(ULONGLONG * LinearPosition, ULONGLONG * PresentationPosition, LONGLONG * Qpc)
+    {
+        LONGLONG qpc = m_Clock.Now();
+
+        if (m_Core.State == StreamCoreRun)
+        {
+            UpdatePosition(qpc);
+        }
+        if (LinearPosition)
+        {
+            *LinearPosition = m_Core.LinearPosition;
+        }
+        if (PresentationPosition)
+        {
+            *PresentationPosition = m_Core.PresentationPosition;
+        }
+        if (Qpc)
+        {
+            *Qpc = qpc;
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    ULONG GetPacketCount()
+    {
+        if (m_Core.State == StreamCoreRun)
+        {
+            UpdatePosition(m_Clock.Now());
+        }
+
+        return (ULONG)m_Core.PacketCounter;
+    }
+
+    //
+    // TimerNotifyRT, at the clock's current time. Returns TRUE if it
+    // signalled the notification events.
+    //
+    BOOLEAN TimerNotify()
+    {
+        LONGLONG    qpc = m_Clock.Now();
+        int         tick;
+
+        m_Timer.Fire();
+        Wakeups++;
+        MaxLatenessTicks = (qpc - m_Core.TimerDueQpc > MaxLatenessTicks) ? qpc - m_Core.TimerDueQpc : MaxLatenessTicks;
+
+        UpdatePosition(qpc);
+
+        tick = StreamCore_Tick(&m_Core);
+
+        if (tick & STREAM_CORE_TICK_UNDERRUN)
+        {
+            Underruns++;
+        }
+        if (tick & STREAM_CORE_TICK_SIGNAL)
+        {
+            Signals++;
+        }
+
+        ArmNotificationTimer(qpc);
+
+        return (tick & STREAM_CORE_TICK_SIGNAL) ? TRUE : FALSE;
+    }
+
+    const FakeTimer & Timer() const { return m_Timer; }
+    const STREAM_CORE & Core() const { return m_Core; }
+    KSSTATE State() const { return (KSSTATE)m_Core.State; }
+    ULONG PacketBytes() const { return m_Core.PacketBytes; }
+
+    ULONGLONG   Wakeups;                // DPCs run
+    ULONGLONG   Signals;                // DPCs that signalled the notification events
+    ULONGLONG   Underruns;              // underrun glitches the DPCs reported
+    ULONGLONG   RepeatedWrites;         // same write offset glitches SetWritePacket reported
+    LONGLONG    MaxLatenessTicks;       // DPC start after the timer's due time
+
+private:
+    void UpdatePosition(LONGLONG Qpc)
+    {
+        ULONG bytes = StreamCore_BytesDue(&m_Core, Qpc);
+
+        if (!m_bCapture)
+        {
+            bytes = StreamCore_ClampToEndOfStream(&m_Core, bytes);
+        }
+
+        StreamCore_Move(&m_Core, bytes);
+    }
+
+    void ArmNotificationTimer(LONGLONG Qpc)
+    {
+        LONGLONG hnsDue;
+
+        if (StreamCore_ArmTimer(&m_Core, Qpc, &hnsDue))
+        {
+            m_Timer.Set(-hnsDue);
+        }
+    }
+
+    FakeClock &     m_Clock;
+    FakeTimer       m_Timer;
+    STREAM_CORE     m_Core;
+    BOOLEAN         m_bCapture;
+    ULONG           m_ulBlockAlign;
+    ULONG           m_ulNotificationsPerBuffer;
+    ULONG           m_ulLastOsReadPacket;
+    ULONG           m_ulLastOsWritePacket;
+};
+
+#endif // _MICYAUDIO_FAKEPORTSTREAM_H_
@@ -0,0 +1,78 @@
+/*++
+
+Module Name:
+
+    ioparse_fuzz.cpp
+
+Abstract:
+
+    Fuzz target for the control device submission parsers. Every input is
+    parsed both as an IOCTL_MICYAUDIO_SET_AUDIO_DATA buffer and as an
+    IOCTL_MICYAUDIO_SUBMIT_BATCH buffer, and every byte of every chunk that
+    is accepted is read, so a chunk reaching outside the buffer shows up
+    under AddressSanitizer.
+
+    With Clang the target links against libFuzzer. Otherwise
+    fuzz_driver.cpp supplies main(): it replays the files named on the
+    command line, then runs a number of randomly mutated inputs.
+--*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "definitions.h"
+#include "ioparse.h"
+
+static
+void
+TouchChunk
+(
+    const MICY_CHUNK * Chunk
+)
+{
+    volatile UCHAR sum = 0;
+
+    for (ULONG i = 0; i < Chunk->Length; i++)
+    {
+        sum = sum + Chunk->Data[i];
+    }
+}
+
+extern "C"
+int
+LLVMFuzzerTestOneInput
+(
+    const uint8_t * Data,
+    size_t          Size
+)
+{
+    // An exactly sized copy, so reading one byte past it is caught.
+    UCHAR *     buffer = (UCHAR *)malloc(Size ? Size : 1);
+    MICY_CHUNK  chunk;
+    ULONG       count;
+
+    if (buffer == NULL || Size > 0xFFFFFFFF)
+    {
+        free(buffer);
+        return 0;
+    }
+    memcpy(buffer, Data, Size);
+
+    if (NT_SUCCESS(MicyParseSetAudioData(buffer, (ULONG)Size, &chunk)))
+    {
+        TouchChunk(&chunk);
+    }
+
+    if (NT_SUCCESS(MicyParseBatch(buffer, (ULONG)Size, &count)))
+    {
+        for (ULONG i = 0; i < count; i++)
+        {
+            MicyGetBatchChunk(buffer, i, &chunk);
+            TouchChunk(&chunk);
+        }
+    }
+
+    free(buffer);
+    return 0;
+}
@@ -0,0 +1,295 @@
+/*++
+
+Module Name:
+
+    ioparse_test.cpp
+
+Abstract:
+
+    Unit tests of the control device submission parsers (ioparse.cpp):
+    IOCTL_MICYAUDIO_SET_AUDIO_DATA headers and IOCTL_MICYAUDIO_SUBMIT_BATCH
+    descriptor vectors, including the overflow cases every length and
+    offset from user mode has to survive, and a randomized comparison
+    against a straightforward 64-bit reference of the rules.
+--*/
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include "definitions.h"
+#include "ioparse.h"
+#include "testutil.h"
+
+namespace
+{
+
+std::vector<UCHAR> MakeSetAudioData(ULONG StreamId, ULONG DataSize, size_t Supplied)
+{
+    std::vector<UCHAR>          buffer(MICYAUDIO_SET_AUDIO_DATA_HEADER_SIZE + Supplied);
+    MICYAUDIO_SET_AUDIO_DATA    header;
+
+    header.StreamId = StreamId;
+    header.DataSize = DataSize;
+    memcpy(buffer.data(), &header, MICYAUDIO_SET_AUDIO_DATA_HEADER_SIZE);
+    TestPatternFill(buffer.data() + MICYAUDIO_SET_AUDIO_DATA_HEADER_SIZE, 0, (uint32_t)Supplied);
+
+    return buffer;
+}
+
+std::vector<UCHAR> MakeBatch
+(
+    const std::vector<MICYAUDIO_CHUNK_DESCRIPTOR> & Descriptors,
+    size_t                                          PayloadLength,
+    ULONG                                           ChunkCount,
+    ULONG                                           Reserved = 0
+)
+{
+    MICYAUDIO_BATCH_HEADER  header = { ChunkCount, Reserved };
+    std::vector<UCHAR>      buffer(sizeof(header) +
+                                   Descriptors.size() * sizeof(MICYAUDIO_CHUNK_DESCRIPTOR) +
+                                   PayloadLength);
+
+    memcpy(buffer.data(), &header, sizeof(header));
+    if (!Descriptors.empty())
+    {
+        memcpy(buffer.data() + sizeof(header), Descriptors.data(),
+               Descriptors.size() * sizeof(MICYAUDIO_CHUNK_DESCRIPTOR));
+    }
+
+    return buffer;
+}
+
+std::vector<UCHAR> MakeBatch(const std::vector<MICYAUDIO_CHUNK_DESCRIPTOR> & Descriptors, size_t PayloadLength)
+{
+    return MakeBatch(Descriptors, PayloadLength, (ULONG)Descriptors.size());
+}
+
+NTSTATUS ParseBatch(const std::vector<UCHAR> & Buffer, ULONG * Count)
+{
+    return MicyParseBatch(Buffer.data(), (ULONG)Buffer.size(), Count);
+}
+
+//
+// The batch rules restated in 64-bit arithmetic, where nothing can wrap.
+//
+bool ReferenceAcceptsBatch(const std::vector<UCHAR> & Buffer)
+{
+    MICYAUDIO_BATCH_HEADER  header;
+    uint64_t                descriptorBytes;
+    uint64_t                payload;
+
+    if (Buffer.size() < sizeof(header))
+    {
+        return false;
+    }
+
+    memcpy(&header, Buffer.data(), sizeof(header));
+    if (header.Reserved != 0 || header.ChunkCount == 0 || header.ChunkCount > MICYAUDIO_MAX_BATCH_CHUNKS)
+    {
+        return false;
+    }
+
+    descriptorBytes = (uint64_t)header.ChunkCount * sizeof(MICYAUDIO_CHUNK_DESCRIPTOR);
+    if (sizeof(header) + descriptorBytes > Buffer.size())
+    {
+        return false;
+    }
+
+    payload = Buffer.size() - sizeof(header) - descriptorBytes;
+
+    for (ULONG i = 0; i < header.ChunkCount; i++)
+    {
+        MICYAUDIO_CHUNK_DESCRIPTOR descriptor;
+
+        memcpy(&descriptor, Buffer.data() + sizeof(header) + i * sizeof(descriptor), sizeof(descriptor));
+        if ((descriptor.Flags & ~MICYAUDIO_CHUNK_FLAGS_VALID) != 0 ||
+            descriptor.Length == 0 ||
+            (uint64_t)descriptor.Offset + descriptor.Length > payload)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+} // namespace
+
+TEST(IoParseSetAudioData, AcceptsHeaderAndData)
+{
+    std::vector<UCHAR>  buffer = MakeSetAudioData(2, 960, 960);
+    MICY_CHUNK          chunk;
+
+    ASSERT_EQ(STATUS_SUCCESS, MicyParseSetAudioData(buffer.data(), (ULONG)buffer.size(), &chunk));
+    EXPECT_EQ(2u, chunk.StreamId);
+    EXPECT_EQ(0u, chunk.Flags);
+    EXPECT_EQ(960u, chunk.Length);
+    EXPECT_EQ(buffer.data() + MICYAUDIO_SET_AUDIO_DATA_HEADER_SIZE, chunk.Data);
+}
+
+TEST(IoParseSetAudioData, HeaderBytesAreNotAudio)
+{
+    EXPECT_EQ(8u, (unsigned)MICYAUDIO_SET_AUDIO_DATA_HEADER_SIZE);
+}
+
+TEST(IoParseSetAudioData, IgnoresTrailingBytes)
+{
+    std::vector<UCHAR>  buffer = MakeSetAudioData(1, 100, 400);
+    MICY_CHUNK          chunk;
+
+    ASSERT_EQ(STATUS_SUCCESS, MicyParseSetAudioData(buffer.data(), (ULONG)buffer.size(), &chunk));
+    EXPECT_EQ(100u, chunk.Length);
+}
+
+TEST(IoParseSetAudioData, RejectsMalformed)
+{
+    std::vector<UCHAR>  buffer = MakeSetAudioData(1, 16, 16);
+    MICY_CHUNK          chunk;
+
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, MicyParseSetAudioData(NULL, 100, &chunk));
+
+    for (ULONG length = 0; length < MICYAUDIO_SET_AUDIO_DATA_HEADER_SIZE; length++)
+    {
+        EXPECT_EQ(STATUS_INVALID_PARAMETER, MicyParseSetAudioData(buffer.data(), length, &chunk)) << length;
+    }
+
+    // Claims one byte more than supplied.
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, MicyParseSetAudioData(buffer.data(), (ULONG)buffer.size() - 1, &chunk));
+    EXPECT_EQ(0u, chunk.Length);
+
+    buffer = MakeSetAudioData(1, 0, 16);
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, MicyParseSetAudioData(buffer.data(), (ULONG)buffer.size(), &chunk));
+
+    buffer = MakeSetAudioData(1, 0xFFFFFFFF, 16);
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, MicyParseSetAudioData(buffer.data(), (ULONG)buffer.size(), &chunk));
+}
+
+TEST(IoParseBatch, AcceptsChunksForSeveralStreams)
+{
+    std::vector<MICYAUDIO_CHUNK_DESCRIPTOR> descriptors =
+    {
+        { 1, 0,    1920, 0 },
+        { 2, 1920, 1920, MICYAUDIO_CHUNK_FLAG_WAIT },
+        { 1, 960,  1920, 0 },                           // overlaps both
+    };
+    std::vector<UCHAR>  buffer = MakeBatch(descriptors, 3840);
+    const UCHAR *       payload = buffer.data() + sizeof(MICYAUDIO_BATCH_HEADER) +
+                                  3 * sizeof(MICYAUDIO_CHUNK_DESCRIPTOR);
+    ULONG               count;
+    MICY_CHUNK          chunk;
+
+    ASSERT_EQ(STATUS_SUCCESS, ParseBatch(buffer, &count));
+    ASSERT_EQ(3u, count);
+
+    for (ULONG i = 0; i < count; i++)
+    {
+        MicyGetBatchChunk(buffer.data(), i, &chunk);
+        EXPECT_EQ(descriptors[i].StreamId, chunk.StreamId);
+        EXPECT_EQ(descriptors[i].Flags, chunk.Flags);
+        EXPECT_EQ(payload + descriptors[i].Offset, chunk.Data);
+        EXPECT_EQ(descriptors[i].Length, chunk.Length);
+    }
+}
+
+TEST(IoParseBatch, ChunkMayEndExactlyAtThePayloadEnd)
+{
+    ULONG count;
+
+    EXPECT_EQ(STATUS_SUCCESS, ParseBatch(MakeBatch({ { 1, 0, 64, 0 } }, 64), &count));
+    EXPECT_EQ(STATUS_SUCCESS, ParseBatch(MakeBatch({ { 1, 63, 1, 0 } }, 64), &count));
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, ParseBatch(MakeBatch({ { 1, 63, 2, 0 } }, 64), &count));
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, ParseBatch(MakeBatch({ { 1, 64, 1, 0 } }, 64), &count));
+}
+
+TEST(IoParseBatch, RejectsMalformedHeader)
+{
+    std::vector<MICYAUDIO_CHUNK_DESCRIPTOR> one = { { 1, 0, 16, 0 } };
+    ULONG count = 1234;
+
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, MicyParseBatch(NULL, 64, &count));
+    EXPECT_EQ(0u, count);
+
+    std::vector<UCHAR> buffer = MakeBatch(one, 16);
+    for (ULONG length = 0; length < sizeof(MICYAUDIO_BATCH_HEADER); length++)
+    {
+        EXPECT_EQ(STATUS_INVALID_PARAMETER, MicyParseBatch(buffer.data(), length, &count)) << length;
+    }
+
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, ParseBatch(MakeBatch(one, 16, 0), &count));
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, ParseBatch(MakeBatch(one, 16, 1, 1), &count));
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, ParseBatch(MakeBatch(one, 16, MICYAUDIO_MAX_BATCH_CHUNKS + 1), &count));
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, ParseBatch(MakeBatch(one, 16, 0xFFFFFFFF), &count));
+}
+
+TEST(IoParseBatch, RejectsTruncatedDescriptors)
+{
+    ULONG count;
+
+    // Two descriptors claimed, one and a half supplied.
+    std::vector<UCHAR> buffer = MakeBatch({ { 1, 0, 4, 0 } }, 8, 2);
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, ParseBatch(buffer, &count));
+}
+
+TEST(IoParseBatch, RejectsMalformedDescriptors)
+{
+    ULONG count;
+
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, ParseBatch(MakeBatch({ { 1, 0, 0, 0 } }, 16), &count));
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, ParseBatch(MakeBatch({ { 1, 0, 16, 0x2 } }, 16), &count));
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, ParseBatch(MakeBatch({ { 1, 0, 16, 0x80000000 } }, 16), &count));
+
+    // Offset + Length wraps a ULONG.
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, ParseBatch(MakeBatch({ { 1, 0xFFFFFFF8, 0x10, 0 } }, 16), &count));
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, ParseBatch(MakeBatch({ { 1, 8, 0xFFFFFFFC, 0 } }, 16), &count));
+
+    // One bad descriptor spoils the batch.
+    EXPECT_EQ(STATUS_INVALID_PARAMETER,
+              ParseBatch(MakeBatch({ { 1, 0, 8, 0 }, { 2, 8, 8, 0 }, { 3, 12, 8, 0 } }, 16), &count));
+    EXPECT_EQ(0u, count);
+}
+
+TEST(IoParseBatch, MatchesReferenceOnRandomBatches)
+{
+    TestRandom  random(5);
+    ULONG       accepted = 0;
+
+    for (int i = 0; i < 200000; i++)
+    {
+        ULONG   chunks = random.Range(0, 6);
+        size_t  payload = random.Range(0, 96);
+        std::vector<MICYAUDIO_CHUNK_DESCRIPTOR> descriptors(chunks);
+
+        for (auto & descriptor : descriptors)
+        {
+            descriptor.StreamId = random.Range(0, 3);
+            descriptor.Offset   = random.Range(0, 8) == 0 ? (ULONG)random.Next() : random.Range(0, 100);
+            descriptor.Length   = random.Range(0, 8) == 0 ? (ULONG)random.Next() : random.Range(0, 100);
+            descriptor.Flags    = random.Range(0, 16) == 0 ? 2 : random.Range(0, 1);
+        }
+
+        std::vector<UCHAR> buffer = MakeBatch(descriptors, payload,
+                                              random.Range(0, 16) == 0 ? chunks + 1 : chunks,
+                                              random.Range(0, 32) == 0 ? 1 : 0);
+
+        // Sometimes cut into the descriptors or the payload.
+        if (!buffer.empty() && random.Range(0, 4) == 0)
+        {
+            buffer.resize(random.Range(0, (ULONG)buffer.size()));
+        }
+
+        ULONG       count;
+        NTSTATUS    status = ParseBatch(buffer, &count);
+        bool        expected = ReferenceAcceptsBatch(buffer);
+
+        ASSERT_EQ(expected, NT_SUCCESS(status)) << "iteration " << i;
+        if (expected)
+        {
+            accepted++;
+        }
+    }
+
+    // Both outcomes are well exercised.
+    EXPECT_GT(accepted, 1000u);
+    EXPECT_LT(accepted, 190000u);
+}
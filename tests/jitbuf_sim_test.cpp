@@ -0,0 +1,320 @@
+/*++
+
+Module Name:
+
+    jitbuf_sim_test.cpp
+
+Abstract:
+
+    Simulation of the jitter buffer mode: a feeder fed from the network
+    delivers packets into a 200 ms ring at jittered times, and a capture
+    DPC drains it every millisecond, doing what ReadUserPcm does with the
+    action JitBuf_Update (jitbuf.h) returns. Each feeder runs once against
+    the plain fixed target, trimmed at twice TargetMs with no pre-roll, and
+    once against the jitter buffer. The simulation reports the share of
+    the stream that came out as silence and the mean and 99th percentile
+    fill, and checks the jitter buffer trades a little latency for far
+    fewer underruns, stays low for a smooth feeder and gives latency back
+    when the jitter stops.
+
+    MICY_JITBUF_SECONDS sets the simulated time per run, default 60.
+--*/
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#include "jitbuf.h"
+#include "testutil.h"
+
+namespace
+{
+
+const double kRingMs = 200.0;
+
+struct Feeder
+{
+    const char *    Name;
+    double          PacketMs;
+    double          JitterMs;       // mean of an exponential delay per packet
+    double          StallChance;    // per packet
+    double          StallMs;
+    double          LateMs;         // before the first packet
+    double          JitterUntilMs;  // the jitter stops after this, 0 never
+};
+
+struct JitResult
+{
+    double          SilencePercent; // after the first second
+    double          MeanFillMs;
+    double          P99FillMs;
+    double          DroppedMs;
+    double          PeakTargetMs;
+    double          FinalTargetMs;
+    ULONG           Rebuffers;
+};
+
+//
+// Arrival times of Feeder's packets on the stream's clock, in ms. A stall
+// holds back every packet due before it ends.
+//
+std::vector<double> Arrivals(const Feeder & Feeder, double Seconds, uint64_t Seed)
+{
+    TestRandom          random(Seed);
+    std::vector<double> arrivals;
+    double              stall = 0.0;
+
+    for (double t = 0.0; t < Seconds * 1000.0; t += Feeder.PacketMs)
+    {
+        double arrival = t + Feeder.LateMs;
+
+        if (Feeder.JitterMs > 0.0 && (Feeder.JitterUntilMs == 0.0 || t < Feeder.JitterUntilMs))
+        {
+            arrival += -log(1.0 - random.Unit()) * Feeder.JitterMs;
+        }
+        if (random.Unit() < Feeder.StallChance)
+        {
+            stall = std::max(stall, arrival + Feeder.StallMs);
+        }
+        arrivals.push_back(std::max(arrival, stall));
+    }
+
+    std::sort(arrivals.begin(), arrivals.end());
+    return arrivals;
+}
+
+JitResult Simulate(const Feeder & Feeder, bool JitterBuffer, double TargetMs, uint64_t Seed)
+{
+    const double        wakeMs = 1.0;
+    double              seconds = (double)TestEnvU64("MICY_JITBUF_SECONDS", 60);
+    std::vector<double> arrivals = Arrivals(Feeder, seconds, Seed);
+    std::vector<double> fills;
+    JITBUF              jit;
+    double              fill = 0.0;
+    double              silence = 0.0;
+    double              total = 0.0;
+    size_t              next = 0;
+    BOOLEAN             wasBuffering = TRUE;
+    JitResult           result = {};
+
+    JitBuf_Init(&jit, TargetMs / 1000.0, kRingMs / 2 / 1000.0);
+
+    for (double t = 0.0; t < seconds * 1000.0; t += wakeMs)
+    {
+        bool   read = true;
+        double got;
+
+        while (next < arrivals.size() && arrivals[next] <= t)
+        {
+            fill = std::min(kRingMs, fill + Feeder.PacketMs);
+            next++;
+        }
+
+        if (!JitterBuffer)
+        {
+            // TrimToTarget: a fill past twice the target drops back to it.
+            if (fill > 2 * TargetMs)
+            {
+                result.DroppedMs += fill - TargetMs;
+                fill = TargetMs;
+            }
+        }
+        else
+        {
+            switch (JitBuf_Update(&jit, fill / 1000.0, wakeMs / 1000.0))
+            {
+            case JitBufBuffer:
+                read = false;
+                break;
+
+            case JitBufShrink:
+                result.DroppedMs += jit.Excess * 1000.0;
+                fill -= jit.Excess * 1000.0;
+                break;
+
+            default:
+                break;
+            }
+
+            if (jit.Buffering && !wasBuffering)
+            {
+                result.Rebuffers++;
+            }
+            wasBuffering = jit.Buffering;
+            result.PeakTargetMs = std::max(result.PeakTargetMs, jit.Target * 1000.0);
+        }
+
+        got = read ? std::min(fill, wakeMs) : 0.0;
+        if (t >= 1000.0)
+        {
+            fills.push_back(fill);
+            silence += wakeMs - got;
+            total += wakeMs;
+        }
+        fill -= got;
+    }
+
+    std::sort(fills.begin(), fills.end());
+    for (double f : fills)
+    {
+        result.MeanFillMs += f;
+    }
+    result.MeanFillMs /= (double)fills.size();
+    result.P99FillMs = fills[fills.size() * 99 / 100];
+    result.SilencePercent = 100.0 * silence / total;
+    result.FinalTargetMs = jit.Target * 1000.0;
+
+    printf("  %-28s TargetMs %2.0f %-13s silence %6.3f%%, fill mean %5.1f ms p99 %5.1f ms, dropped %6.0f ms, %u rebuffers\n",
+           Feeder.Name, TargetMs, JitterBuffer ? "jitter buffer" : "fixed target", result.SilencePercent,
+           result.MeanFillMs, result.P99FillMs, result.DroppedMs, result.Rebuffers);
+
+    return result;
+}
+
+const Feeder kWifi = { "20 ms, 5 ms exponential", 20.0, 5.0, 0.0, 0.0, 3.0, 0.0 };
+const Feeder kStalls = { "20 ms, 10 ms exp, 1% stalls", 20.0, 10.0, 0.01, 80.0, 3.0, 0.0 };
+const Feeder kSmooth = { "smooth 10 ms chunks", 10.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+const Feeder kLate = { "10 ms chunks, 7 ms late", 10.0, 0.0, 0.0, 0.0, 7.0, 0.0 };
+
+} // namespace
+
+TEST(JitBufSim, JitteredFeederRarelyRunsDry)
+{
+    JitResult fixed = Simulate(kWifi, false, 20.0, 1);
+    JitResult jitter = Simulate(kWifi, true, 20.0, 1);
+
+    EXPECT_GT(fixed.SilencePercent, 0.5);
+    EXPECT_LT(jitter.SilencePercent, 0.1);
+    EXPECT_LT(jitter.MeanFillMs, 45.0);
+    EXPECT_LT(jitter.P99FillMs, kRingMs / 2);
+}
+
+TEST(JitBufSim, StallsBuyLatencyNotSilence)
+{
+    JitResult fixed = Simulate(kStalls, false, 20.0, 2);
+    JitResult jitter = Simulate(kStalls, true, 20.0, 2);
+
+    EXPECT_LT(jitter.SilencePercent, fixed.SilencePercent / 5);
+    EXPECT_LT(jitter.SilencePercent, 2.0);
+    EXPECT_LT(jitter.MeanFillMs, kRingMs / 2);
+}
+
+TEST(JitBufSim, SmoothFeederStaysAtThePreRoll)
+{
+    for (double targetMs : { 5.0, 20.0 })
+    {
+        JitResult jitter = Simulate(kSmooth, true, targetMs, 3);
+
+        EXPECT_EQ(0.0, jitter.SilencePercent);
+        EXPECT_LT(jitter.MeanFillMs, targetMs + 10.0);
+        EXPECT_EQ(0u, jitter.Rebuffers);
+    }
+}
+
+TEST(JitBufSim, LateStartDoesNotLeaveTheRingNearlyEmpty)
+{
+    JitResult fixed = Simulate(kLate, false, 20.0, 4);
+    JitResult jitter = Simulate(kLate, true, 20.0, 4);
+
+    // Without pre-roll the stream drains each chunk as it lands.
+    EXPECT_LT(fixed.MeanFillMs, 10.0);
+    EXPECT_EQ(0.0, jitter.SilencePercent);
+    EXPECT_GE(jitter.MeanFillMs, 15.0);
+}
+
+TEST(JitBufSim, TargetFallsBackWhenTheJitterStops)
+{
+    Feeder  calming = { "8 ms exponential, then none", 20.0, 8.0, 0.0, 0.0, 3.0, 0.0 };
+    double  seconds = (double)TestEnvU64("MICY_JITBUF_SECONDS", 60);
+
+    // Jitter for the first tenth, then well over two forgetting time
+    // constants of a feeder that only ever delivers 20 ms at a time.
+    calming.JitterUntilMs = seconds * 1000.0 / 10;
+
+    JitResult calmed = Simulate(calming, true, 5.0, 5);
+
+    printf("  target peaked at %.1f ms, ended at %.1f ms\n", calmed.PeakTargetMs, calmed.FinalTargetMs);
+    EXPECT_LT(calmed.FinalTargetMs, calmed.PeakTargetMs / 2);
+    EXPECT_LT(calmed.FinalTargetMs, 25.0);
+}
+
+TEST(JitBuf, PreRollThenPlay)
+{
+    JITBUF jit;
+
+    JitBuf_Init(&jit, 0.020, 0.100);
+
+    EXPECT_EQ(JitBufBuffer, JitBuf_Update(&jit, 0.000, 0.001));
+    EXPECT_EQ(JitBufBuffer, JitBuf_Update(&jit, 0.019, 0.001));
+    EXPECT_EQ(JitBufPlay, JitBuf_Update(&jit, 0.020, 0.001));
+    EXPECT_FALSE(jit.Buffering);
+
+    // Running short plays what there is and buffers from the next wakeup.
+    EXPECT_EQ(JitBufPlay, JitBuf_Update(&jit, 0.0005, 0.001));
+    EXPECT_TRUE(jit.Buffering);
+    EXPECT_EQ(JitBufBuffer, JitBuf_Update(&jit, 0.010, 0.001));
+
+    JitBuf_Reset(&jit);
+    EXPECT_TRUE(jit.Buffering);
+    EXPECT_EQ(0.020, jit.Target);
+    EXPECT_EQ(0.0, jit.Total);
+}
+
+TEST(JitBuf, ExcessIsDroppedDownToTheTarget)
+{
+    JITBUF jit;
+    int    shrinks = 0;
+
+    JitBuf_Init(&jit, 0.010, 0.100);
+    JitBuf_Update(&jit, 0.010, 0.001);
+
+    // A feeder that suddenly queues 80 ms more than needed.
+    for (int i = 0; i < 5000; i++)
+    {
+        double fill = 0.090;
+
+        if (JitBuf_Update(&jit, fill, 0.001) == JitBufShrink)
+        {
+            EXPECT_GT(jit.Excess, 0.0);
+            EXPECT_LE(jit.Excess, fill - 0.001);
+            shrinks++;
+        }
+    }
+
+    EXPECT_GT(shrinks, 0);
+    EXPECT_GE(jit.Target, jit.MinTarget);
+    EXPECT_LE(jit.Target, jit.MaxTarget);
+}
+
+TEST(JitBuf, HistogramForgetsAndKeepsItsShape)
+{
+    JITBUF jit;
+
+    JitBuf_Init(&jit, 0.005, 0.100);
+
+    // 1% of delays at 30 ms, the rest at 2 ms: the 99.5% quantile is
+    // the 30 ms bucket's upper edge.
+    for (int i = 0; i < 100000; i++)
+    {
+        JitBuf_Record(&jit, (i % 100 == 0) ? 0.0305 : 0.0025, 0.0);
+    }
+    EXPECT_NEAR(0.031, JitBuf_Quantile(&jit), 1e-9);
+    EXPECT_NEAR(0.0025 * 0.99 + 0.0305 * 0.01, JitBuf_MeanDelay(&jit), 1e-6);
+
+    // Weights grow by 1 ms / 20 s per record and are rescaled on the way;
+    // after 60 s of 2 ms delays the old ones hardly count.
+    for (int i = 0; i < 60000; i++)
+    {
+        JitBuf_Record(&jit, 0.0025, 0.001);
+    }
+    EXPECT_NEAR(0.003, JitBuf_Quantile(&jit), 1e-9);
+    EXPECT_LE(jit.Weight, 1e9);
+
+    // Delays past the histogram count in the last bucket.
+    JitBuf_Reset(&jit);
+    JitBuf_Record(&jit, 10.0, 0.0);
+    EXPECT_NEAR(JITBUF_BUCKETS * JITBUF_BUCKET_SECONDS, JitBuf_Quantile(&jit), 1e-9);
+}
@@ -0,0 +1,175 @@
+/*++
+
+Module Name:
+
+    lathist_test.cpp
+
+Abstract:
+
+    Tests for lathist.h: the bucket layout, recording, merging the per
+    processor copies and percentiles against the exact ones.
+--*/
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include "lathist.h"
+#include "testutil.h"
+
+namespace
+{
+
+//
+// Latencies spread over several decades, as DPC and IOCTL times are.
+//
+ULONGLONG RandomLatency(TestRandom & Random)
+{
+    return (ULONGLONG)exp(Random.Unit() * log(1e8));
+}
+
+} // namespace
+
+TEST(LatHist, BucketsTileTheRangeWithoutGaps)
+{
+    EXPECT_EQ(225u, (ULONG)LAT_HIST_BUCKETS);
+
+    for (ULONGLONG value = 0; value < 2 * LAT_HIST_SUB_COUNT; value++)
+    {
+        EXPECT_EQ(value, LatHist_BucketOf(value));
+        EXPECT_EQ(value, LatHist_BucketLow((ULONG)value));
+    }
+
+    for (ULONG bucket = 0; bucket < LAT_HIST_OVERFLOW; bucket++)
+    {
+        ULONGLONG low = LatHist_BucketLow(bucket);
+        ULONGLONG next = LatHist_BucketLow(bucket + 1);
+
+        ASSERT_LT(low, next) << bucket;
+        ASSERT_EQ(bucket, LatHist_BucketOf(low)) << bucket;
+        ASSERT_EQ(bucket, LatHist_BucketOf(next - 1)) << bucket;
+
+        // A bucket is at most 1/8 of the values in it wide.
+        ASSERT_LE(next - low, std::max<ULONGLONG>(1, low / LAT_HIST_SUB_COUNT)) << bucket;
+    }
+
+    EXPECT_EQ((ULONGLONG)1 << LAT_HIST_MAX_BITS, LatHist_BucketLow(LAT_HIST_OVERFLOW));
+    EXPECT_EQ((ULONG)LAT_HIST_OVERFLOW - 1, LatHist_BucketOf(((ULONGLONG)1 << LAT_HIST_MAX_BITS) - 1));
+    EXPECT_EQ((ULONG)LAT_HIST_OVERFLOW, LatHist_BucketOf((ULONGLONG)1 << LAT_HIST_MAX_BITS));
+    EXPECT_EQ((ULONG)LAT_HIST_OVERFLOW, LatHist_BucketOf(~0ull));
+}
+
+TEST(LatHist, RandomValuesLandInTheirBucket)
+{
+    TestRandom random(23);
+
+    for (int i = 0; i < 1000000; i++)
+    {
+        ULONGLONG value = random.Next() >> random.Range(34, 63);
+        ULONG     bucket = LatHist_BucketOf(value);
+
+        ASSERT_LE(LatHist_BucketLow(bucket), value);
+        ASSERT_LT(value, LatHist_BucketLow(bucket + 1));
+    }
+}
+
+TEST(LatHist, RecordKeepsCountSumAndMax)
+{
+    LAT_HIST hist;
+
+    LatHist_Reset(&hist);
+    EXPECT_EQ(0u, LatHist_Percentile(&hist, 500));
+
+    for (ULONGLONG value : { 0ull, 5ull, 17ull, 1000ull, 5000000000ull })
+    {
+        LatHist_Record(&hist, value);
+    }
+
+    EXPECT_EQ(5u, hist.Count);
+    EXPECT_EQ(5000001022ull, hist.Sum);
+    EXPECT_EQ(5000000000ull, hist.Max);
+    EXPECT_EQ(1u, hist.Buckets[0]);
+    EXPECT_EQ(1u, hist.Buckets[5]);
+    EXPECT_EQ(1u, hist.Buckets[LatHist_BucketOf(17)]);
+    EXPECT_EQ(1u, hist.Buckets[LAT_HIST_OVERFLOW]);
+
+    // The overflow bucket only has the maximum to go by.
+    EXPECT_EQ(5000000000ull, LatHist_Percentile(&hist, 1000));
+
+    LatHist_Reset(&hist);
+    EXPECT_EQ(0u, hist.Count);
+    EXPECT_EQ(0u, hist.Max);
+    for (ULONG i = 0; i < LAT_HIST_BUCKETS; i++)
+    {
+        ASSERT_EQ(0u, hist.Buckets[i]);
+    }
+}
+
+TEST(LatHist, PercentilesBoundTheExactOnes)
+{
+    TestRandom              random(24);
+    LAT_HIST                hist;
+    std::vector<ULONGLONG>  values(200000);
+
+    LatHist_Reset(&hist);
+    for (ULONGLONG & value : values)
+    {
+        value = RandomLatency(random);
+        LatHist_Record(&hist, value);
+    }
+    std::sort(values.begin(), values.end());
+
+    for (ULONG perMille : { 0u, 1u, 100u, 500u, 900u, 990u, 999u, 1000u })
+    {
+        size_t      rank = std::max<size_t>(1, (values.size() * perMille + 999) / 1000);
+        ULONGLONG   exact = values[rank - 1];
+        ULONGLONG   reported = LatHist_Percentile(&hist, perMille);
+
+        // The end of the exact value's bucket, never below it and never
+        // more than a bucket above.
+        EXPECT_GE(reported, exact) << perMille;
+        EXPECT_LE(reported, exact + exact / LAT_HIST_SUB_COUNT) << perMille;
+        EXPECT_LE(reported, hist.Max) << perMille;
+    }
+
+    EXPECT_EQ(values.back(), LatHist_Percentile(&hist, 1000));
+    EXPECT_EQ(LatHist_Percentile(&hist, 1000), LatHist_Percentile(&hist, 5000));
+}
+
+TEST(LatHist, MergedCopiesEqualOneHistogram)
+{
+    TestRandom  random(25);
+    LAT_HIST    perCpu[4];
+    LAT_HIST    merged;
+    LAT_HIST    single;
+
+    LatHist_Reset(&single);
+    for (LAT_HIST & hist : perCpu)
+    {
+        LatHist_Reset(&hist);
+    }
+
+    for (int i = 0; i < 100000; i++)
+    {
+        ULONGLONG value = RandomLatency(random);
+
+        LatHist_Record(&perCpu[random.Range(0, 3)], value);
+        LatHist_Record(&single, value);
+    }
+
+    LatHist_Reset(&merged);
+    for (const LAT_HIST & hist : perCpu)
+    {
+        LatHist_Merge(&merged, &hist);
+    }
+
+    EXPECT_EQ(single.Count, merged.Count);
+    EXPECT_EQ(single.Sum, merged.Sum);
+    EXPECT_EQ(single.Max, merged.Max);
+    for (ULONG i = 0; i < LAT_HIST_BUCKETS; i++)
+    {
+        ASSERT_EQ(single.Buckets[i], merged.Buckets[i]) << i;
+    }
+}
@@ -0,0 +1,509 @@
+/*++
+
+Module Name:
+
+    pcmconceal_test.cpp
+
+Abstract:
+
+    Tests for pcmconceal.cpp with scripted underruns: a capture stream
+    wakes up every 1 or 10 ms and finds the feeder's audio missing for
+    gaps of 2 to 80 ms, the way ReadUserPcm hands the concealer the frames
+    it read and the frames it came up short.
+
+    Each gap edge is scored by the largest second difference of the
+    output within two frames of it, relative to the 99.9th percentile of
+    the source's own: a click is a jump the source never makes. Zero
+    filling scores in the hundreds on a tone; the concealment modes must
+    stay within a small multiple of the source. The envelopes, the fade
+    back in and the comfort noise level are checked against what
+    pcmconceal.h promises, and the output must not depend on how the
+    wakeups split the audio or on the sample format.
+--*/
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#include "pcmconceal.h"
+#include "testutil.h"
+
+namespace
+{
+
+const ULONG     kRate = 48000;
+const ULONG     kChannels = 2;
+const double    kFullScale = 2147483648.0;
+
+enum Signal
+{
+    SignalTone,         // 440 Hz at -6 dBFS
+    SignalVoiced,       // 120-160 Hz harmonics under a syllable envelope
+    SignalNoise,        // a quiet room, mean |sample| 0.005
+};
+
+const char * const kSignalNames[] = { "tone", "voiced", "noise" };
+const char * const kModeNames[] = { "zero-fill", "fade", "repeat", "noise" };
+
+//
+// Seconds of Kind as interleaved int32, the right channel at 0.8 of the
+// left.
+//
+std::vector<LONG> MakeSignal(Signal Kind, double Seconds)
+{
+    ULONG               frames = (ULONG)(Seconds * kRate);
+    std::vector<LONG>   samples((size_t)frames * kChannels);
+    TestRandom          random(7);
+    double              phase = 0.0;
+
+    for (ULONG n = 0; n < frames; n++)
+    {
+        double t = (double)n / kRate;
+        double x = 0.0;
+
+        switch (Kind)
+        {
+        case SignalTone:
+            x = 0.5 * sin(2 * M_PI * 440.0 * t);
+            break;
+
+        case SignalVoiced:
+            phase += 2 * M_PI * (140.0 + 20.0 * sin(2 * M_PI * 3.0 * t)) / kRate;
+            for (int h = 1; h <= 12; h++)
+            {
+                x += sin(h * phase) / h;
+            }
+            x = 0.25 * x * (0.5 + 0.5 * sin(2 * M_PI * 4.0 * t)) + 0.002 * (random.Unit() * 2.0 - 1.0);
+            break;
+
+        case SignalNoise:
+            x = 0.01 * (random.Unit() * 2.0 - 1.0);
+            break;
+        }
+
+        samples[(size_t)n * kChannels] = (LONG)lrint(x * (kFullScale - 1.0));
+        samples[(size_t)n * kChannels + 1] = (LONG)lrint(0.8 * x * (kFullScale - 1.0));
+    }
+
+    return samples;
+}
+
+struct Gap
+{
+    ULONG   Start;          // frame
+    ULONG   Frames;
+};
+
+//
+// A gap every 250 ms from 0.5 s on, cycling through 2, 5, 10, 20, 40 and
+// 80 ms and landing anywhere within a 10 ms packet.
+//
+std::vector<Gap> ScriptedGaps(double Seconds)
+{
+    static const ULONG  lengthsMs[] = { 2, 5, 10, 20, 40, 80 };
+    std::vector<Gap>    gaps;
+    ULONG               end = (ULONG)(Seconds * kRate) - kRate / 4;
+
+    for (ULONG start = kRate / 2, i = 0; start < end; start += kRate / 4, i++)
+    {
+        gaps.push_back({ start + (i * 137) % 480, lengthsMs[i % 6] * kRate / 1000 });
+    }
+
+    return gaps;
+}
+
+class Capture
+{
+public:
+
+    Capture(PCM_CONCEAL_MODE Mode, ULONG Channels = kChannels)
+        : m_Memory(PcmConceal_GetSize(kRate, Channels) / sizeof(int64_t) + 1)
+    {
+        m_Conceal = (PPCM_CONCEAL)m_Memory.data();
+        EXPECT_TRUE(PcmConceal_Init(m_Conceal, (ULONG)(m_Memory.size() * sizeof(int64_t)), Mode, kRate, Channels));
+    }
+
+    PPCM_CONCEAL Get()
+    {
+        return m_Conceal;
+    }
+
+    //
+    // What ReadUserPcm does for Source with the feeder missing during
+    // Gaps: every wakeup of Wakeup frames is split into runs of audio,
+    // fed, and runs of gap, filled. Wakeup 0 picks a random length for
+    // each wakeup. Returns what the stream captured.
+    //
+    std::vector<LONG> Run(const std::vector<LONG> & Source, const std::vector<Gap> & Gaps, ULONG Wakeup)
+    {
+        ULONG               frames = (ULONG)(Source.size() / kChannels);
+        std::vector<LONG>   output(Source);
+        std::vector<char>   missing(frames, 0);
+        TestRandom          random(11);
+
+        for (const Gap & gap : Gaps)
+        {
+            std::fill(missing.begin() + gap.Start, missing.begin() + std::min(gap.Start + gap.Frames, frames), 1);
+        }
+
+        for (ULONG n = 0; n < frames; )
+        {
+            ULONG end = std::min(frames, n + (Wakeup != 0 ? Wakeup : random.Range(1, 960)));
+
+            while (n < end)
+            {
+                ULONG run = n;
+
+                while (run < end && missing[run] == missing[n])
+                {
+                    run++;
+                }
+
+                if (missing[n])
+                {
+                    PcmConceal_Fill(m_Conceal, PcmSampleFormatInt32, &output[(size_t)n * kChannels], run - n);
+                }
+                else
+                {
+                    PcmConceal_Feed(m_Conceal, PcmSampleFormatInt32, &output[(size_t)n * kChannels], run - n);
+                }
+                n = run;
+            }
+        }
+
+        return output;
+    }
+
+private:
+
+    std::vector<int64_t>    m_Memory;
+    PPCM_CONCEAL            m_Conceal;
+};
+
+double SecondDifference(const std::vector<LONG> & Samples, ULONG Frame)
+{
+    return fabs((double)Samples[(size_t)Frame * kChannels] -
+                2.0 * Samples[(size_t)(Frame - 1) * kChannels] +
+                Samples[(size_t)(Frame - 2) * kChannels]);
+}
+
+//
+// The worst gap edge of Output, relative to the 99.9th percentile second
+// difference of Source, left channel.
+//
+double WorstEdge(const std::vector<LONG> & Source, const std::vector<LONG> & Output, const std::vector<Gap> & Gaps)
+{
+    ULONG               frames = (ULONG)(Source.size() / kChannels);
+    std::vector<double> reference;
+    double              worst = 0.0;
+
+    for (ULONG n = 2; n < frames; n++)
+    {
+        reference.push_back(SecondDifference(Source, n));
+    }
+    std::sort(reference.begin(), reference.end());
+
+    for (const Gap & gap : Gaps)
+    {
+        for (ULONG edge : { gap.Start, gap.Start + gap.Frames })
+        {
+            for (ULONG n = edge - 2; n <= edge + 2 && n < frames; n++)
+            {
+                worst = std::max(worst, SecondDifference(Output, n));
+            }
+        }
+    }
+
+    return worst / reference[reference.size() * 999 / 1000];
+}
+
+//
+// RMS of the left channel over frames [Begin, End), full scale 1.0.
+//
+double Rms(const std::vector<LONG> & Samples, ULONG Begin, ULONG End)
+{
+    double sum = 0.0;
+
+    for (ULONG n = Begin; n < End; n++)
+    {
+        double x = Samples[(size_t)n * kChannels] / kFullScale;
+
+        sum += x * x;
+    }
+
+    return sqrt(sum / (End - Begin));
+}
+
+//
+// Output of Mode for a gap of GapMs starting at 200 ms into Kind, with
+// 10 ms wakeups.
+//
+std::vector<LONG> OneGap(PCM_CONCEAL_MODE Mode, Signal Kind, ULONG GapMs)
+{
+    Capture capture(Mode);
+
+    return capture.Run(MakeSignal(Kind, 0.5), { { kRate / 5, GapMs * kRate / 1000 } }, 480);
+}
+
+} // namespace
+
+TEST(PcmConceal, SupportedConfigurations)
+{
+    EXPECT_EQ(0u, PcmConceal_GetSize(PCM_CONCEAL_MIN_RATE - 1, 2));
+    EXPECT_EQ(0u, PcmConceal_GetSize(PCM_CONCEAL_MAX_RATE + 1, 2));
+    EXPECT_EQ(0u, PcmConceal_GetSize(48000, 0));
+    EXPECT_EQ(0u, PcmConceal_GetSize(48000, PCM_CONCEAL_MAX_CHANNELS + 1));
+    EXPECT_LT(PcmConceal_GetSize(48000, 1), PcmConceal_GetSize(48000, 2));
+    EXPECT_LT(PcmConceal_GetSize(48000, 2), PcmConceal_GetSize(96000, 2));
+
+    std::vector<int64_t>    memory(PcmConceal_GetSize(PCM_CONCEAL_MAX_RATE, PCM_CONCEAL_MAX_CHANNELS) / sizeof(int64_t) + 1);
+    PPCM_CONCEAL            conceal = (PPCM_CONCEAL)memory.data();
+    ULONG                   size = PcmConceal_GetSize(48000, 2);
+
+    EXPECT_FALSE(PcmConceal_Init(conceal, size - 1, PcmConcealModeRepeat, 48000, 2));
+    EXPECT_FALSE(PcmConceal_Init(conceal, size, PcmConcealModeCount, 48000, 2));
+    EXPECT_TRUE(PcmConceal_Init(conceal, size, PcmConcealModeRepeat, 48000, 2));
+    EXPECT_TRUE(PcmConceal_Init(conceal, (ULONG)(memory.size() * sizeof(int64_t)), PcmConcealModeNoise,
+                                PCM_CONCEAL_MAX_RATE, PCM_CONCEAL_MAX_CHANNELS));
+}
+
+TEST(PcmConceal, ZerosInSilenceModeAndBeforeAnyAudio)
+{
+    std::vector<LONG> source = MakeSignal(SignalTone, 0.1);
+
+    for (int mode = PcmConcealModeSilence; mode < PcmConcealModeCount; mode++)
+    {
+        Capture             capture((PCM_CONCEAL_MODE)mode);
+        std::vector<LONG>   packet(480 * kChannels, 0x5A5A5A5A);
+
+        PcmConceal_Fill(capture.Get(), PcmSampleFormatInt32, packet.data(), 480);
+        EXPECT_EQ(std::vector<LONG>(packet.size(), 0), packet) << kModeNames[mode];
+
+        // Silence mode leaves the feeder's audio alone, before and after.
+        if (mode == PcmConcealModeSilence)
+        {
+            std::vector<LONG> output = capture.Run(source, { { 1000, 960 } }, 480);
+
+            for (ULONG n = 0; n < source.size() / kChannels; n++)
+            {
+                bool inGap = n >= 1000 && n < 1960;
+
+                ASSERT_EQ(inGap ? 0 : source[n * kChannels], output[n * kChannels]) << n;
+            }
+        }
+    }
+}
+
+TEST(PcmConceal, RepeatCarriesTheWaveformOn)
+{
+    std::vector<LONG>   source = MakeSignal(SignalTone, 0.5);
+    std::vector<LONG>   output = OneGap(PcmConcealModeRepeat, SignalTone, 10);
+    ULONG               start = kRate / 5;
+    double              error = 0.0;
+
+    // Within the hold the loop is the last period of the tone, so it stays
+    // close to what the feeder would have sent.
+    for (ULONG n = start; n < start + kRate / 100; n++)
+    {
+        double d = (output[n * kChannels] - (double)source[n * kChannels]) / kFullScale;
+
+        error += d * d;
+    }
+    error = sqrt(error / (kRate / 100));
+
+    EXPECT_LT(error, 0.05 * Rms(source, start, start + kRate / 100));
+}
+
+TEST(PcmConceal, EnvelopesFollowTheMode)
+{
+    const ULONG ms = kRate / 1000;
+    ULONG       start = kRate / 5;
+    double      tone = Rms(MakeSignal(SignalTone, 0.5), 0, kRate / 5);
+
+    // Fade: gone after 5 ms.
+    std::vector<LONG> fade = OneGap(PcmConcealModeFade, SignalTone, 100);
+
+    EXPECT_GT(Rms(fade, start, start + ms), 0.5 * tone);
+    EXPECT_EQ(0.0, Rms(fade, start + 5 * ms, start + 100 * ms));
+
+    // Repeat: full level for 10 ms, fading to nothing by 60 ms.
+    std::vector<LONG> repeat = OneGap(PcmConcealModeRepeat, SignalTone, 100);
+
+    EXPECT_NEAR(tone, Rms(repeat, start, start + 10 * ms), 0.06 * tone);
+    EXPECT_GT(Rms(repeat, start + 20 * ms, start + 30 * ms), Rms(repeat, start + 40 * ms, start + 50 * ms));
+    EXPECT_EQ(0.0, Rms(repeat, start + 60 * ms, start + 100 * ms));
+
+    // Noise: a tone's floor is capped at about -42 dBFS, as mean |sample|.
+    std::vector<LONG>   noise = OneGap(PcmConcealModeNoise, SignalTone, 100);
+    double              mean = 0.0;
+
+    for (ULONG n = start + 5 * ms; n < start + 100 * ms; n++)
+    {
+        mean += fabs(noise[n * kChannels] / kFullScale);
+    }
+    mean /= 95 * ms;
+
+    EXPECT_GT(mean, 0.0);
+    EXPECT_LT(mean, 1.1 / 128);
+}
+
+TEST(PcmConceal, ComfortNoiseMatchesTheRoom)
+{
+    const ULONG         ms = kRate / 1000;
+    ULONG               start = kRate / 5;
+    std::vector<LONG>   source = MakeSignal(SignalNoise, 0.5);
+    std::vector<LONG>   output = OneGap(PcmConcealModeNoise, SignalNoise, 250);
+    double              room = Rms(source, 0, start);
+
+    // As loud as the room for as long as the gap lasts.
+    for (ULONG begin = start + 5 * ms; begin < start + 250 * ms; begin += 50 * ms)
+    {
+        double level = Rms(output, begin, std::min(begin + 50 * ms, start + 250 * ms));
+
+        EXPECT_NEAR(0.0, 20.0 * log10(level / room), 2.0) << (begin - start) / ms << " ms into the gap";
+    }
+}
+
+TEST(PcmConceal, ResumeFadesInOver5Milliseconds)
+{
+    const ULONG ms = kRate / 1000;
+    ULONG       end = kRate / 5 + 40 * ms;
+
+    for (int mode = PcmConcealModeFade; mode < PcmConcealModeCount; mode++)
+    {
+        std::vector<LONG> source = MakeSignal(SignalVoiced, 0.5);
+        std::vector<LONG> output = OneGap((PCM_CONCEAL_MODE)mode, SignalVoiced, 40);
+
+        // Blended for the first 5 ms, then the feeder's audio untouched.
+        EXPECT_NE(source[end * kChannels], output[end * kChannels]) << kModeNames[mode];
+        for (ULONG n = end + 5 * ms; n < source.size() / kChannels; n++)
+        {
+            ASSERT_EQ(source[n * kChannels], output[n * kChannels]) << kModeNames[mode] << " frame " << n;
+            ASSERT_EQ(source[n * kChannels + 1], output[n * kChannels + 1]) << kModeNames[mode] << " frame " << n;
+        }
+    }
+}
+
+TEST(PcmConceal, ScriptedUnderrunsDoNotClick)
+{
+    const double        seconds = 10.0;
+    std::vector<Gap>    gaps = ScriptedGaps(seconds);
+
+    for (Signal kind : { SignalTone, SignalVoiced, SignalNoise })
+    {
+        std::vector<LONG>   source = MakeSignal(kind, seconds);
+        double              zeroFill = 0.0;
+
+        for (int mode = PcmConcealModeSilence; mode < PcmConcealModeCount; mode++)
+        {
+            for (ULONG wakeup : { 48u, 480u })
+            {
+                Capture capture((PCM_CONCEAL_MODE)mode);
+                double  worst = WorstEdge(source, capture.Run(source, gaps, wakeup), gaps);
+
+                printf("  %-6s %-9s %3u frame wakeups: worst edge %6.1f x the source\n",
+                       kSignalNames[kind], kModeNames[mode], wakeup, worst);
+
+                if (mode == PcmConcealModeSilence)
+                {
+                    zeroFill = std::max(zeroFill, worst);
+                }
+                else if (mode == PcmConcealModeNoise && kind == SignalTone)
+                {
+                    // The comfort noise is rougher than a pure tone, but
+                    // nothing like cutting it off.
+                    EXPECT_LT(worst, zeroFill / 4) << kModeNames[mode];
+                }
+                else
+                {
+                    EXPECT_LT(worst, 12.0) << kSignalNames[kind] << " " << kModeNames[mode];
+                }
+            }
+        }
+
+        // The metric sees zero filling for what it is, bar in a quiet room.
+        if (kind != SignalNoise)
+        {
+            EXPECT_GT(zeroFill, 30.0) << kSignalNames[kind];
+        }
+    }
+}
+
+TEST(PcmConceal, WakeupsDoNotChangeTheOutput)
+{
+    std::vector<LONG>   source = MakeSignal(SignalVoiced, 3.0);
+    std::vector<Gap>    gaps = ScriptedGaps(3.0);
+
+    for (int mode = PcmConcealModeFade; mode < PcmConcealModeCount; mode++)
+    {
+        Capture             packets((PCM_CONCEAL_MODE)mode);
+        Capture             ragged((PCM_CONCEAL_MODE)mode);
+        std::vector<LONG>   expected = packets.Run(source, gaps, 480);
+        std::vector<LONG>   actual = ragged.Run(source, gaps, 0);
+
+        ASSERT_EQ(expected, actual) << kModeNames[mode];
+    }
+}
+
+TEST(PcmConceal, OtherFormatsGoThroughInt32)
+{
+    std::vector<LONG>   source = MakeSignal(SignalVoiced, 1.0);
+    std::vector<Gap>    gaps = ScriptedGaps(1.0);
+
+    for (PCM_SAMPLE_FORMAT format : { PcmSampleFormatInt16, PcmSampleFormatInt24, PcmSampleFormatFloat32 })
+    {
+        ULONG               bytes = PcmConvert_SampleBytes(format);
+        std::vector<UCHAR>  narrow(source.size() * bytes);
+        std::vector<LONG>   widened(source.size());
+
+        // The int32 run sees exactly what the other format widens to.
+        PcmConvert(format, narrow.data(), PcmSampleFormatInt32, source.data(), (ULONG)source.size());
+        PcmConvert(PcmSampleFormatInt32, widened.data(), format, narrow.data(), (ULONG)source.size());
+
+        for (int mode = PcmConcealModeFade; mode < PcmConcealModeCount; mode++)
+        {
+            Capture             wide((PCM_CONCEAL_MODE)mode);
+            Capture             other((PCM_CONCEAL_MODE)mode);
+            std::vector<LONG>   expected = wide.Run(widened, gaps, 480);
+            std::vector<UCHAR>  expectedNarrow(narrow);
+            std::vector<UCHAR>  actual(narrow);
+            std::vector<char>   missing(source.size() / kChannels, 0);
+
+            // Only the gaps and the 5 ms fades after them are written back;
+            // the rest stays what the feeder sent.
+            for (const Gap & gap : gaps)
+            {
+                ULONG written = gap.Frames + 5 * kRate / 1000;
+
+                std::fill(missing.begin() + gap.Start, missing.begin() + gap.Start + gap.Frames, 1);
+                PcmConvert(format, &expectedNarrow[(size_t)gap.Start * kChannels * bytes], PcmSampleFormatInt32,
+                           &expected[(size_t)gap.Start * kChannels], written * kChannels);
+            }
+
+            for (ULONG n = 0; n < missing.size(); )
+            {
+                ULONG run = n;
+
+                while (run < missing.size() && run - n < 480 && missing[run] == missing[n])
+                {
+                    run++;
+                }
+
+                if (missing[n])
+                {
+                    PcmConceal_Fill(other.Get(), format, &actual[(size_t)n * kChannels * bytes], run - n);
+                }
+                else
+                {
+                    PcmConceal_Feed(other.Get(), format, &actual[(size_t)n * kChannels * bytes], run - n);
+                }
+                n = run;
+            }
+
+            ASSERT_EQ(expectedNarrow, actual) << "format " << format << " " << kModeNames[mode];
+        }
+    }
+}
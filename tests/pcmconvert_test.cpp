@@ -0,0 +1,331 @@
+/*++
+
+Module Name:
+
+    pcmconvert_test.cpp
+
+Abstract:
+
+    Tests for pcmconvert.cpp. PcmConvert, which uses the SSE2 or NEON
+    kernels where the host has them, must match PcmConvert_Reference bit
+    for bit for every pair of formats, every length and alignment and every
+    float value, including NaN, infinities, denormals and values just
+    outside full scale. The reference itself is checked against the rules
+    pcmconvert.h states.
+--*/
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <string.h>
+#include <limits>
+#include <vector>
+
+#include "pcmconvert.h"
+#include "testutil.h"
+
+namespace
+{
+
+const PCM_SAMPLE_FORMAT Formats[] =
+{
+    PcmSampleFormatInt16,
+    PcmSampleFormatInt24,
+    PcmSampleFormatInt32,
+    PcmSampleFormatFloat32,
+};
+
+const char * FormatName(PCM_SAMPLE_FORMAT Format)
+{
+    switch (Format)
+    {
+    case PcmSampleFormatInt16:      return "int16";
+    case PcmSampleFormatInt24:      return "int24";
+    case PcmSampleFormatInt32:      return "int32";
+    case PcmSampleFormatFloat32:    return "float32";
+    default:                        return "?";
+    }
+}
+
+float FloatOfBits(uint32_t Bits)
+{
+    float value;
+
+    memcpy(&value, &Bits, sizeof(value));
+    return value;
+}
+
+//
+// Random samples in Format, with the values conversions get wrong most
+// often mixed in.
+//
+void FillSamples(PCM_SAMPLE_FORMAT Format, UCHAR * Buffer, ULONG Samples, TestRandom & Random)
+{
+    static const float specials[] =
+    {
+        0.0f, -0.0f, 1.0f, -1.0f, 0.5f, -0.5f,
+        1.0000001f, -1.0000001f, 0.99999994f, -0.99999994f,
+        2.0f, -2.0f, 1e30f, -1e30f, 1e-40f, -1e-40f,
+        1.0f / 2147483648.0f, 1.5f / 2147483648.0f,
+        std::numeric_limits<float>::infinity(),
+        -std::numeric_limits<float>::infinity(),
+        std::numeric_limits<float>::quiet_NaN(),
+        -std::numeric_limits<float>::quiet_NaN(),
+        std::numeric_limits<float>::signaling_NaN(),
+    };
+
+    if (Format != PcmSampleFormatFloat32)
+    {
+        for (ULONG i = 0; i < Samples * PcmConvert_SampleBytes(Format); i++)
+        {
+            Buffer[i] = (UCHAR)Random.Next();
+        }
+        return;
+    }
+
+    for (ULONG i = 0; i < Samples; i++)
+    {
+        float value;
+
+        switch (Random.Range(0, 3))
+        {
+        case 0:
+            value = specials[Random.Range(0, sizeof(specials) / sizeof(specials[0]) - 1)];
+            break;
+        case 1:
+            value = FloatOfBits((uint32_t)Random.Next());
+            break;
+        default:
+            value = (float)(Random.Unit() * 2.2 - 1.1);
+            break;
+        }
+        memcpy(Buffer + i * 4, &value, sizeof(value));
+    }
+}
+
+void ExpectSameAsReference(PCM_SAMPLE_FORMAT To, PCM_SAMPLE_FORMAT From,
+                           const UCHAR * Source, ULONG Samples, ULONG Offset)
+{
+    ULONG               toBytes = PcmConvert_SampleBytes(To);
+    std::vector<UCHAR>  fast(Samples * toBytes + Offset + 16, 0xA5);
+    std::vector<UCHAR>  reference(fast.size(), 0xA5);
+
+    PcmConvert(To, fast.data() + Offset, From, Source, Samples);
+    PcmConvert_Reference(To, reference.data() + Offset, From, Source, Samples);
+
+    for (size_t i = 0; i < fast.size(); i++)
+    {
+        if (fast[i] != reference[i])
+        {
+            ADD_FAILURE() << FormatName(From) << " -> " << FormatName(To)
+                          << ", " << Samples << " samples at offset " << Offset
+                          << ": byte " << i << " is " << (int)fast[i]
+                          << ", reference " << (int)reference[i];
+            return;
+        }
+    }
+}
+
+} // namespace
+
+TEST(PcmConvert, SampleBytes)
+{
+    EXPECT_EQ(2u, PcmConvert_SampleBytes(PcmSampleFormatInt16));
+    EXPECT_EQ(3u, PcmConvert_SampleBytes(PcmSampleFormatInt24));
+    EXPECT_EQ(4u, PcmConvert_SampleBytes(PcmSampleFormatInt32));
+    EXPECT_EQ(4u, PcmConvert_SampleBytes(PcmSampleFormatFloat32));
+    EXPECT_EQ(0u, PcmConvert_SampleBytes(PcmSampleFormatInvalid));
+    EXPECT_EQ(0u, PcmConvert_SampleBytes(PcmSampleFormatCount));
+}
+
+TEST(PcmConvert, ReferenceFollowsTheRules)
+{
+    const float in[] =
+    {
+        1.0f, -1.0f, 0.5f, 2.0f, -2.0f,
+        std::numeric_limits<float>::quiet_NaN(),
+        std::numeric_limits<float>::infinity(),
+        -std::numeric_limits<float>::infinity(),
+        0.75f / 2147483648.0f, -0.75f / 2147483648.0f,
+    };
+    const LONG expected[] =
+    {
+        0x7FFFFFFF, (LONG)0x80000000, 0x40000000, 0x7FFFFFFF, (LONG)0x80000000,
+        0,
+        0x7FFFFFFF, (LONG)0x80000000,
+        0, 0,                           // truncated toward zero
+    };
+    LONG out[sizeof(in) / sizeof(in[0])];
+
+    PcmConvert_Reference(PcmSampleFormatInt32, out, PcmSampleFormatFloat32, in, sizeof(in) / sizeof(in[0]));
+    for (size_t i = 0; i < sizeof(in) / sizeof(in[0]); i++)
+    {
+        EXPECT_EQ(expected[i], out[i]) << "sample " << i;
+    }
+
+    // int16 and int24 land in the top bits; the way back truncates.
+    const SHORT  s16[] = { 0x7FFF, -0x8000, 1, -1 };
+    const UCHAR  s24[] = { 0x56, 0x34, 0x12, 0xFF, 0xFF, 0xFF };
+    const LONG   s32[] = { 0x1234FFFF, (LONG)0xFFFF0001 };
+    LONG         wide[4];
+    SHORT        narrow[2];
+    UCHAR        packed[6];
+
+    PcmConvert_Reference(PcmSampleFormatInt32, wide, PcmSampleFormatInt16, s16, 4);
+    EXPECT_EQ(0x7FFF0000, wide[0]);
+    EXPECT_EQ((LONG)0x80000000, wide[1]);
+    EXPECT_EQ(0x00010000, wide[2]);
+    EXPECT_EQ((LONG)0xFFFF0000, wide[3]);
+
+    PcmConvert_Reference(PcmSampleFormatInt32, wide, PcmSampleFormatInt24, s24, 2);
+    EXPECT_EQ(0x12345600, wide[0]);
+    EXPECT_EQ((LONG)0xFFFFFF00, wide[1]);
+
+    PcmConvert_Reference(PcmSampleFormatInt16, narrow, PcmSampleFormatInt32, s32, 2);
+    EXPECT_EQ(0x1234, narrow[0]);
+    EXPECT_EQ(-1, narrow[1]);
+
+    PcmConvert_Reference(PcmSampleFormatInt24, packed, PcmSampleFormatInt32, s32, 2);
+    EXPECT_EQ(0xFF, packed[0]);
+    EXPECT_EQ(0x34, packed[1]);
+    EXPECT_EQ(0x12, packed[2]);
+    EXPECT_EQ(0x00, packed[3]);
+    EXPECT_EQ(0xFF, packed[4]);
+    EXPECT_EQ(0xFF, packed[5]);
+
+    // int32 to float is the nearest float.
+    const LONG  big[] = { 0x7FFFFFFF, (LONG)0x80000000, 0x40000000, 0x01000001 };
+    float       f[4];
+
+    PcmConvert_Reference(PcmSampleFormatFloat32, f, PcmSampleFormatInt32, big, 4);
+    EXPECT_EQ(1.0f, f[0]);
+    EXPECT_EQ(-1.0f, f[1]);
+    EXPECT_EQ(0.5f, f[2]);
+    EXPECT_EQ((float)0x01000001 / 2147483648.0f, f[3]);
+}
+
+TEST(PcmConvert, Int16AndInt24SurviveTheRoundTrip)
+{
+    std::vector<SHORT>  s16(65536);
+    std::vector<SHORT>  back16(65536);
+    std::vector<float>  f(65536);
+    std::vector<UCHAR>  s24(3 << 16);
+    std::vector<UCHAR>  back24(3 << 16);
+
+    for (ULONG i = 0; i < 65536; i++)
+    {
+        s16[i] = (SHORT)i;
+    }
+
+    // Every int16 and int24 value is exact in float.
+    PcmConvert(PcmSampleFormatFloat32, f.data(), PcmSampleFormatInt16, s16.data(), 65536);
+    PcmConvert(PcmSampleFormatInt16, back16.data(), PcmSampleFormatFloat32, f.data(), 65536);
+    EXPECT_EQ(s16, back16);
+
+    for (ULONG high = 0; high < 256; high++)
+    {
+        for (ULONG i = 0; i < 65536; i++)
+        {
+            s24[i * 3]     = (UCHAR)i;
+            s24[i * 3 + 1] = (UCHAR)(i >> 8);
+            s24[i * 3 + 2] = (UCHAR)high;
+        }
+        PcmConvert(PcmSampleFormatFloat32, f.data(), PcmSampleFormatInt24, s24.data(), 65536);
+        PcmConvert(PcmSampleFormatInt24, back24.data(), PcmSampleFormatFloat32, f.data(), 65536);
+        ASSERT_EQ(s24, back24) << "high byte " << high;
+    }
+}
+
+TEST(PcmConvert, EveryPairMatchesTheReference)
+{
+    TestRandom          random(10);
+    std::vector<UCHAR>  source(4 * 1100 + 16);
+
+    for (PCM_SAMPLE_FORMAT from : Formats)
+    {
+        for (PCM_SAMPLE_FORMAT to : Formats)
+        {
+            for (int round = 0; round < 200; round++)
+            {
+                // Short lengths exercise the tails, long ones the block loop.
+                ULONG samples = (round < 64) ? (ULONG)round : random.Range(64, 1100);
+                ULONG offset  = random.Range(0, 15);
+
+                FillSamples(from, source.data() + offset, samples, random);
+                ExpectSameAsReference(to, from, source.data() + offset, samples, random.Range(0, 15));
+            }
+        }
+    }
+}
+
+TEST(PcmConvert, EveryFloatExponentMatchesTheReference)
+{
+    // All sign/exponent/top mantissa bit combinations with random low bits:
+    // covers NaN payloads, infinities, denormals and both sides of every
+    // rounding boundary near full scale.
+    TestRandom              random(11);
+    std::vector<uint32_t>   bits(65536);
+    std::vector<LONG>       fast(65536);
+    std::vector<LONG>       reference(65536);
+    std::vector<SHORT>      fast16(65536);
+    std::vector<SHORT>      reference16(65536);
+
+    for (int round = 0; round < 64; round++)
+    {
+        for (ULONG high = 0; high < 65536; high++)
+        {
+            bits[high] = (high << 16) | (uint32_t)(random.Next() & 0xFFFF);
+        }
+        if (round == 0)
+        {
+            for (ULONG high = 0; high < 65536; high++)
+            {
+                bits[high] &= 0xFFFF0000;
+            }
+        }
+
+        PcmConvert(PcmSampleFormatInt32, fast.data(), PcmSampleFormatFloat32, bits.data(), 65536);
+        PcmConvert_Reference(PcmSampleFormatInt32, reference.data(), PcmSampleFormatFloat32, bits.data(), 65536);
+        ASSERT_EQ(reference, fast) << "round " << round;
+
+        PcmConvert(PcmSampleFormatInt16, fast16.data(), PcmSampleFormatFloat32, bits.data(), 65536);
+        PcmConvert_Reference(PcmSampleFormatInt16, reference16.data(), PcmSampleFormatFloat32, bits.data(), 65536);
+        ASSERT_EQ(reference16, fast16) << "round " << round;
+    }
+}
+
+TEST(PcmConvert, EveryInt32MatchesTheReference)
+{
+    // int32 -> float and int16 for every top 16 bits with random low bits.
+    TestRandom              random(12);
+    std::vector<LONG>       source(65536);
+    std::vector<float>      fast(65536);
+    std::vector<float>      reference(65536);
+    std::vector<SHORT>      fast16(65536);
+    std::vector<SHORT>      reference16(65536);
+
+    for (int round = 0; round < 64; round++)
+    {
+        for (ULONG high = 0; high < 65536; high++)
+        {
+            source[high] = (LONG)((high << 16) | (uint32_t)(random.Next() & 0xFFFF));
+        }
+
+        PcmConvert(PcmSampleFormatFloat32, fast.data(), PcmSampleFormatInt32, source.data(), 65536);
+        PcmConvert_Reference(PcmSampleFormatFloat32, reference.data(), PcmSampleFormatInt32, source.data(), 65536);
+        ASSERT_EQ(0, memcmp(fast.data(), reference.data(), 65536 * sizeof(float))) << "round " << round;
+
+        PcmConvert(PcmSampleFormatInt16, fast16.data(), PcmSampleFormatInt32, source.data(), 65536);
+        PcmConvert_Reference(PcmSampleFormatInt16, reference16.data(), PcmSampleFormatInt32, source.data(), 65536);
+        ASSERT_EQ(reference16, fast16) << "round " << round;
+    }
+}
+
+TEST(PcmConvert, SameFormatInPlaceIsANoOp)
+{
+    std::vector<SHORT> buffer = { 1, -2, 3, -4 };
+    std::vector<SHORT> copy = buffer;
+
+    PcmConvert(PcmSampleFormatInt16, buffer.data(), PcmSampleFormatInt16, buffer.data(), 4);
+    EXPECT_EQ(copy, buffer);
+}
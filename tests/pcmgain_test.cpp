@@ -0,0 +1,283 @@
+/*++
+
+Module Name:
+
+    pcmgain_test.cpp
+
+Abstract:
+
+    Tests for pcmgain.cpp: the volume table against 10^(dB/20), the vector
+    kernels against a scalar reference of the rules in pcmgain.h for every
+    channel count and packet length, saturation, unity and the ramps.
+--*/
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "pcmgain.h"
+#include "testutil.h"
+
+namespace
+{
+
+const LONG kHalfDecibel = 0x8000;       // in 1/65536 dB
+
+//
+// The rules of pcmgain.h, one sample at a time in signed 64-bit arithmetic.
+//
+LONG ReferenceSample(LONG Sample, LONG Gain)
+{
+    int64_t magnitude = llabs((int64_t)Sample);
+    int64_t product = (magnitude * Gain + (1 << 29)) >> 30;
+    int64_t limit = (Sample < 0) ? (int64_t)0x80000000 : (int64_t)0x7FFFFFFF;
+
+    product = std::min(product, limit);
+    return (LONG)((Sample < 0) ? -product : product);
+}
+
+void ReferenceApply(LONG * Samples, ULONG Channels, ULONG Frames, const LONG * StartGain, const LONG * EndGain)
+{
+    for (ULONG c = 0; c < Channels; c++)
+    {
+        LONG from = std::max(StartGain[c], 0);
+        LONG to = std::max(EndGain[c], 0);
+        LONG step = (LONG)(((int64_t)to - from) / (int64_t)Frames);
+
+        for (ULONG f = 0; f < Frames; f++)
+        {
+            Samples[f * Channels + c] = ReferenceSample(Samples[f * Channels + c], from + step * (LONG)f);
+        }
+    }
+}
+
+LONG RandomGain(TestRandom & Random)
+{
+    switch (Random.Range(0, 3))
+    {
+        case 0:  return PCM_GAIN_UNITY;
+        case 1:  return PCM_GAIN_MAXIMUM - (LONG)Random.Range(0, 3);
+        default: return (LONG)Random.Range(0, PCM_GAIN_MAXIMUM);
+    }
+}
+
+LONG RandomSample(TestRandom & Random)
+{
+    switch (Random.Range(0, 7))
+    {
+        case 0:  return (LONG)0x80000000;
+        case 1:  return 0x7FFFFFFF;
+        case 2:  return -1;
+        default: return (LONG)(uint32_t)Random.Next();
+    }
+}
+
+} // namespace
+
+TEST(PcmGain, TableStepsAreHalfDecibels)
+{
+    for (LONG n = 0; n <= 192; n++)
+    {
+        double expected = floor(1073741824.0 * pow(10.0, -n / 40.0) + 0.5);
+
+        EXPECT_EQ((LONG)expected, PcmGain_FromVolume(-n * kHalfDecibel)) << -n / 2.0 << " dB";
+    }
+}
+
+TEST(PcmGain, VolumeLevelsFollowTheDecibelCurve)
+{
+    LONG previous = PCM_GAIN_UNITY;
+
+    EXPECT_EQ(PCM_GAIN_UNITY, PcmGain_FromVolume(0));
+    EXPECT_EQ(PCM_GAIN_UNITY, PcmGain_FromVolume(1));
+    EXPECT_EQ(PCM_GAIN_UNITY, PcmGain_FromVolume(0x7FFFFFFF));
+
+    // Between the table's entries the gain is interpolated linearly, which
+    // over half a decibel stays well within a hundredth of one.
+    for (LONG volume = 0; volume >= -96 * 65536; volume -= 997)
+    {
+        LONG    gain = PcmGain_FromVolume(volume);
+        double  decibels = 20.0 * log10((double)gain / PCM_GAIN_UNITY);
+
+        ASSERT_LE(gain, previous) << volume;
+        ASSERT_NEAR(volume / 65536.0, decibels, 0.01) << volume;
+        previous = gain;
+    }
+
+    // Below -96 dB, down to the most negative level a property can carry.
+    EXPECT_EQ(PcmGain_FromVolume(-96 * 65536), PcmGain_FromVolume(-96 * 65536 - 1));
+    EXPECT_EQ(PcmGain_FromVolume(-96 * 65536), PcmGain_FromVolume((LONG)0x80000000));
+}
+
+TEST(PcmGain, KernelsMatchTheReference)
+{
+    TestRandom random(14);
+
+    for (ULONG channels = 1; channels <= PCM_GAIN_MAX_CHANNELS; channels++)
+    {
+        for (ULONG frames : { 1u, 2u, 3u, 5u, 7u, 13u, 16u, 29u, 100u, 441u, 480u })
+        {
+            for (int round = 0; round < 8; round++)
+            {
+                std::vector<LONG>   samples((size_t)frames * channels);
+                std::vector<LONG>   expected;
+                LONG                start[PCM_GAIN_MAX_CHANNELS];
+                LONG                end[PCM_GAIN_MAX_CHANNELS];
+
+                for (LONG & x : samples)
+                {
+                    x = RandomSample(random);
+                }
+                for (ULONG c = 0; c < channels; c++)
+                {
+                    start[c] = RandomGain(random);
+                    end[c] = (round & 1) ? start[c] : RandomGain(random);
+                }
+                expected = samples;
+
+                ReferenceApply(expected.data(), channels, frames, start, end);
+                PcmGain_Apply(PcmSampleFormatInt32, samples.data(), channels, frames, start, end);
+
+                ASSERT_EQ(expected, samples) << channels << " channels, " << frames << " frames";
+            }
+        }
+    }
+}
+
+TEST(PcmGain, UnitySilenceAndSaturation)
+{
+    const LONG          unity[2] = { PCM_GAIN_UNITY, PCM_GAIN_UNITY };
+    const LONG          silence[2] = { PCM_GAIN_SILENCE, -5 };
+    const LONG          maximum[2] = { PCM_GAIN_MAXIMUM, PCM_GAIN_MAXIMUM };
+    TestRandom          random(15);
+    std::vector<LONG>   samples(2 * 480);
+    std::vector<LONG>   original;
+
+    for (LONG & x : samples)
+    {
+        x = RandomSample(random);
+    }
+    original = samples;
+
+    // Unity leaves the audio bit for bit unchanged.
+    PcmGain_Apply(PcmSampleFormatInt32, samples.data(), 2, 480, unity, unity);
+    EXPECT_EQ(original, samples);
+
+    // Just under 2.0 saturates the loud samples to the end of their range.
+    PcmGain_Apply(PcmSampleFormatInt32, samples.data(), 2, 480, maximum, maximum);
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        if (original[i] >= 0x40000000)
+        {
+            ASSERT_EQ(0x7FFFFFFF, samples[i]) << i;
+        }
+        else if (original[i] < -0x40000000)
+        {
+            ASSERT_EQ((LONG)0x80000000, samples[i]) << i;
+        }
+    }
+
+    // Silence, and a negative gain counts as silence.
+    PcmGain_Apply(PcmSampleFormatInt32, samples.data(), 2, 480, silence, silence);
+    for (LONG x : samples)
+    {
+        ASSERT_EQ(0, x);
+    }
+
+    // Nothing for no frames, no channels, too many or an unknown format.
+    samples = original;
+    PcmGain_Apply(PcmSampleFormatInt32, samples.data(), 2, 0, silence, silence);
+    PcmGain_Apply(PcmSampleFormatInt32, samples.data(), 0, 480, silence, silence);
+    PcmGain_Apply(PcmSampleFormatInt32, samples.data(), PCM_GAIN_MAX_CHANNELS + 1, 10, silence, silence);
+    PcmGain_Apply(PcmSampleFormatInvalid, samples.data(), 2, 480, silence, silence);
+    EXPECT_EQ(original, samples);
+}
+
+TEST(PcmGain, RampsStayBetweenTheirEnds)
+{
+    const ULONG         frames = 480;
+    const LONG          start[3] = { PCM_GAIN_UNITY, 0, PCM_GAIN_MAXIMUM };
+    const LONG          end[3] = { 0, PCM_GAIN_UNITY, PCM_GAIN_UNITY / 2 };
+    std::vector<LONG>   samples(frames * 3, 0x10000000);
+
+    PcmGain_Apply(PcmSampleFormatInt32, samples.data(), 3, frames, start, end);
+
+    for (ULONG c = 0; c < 3; c++)
+    {
+        LONG low = std::min(start[c], end[c]) >> 2;
+        LONG high = std::max(start[c], end[c]) >> 2;
+
+        // A sample of 0.25 full scale reads back the gain over 4.
+        EXPECT_NEAR((double)(start[c] >> 2), (double)samples[c], 1.0);
+        for (ULONG f = 1; f < frames; f++)
+        {
+            LONG previous = samples[(f - 1) * 3 + c];
+            LONG current = samples[f * 3 + c];
+
+            ASSERT_GE(current, low - 1) << c << ", " << f;
+            ASSERT_LE(current, high + 1) << c << ", " << f;
+            ASSERT_TRUE((end[c] > start[c]) ? (current >= previous) : (current <= previous)) << c << ", " << f;
+        }
+
+        // The last frame is one step short of the end gain, and the step
+        // was truncated by less than one each frame.
+        EXPECT_NEAR((double)(end[c] >> 2), (double)samples[(frames - 1) * 3 + c],
+                    fabs((double)(end[c] - start[c])) / frames / 4 + frames / 4 + 2.0);
+    }
+}
+
+TEST(PcmGain, OtherFormatsGoThroughInt32)
+{
+    TestRandom random(16);
+
+    for (PCM_SAMPLE_FORMAT format : { PcmSampleFormatInt16, PcmSampleFormatInt24, PcmSampleFormatFloat32 })
+    {
+        for (ULONG channels : { 1u, 2u, 6u })
+        {
+            // More than one conversion block, ending part way into one.
+            const ULONG         frames = 1000;
+            ULONG               bytes = PcmConvert_SampleBytes(format);
+            std::vector<UCHAR>  samples((size_t)frames * channels * bytes);
+            std::vector<UCHAR>  expected(samples.size());
+            std::vector<LONG>   wide((size_t)frames * channels);
+            LONG                start[PCM_GAIN_MAX_CHANNELS];
+            LONG                end[PCM_GAIN_MAX_CHANNELS];
+
+            if (format == PcmSampleFormatFloat32)
+            {
+                for (size_t i = 0; i < wide.size(); i++)
+                {
+                    float x = (float)(random.Unit() * 2.0 - 1.0);
+
+                    memcpy(&samples[i * 4], &x, sizeof(x));
+                }
+            }
+            else
+            {
+                for (UCHAR & b : samples)
+                {
+                    b = (UCHAR)random.Next();
+                }
+            }
+            for (ULONG c = 0; c < channels; c++)
+            {
+                start[c] = RandomGain(random);
+                end[c] = RandomGain(random);
+            }
+
+            // The blocks carry each ramp on where the last one stopped, so
+            // the result is the same as one pass over int32.
+            PcmConvert_Reference(PcmSampleFormatInt32, wide.data(), format, samples.data(), (ULONG)wide.size());
+            ReferenceApply(wide.data(), channels, frames, start, end);
+            PcmConvert_Reference(format, expected.data(), PcmSampleFormatInt32, wide.data(), (ULONG)wide.size());
+
+            PcmGain_Apply(format, samples.data(), channels, frames, start, end);
+
+            ASSERT_EQ(0, memcmp(expected.data(), samples.data(), samples.size()))
+                << "format " << format << ", " << channels << " channels";
+        }
+    }
+}
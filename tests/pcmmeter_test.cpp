@@ -0,0 +1,212 @@
+/*++
+
+Module Name:
+
+    pcmmeter_test.cpp
+
+Abstract:
+
+    Tests for pcmmeter.cpp against a straightforward double precision
+    reference, for every channel count, packet lengths that do and do not
+    fill the vector kernel, and every sample format. Peaks must match
+    exactly; the RMS level is accumulated in float by the vector kernel and
+    must stay within a small relative error of the reference.
+--*/
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+#include "pcmmeter.h"
+#include "testutil.h"
+
+namespace
+{
+
+struct ReferenceLevels
+{
+    ULONG   Peak[PCM_METER_MAX_CHANNELS];
+    double  Rms[PCM_METER_MAX_CHANNELS];
+};
+
+//
+// Levels of Frames frames of int32 PCM, full scale 1.0.
+//
+ReferenceLevels Reference(const std::vector<LONG> & Samples, ULONG Channels)
+{
+    ReferenceLevels levels = {};
+    float           peak[PCM_METER_MAX_CHANNELS] = {};
+    double          sum[PCM_METER_MAX_CHANNELS] = {};
+    size_t          frames = Samples.size() / Channels;
+
+    for (size_t i = 0; i < frames * Channels; i++)
+    {
+        ULONG  c = (ULONG)(i % Channels);
+        double x = (double)Samples[i] / 2147483648.0;
+
+        // Peaks are taken from the sample as a float.
+        peak[c] = fmaxf(peak[c], fabsf((float)Samples[i]) * (1.0f / 2147483648.0f));
+        sum[c] += x * x;
+    }
+
+    for (ULONG c = 0; c < Channels; c++)
+    {
+        levels.Peak[c] = (peak[c] >= 1.0f) ? 0x7FFFFFFF : (ULONG)((double)peak[c] * 2147483647.0);
+        levels.Rms[c]  = frames ? sqrt(sum[c] / (double)frames) : 0.0;
+    }
+
+    return levels;
+}
+
+void ExpectLevels(PPCM_METER Meter, const ReferenceLevels & Expected, ULONG Channels, const char * What)
+{
+    for (ULONG c = 0; c < Channels; c++)
+    {
+        EXPECT_EQ(Expected.Peak[c], PcmMeter_GetPeak(Meter, c)) << What << ", channel " << c;
+        EXPECT_NEAR(Expected.Rms[c] * 2147483647.0, (double)PcmMeter_GetRms(Meter, c),
+                    Expected.Rms[c] * 2147483647.0 * 1e-5 + 2.0)
+            << What << ", channel " << c;
+    }
+}
+
+} // namespace
+
+TEST(PcmMeter, MatchesTheReferenceForEveryLayout)
+{
+    TestRandom random(13);
+
+    for (ULONG channels = 1; channels <= PCM_METER_MAX_CHANNELS; channels++)
+    {
+        for (ULONG frames : { 0u, 1u, 3u, 7u, 15u, 16u, 17u, 33u, 441u, 480u, 960u, 4800u })
+        {
+            std::vector<LONG>   samples((size_t)frames * channels);
+            PCM_METER           meter;
+
+            // A different level on every channel, so a mixed up lane shows.
+            for (size_t i = 0; i < samples.size(); i++)
+            {
+                ULONG shift = (ULONG)(i % channels) * 3;
+
+                samples[i] = (LONG)(uint32_t)random.Next() >> shift;
+            }
+            if (frames > 2)
+            {
+                samples[random.Range(0, (ULONG)samples.size() - 1)] = (LONG)0x80000000;
+            }
+
+            PcmMeter_Reset(&meter, channels);
+            PcmMeter_Accumulate(&meter, PcmSampleFormatInt32, samples.data(), frames);
+
+            ExpectLevels(&meter, Reference(samples, channels), channels, "int32");
+            ASSERT_FALSE(HasFailure()) << channels << " channels, " << frames << " frames";
+        }
+    }
+}
+
+TEST(PcmMeter, AccumulatesAcrossCalls)
+{
+    TestRandom          random(14);
+    const ULONG         channels = 6;
+    std::vector<LONG>   samples(4800 * channels);
+    PCM_METER           meter;
+    ULONG               done = 0;
+
+    for (LONG & x : samples)
+    {
+        x = (LONG)(uint32_t)random.Next() >> random.Range(0, 12);
+    }
+
+    PcmMeter_Reset(&meter, channels);
+    while (done < 4800)
+    {
+        ULONG frames = std::min(random.Range(1, 500), 4800 - done);
+
+        PcmMeter_Accumulate(&meter, PcmSampleFormatInt32, samples.data() + (size_t)done * channels, frames);
+        done += frames;
+    }
+
+    EXPECT_EQ(4800u, meter.Frames);
+    ExpectLevels(&meter, Reference(samples, channels), channels, "pieces");
+}
+
+TEST(PcmMeter, OtherFormatsGoThroughInt32)
+{
+    TestRandom  random(15);
+    const ULONG channels = 2;
+    const ULONG frames = 1000;
+
+    for (PCM_SAMPLE_FORMAT format : { PcmSampleFormatInt16, PcmSampleFormatInt24, PcmSampleFormatFloat32 })
+    {
+        std::vector<UCHAR>  source((size_t)frames * channels * PcmConvert_SampleBytes(format));
+        std::vector<LONG>   wide((size_t)frames * channels);
+        PCM_METER           meter;
+
+        if (format == PcmSampleFormatFloat32)
+        {
+            for (size_t i = 0; i < wide.size(); i++)
+            {
+                float x = (float)(random.Unit() * 2.4 - 1.2);
+
+                memcpy(&source[i * 4], &x, sizeof(x));
+            }
+        }
+        else
+        {
+            for (UCHAR & b : source)
+            {
+                b = (UCHAR)random.Next();
+            }
+        }
+
+        PcmConvert_Reference(PcmSampleFormatInt32, wide.data(), format, source.data(), (ULONG)wide.size());
+
+        PcmMeter_Reset(&meter, channels);
+        PcmMeter_Accumulate(&meter, format, source.data(), frames);
+
+        ExpectLevels(&meter, Reference(wide, channels), channels, "converted");
+    }
+}
+
+TEST(PcmMeter, KnownSignals)
+{
+    const ULONG         frames = 4800;
+    std::vector<LONG>   samples(frames * 4);
+    PCM_METER           meter;
+
+    for (ULONG i = 0; i < frames; i++)
+    {
+        samples[i * 4]     = (LONG)(2147483647.0 * sin(2.0 * M_PI * 1000.0 * i / 48000.0));  // full-scale sine
+        samples[i * 4 + 1] = (i & 1) ? 0x40000000 : -0x40000000;                             // half-scale square
+        samples[i * 4 + 2] = 0;                                                             // silence
+        samples[i * 4 + 3] = (LONG)0x80000000;                                              // negative full scale
+    }
+
+    PcmMeter_Reset(&meter, 4);
+    PcmMeter_Accumulate(&meter, PcmSampleFormatInt32, samples.data(), frames);
+
+    EXPECT_NEAR(2147483647.0, (double)PcmMeter_GetPeak(&meter, 0), 256.0);
+    EXPECT_NEAR(2147483647.0 / sqrt(2.0), (double)PcmMeter_GetRms(&meter, 0), 2147483647.0 * 1e-5);
+    EXPECT_EQ(0x3FFFFFFFu, PcmMeter_GetPeak(&meter, 1));
+    EXPECT_NEAR(1073741824.0, (double)PcmMeter_GetRms(&meter, 1), 1073741824.0 * 1e-6);
+    EXPECT_EQ(0u, PcmMeter_GetPeak(&meter, 2));
+    EXPECT_EQ(0u, PcmMeter_GetRms(&meter, 2));
+    EXPECT_EQ(0x7FFFFFFFu, PcmMeter_GetPeak(&meter, 3));
+    EXPECT_EQ(0x7FFFFFFFu, PcmMeter_GetRms(&meter, 3));
+
+    // Out of range channels and a reset meter read as silence.
+    EXPECT_EQ(0u, PcmMeter_GetPeak(&meter, 4));
+    EXPECT_EQ(0u, PcmMeter_GetRms(&meter, 4));
+
+    PcmMeter_Reset(&meter, 4);
+    EXPECT_EQ(0u, PcmMeter_GetPeak(&meter, 0));
+    EXPECT_EQ(0u, PcmMeter_GetRms(&meter, 0));
+
+    // More channels than the meter holds are clamped, and an unknown
+    // format is ignored.
+    PcmMeter_Reset(&meter, PCM_METER_MAX_CHANNELS + 3);
+    EXPECT_EQ((ULONG)PCM_METER_MAX_CHANNELS, meter.Channels);
+    PcmMeter_Accumulate(&meter, PcmSampleFormatInvalid, samples.data(), 10);
+    EXPECT_EQ(0u, meter.Frames);
+}
@@ -0,0 +1,180 @@
+/*++
+
+Module Name:
+
+    pcmring_bench.cpp
+
+Abstract:
+
+    Cost of the feeder ring (pcmring.h). WriteRead and ReaderRead time one
+    feeder submission and the capture DPC taking it back out, on one
+    thread, for chunk sizes from a few frames to 40 ms of 48 kHz stereo
+    int32 (3840 bytes is one 10 ms packet); ReaderRead goes through a
+    reader's cursor and PcmRing_Release as UserPcmRing_Read does.
+
+    FanOut is the ring shared by several capture streams: one writer
+    thread and up to eight reader threads, each reader getting every byte
+    and releasing space after every read. Chunks are one 10 ms packet.
+    bytes_per_second counts what the readers received together; laps must
+    stay 0, since every reader holds the writer back.
+--*/
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "pcmring.h"
+#include "testutil.h"
+
+namespace
+{
+
+const ULONG     kCapacity = 64 * 1024;
+const ULONG     kChunk = 480 * 8;
+const uint64_t  kBytesPerIteration = 4ull << 20;
+
+void BM_WriteRead(benchmark::State & State)
+{
+    ULONG               length = (ULONG)State.range(0);
+    std::vector<UCHAR>  data(kCapacity);
+    std::vector<UCHAR>  source(length, 0x5A);
+    std::vector<UCHAR>  destination(length);
+    PCM_RING_CONTROL    control;
+    PCM_RING            ring;
+
+    PcmRing_Attach(&ring, &control, data.data(), kCapacity);
+
+    for (auto _ : State)
+    {
+        benchmark::DoNotOptimize(PcmRing_Write(&ring, source.data(), length));
+        benchmark::DoNotOptimize(PcmRing_Read(&ring, destination.data(), length));
+        benchmark::ClobberMemory();
+    }
+
+    State.SetBytesProcessed((int64_t)State.iterations() * length);
+}
+
+void BM_ReaderRead(benchmark::State & State)
+{
+    ULONG               length = (ULONG)State.range(0);
+    std::vector<UCHAR>  data(kCapacity);
+    std::vector<UCHAR>  source(length, 0x5A);
+    std::vector<UCHAR>  destination(length);
+    PCM_RING_CONTROL    control;
+    PCM_RING            ring;
+    PCM_RING_READER     readers[PCM_RING_MAX_READERS] = {};
+
+    PcmRing_Attach(&ring, &control, data.data(), kCapacity);
+
+    for (auto _ : State)
+    {
+        benchmark::DoNotOptimize(PcmRing_Write(&ring, source.data(), length));
+        benchmark::DoNotOptimize(PcmRing_ReaderRead(&ring, &readers[0], destination.data(), length));
+        PcmRing_Release(&ring, readers, 0x1);
+        benchmark::ClobberMemory();
+    }
+
+    State.SetBytesProcessed((int64_t)State.iterations() * length);
+}
+
+void ChunkArguments(benchmark::internal::Benchmark * Bench)
+{
+    Bench->ArgName("bytes");
+    for (ULONG length : { 64, 384, 1920, 3840, 7680, 15360 })
+    {
+        Bench->Arg(length);
+    }
+}
+
+void BM_FanOut(benchmark::State & State)
+{
+    ULONG               readerCount = (ULONG)State.range(0);
+    ULONG               active = (1UL << readerCount) - 1;
+    std::vector<UCHAR>  data(kCapacity);
+    PCM_RING_CONTROL    control;
+    PCM_RING            ring;
+    PCM_RING_READER     readers[PCM_RING_MAX_READERS] = {};
+    uint64_t            laps = 0;
+
+    for (auto _ : State)
+    {
+        std::vector<std::thread> threads;
+
+        PcmRing_Attach(&ring, &control, data.data(), kCapacity);
+        for (ULONG r = 0; r < readerCount; r++)
+        {
+            readers[r].Cursor = 0;
+            readers[r].Laps = 0;
+        }
+
+        threads.emplace_back([&]
+        {
+            std::vector<UCHAR>  chunk(kChunk, 0x5A);
+            uint64_t            position = 0;
+
+            TestPinThread(0);
+
+            while (position < kBytesPerIteration)
+            {
+                ULONG written = PcmRing_Write(&ring, chunk.data(), kChunk);
+
+                if (written == 0)
+                {
+                    std::this_thread::yield();
+                }
+                position += written;
+            }
+        });
+
+        for (ULONG r = 0; r < readerCount; r++)
+        {
+            threads.emplace_back([&, r]
+            {
+                std::vector<UCHAR>  chunk(kChunk);
+                uint64_t            position = 0;
+
+                TestPinThread(1 + r);
+
+                while (position < kBytesPerIteration)
+                {
+                    ULONG read = PcmRing_ReaderRead(&ring, &readers[r], chunk.data(), kChunk);
+
+                    if (read == 0)
+                    {
+                        std::this_thread::yield();
+                        continue;
+                    }
+                    position += read;
+                    PcmRing_Release(&ring, readers, active);
+                }
+            });
+        }
+
+        for (std::thread & thread : threads)
+        {
+            thread.join();
+        }
+
+        for (ULONG r = 0; r < readerCount; r++)
+        {
+            laps += readers[r].Laps;
+        }
+    }
+
+    State.SetBytesProcessed((int64_t)(State.iterations() * kBytesPerIteration * readerCount));
+    State.counters["laps"] = (double)laps;
+}
+
+} // namespace
+
+BENCHMARK(BM_WriteRead)->Name("PcmRing/WriteRead")->Apply(ChunkArguments);
+BENCHMARK(BM_ReaderRead)->Name("PcmRing/ReaderRead")->Apply(ChunkArguments);
+
+BENCHMARK(BM_FanOut)
+    ->Name("PcmRing/FanOut")
+    ->ArgName("readers")
+    ->Arg(1)->Arg(2)->Arg(4)->Arg(8)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
@@ -0,0 +1,314 @@
+/*++
+
+Module Name:
+
+    pcmring_mmap_test.cpp
+
+Abstract:
+
+    Harness for the mapped capture ring (IOCTL_MICYAUDIO_MAP_RING). A shared
+    file laid out like the driver's mapping, one page holding the cursor
+    block followed by the data area, stands in for the pages the driver
+    maps into the feeder. A forked feeder process maps the file on its own,
+    at its own address, binds a ring view with PcmRing_Bind and produces
+    with PcmRing_Write, as a feeder does with a real mapping; this process
+    consumes like the capture DPC and checks every byte.
+
+    A second test plays a hostile feeder that scribbles over the cursors
+    while the consumer runs, which must never make the consumer copy from
+    outside the data area.
+
+    MICY_MMAP_BYTES sets how much the feeder pushes (default 64 MB).
+--*/
+
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "pcmring.h"
+#include "testutil.h"
+
+namespace
+{
+
+// Same layout as USERPCM_CONTROL_BYTES in userpcm.cpp and the
+// ControlOffset/DataOffset the driver returns in MICYAUDIO_RING_MAPPING.
+const size_t ControlOffset = 0;
+const size_t DataOffset    = 4096;
+
+class SharedRingFile
+{
+public:
+    explicit SharedRingFile(ULONG Capacity) : m_Capacity(Capacity)
+    {
+        char path[] = "/tmp/micy-ring-XXXXXX";
+
+        m_Fd = mkstemp(path);
+        if (m_Fd >= 0)
+        {
+            unlink(path);
+            if (ftruncate(m_Fd, (off_t)Size()) != 0)
+            {
+                close(m_Fd);
+                m_Fd = -1;
+            }
+        }
+    }
+
+    ~SharedRingFile()
+    {
+        if (m_Fd >= 0)
+        {
+            close(m_Fd);
+        }
+    }
+
+    bool IsValid() const { return m_Fd >= 0; }
+    size_t Size() const { return DataOffset + m_Capacity; }
+
+    //
+    // Maps the file and binds a ring view to it, like a feeder binds one to
+    // what IOCTL_MICYAUDIO_MAP_RING returned. Every call maps anew.
+    //
+    UCHAR * Map(PPCM_RING Ring) const
+    {
+        void * base = mmap(NULL, Size(), PROT_READ | PROT_WRITE, MAP_SHARED, m_Fd, 0);
+
+        if (base == MAP_FAILED)
+        {
+            return NULL;
+        }
+
+        PcmRing_Bind(Ring,
+                     (PPCM_RING_CONTROL)((UCHAR *)base + ControlOffset),
+                     (UCHAR *)base + DataOffset,
+                     m_Capacity);
+        return (UCHAR *)base;
+    }
+
+    void Unmap(UCHAR * Base) const
+    {
+        munmap(Base, Size());
+    }
+
+private:
+    ULONG   m_Capacity;
+    int     m_Fd;
+};
+
+//
+// Feeder process: produces Total bytes of the test pattern in 10 ms sized
+// chunks of a 48 kHz stereo int32 stream, with some jitter in the size.
+//
+int RunFeeder(const SharedRingFile & File, uint64_t Total)
+{
+    PCM_RING            ring;
+    UCHAR *             base = File.Map(&ring);
+    std::vector<UCHAR>  chunk(7680);
+    TestRandom          random(3);
+    uint64_t            position = 0;
+
+    if (base == NULL)
+    {
+        return 2;
+    }
+
+    while (position < Total)
+    {
+        ULONG length = random.Range(1, (ULONG)chunk.size());
+        ULONG written;
+
+        if (length > Total - position)
+        {
+            length = (ULONG)(Total - position);
+        }
+
+        TestPatternFill(chunk.data(), position, length);
+        written = PcmRing_Write(&ring, chunk.data(), length);
+        if (written == 0)
+        {
+            sched_yield();
+        }
+        position += written;
+    }
+
+    File.Unmap(base);
+    return 0;
+}
+
+} // namespace
+
+TEST(PcmRingMmap, FeederProcessProducesThroughSharedMapping)
+{
+    const ULONG     capacity = 32768;
+    const uint64_t  total = TestEnvU64("MICY_MMAP_BYTES", 64ull << 20);
+    SharedRingFile  file(capacity);
+    PCM_RING        ring;
+    UCHAR *         base;
+    std::vector<UCHAR> packet(1920);        // 10 ms of 48 kHz stereo int16
+    uint64_t        position = 0;
+    uint64_t        firstBad = ~0ull;
+    pid_t           feeder;
+    int             status = 0;
+
+    ASSERT_TRUE(file.IsValid());
+
+    // The driver owns the ring: it resets the cursors before mapping it.
+    base = file.Map(&ring);
+    ASSERT_NE((UCHAR *)NULL, base);
+    PcmRing_Attach(&ring, ring.Control, ring.Data, capacity);
+
+    feeder = fork();
+    ASSERT_GE(feeder, 0);
+    if (feeder == 0)
+    {
+        _exit(RunFeeder(file, total));
+    }
+
+    while (position < total)
+    {
+        ULONG read = PcmRing_Read(&ring, packet.data(), (ULONG)packet.size());
+        ULONG good;
+
+        if (read == 0)
+        {
+            if (waitpid(feeder, &status, WNOHANG) == feeder)
+            {
+                feeder = -1;
+                if (PcmRing_Count(&ring) == 0)
+                {
+                    break;
+                }
+            }
+            sched_yield();
+            continue;
+        }
+
+        good = TestPatternCheck(packet.data(), position, read);
+        if (good != read)
+        {
+            firstBad = position + good;
+            break;
+        }
+        position += read;
+    }
+
+    if (feeder > 0)
+    {
+        if (firstBad != ~0ull)
+        {
+            kill(feeder, SIGKILL);
+        }
+        ASSERT_EQ(feeder, waitpid(feeder, &status, 0));
+    }
+
+    EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0) << "feeder status " << status;
+    EXPECT_EQ(~0ull, firstBad) << "first corrupt byte at stream offset " << firstBad;
+    EXPECT_EQ(total, position);
+    EXPECT_EQ((LONG64)total, ring.Control->WriteCursor);
+
+    file.Unmap(base);
+}
+
+TEST(PcmRingMmap, HostileFeederCannotSteerTheConsumer)
+{
+    const ULONG         capacity = 4096;
+    SharedRingFile      file(capacity);
+    PCM_RING            consumer = {};
+    PCM_RING            feeder = {};
+    UCHAR *             consumerBase;
+    UCHAR *             feederBase;
+    std::vector<UCHAR>  packet(capacity * 2);
+    volatile bool       stop = false;
+    volatile uint64_t   scribbles = 0;
+    uint64_t            reads = 0;
+    uint64_t            bytes = 0;
+    bool                overlong = false;
+
+    ASSERT_TRUE(file.IsValid());
+
+    consumerBase = file.Map(&consumer);
+    feederBase   = file.Map(&feeder);
+    ASSERT_NE((UCHAR *)NULL, consumerBase);
+    ASSERT_NE((UCHAR *)NULL, feederBase);
+    PcmRing_Attach(&consumer, consumer.Control, consumer.Data, capacity);
+
+    // Both cursors are fair game for an untrusted process: random values,
+    // values just past a valid fill, and the read cursor moved backwards.
+    std::thread scribbler([&]
+    {
+        std::vector<UCHAR>  chunk(capacity);
+        TestRandom          random(4);
+
+        while (!stop)
+        {
+            LONG64 write = ReadAcquire64(&feeder.Control->WriteCursor);
+
+            switch (random.Range(0, 3))
+            {
+            case 0:
+                WriteRelease64(&feeder.Control->WriteCursor, (LONG64)random.Next());
+                break;
+            case 1:
+                WriteRelease64(&feeder.Control->WriteCursor,
+                               ReadAcquire64(&feeder.Control->ReadCursor) + capacity + random.Range(1, 4096));
+                break;
+            case 2:
+                WriteRelease64(&feeder.Control->ReadCursor, write - random.Range(0, 2 * capacity));
+                break;
+            default:
+                PcmRing_Write(&feeder, chunk.data(), random.Range(1, capacity));
+                break;
+            }
+            scribbles = scribbles + 1;
+            if ((scribbles & 1023) == 0)
+            {
+                sched_yield();
+            }
+        }
+    });
+
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(300);
+
+    for (int i = 0; std::chrono::steady_clock::now() < end; i++)
+    {
+        ULONG read = PcmRing_Read(&consumer, packet.data(), (ULONG)packet.size());
+
+        if (read > capacity)
+        {
+            overlong = true;
+        }
+        if (PcmRing_Count(&consumer) > capacity)
+        {
+            overlong = true;
+        }
+        reads += (read != 0);
+        bytes += read;
+
+        // Let the scribbler in on a single processor host.
+        if ((i & 1023) == 0)
+        {
+            sched_yield();
+        }
+    }
+
+    stop = true;
+    scribbler.join();
+
+    printf("  %llu cursor scribbles, %llu non-empty reads, %llu bytes\n",
+           (unsigned long long)scribbles, (unsigned long long)reads, (unsigned long long)bytes);
+
+    EXPECT_GT(scribbles, 0u);
+    EXPECT_FALSE(overlong);
+
+    file.Unmap(feederBase);
+    file.Unmap(consumerBase);
+}
@@ -0,0 +1,410 @@
+/*++
+
+Module Name:
+
+    pcmring_test.cpp
+
+Abstract:
+
+    Tests of the lock-free feeder ring (pcmring.h): single threaded checks
+    of the cursor arithmetic, the corruption handling and the readers of a
+    shared ring, and stress tests that run the producer and one consumer,
+    or eight readers, on separate processors with random chunk sizes and
+    check every byte that comes out.
+
+    MICY_STRESS_BYTES sets how much the stress tests push through the ring
+    (default 256 MB, an eighth of that with eight readers).
+--*/
+
+#include <gtest/gtest.h>
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "pcmring.h"
+#include "testutil.h"
+
+namespace
+{
+
+class TestRing
+{
+public:
+    explicit TestRing(ULONG Capacity) : m_Data(Capacity)
+    {
+        PcmRing_Attach(&m_Ring, &m_Control, m_Data.data(), Capacity);
+    }
+
+    PPCM_RING Get() { return &m_Ring; }
+    PPCM_RING_CONTROL Control() { return &m_Control; }
+
+private:
+    PCM_RING            m_Ring;
+    PCM_RING_CONTROL    m_Control;
+    std::vector<UCHAR>  m_Data;
+};
+
+} // namespace
+
+TEST(PcmRing, RoundCapacity)
+{
+    EXPECT_EQ(PCM_RING_MIN_CAPACITY, PcmRing_RoundCapacity(0));
+    EXPECT_EQ(PCM_RING_MIN_CAPACITY, PcmRing_RoundCapacity(1));
+    EXPECT_EQ(4096u, PcmRing_RoundCapacity(4096));
+    EXPECT_EQ(8192u, PcmRing_RoundCapacity(4097));
+    EXPECT_EQ(32768u, PcmRing_RoundCapacity(7680 * 4));
+    EXPECT_EQ(PCM_RING_MAX_CAPACITY, PcmRing_RoundCapacity(PCM_RING_MAX_CAPACITY + 1));
+}
+
+TEST(PcmRing, CursorsSitOnSeparateCacheLines)
+{
+    EXPECT_EQ(0u, offsetof(PCM_RING_CONTROL, WriteCursor) % PCM_RING_CACHE_LINE);
+    EXPECT_EQ(0u, offsetof(PCM_RING_CONTROL, ReadCursor) % PCM_RING_CACHE_LINE);
+    EXPECT_NE(offsetof(PCM_RING_CONTROL, WriteCursor) / PCM_RING_CACHE_LINE,
+              offsetof(PCM_RING_CONTROL, ReadCursor) / PCM_RING_CACHE_LINE);
+}
+
+TEST(PcmRing, WriteTruncatesToFreeSpace)
+{
+    TestRing    ring(256);
+    UCHAR       in[400];
+    UCHAR       out[400];
+
+    TestPatternFill(in, 0, sizeof(in));
+
+    EXPECT_EQ(256u, PcmRing_Write(ring.Get(), in, sizeof(in)));
+    EXPECT_EQ(256u, PcmRing_Count(ring.Get()));
+    EXPECT_EQ(0u, PcmRing_Write(ring.Get(), in, 1));
+
+    EXPECT_EQ(256u, PcmRing_Read(ring.Get(), out, sizeof(out)));
+    EXPECT_EQ(256u, TestPatternCheck(out, 0, 256));
+    EXPECT_EQ(0u, PcmRing_Count(ring.Get()));
+    EXPECT_EQ(0u, PcmRing_Read(ring.Get(), out, sizeof(out)));
+}
+
+TEST(PcmRing, WrapsAroundTheEnd)
+{
+    TestRing    ring(256);
+    UCHAR       buffer[200];
+    uint64_t    written = 0;
+    uint64_t    read = 0;
+
+    // Chunk sizes coprime with the capacity visit every wrap offset.
+    for (int i = 0; i < 1000; i++)
+    {
+        ULONG length = 1 + (ULONG)(i * 37) % 199;
+
+        TestPatternFill(buffer, written, length);
+        ASSERT_EQ(length, PcmRing_Write(ring.Get(), buffer, length));
+        written += length;
+
+        ASSERT_EQ(length, PcmRing_Read(ring.Get(), buffer, length));
+        ASSERT_EQ(length, TestPatternCheck(buffer, read, length));
+        read += length;
+    }
+
+    EXPECT_EQ((LONG64)written, ring.Control()->WriteCursor);
+    EXPECT_EQ((LONG64)read, ring.Control()->ReadCursor);
+}
+
+TEST(PcmRing, SkipAndDiscard)
+{
+    TestRing    ring(256);
+    UCHAR       buffer[100];
+
+    TestPatternFill(buffer, 0, sizeof(buffer));
+    ASSERT_EQ(100u, PcmRing_Write(ring.Get(), buffer, 100));
+
+    EXPECT_EQ(30u, PcmRing_Skip(ring.Get(), 30));
+    EXPECT_EQ(70u, PcmRing_Count(ring.Get()));
+    EXPECT_EQ(10u, PcmRing_Read(ring.Get(), buffer, 10));
+    EXPECT_EQ(10u, TestPatternCheck(buffer, 30, 10));
+
+    EXPECT_EQ(60u, PcmRing_Skip(ring.Get(), 1000));
+    EXPECT_EQ(0u, PcmRing_Count(ring.Get()));
+
+    ASSERT_EQ(100u, PcmRing_Write(ring.Get(), buffer, 100));
+    PcmRing_Discard(ring.Get());
+    EXPECT_EQ(0u, PcmRing_Count(ring.Get()));
+    EXPECT_EQ(100u, PcmRing_Write(ring.Get(), buffer, 100));
+}
+
+TEST(PcmRing, CorruptCursorsNeverSteerACopy)
+{
+    TestRing    ring(256);
+    UCHAR       buffer[64] = { 0 };
+
+    // A peer that moves the read cursor past the write cursor: the producer
+    // sees a full ring and the consumer resynchronizes on the write cursor.
+    ring.Control()->WriteCursor = 1000;
+    ring.Control()->ReadCursor  = 5000;
+
+    EXPECT_EQ(0u, PcmRing_Count(ring.Get()));
+    EXPECT_EQ(0u, PcmRing_Write(ring.Get(), buffer, sizeof(buffer)));
+    EXPECT_EQ(0u, PcmRing_Read(ring.Get(), buffer, sizeof(buffer)));
+    EXPECT_EQ(1000, ring.Control()->ReadCursor);
+
+    // And one that claims more than the capacity is queued.
+    ring.Control()->WriteCursor = 1000 + 257;
+
+    EXPECT_EQ(0u, PcmRing_Count(ring.Get()));
+    EXPECT_EQ(0u, PcmRing_Read(ring.Get(), buffer, sizeof(buffer)));
+    EXPECT_EQ(1000 + 257, ring.Control()->ReadCursor);
+
+    EXPECT_EQ(64u, PcmRing_Write(ring.Get(), buffer, sizeof(buffer)));
+}
+
+TEST(PcmRing, StressProducerAndConsumerOnSeparateCores)
+{
+    const ULONG     capacity = 64 * 1024;
+    const uint64_t  total = TestEnvU64("MICY_STRESS_BYTES", 256ull << 20);
+    TestRing        ring(capacity);
+    std::atomic<uint64_t> mismatchAt(~0ull);
+    uint64_t        producerStalls = 0;
+    uint64_t        consumerStalls = 0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::thread producer([&]
+    {
+        std::vector<UCHAR>  chunk(capacity);
+        TestRandom          random(1);
+        uint64_t            position = 0;
+
+        TestPinThread(0);
+
+        while (position < total && mismatchAt == ~0ull)
+        {
+            ULONG length = random.Range(1, capacity / 4);
+            ULONG written;
+
+            if (length > total - position)
+            {
+                length = (ULONG)(total - position);
+            }
+
+            TestPatternFill(chunk.data(), position, length);
+            written = PcmRing_Write(ring.Get(), chunk.data(), length);
+            if (written == 0)
+            {
+                producerStalls++;
+                std::this_thread::yield();
+            }
+            position += written;
+        }
+    });
+
+    std::thread consumer([&]
+    {
+        std::vector<UCHAR>  chunk(capacity);
+        TestRandom          random(2);
+        uint64_t            position = 0;
+
+        TestPinThread(1);
+
+        while (position < total)
+        {
+            ULONG length = random.Range(1, capacity / 4);
+            ULONG read = PcmRing_Read(ring.Get(), chunk.data(), length);
+            ULONG good;
+
+            if (read == 0)
+            {
+                consumerStalls++;
+                std::this_thread::yield();
+                continue;
+            }
+
+            good = TestPatternCheck(chunk.data(), position, read);
+            if (good != read)
+            {
+                mismatchAt = position + good;
+                return;
+            }
+            position += read;
+        }
+    });
+
+    producer.join();
+    consumer.join();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("  %llu MB in %.2f s, %.0f MB/s, %u processors, %llu producer and %llu consumer stalls\n",
+           (unsigned long long)(total >> 20), seconds, (double)total / (1 << 20) / seconds,
+           TestProcessorCount(),
+           (unsigned long long)producerStalls, (unsigned long long)consumerStalls);
+
+    EXPECT_EQ(~0ull, mismatchAt.load()) << "first corrupt byte at stream offset " << mismatchAt.load();
+    EXPECT_EQ((LONG64)total, ring.Control()->WriteCursor);
+    EXPECT_EQ((LONG64)total, ring.Control()->ReadCursor);
+}
+
+TEST(PcmRing, EveryReaderGetsEveryByte)
+{
+    TestRing        ring(256);
+    PCM_RING_READER readers[PCM_RING_MAX_READERS] = {};
+    UCHAR           buffer[256];
+
+    TestPatternFill(buffer, 0, sizeof(buffer));
+    EXPECT_EQ(256u, PcmRing_Write(ring.Get(), buffer, 256));
+
+    // The producer only gets space back once the slowest reader is past it.
+    EXPECT_EQ(100u, PcmRing_ReaderRead(ring.Get(), &readers[0], buffer, 100));
+    EXPECT_EQ(100u, TestPatternCheck(buffer, 0, 100));
+    EXPECT_EQ(40u, PcmRing_ReaderRead(ring.Get(), &readers[1], buffer, 40));
+    EXPECT_EQ(40u, TestPatternCheck(buffer, 0, 40));
+    PcmRing_Release(ring.Get(), readers, 0x3);
+    EXPECT_EQ(40, ring.Control()->ReadCursor);
+    EXPECT_EQ(216u, PcmRing_Count(ring.Get()));
+
+    TestPatternFill(buffer, 256, 100);
+    EXPECT_EQ(40u, PcmRing_Write(ring.Get(), buffer, 100));
+
+    // Releasing with an older minimum does not move ReadCursor back.
+    EXPECT_EQ(256u, PcmRing_ReaderRead(ring.Get(), &readers[1], buffer, 256));
+    EXPECT_EQ(256u, TestPatternCheck(buffer, 40, 256));
+    PcmRing_Release(ring.Get(), readers, 0x2);
+    EXPECT_EQ(296, ring.Control()->ReadCursor);
+    PcmRing_Release(ring.Get(), readers, 0x3);
+    EXPECT_EQ(296, ring.Control()->ReadCursor);
+
+    EXPECT_EQ(196u, PcmRing_ReaderCount(ring.Get(), &readers[0]));
+    EXPECT_EQ(0u, PcmRing_ReaderCount(ring.Get(), &readers[1]));
+    EXPECT_EQ(0u, readers[0].Laps + readers[1].Laps);
+}
+
+TEST(PcmRing, LappedReaderSkipsToTheNewestData)
+{
+    TestRing        ring(256);
+    PCM_RING_READER readers[2] = {};
+    UCHAR           buffer[256];
+    uint64_t        position = 0;
+
+    // Reader 1 is not counted towards ReadCursor, so nothing holds the
+    // producer back for it.
+    for (int i = 0; i < 3; i++)
+    {
+        TestPatternFill(buffer, position, 200);
+        ASSERT_EQ(200u, PcmRing_Write(ring.Get(), buffer, 200));
+        position += 200;
+        ASSERT_EQ(200u, PcmRing_ReaderRead(ring.Get(), &readers[0], buffer, 256));
+        PcmRing_Release(ring.Get(), readers, 0x1);
+    }
+
+    EXPECT_EQ(0u, PcmRing_ReaderCount(ring.Get(), &readers[1]));
+    EXPECT_EQ(0u, PcmRing_ReaderRead(ring.Get(), &readers[1], buffer, 256));
+    EXPECT_EQ(1u, readers[1].Laps);
+    EXPECT_EQ((LONG64)position, readers[1].Cursor);
+
+    // Within the ring but behind ReadCursor: the copy is thrown away.
+    TestPatternFill(buffer, position, 200);
+    ASSERT_EQ(200u, PcmRing_Write(ring.Get(), buffer, 200));
+    position += 200;
+    ASSERT_EQ(200u, PcmRing_ReaderRead(ring.Get(), &readers[0], buffer, 256));
+    PcmRing_Release(ring.Get(), readers, 0x1);
+    WriteRelease64(&readers[1].Cursor, (LONG64)position - 250);
+
+    EXPECT_EQ(0u, PcmRing_ReaderRead(ring.Get(), &readers[1], buffer, 256));
+    EXPECT_EQ(2u, readers[1].Laps);
+    EXPECT_EQ((LONG64)position, readers[1].Cursor);
+
+    // From there it reads on like any other reader.
+    TestPatternFill(buffer, position, 64);
+    ASSERT_EQ(64u, PcmRing_Write(ring.Get(), buffer, 64));
+    EXPECT_EQ(64u, PcmRing_ReaderRead(ring.Get(), &readers[1], buffer, 256));
+    EXPECT_EQ(64u, TestPatternCheck(buffer, position, 64));
+    EXPECT_EQ(0u, readers[0].Laps);
+}
+
+TEST(PcmRing, StressOneWriterAndEightReaders)
+{
+    const ULONG     capacity = 64 * 1024;
+    const uint64_t  total = TestEnvU64("MICY_STRESS_BYTES", 256ull << 20) / 8;
+    const ULONG     active = (1UL << PCM_RING_MAX_READERS) - 1;
+    TestRing        ring(capacity);
+    PCM_RING_READER readers[PCM_RING_MAX_READERS] = {};
+    std::atomic<uint64_t> mismatchAt(~0ull);
+    std::vector<std::thread> threads;
+
+    auto start = std::chrono::steady_clock::now();
+
+    threads.emplace_back([&]
+    {
+        std::vector<UCHAR>  chunk(capacity);
+        TestRandom          random(1);
+        uint64_t            position = 0;
+
+        TestPinThread(0);
+
+        while (position < total && mismatchAt == ~0ull)
+        {
+            ULONG length = (ULONG)std::min<uint64_t>(random.Range(1, capacity / 4), total - position);
+            ULONG written;
+
+            TestPatternFill(chunk.data(), position, length);
+            written = PcmRing_Write(ring.Get(), chunk.data(), length);
+            if (written == 0)
+            {
+                std::this_thread::yield();
+            }
+            position += written;
+        }
+    });
+
+    for (ULONG r = 0; r < PCM_RING_MAX_READERS; r++)
+    {
+        threads.emplace_back([&, r]
+        {
+            std::vector<UCHAR>  chunk(capacity);
+            TestRandom          random(2 + r);
+            uint64_t            position = 0;
+
+            TestPinThread(1 + r);
+
+            while (position < total && mismatchAt == ~0ull)
+            {
+                ULONG length = random.Range(1, capacity / 4);
+                ULONG read = PcmRing_ReaderRead(ring.Get(), &readers[r], chunk.data(), length);
+                ULONG good;
+
+                if (read == 0)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                good = TestPatternCheck(chunk.data(), position, read);
+                if (good != read)
+                {
+                    mismatchAt = position + good;
+                    return;
+                }
+                position += read;
+                PcmRing_Release(ring.Get(), readers, active);
+            }
+        });
+    }
+
+    for (std::thread & thread : threads)
+    {
+        thread.join();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("  %llu MB to each of %u readers in %.2f s, %.0f MB/s delivered, %u processors\n",
+           (unsigned long long)(total >> 20), PCM_RING_MAX_READERS, seconds,
+           (double)total * PCM_RING_MAX_READERS / (1 << 20) / seconds, TestProcessorCount());
+
+    EXPECT_EQ(~0ull, mismatchAt.load()) << "first corrupt byte at stream offset " << mismatchAt.load();
+    EXPECT_EQ((LONG64)total, ring.Control()->ReadCursor);
+    for (ULONG r = 0; r < PCM_RING_MAX_READERS; r++)
+    {
+        EXPECT_EQ(0u, readers[r].Laps) << "reader " << r;
+    }
+}
@@ -0,0 +1,264 @@
+/*++
+
+Module Name:
+
+    pktstamp_sim_test.cpp
+
+Abstract:
+
+    Simulation of the packet stamps GetReadPacket serves (pktstamp.h) over a
+    month of continuous capture, on a machine that has already been up for
+    more than a year.
+
+    The stream is FakePortStream, whose DPC runs TimerNotifyRT's steps on
+    the stream core: it moves the position to the QPC it runs at, crosses
+    the boundaries reached and stamps the packet. It runs a random dispatch
+    latency after the timer is due and is sometimes held off for longer
+    than a packet, so boundaries collapse. Every so often the stream pauses,
+    anywhere between two DPCs, for a while and runs again. Each stamp
+    GetReadPacket serves is checked against the exact boundary time
+    computed in 128 bits: it must be the first QPC tick at which the
+    boundary frame was due, so its error is less than one tick, and stamps
+    must strictly increase with the packet number.
+
+    MICY_PKTSTAMP_DAYS sets the simulated time of the long run, default 30.
+--*/
+
+#include <gtest/gtest.h>
+
+#include <stdio.h>
+#include <algorithm>
+
+#include "fakeportstream.h"
+#include "testutil.h"
+
+namespace
+{
+
+struct StampConfig
+{
+    ULONGLONG   Frequency;
+    ULONG       FramesPerSecond;
+    ULONG       BlockAlign;
+    ULONG       PacketFrames;
+};
+
+struct StampResult
+{
+    ULONGLONG   Packets;
+    ULONGLONG   Collapsed;          // boundaries folded into a later one
+    ULONGLONG   Pauses;
+    ULONGLONG   PausedPackets;      // completed by the position update at PAUSE
+    ULONGLONG   Mismatches;         // stamps off the exact boundary tick
+    ULONGLONG   Reversals;          // stamps not after the previous one
+    ULONGLONG   Missing;            // last completed packet not found
+    double      MaxLagUs;           // boundary to the DPC that stamped it
+};
+
+//
+// First QPC tick at which Frame frames after Epoch are due.
+//
+LONGLONG ExactQpc(const StampConfig & Config, LONGLONG Epoch, ULONGLONG Frame)
+{
+    unsigned __int128 product = (unsigned __int128)Frame * Config.Frequency;
+
+    return Epoch + (LONGLONG)((product + Config.FramesPerSecond - 1) / Config.FramesPerSecond);
+}
+
+StampResult Simulate(const StampConfig & Config, double Days, uint64_t Seed, double PauseEverySeconds = 3600.0 * 6)
+{
+    const ULONG     packetBytes = Config.PacketFrames * Config.BlockAlign;
+    const LONGLONG  uptime = (LONGLONG)(Config.Frequency * 86400ull * 400);
+    FakeClock       clock(Config.Frequency, uptime);
+    FakePortStream  stream(clock, Config.FramesPerSecond, Config.BlockAlign, FALSE);
+    const LONGLONG  end = uptime + clock.TicksOfSeconds(Days * 86400.0);
+    const LONGLONG  pauseEvery = clock.TicksOfSeconds(PauseEverySeconds);
+    const LONGLONG  packetTicks = clock.TicksOfSeconds((double)Config.PacketFrames / Config.FramesPerSecond);
+    TestRandom      random(Seed);
+    StampResult     result = {};
+    LONGLONG        epoch;
+    ULONGLONG       runPosition;            // linear position at the last RUN
+    LONGLONG        nextPause;
+    LONGLONG        lastStamp = 0;
+    ULONG           lastPacket = MAXULONG;
+    ULONG           actual;
+
+    //
+    // GetReadPacket after a packet completed: the stamp must be the first
+    // tick of the packet's end boundary on the clock of the last RUN.
+    //
+    auto check = [&]()
+    {
+        ULONG       packet;
+        ULONG       flags;
+        ULONG64     stamp;
+        BOOLEAN     moreData;
+        ULONGLONG   boundary = stream.Core().NextPacketPosition - packetBytes;
+
+        if (stream.GetReadPacket(&packet, &flags, &stamp, &moreData) != STATUS_SUCCESS ||
+            packet != lastPacket + 1)
+        {
+            result.Missing++;
+            return;
+        }
+
+        if ((LONGLONG)stamp != ExactQpc(Config, epoch, (boundary - runPosition) / Config.BlockAlign))
+        {
+            result.Mismatches++;
+        }
+        if ((LONGLONG)stamp <= lastStamp || (LONGLONG)stamp > clock.Now())
+        {
+            result.Reversals++;
+        }
+        result.MaxLagUs = std::max(result.MaxLagUs, (double)(clock.Now() - (LONGLONG)stamp) * 1e6 / Config.Frequency);
+        lastStamp = (LONGLONG)stamp;
+        lastPacket = packet;
+    };
+
+    EXPECT_EQ(STATUS_SUCCESS, stream.AllocateBufferWithNotification(2, 2 * packetBytes, &actual));
+    stream.SetState(KSSTATE_ACQUIRE);
+    stream.SetState(KSSTATE_PAUSE);
+    stream.SetState(KSSTATE_RUN);
+    epoch = clock.Now();
+    runPosition = 0;
+    nextPause = epoch + pauseEvery;
+
+    while (clock.Now() < end)
+    {
+        LONGLONG    latency;
+        ULONGLONG   boundary = stream.Core().NextPacketPosition;
+
+        // Packets shorter than the 1 ms notification granularity are not
+        // timer driven.
+        if (!stream.Timer().Armed())
+        {
+            ADD_FAILURE() << "notification timer not armed";
+            break;
+        }
+
+        // PAUSE anywhere between two DPCs for up to a minute, then RUN;
+        // positions carry on. The position update at PAUSE may reach the
+        // next boundary before the DPC does.
+        if (clock.Now() >= nextPause)
+        {
+            LONGLONG packets = stream.Core().PacketCounter;
+
+            clock.Advance((LONGLONG)(random.Unit() * 1.5 * packetTicks));
+            stream.SetState(KSSTATE_PAUSE);
+            if (stream.Core().PacketCounter != packets)
+            {
+                result.PausedPackets++;
+                check();
+            }
+
+            clock.Advance(clock.TicksOfSeconds(random.Unit() * 60.0));
+            stream.SetState(KSSTATE_RUN);
+            epoch = clock.Now();
+            runPosition = stream.Core().LinearPosition;
+            nextPause = epoch + pauseEvery;
+            result.Pauses++;
+            continue;
+        }
+
+        // The timer fires late: mostly by tens of microseconds, now and then
+        // by more than a packet.
+        latency = (LONGLONG)(random.Unit() * 0.0002 * Config.Frequency);
+        if (random.Range(0, 9999) == 0)
+        {
+            latency += (LONGLONG)(random.Unit() * 0.05 * Config.Frequency);
+        }
+        clock.AdvanceTo(stream.Timer().DueQpc() + latency);
+
+        if (!stream.TimerNotify())
+        {
+            continue;
+        }
+        result.Collapsed += (stream.Core().NextPacketPosition - boundary) / packetBytes - 1;
+        result.Packets++;
+        check();
+    }
+
+    printf("  %10llu Hz, %6u Hz, %4u frame packets, %5.2f days: %llu packets, %llu collapsed, %llu pauses, "
+           "%llu completed at PAUSE, lag max %.0f us, %llu off the exact tick, %llu out of order, %llu missing\n",
+           (unsigned long long)Config.Frequency, Config.FramesPerSecond, Config.PacketFrames, Days,
+           (unsigned long long)result.Packets, (unsigned long long)result.Collapsed,
+           (unsigned long long)result.Pauses, (unsigned long long)result.PausedPackets, result.MaxLagUs,
+           (unsigned long long)result.Mismatches, (unsigned long long)result.Reversals,
+           (unsigned long long)result.Missing);
+
+    return result;
+}
+
+void ExpectExact(const StampResult & Result)
+{
+    EXPECT_GT(Result.Packets, 0u);
+    EXPECT_GT(Result.Collapsed, 0u);
+    EXPECT_EQ(0u, Result.Mismatches);
+    EXPECT_EQ(0u, Result.Reversals);
+    EXPECT_EQ(0u, Result.Missing);
+}
+
+} // namespace
+
+TEST(PktStampSim, ThirtyDaysOfTenMillisecondPackets)
+{
+    double days = (double)TestEnvU64("MICY_PKTSTAMP_DAYS", 30);
+
+    ExpectExact(Simulate({ 10000000, 48000, 8, 480 }, days, 1));
+}
+
+TEST(PktStampSim, RatesThatDoNotDivideTheQpcFrequency)
+{
+    const StampConfig configs[] =
+    {
+        { 10000000,   44100,  4,  441 },    // 10 ms
+        { 3579545,    48000,  6,  144 },    // ACPI PM timer, 3 ms
+        { 24000000,   96000,  12, 1000 },   // ARM64 generic timer
+        { 2400000000, 192000, 32, 192 },    // invariant TSC, 1 ms
+        { 14318180,   16000,  2,  160 },    // HPET
+    };
+
+    for (const StampConfig & config : configs)
+    {
+        ExpectExact(Simulate(config, 0.25, 2, 3600.0));
+    }
+}
+
+TEST(PktStampSim, PauseBetweenTimerWakeups)
+{
+    // Pausing every 10 s, often after the position has reached the next
+    // boundary but before the DPC has run.
+    StampResult result = Simulate({ 10000000, 48000, 8, 480 }, 0.1, 3, 10.0);
+
+    ExpectExact(result);
+    EXPECT_GT(result.Pauses, 100u);
+    EXPECT_GT(result.PausedPackets, 20u);
+}
+
+TEST(PktStamp, RingKeepsTheLastPackets)
+{
+    PKT_STAMP_RING  ring;
+    LONGLONG        qpc = 0;
+
+    PktStamp_Reset(&ring);
+    EXPECT_EQ(0, PktStamp_Lookup(&ring, 0, &qpc));
+    EXPECT_EQ(0, PktStamp_Lookup(&ring, -1, &qpc));
+
+    for (LONGLONG packet = 0; packet < 20; packet++)
+    {
+        PktStamp_Record(&ring, packet, 1000 + packet * 10);
+    }
+
+    for (LONGLONG packet = 0; packet < 20; packet++)
+    {
+        if (packet >= 20 - PKT_STAMP_RING_SIZE)
+        {
+            ASSERT_EQ(1, PktStamp_Lookup(&ring, packet, &qpc)) << packet;
+            EXPECT_EQ(1000 + packet * 10, qpc);
+        }
+        else
+        {
+            EXPECT_EQ(0, PktStamp_Lookup(&ring, packet, &qpc)) << packet;
+        }
+    }
+}
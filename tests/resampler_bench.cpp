@@ -0,0 +1,98 @@
+/*++
+
+Module Name:
+
+    resampler_bench.cpp
+
+Abstract:
+
+    Cost of the resampler per output frame for each preset, converting the
+    usual feeder rates to 48 kHz stereo 10 ms at a time as the capture DPC
+    does. The adjustable variants run trimmed, so every frame interpolates
+    between two phases. sec_per_frame is per output frame, all channels.
+--*/
+
+#include <benchmark/benchmark.h>
+
+#include <stdlib.h>
+#include <vector>
+
+#include "resampler.h"
+#include "testutil.h"
+
+namespace
+{
+
+void BM_Resample(benchmark::State & State)
+{
+    ULONG               rate = (ULONG)State.range(0);
+    RESAMPLER_QUALITY   quality = (RESAMPLER_QUALITY)State.range(1);
+    ULONG               flags = (ULONG)State.range(2);
+    const ULONG         channels = 2;
+    const ULONG         packet = 480;
+    ULONG               size = Resampler_GetSize(rate, 48000, channels, quality, flags);
+    PRESAMPLER          resampler = (PRESAMPLER)aligned_alloc(16, (size + 15) & ~15u);
+    std::vector<float>  input((size_t)rate * channels);
+    std::vector<float>  output((size_t)packet * channels);
+    TestRandom          random(1);
+    ULONG               next = 0;
+    int64_t             frames = 0;
+
+    for (float & x : input)
+    {
+        x = (float)(random.Unit() - 0.5);
+    }
+
+    Resampler_Init(resampler, size, rate, 48000, channels, quality, flags);
+    Resampler_SetAdjustment(resampler, 100000);
+
+    for (auto _ : State)
+    {
+        ULONG produced = 0;
+
+        // One DPC: pull a packet, feeding input as the converter asks.
+        while (produced < packet)
+        {
+            ULONG got = Resampler_Read(resampler, output.data() + (size_t)produced * channels, packet - produced);
+            ULONG space;
+
+            produced += got;
+            if (produced == packet)
+            {
+                break;
+            }
+
+            space = Resampler_GetInputSpace(resampler);
+            if (space > rate - next)
+            {
+                space = rate - next;
+            }
+            Resampler_Write(resampler, input.data() + (size_t)next * channels, space);
+            next = (next + space) % rate;
+        }
+
+        benchmark::DoNotOptimize(output.data());
+        frames += packet;
+    }
+
+    State.counters["sec_per_frame"] = benchmark::Counter((double)frames,
+                                                         benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+    free(resampler);
+}
+
+void ResampleArguments(benchmark::internal::Benchmark * Bench)
+{
+    Bench->ArgNames({ "rate", "quality", "adjustable" });
+    for (int rate : { 16000, 22050, 44100, 96000 })
+    {
+        for (int quality : { ResamplerQualityLow, ResamplerQualityMedium, ResamplerQualityHigh })
+        {
+            Bench->Args({ rate, quality, 0 });
+            Bench->Args({ rate, quality, RESAMPLER_FLAG_ADJUSTABLE });
+        }
+    }
+}
+
+} // namespace
+
+BENCHMARK(BM_Resample)->Name("Resampler")->Apply(ResampleArguments);
@@ -0,0 +1,379 @@
+/*++
+
+Module Name:
+
+    resampler_test.cpp
+
+Abstract:
+
+    Tests for resampler.cpp.
+
+    Streaming must not change a single bit: the same input pushed and
+    pulled in pieces of any size, as the capture DPC does across ticks,
+    gives exactly the output of one large call, each channel of an
+    interleaved stream comes out as it would on its own, and an adjustable
+    converter left untrimmed matches a fixed one built with the same bank.
+
+    Quality is measured as THD+N against an ideal reference, the sine the
+    output should be (fitted in amplitude and phase, at the exact output
+    frequency), for each preset and the usual rate pairs.
+--*/
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+#include <numeric>
+#include <vector>
+
+#include "resampler.h"
+#include "testutil.h"
+
+namespace
+{
+
+struct FreeDeleter
+{
+    void operator()(void * Pointer) const { free(Pointer); }
+};
+
+typedef std::unique_ptr<RESAMPLER, FreeDeleter> ResamplerPtr;
+
+ResamplerPtr MakeResampler(ULONG InputRate, ULONG OutputRate, ULONG Channels,
+                           RESAMPLER_QUALITY Quality, ULONG Flags = 0)
+{
+    ULONG size = Resampler_GetSize(InputRate, OutputRate, Channels, Quality, Flags);
+
+    if (size == 0)
+    {
+        return ResamplerPtr();
+    }
+
+    ResamplerPtr resampler((PRESAMPLER)aligned_alloc(16, (size + 15) & ~15u));
+
+    if (!Resampler_Init(resampler.get(), size, InputRate, OutputRate, Channels, Quality, Flags))
+    {
+        return ResamplerPtr();
+    }
+    return resampler;
+}
+
+//
+// Pushes Input through in pieces of random size, pulling output in pieces
+// of random size, until the input is used up. MaxPiece 0 uses whole calls.
+//
+std::vector<float> Stream(PRESAMPLER Resampler, const std::vector<float> & Input, ULONG Channels,
+                          ULONG MaxPiece, TestRandom & Random)
+{
+    std::vector<float>  output;
+    std::vector<float>  piece;
+    ULONG               frames = (ULONG)(Input.size() / Channels);
+    ULONG               written = 0;
+
+    for (;;)
+    {
+        ULONG want = MaxPiece ? Random.Range(1, MaxPiece) : 1 << 20;
+        ULONG got;
+
+        piece.resize((size_t)want * Channels);
+        got = Resampler_Read(Resampler, piece.data(), want);
+        output.insert(output.end(), piece.begin(), piece.begin() + (size_t)got * Channels);
+
+        if (got == want)
+        {
+            continue;
+        }
+        if (written == frames)
+        {
+            break;
+        }
+
+        ULONG count = Resampler_GetInputSpace(Resampler);
+
+        if (MaxPiece != 0 && count > MaxPiece)
+        {
+            count = Random.Range(1, MaxPiece);
+        }
+        if (count > frames - written)
+        {
+            count = frames - written;
+        }
+
+        Resampler_Write(Resampler, Input.data() + (size_t)written * Channels, count);
+        written += count;
+    }
+
+    return output;
+}
+
+std::vector<float> Noise(ULONG Samples, TestRandom & Random)
+{
+    std::vector<float> input(Samples);
+
+    for (float & x : input)
+    {
+        x = (float)(Random.Unit() * 1.8 - 0.9);
+    }
+    return input;
+}
+
+//
+// THD+N in dB of a resampled sine of Frequency Hz at OutputRate against the
+// ideal one. The first frames, where the filter fills, are left out.
+//
+double ThdPlusNoise(const std::vector<float> & Output, double Frequency, ULONG OutputRate, size_t Skip)
+{
+    double w = 2.0 * M_PI * Frequency / OutputRate;
+    double ss = 0, cc = 0, sc = 0, ys = 0, yc = 0;
+    double error = 0, power = 0;
+    double det, a, b;
+
+    for (size_t i = Skip; i < Output.size(); i++)
+    {
+        double s = sin(w * (double)i);
+        double c = cos(w * (double)i);
+
+        ss += s * s;
+        cc += c * c;
+        sc += s * c;
+        ys += Output[i] * s;
+        yc += Output[i] * c;
+    }
+
+    det = ss * cc - sc * sc;
+    a = (ys * cc - yc * sc) / det;
+    b = (yc * ss - ys * sc) / det;
+
+    for (size_t i = Skip; i < Output.size(); i++)
+    {
+        double model = a * sin(w * (double)i) + b * cos(w * (double)i);
+
+        error += (Output[i] - model) * (Output[i] - model);
+        power += model * model;
+    }
+
+    return 10.0 * log10(error / power);
+}
+
+double MeasureThd(ULONG InputRate, ULONG OutputRate, RESAMPLER_QUALITY Quality, double Frequency,
+                  ULONG Flags, LONG Trim)
+{
+    ResamplerPtr        resampler = MakeResampler(InputRate, OutputRate, 1, Quality, Flags);
+    std::vector<float>  input(InputRate * 2);
+    TestRandom          random(1);
+
+    for (size_t i = 0; i < input.size(); i++)
+    {
+        input[i] = (float)(0.5 * sin(2.0 * M_PI * Frequency * (double)i / InputRate));
+    }
+
+    Resampler_SetAdjustment(resampler.get(), Trim);
+
+    std::vector<float> output = Stream(resampler.get(), input, 1, 0, random);
+
+    // A trim consuming input faster raises the output frequency.
+    return ThdPlusNoise(output, Frequency * (1.0 + Trim * 1e-9), OutputRate, OutputRate / 10);
+}
+
+const ULONG InputRates[] = { 8000, 11025, 16000, 22050, 32000, 44100, 96000 };
+
+const RESAMPLER_QUALITY Qualities[] =
+{
+    ResamplerQualityLow,
+    ResamplerQualityMedium,
+    ResamplerQualityHigh,
+};
+
+} // namespace
+
+TEST(Resampler, RejectsUnsupportedConfigurations)
+{
+    EXPECT_EQ(0u, Resampler_GetSize(RESAMPLER_MIN_RATE - 1, 48000, 2, ResamplerQualityMedium, 0));
+    EXPECT_EQ(0u, Resampler_GetSize(48000, RESAMPLER_MAX_RATE + 1, 2, ResamplerQualityMedium, 0));
+    EXPECT_EQ(0u, Resampler_GetSize(44100, 48000, 0, ResamplerQualityMedium, 0));
+    EXPECT_EQ(0u, Resampler_GetSize(44100, 48000, RESAMPLER_MAX_CHANNELS + 1, ResamplerQualityMedium, 0));
+    EXPECT_EQ(0u, Resampler_GetSize(44100, 48000, 2, ResamplerQualityCount, 0));
+    EXPECT_NE(0u, Resampler_GetSize(11025, 48000, 2, ResamplerQualityHigh, 0));
+
+    ULONG   size = Resampler_GetSize(44100, 48000, 2, ResamplerQualityMedium, 0);
+    void *  memory = aligned_alloc(16, (size + 15) & ~15u);
+
+    EXPECT_FALSE(Resampler_Init((PRESAMPLER)memory, size - 1, 44100, 48000, 2, ResamplerQualityMedium, 0));
+    EXPECT_TRUE(Resampler_Init((PRESAMPLER)memory, size, 44100, 48000, 2, ResamplerQualityMedium, 0));
+    free(memory);
+}
+
+TEST(Resampler, PieceSizesDoNotChangeABit)
+{
+    TestRandom random(2);
+
+    for (ULONG rate : InputRates)
+    {
+        for (RESAMPLER_QUALITY quality : Qualities)
+        {
+            for (ULONG flags : { 0u, (ULONG)RESAMPLER_FLAG_ADJUSTABLE })
+            {
+                std::vector<float>  input = Noise(rate / 5 * 2, random);
+                ResamplerPtr        whole = MakeResampler(rate, 48000, 2, quality, flags);
+                ResamplerPtr        pieces = MakeResampler(rate, 48000, 2, quality, flags);
+
+                ASSERT_TRUE(whole && pieces);
+                Resampler_SetAdjustment(whole.get(), 123456);
+                Resampler_SetAdjustment(pieces.get(), 123456);
+
+                std::vector<float> expected = Stream(whole.get(), input, 2, 0, random);
+                std::vector<float> actual = Stream(pieces.get(), input, 2, 37, random);
+
+                ASSERT_GT(expected.size(), 48000u / 5 * 2 - 200);
+                ASSERT_EQ(expected.size(), actual.size()) << rate << " Hz, quality " << quality;
+                ASSERT_EQ(0, memcmp(expected.data(), actual.data(), expected.size() * sizeof(float)))
+                    << rate << " Hz, quality " << quality << ", flags " << flags;
+            }
+        }
+    }
+}
+
+TEST(Resampler, ChannelsAreIndependent)
+{
+    TestRandom          random(3);
+    const ULONG         channels = 5;
+    std::vector<float>  input = Noise(22050 / 10 * channels, random);
+    ResamplerPtr        multi = MakeResampler(22050, 48000, channels, ResamplerQualityHigh);
+    std::vector<float>  interleaved = Stream(multi.get(), input, channels, 0, random);
+
+    for (ULONG c = 0; c < channels; c++)
+    {
+        ResamplerPtr        mono = MakeResampler(22050, 48000, 1, ResamplerQualityHigh);
+        std::vector<float>  plane(input.size() / channels);
+
+        for (size_t i = 0; i < plane.size(); i++)
+        {
+            plane[i] = input[i * channels + c];
+        }
+
+        std::vector<float> expected = Stream(mono.get(), plane, 1, 0, random);
+
+        ASSERT_EQ(expected.size() * channels, interleaved.size());
+        for (size_t i = 0; i < expected.size(); i++)
+        {
+            ASSERT_EQ(expected[i], interleaved[i * channels + c]) << "channel " << c << " frame " << i;
+        }
+    }
+}
+
+TEST(Resampler, ResetStartsOver)
+{
+    TestRandom          random(4);
+    std::vector<float>  input = Noise(4410, random);
+    ResamplerPtr        resampler = MakeResampler(44100, 48000, 1, ResamplerQualityMedium);
+    std::vector<float>  first = Stream(resampler.get(), input, 1, 0, random);
+
+    Resampler_Reset(resampler.get());
+
+    std::vector<float> second = Stream(resampler.get(), input, 1, 0, random);
+
+    EXPECT_EQ(first, second);
+}
+
+TEST(Resampler, TrimChangesTheRate)
+{
+    TestRandom          random(5);
+    std::vector<float>  input = Noise(441000, random);
+    ResamplerPtr        fast = MakeResampler(44100, 48000, 1, ResamplerQualityLow, RESAMPLER_FLAG_ADJUSTABLE);
+    ResamplerPtr        slow = MakeResampler(44100, 48000, 1, ResamplerQualityLow, RESAMPLER_FLAG_ADJUSTABLE);
+
+    // Consuming input faster means fewer output frames for the same input.
+    Resampler_SetAdjustment(fast.get(), 400000);
+    Resampler_SetAdjustment(slow.get(), -400000);
+
+    double outFast = (double)Stream(fast.get(), input, 1, 0, random).size();
+    double outSlow = (double)Stream(slow.get(), input, 1, 0, random).size();
+
+    EXPECT_NEAR(480000.0 / 1.0004, outFast, 40.0);
+    EXPECT_NEAR(480000.0 / 0.9996, outSlow, 40.0);
+
+    // Beyond the limit the trim is clamped.
+    ResamplerPtr clamped = MakeResampler(44100, 48000, 1, ResamplerQualityLow, RESAMPLER_FLAG_ADJUSTABLE);
+
+    Resampler_SetAdjustment(clamped.get(), 10000000);
+    EXPECT_NEAR(480000.0 / (1.0 + RESAMPLER_MAX_ADJUSTMENT_PPM * 1e-6),
+                (double)Stream(clamped.get(), input, 1, 0, random).size(), 40.0);
+}
+
+TEST(Resampler, ThdPlusNoiseMeetsThePresets)
+{
+    // Bounds a few dB above what resampler.h documents for 44.1 -> 48 kHz.
+    const double bound[] = { 0.0, -65.0, -85.0, -110.0 };
+
+    for (RESAMPLER_QUALITY quality : Qualities)
+    {
+        for (ULONG rate : InputRates)
+        {
+            double thd = MeasureThd(rate, 48000, quality, 1000.0, 0, 0);
+            double trimmed = MeasureThd(rate, 48000, quality, 1000.0, RESAMPLER_FLAG_ADJUSTABLE, 250000);
+
+            printf("  quality %d, %6u -> 48000 Hz, 1 kHz: THD+N %6.1f dB, trimmed 250 ppm %6.1f dB\n",
+                   quality, rate, thd, trimmed);
+            EXPECT_LT(thd, bound[quality]) << rate << " Hz";
+            EXPECT_LT(trimmed, bound[quality]) << rate << " Hz, trimmed";
+        }
+    }
+}
+
+TEST(Resampler, DecimationRejectsWhatWouldAlias)
+{
+    // 12 kHz at 48 kHz has no place at 16 kHz; what survives folds to 4 kHz.
+    for (RESAMPLER_QUALITY quality : Qualities)
+    {
+        ResamplerPtr        resampler = MakeResampler(48000, 16000, 1, quality);
+        std::vector<float>  input(48000);
+        TestRandom          random(6);
+        double              power = 0.0;
+
+        for (size_t i = 0; i < input.size(); i++)
+        {
+            input[i] = (float)(0.5 * sin(2.0 * M_PI * 12000.0 * (double)i / 48000));
+        }
+
+        std::vector<float> output = Stream(resampler.get(), input, 1, 0, random);
+
+        for (size_t i = 1600; i < output.size(); i++)
+        {
+            power += (double)output[i] * output[i];
+        }
+        power /= (double)(output.size() - 1600);
+
+        double db = 10.0 * log10(power / 0.125);
+
+        printf("  quality %d, 12 kHz at 48 -> 16 kHz: %6.1f dB\n", quality, db);
+        EXPECT_LT(db, (quality == ResamplerQualityLow) ? -50.0 : -70.0);
+    }
+}
+
+TEST(Resampler, UntrimmedAdjustableMatchesFixed)
+{
+    // Rates whose bank is not scaled for an adjustable converter.
+    const ULONG rates[] = { 11025, 22050, 44100 };
+    TestRandom  random(7);
+
+    for (ULONG rate : rates)
+    {
+        for (RESAMPLER_QUALITY quality : Qualities)
+        {
+            std::vector<float>  input = Noise(rate / 10, random);
+            ResamplerPtr        fixed = MakeResampler(rate, 48000, 1, quality);
+            ResamplerPtr        adjustable = MakeResampler(rate, 48000, 1, quality, RESAMPLER_FLAG_ADJUSTABLE);
+            std::vector<float>  expected = Stream(fixed.get(), input, 1, 0, random);
+            std::vector<float>  actual = Stream(adjustable.get(), input, 1, 0, random);
+
+            // Interpolating reaches one input frame further, so the
+            // adjustable converter holds back the output of the last one.
+            ASSERT_LE(expected.size() - actual.size(), 48000u / std::gcd(rate, 48000u));
+            ASSERT_EQ(0, memcmp(expected.data(), actual.data(), actual.size() * sizeof(float)))
+                << rate << " Hz, quality " << quality;
+        }
+    }
+}
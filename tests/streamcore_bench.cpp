@@ -0,0 +1,193 @@
+/*++
+
+Module Name:
+
+    streamcore_bench.cpp
+
+Abstract:
+
+    Cost of the stream's timing work (streamcore.h, pktstamp.h): what
+    UpdatePosition, ArmNotificationTimer, the notification DPC and
+    GetReadPacket each do to the core, and a whole DPC of FakePortStream
+    per 10 ms packet of 48 kHz stereo int32 on a 10 MHz QPC, with its CPU
+    time in parts per million of the packet as packet_budget_ppm.
+--*/
+
+#include <benchmark/benchmark.h>
+
+#include "fakeportstream.h"
+#include "testutil.h"
+
+namespace
+{
+
+const ULONGLONG kFrequency = 10000000;
+const ULONG     kBlockAlign = 8;
+const ULONG     kPacketBytes = 480 * kBlockAlign;
+const LONGLONG  kPacketTicks = kFrequency / 100;
+
+void StartCore(PSTREAM_CORE Core)
+{
+    StreamCore_Init(Core, kFrequency, 48000, kBlockAlign);
+    StreamCore_SetBuffer(Core, 2 * kPacketBytes, kPacketBytes);
+    StreamCore_Run(Core, kFrequency * 86400);
+}
+
+//
+// UpdatePosition, called from the DPC and every position query.
+//
+void BM_UpdatePosition(benchmark::State & State)
+{
+    STREAM_CORE core;
+    LONGLONG    qpc;
+
+    StartCore(&core);
+    qpc = core.Clock.Epoch;
+
+    for (auto _ : State)
+    {
+        qpc += 3331;
+        StreamCore_Move(&core, StreamCore_BytesDue(&core, qpc));
+    }
+
+    benchmark::DoNotOptimize(core.LinearPosition);
+}
+
+//
+// ArmNotificationTimer's due time.
+//
+void BM_TicksToNextPacket(benchmark::State & State)
+{
+    STREAM_CORE core;
+    LONGLONG    qpc;
+
+    StartCore(&core);
+    qpc = core.Clock.Epoch + 12345;
+    StreamCore_Move(&core, StreamCore_BytesDue(&core, qpc));
+
+    for (auto _ : State)
+    {
+        benchmark::DoNotOptimize(qpc);
+        benchmark::DoNotOptimize(StreamCore_TicksToNextPacket(&core, qpc));
+    }
+}
+
+//
+// The DPC's share: position, boundary, stamp and the next due time.
+//
+void BM_CompletePacket(benchmark::State & State)
+{
+    STREAM_CORE core;
+    LONGLONG    qpc;
+
+    StartCore(&core);
+    qpc = core.Clock.Epoch;
+
+    for (auto _ : State)
+    {
+        qpc += kPacketTicks;
+        StreamCore_Move(&core, StreamCore_BytesDue(&core, qpc));
+        if (StreamCore_CrossBoundaries(&core))
+        {
+            StreamCore_CompletePacket(&core);
+        }
+        benchmark::DoNotOptimize(StreamCore_TicksToNextPacket(&core, qpc));
+    }
+}
+
+//
+// GetReadPacket's lookup of the last completed packet.
+//
+void BM_GetCompletedPacket(benchmark::State & State)
+{
+    STREAM_CORE core;
+    LONGLONG    packet;
+    LONGLONG    qpc;
+
+    StartCore(&core);
+    StreamCore_Move(&core, StreamCore_BytesDue(&core, core.Clock.Epoch + 5 * kPacketTicks));
+    StreamCore_CrossBoundaries(&core);
+    StreamCore_CompletePacket(&core);
+
+    for (auto _ : State)
+    {
+        benchmark::DoNotOptimize(StreamCore_GetCompletedPacket(&core, &packet, &qpc));
+        benchmark::DoNotOptimize(qpc);
+    }
+}
+
+//
+// The frames to QPC conversion a stamp takes, hours into the stream.
+//
+void BM_PktStamp_QpcOfPosition(benchmark::State & State)
+{
+    STREAM_CORE core;
+    ULONGLONG   position;
+
+    StartCore(&core);
+    StreamCore_Move(&core, StreamCore_BytesDue(&core, core.Clock.Epoch + kFrequency * 3600 * 5 + 777));
+    position = core.LinearPosition - 1000 * kBlockAlign;
+
+    for (auto _ : State)
+    {
+        benchmark::DoNotOptimize(position);
+        benchmark::DoNotOptimize(PktStamp_QpcOfPosition(&core.Clock, core.LinearPosition, position));
+    }
+}
+
+void BM_PktStamp_RecordLookup(benchmark::State & State)
+{
+    PKT_STAMP_RING  ring;
+    LONGLONG        packet = 0;
+    LONGLONG        qpc;
+
+    PktStamp_Reset(&ring);
+
+    for (auto _ : State)
+    {
+        PktStamp_Record(&ring, packet, packet * kPacketTicks);
+        benchmark::DoNotOptimize(PktStamp_Lookup(&ring, packet, &qpc));
+        packet++;
+    }
+}
+
+//
+// One TimerNotifyRT per packet, on time, and the engine's GetReadPacket.
+//
+void BM_FakePortDpc(benchmark::State & State)
+{
+    FakeClock       clock(kFrequency, kFrequency * 86400);
+    FakePortStream  stream(clock, 48000, kBlockAlign, FALSE);
+    ULONG           actual;
+    ULONG           packet;
+    ULONG           flags;
+    ULONG64         stamp;
+    BOOLEAN         moreData;
+    double          start;
+
+    stream.AllocateBufferWithNotification(2, 2 * kPacketBytes, &actual);
+    stream.SetState(KSSTATE_ACQUIRE);
+    stream.SetState(KSSTATE_PAUSE);
+    stream.SetState(KSSTATE_RUN);
+    start = TestThreadSeconds();
+
+    for (auto _ : State)
+    {
+        clock.AdvanceTo(stream.Timer().DueQpc());
+        stream.TimerNotify();
+        benchmark::DoNotOptimize(stream.GetReadPacket(&packet, &flags, &stamp, &moreData));
+    }
+
+    // Share of the 10 ms a packet lasts.
+    State.counters["packet_budget_ppm"] = (TestThreadSeconds() - start) / (double)State.iterations() / 0.010 * 1e6;
+}
+
+} // namespace
+
+BENCHMARK(BM_UpdatePosition)->Name("StreamCore/UpdatePosition");
+BENCHMARK(BM_TicksToNextPacket)->Name("StreamCore/TicksToNextPacket");
+BENCHMARK(BM_CompletePacket)->Name("StreamCore/CompletePacket");
+BENCHMARK(BM_GetCompletedPacket)->Name("StreamCore/GetCompletedPacket");
+BENCHMARK(BM_PktStamp_QpcOfPosition)->Name("PktStamp/QpcOfPosition");
+BENCHMARK(BM_PktStamp_RecordLookup)->Name("PktStamp/RecordLookup");
+BENCHMARK(BM_FakePortDpc)->Name("FakePort/Dpc");
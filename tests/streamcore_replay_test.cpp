@@ -0,0 +1,584 @@
+/*++
+
+Module Name:
+
+    streamcore_replay_test.cpp
+
+Abstract:
+
+    Replays hours of a capture stream through FakePortStream: the stream
+    is opened, allocates its buffer, runs, pauses, runs again and is
+    stopped and restarted, while the audio engine reads packets and
+    positions at random moments and the notification DPC runs a random
+    dispatch latency after the timer is due, now and then by more than a
+    packet. Throughout, the position must be exactly the frames due while
+    running (in 128 bits), every packet the engine reads must carry the
+    first QPC tick of its boundary and follow the last one, and the timer
+    must wake the stream about once per packet, or once per millisecond in
+    low latency mode.
+
+    A render stream is replayed too, with the OS writing a packet per
+    wakeup: a wakeup it falls behind for must report an underrun, and after
+    EoS the position must stop at the EoS offset, whether it gets there
+    directly or only by wrapping around the buffer, with the events
+    signalled once more and the timer left disarmed.
+
+    MICY_REPLAY_HOURS sets the simulated time of the main run, default 24;
+    the other runs replay a quarter of it.
+--*/
+
+#include <gtest/gtest.h>
+
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+#include "fakeportstream.h"
+#include "testutil.h"
+
+namespace
+{
+
+const LONGLONG kNever = INT64_MAX;
+
+struct ReplayConfig
+{
+    ULONGLONG   Frequency;
+    ULONG       SamplesPerSec;
+    ULONG       BlockAlign;
+    ULONG       PacketMs;
+    BOOLEAN     LowLatency;
+};
+
+struct ReplayResult
+{
+    ULONGLONG   Dpcs;
+    ULONGLONG   Packets;            // completed
+    ULONGLONG   Read;               // returned by GetReadPacket
+    ULONGLONG   Dropped;            // completed but never read, engine late
+    ULONGLONG   Runs;
+    ULONGLONG   Stops;
+    ULONGLONG   PositionErrors;
+    ULONGLONG   StampErrors;
+    ULONGLONG   OrderErrors;
+    double      WakeupsPerPacket;
+    double      NsPerDpc;           // replay speed
+};
+
+//
+// Where a RUN started: its QPC and the linear position then.
+//
+struct RunSegment
+{
+    LONGLONG    Qpc;
+    ULONGLONG   Position;
+};
+
+class Replay
+{
+public:
+    Replay(const ReplayConfig & Config, uint64_t Seed)
+        : m_Config(Config),
+          m_Clock(Config.Frequency, (LONGLONG)(Config.Frequency * 86400ull * 100)),
+          m_Stream(m_Clock, Config.SamplesPerSec, Config.BlockAlign, Config.LowLatency),
+          m_Random(Seed),
+          m_Result()
+    {
+    }
+
+    ReplayResult Run(double Hours)
+    {
+        const LONGLONG  end = m_Clock.Now() + m_Clock.TicksOfSeconds(Hours * 3600.0);
+        const LONGLONG  packetTicks = m_Clock.TicksOfSeconds(m_Config.PacketMs / 1000.0);
+        LONGLONG        nextDpc = 0;
+        LONGLONG        nextRead = kNever;
+        LONGLONG        nextPoll = m_Clock.Now();
+        LONGLONG        nextStateChange;
+        ULONG           actual;
+
+        auto start = std::chrono::steady_clock::now();
+
+        EXPECT_EQ(STATUS_SUCCESS, m_Stream.AllocateBufferWithNotification(
+                      2, 2 * m_Config.SamplesPerSec / 1000 * m_Config.PacketMs * m_Config.BlockAlign, &actual));
+        Start();
+        nextStateChange = m_Clock.Now() + m_Clock.TicksOfSeconds(600.0 * m_Random.Unit());
+
+        while (m_Clock.Now() < end)
+        {
+            // The next thing to happen: the DPC, the engine reading the
+            // packet it was signalled for, a position poll or a state change.
+            if (m_Stream.Timer().Armed() && nextDpc == 0)
+            {
+                nextDpc = m_Stream.Timer().DueQpc() + Latency(packetTicks);
+            }
+
+            LONGLONG next = std::min({ nextDpc ? nextDpc : kNever, nextRead, nextPoll, nextStateChange });
+
+            m_Clock.AdvanceTo(next);
+
+            if (next == nextDpc)
+            {
+                nextDpc = 0;
+                m_Result.Dpcs++;
+                if (m_Stream.TimerNotify())
+                {
+                    NoteCompletion();
+                    if (nextRead == kNever)
+                    {
+                        nextRead = m_Clock.Now() + Latency(packetTicks);
+                    }
+                }
+            }
+            else if (next == nextRead)
+            {
+                nextRead = kNever;
+                ReadPacket();
+            }
+            else if (next == nextPoll)
+            {
+                nextPoll = m_Clock.Now() + (LONGLONG)(m_Random.Unit() * 3 * packetTicks);
+                CheckPosition();
+            }
+            else
+            {
+                ChangeState();
+                nextDpc = 0;
+                nextRead = kNever;
+                nextStateChange = m_Clock.Now() + m_Clock.TicksOfSeconds(600.0 * m_Random.Unit());
+            }
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        m_Result.WakeupsPerPacket = (double)m_Stream.Wakeups / (double)std::max<ULONGLONG>(m_Result.Packets, 1);
+        m_Result.NsPerDpc = seconds * 1e9 / (double)std::max<ULONGLONG>(m_Result.Dpcs, 1);
+
+        printf("  %10llu Hz, %6u Hz, %2u ms packets%s, %.1f h: %llu DPCs, %.2f per packet, %llu packets read, "
+               "%llu dropped, %llu runs, %llu stops, %llu/%llu/%llu position/stamp/order errors, %.0f ns per DPC replayed\n",
+               (unsigned long long)m_Config.Frequency, m_Config.SamplesPerSec, m_Config.PacketMs,
+               m_Config.LowLatency ? " low latency" : "", Hours,
+               (unsigned long long)m_Result.Dpcs, m_Result.WakeupsPerPacket,
+               (unsigned long long)m_Result.Read, (unsigned long long)m_Result.Dropped,
+               (unsigned long long)m_Result.Runs, (unsigned long long)m_Result.Stops,
+               (unsigned long long)m_Result.PositionErrors, (unsigned long long)m_Result.StampErrors,
+               (unsigned long long)m_Result.OrderErrors, m_Result.NsPerDpc);
+
+        return m_Result;
+    }
+
+private:
+    //
+    // Dispatch latency: mostly tens of microseconds, rarely over a packet.
+    //
+    LONGLONG Latency(LONGLONG PacketTicks)
+    {
+        LONGLONG ticks = (LONGLONG)(m_Random.Unit() * m_Clock.Frequency() / 10000);
+
+        if (m_Random.Range(0, 999) == 0)
+        {
+            ticks += (LONGLONG)(m_Random.Unit() * 3 * PacketTicks);
+        }
+        return ticks;
+    }
+
+    void Start()
+    {
+        m_Stream.SetState(KSSTATE_ACQUIRE);
+        m_Stream.SetState(KSSTATE_PAUSE);
+        Resume();
+        m_LastRead = -1;
+        m_LastStamp = 0;
+        m_Segments.clear();
+        m_Boundaries.clear();
+        m_Frames = 0;
+        m_Segments.push_back({ m_Clock.Now(), 0 });
+    }
+
+    void Resume()
+    {
+        m_Stream.SetState(KSSTATE_RUN);
+        m_Result.Runs++;
+    }
+
+    void ChangeState()
+    {
+        // PAUSE, then either RUN again a little later or STOP and start over.
+        m_Frames = CheckPosition();
+        m_Stream.SetState(KSSTATE_PAUSE);
+        CheckPosition();
+        m_Clock.Advance(m_Clock.TicksOfSeconds(m_Random.Unit() * 5.0));
+
+        if (m_Random.Range(0, 3) == 0)
+        {
+            m_Stream.SetState(KSSTATE_ACQUIRE);
+            m_Stream.SetState(KSSTATE_STOP);
+            m_Result.Stops++;
+            Start();
+        }
+        else
+        {
+            Resume();
+            m_Segments.push_back({ m_Clock.Now(), m_Stream.Core().LinearPosition });
+        }
+    }
+
+    //
+    // The position is exactly the frames due since each RUN. Returns the
+    // frames expected.
+    //
+    ULONGLONG CheckPosition()
+    {
+        ULONGLONG   linear;
+        ULONGLONG   presentation;
+        LONGLONG    qpc;
+        ULONGLONG   expected = m_Frames;
+
+        m_Stream.GetPositions(&linear, &presentation, &qpc);
+
+        if (m_Stream.State() == KSSTATE_RUN)
+        {
+            const RunSegment & run = m_Segments.back();
+
+            expected = run.Position / m_Config.BlockAlign +
+                       (ULONGLONG)((unsigned __int128)(qpc - run.Qpc) * m_Config.SamplesPerSec / m_Config.Frequency);
+        }
+
+        if (linear != expected * m_Config.BlockAlign || presentation != linear)
+        {
+            m_Result.PositionErrors++;
+        }
+
+        return expected;
+    }
+
+    //
+    // Remembers which boundary the packet just completed ended at, and in
+    // which RUN, to check its stamp when the engine reads it.
+    //
+    void NoteCompletion()
+    {
+        const STREAM_CORE & core = m_Stream.Core();
+
+        m_Result.Packets++;
+        m_Boundaries[core.PacketCounter - 1] = { core.NextPacketPosition - core.PacketBytes, m_Segments.size() - 1 };
+        if (m_Boundaries.size() > 2 * PKT_STAMP_RING_SIZE)
+        {
+            m_Boundaries.erase(m_Boundaries.begin());
+        }
+
+        // No boundary the position reached is left uncrossed.
+        if (core.NextPacketPosition <= core.LinearPosition)
+        {
+            m_Result.OrderErrors++;
+        }
+    }
+
+    void ReadPacket()
+    {
+        ULONG       packet;
+        ULONG       flags;
+        ULONG64     stamp;
+        BOOLEAN     moreData;
+        NTSTATUS    status = m_Stream.GetReadPacket(&packet, &flags, &stamp, &moreData);
+
+        if (status != STATUS_SUCCESS)
+        {
+            return;
+        }
+
+        m_Result.Read++;
+        m_Result.Dropped += (ULONGLONG)((LONGLONG)packet - m_LastRead - 1);
+
+        if ((LONGLONG)packet <= m_LastRead || (LONGLONG)stamp <= m_LastStamp || (LONGLONG)stamp > m_Clock.Now())
+        {
+            m_Result.OrderErrors++;
+        }
+
+        auto boundary = m_Boundaries.find(packet);
+
+        if (boundary == m_Boundaries.end() || (LONGLONG)stamp != ExactQpc(boundary->second.first, boundary->second.second))
+        {
+            m_Result.StampErrors++;
+        }
+
+        m_LastRead = packet;
+        m_LastStamp = (LONGLONG)stamp;
+    }
+
+    //
+    // First QPC tick at which Position was due in RUN segment Segment. A
+    // boundary reached before it is counted back from its start, as the
+    // clock does.
+    //
+    LONGLONG ExactQpc(ULONGLONG Position, size_t Segment) const
+    {
+        const RunSegment &  run = m_Segments[Segment];
+        bool                before = Position < run.Position;
+        unsigned __int128   frames = (before ? run.Position - Position : Position - run.Position) / m_Config.BlockAlign;
+        LONGLONG            ticks = (LONGLONG)((frames * m_Config.Frequency + m_Config.SamplesPerSec - 1) / m_Config.SamplesPerSec);
+
+        return before ? run.Qpc - ticks : run.Qpc + ticks;
+    }
+
+    ReplayConfig                m_Config;
+    FakeClock                   m_Clock;
+    FakePortStream              m_Stream;
+    TestRandom                  m_Random;
+    ReplayResult                m_Result;
+    std::vector<RunSegment>     m_Segments;
+    std::map<LONGLONG, std::pair<ULONGLONG, size_t>> m_Boundaries;
+    ULONGLONG                   m_Frames = 0;       // frames at the last PAUSE
+    LONGLONG                    m_LastRead = -1;
+    LONGLONG                    m_LastStamp = 0;
+};
+
+void ExpectClean(const ReplayResult & Result)
+{
+    EXPECT_GT(Result.Read, 0u);
+    EXPECT_GT(Result.Stops, 0u);
+    EXPECT_EQ(0u, Result.PositionErrors);
+    EXPECT_EQ(0u, Result.StampErrors);
+    EXPECT_EQ(0u, Result.OrderErrors);
+
+    // The engine only misses a packet when it or the DPC runs late.
+    EXPECT_LT((double)Result.Dropped, (double)Result.Read * 0.01);
+}
+
+double ReplayHours()
+{
+    return (double)TestEnvU64("MICY_REPLAY_HOURS", 24);
+}
+
+} // namespace
+
+TEST(StreamCoreReplay, EventDrivenCapture)
+{
+    ReplayResult result = Replay({ 10000000, 48000, 8, 10, FALSE }, 1).Run(ReplayHours());
+
+    ExpectClean(result);
+    EXPECT_LT(result.WakeupsPerPacket, 1.01);
+}
+
+TEST(StreamCoreReplay, RatesAndClocksThatDoNotDivide)
+{
+    ExpectClean(Replay({ 3579545, 44100, 4, 10, FALSE }, 2).Run(ReplayHours() / 4));
+    ExpectClean(Replay({ 24000000, 96000, 12, 3, FALSE }, 3).Run(ReplayHours() / 4));
+    ExpectClean(Replay({ 2400000000, 16000, 2, 20, FALSE }, 4).Run(ReplayHours() / 4));
+}
+
+TEST(StreamCoreReplay, LowLatencyWakesEveryMillisecond)
+{
+    ReplayResult result = Replay({ 10000000, 48000, 8, 10, TRUE }, 5).Run(ReplayHours() / 4);
+
+    ExpectClean(result);
+    EXPECT_GT(result.WakeupsPerPacket, 9.0);
+    EXPECT_LT(result.WakeupsPerPacket, 10.5);
+}
+
+TEST(StreamCoreReplay, NotEventDrivenUntilTheBufferIsAllocated)
+{
+    FakeClock       clock(10000000, 1);
+    FakePortStream  stream(clock, 48000, 4, FALSE);
+    ULONG           packet;
+    ULONG           flags;
+    ULONG64         stamp;
+    BOOLEAN         moreData;
+    ULONG           actual;
+
+    EXPECT_EQ(STATUS_NOT_SUPPORTED, stream.GetReadPacket(&packet, &flags, &stamp, &moreData));
+    EXPECT_EQ(STATUS_INVALID_PARAMETER, stream.AllocateBufferWithNotification(3, 3841, &actual));
+    EXPECT_EQ(STATUS_UNSUCCESSFUL, stream.AllocateBufferWithNotification(2, 0, &actual));
+    ASSERT_EQ(STATUS_SUCCESS, stream.AllocateBufferWithNotification(2, 3840, &actual));
+    EXPECT_EQ(3840u, actual);
+    EXPECT_EQ(STATUS_INVALID_DEVICE_STATE, stream.GetReadPacket(&packet, &flags, &stamp, &moreData));
+
+    // Before the first packet completes there is nothing to read.
+    stream.SetState(KSSTATE_ACQUIRE);
+    stream.SetState(KSSTATE_PAUSE);
+    stream.SetState(KSSTATE_RUN);
+    EXPECT_EQ(STATUS_DEVICE_NOT_READY, stream.GetReadPacket(&packet, &flags, &stamp, &moreData));
+    ASSERT_TRUE(stream.Timer().Armed());
+    EXPECT_EQ(1 + 100000, stream.Timer().DueQpc());
+
+    // The DPC on time completes packet 0, stamped with its boundary.
+    clock.AdvanceTo(stream.Timer().DueQpc());
+    EXPECT_TRUE(stream.TimerNotify());
+    ASSERT_EQ(STATUS_SUCCESS, stream.GetReadPacket(&packet, &flags, &stamp, &moreData));
+    EXPECT_EQ(0u, packet);
+    EXPECT_EQ(1u + 100000, stamp);
+    EXPECT_EQ(STATUS_DEVICE_NOT_READY, stream.GetReadPacket(&packet, &flags, &stamp, &moreData));
+    EXPECT_EQ(1u, stream.GetPacketCount());
+
+    // Pausing cancels the timer and stopping starts the count over.
+    stream.SetState(KSSTATE_PAUSE);
+    EXPECT_FALSE(stream.Timer().Armed());
+    stream.SetState(KSSTATE_ACQUIRE);
+    stream.SetState(KSSTATE_STOP);
+    EXPECT_EQ(0u, stream.Core().LinearPosition);
+    EXPECT_EQ(0u, stream.GetPacketCount());
+}
+
+namespace
+{
+
+const ULONG kRenderPacketBytes = 1920;      // 10 ms at 48 kHz, 4 byte frames
+
+//
+// A running render stream of two 10 ms packets with the OS one packet
+// ahead, as after KSSTATE_RUN.
+//
+void StartRender(FakePortStream & Stream)
+{
+    ULONG actual;
+
+    ASSERT_EQ(STATUS_SUCCESS, Stream.AllocateBufferWithNotification(2, 2 * kRenderPacketBytes, &actual));
+    Stream.SetState(KSSTATE_ACQUIRE);
+    ASSERT_EQ(STATUS_SUCCESS, Stream.SetWritePacket(0, FALSE, 0));
+    Stream.SetState(KSSTATE_PAUSE);
+    Stream.SetState(KSSTATE_RUN);
+    ASSERT_TRUE(Stream.Timer().Armed());
+}
+
+//
+// Runs the DPC Late ticks after the timer is due.
+//
+BOOLEAN FireTimer(FakeClock & Clock, FakePortStream & Stream, LONGLONG Late)
+{
+    EXPECT_TRUE(Stream.Timer().Armed());
+    Clock.AdvanceTo(Stream.Timer().DueQpc() + Late);
+    return Stream.TimerNotify();
+}
+
+//
+// The OS writes packets until it has written Packet, on time, and ends the
+// stream EosBytes into it; the DPC for the packet before it runs Late
+// ticks late.
+//
+void RenderToEndOfStream(ULONG Packet, ULONG EosBytes, LONGLONG Late)
+{
+    FakeClock       clock(10000000, 1);
+    FakePortStream  stream(clock, 48000, 4, FALSE, FALSE);
+    ULONGLONG       signals;
+    ULONGLONG       lateBytes = (ULONGLONG)Late * 48000 * 4 / 10000000;
+
+    StartRender(stream);
+
+    for (ULONG written = 1; written < Packet; written++)
+    {
+        ASSERT_EQ(STATUS_SUCCESS, stream.SetWritePacket(written, FALSE, 0));
+        ASSERT_TRUE(FireTimer(clock, stream, 0));
+    }
+
+    ASSERT_EQ(STATUS_SUCCESS, stream.SetWritePacket(Packet, TRUE, EosBytes));
+    EXPECT_EQ(STATUS_INVALID_DEVICE_STATE, stream.SetWritePacket(Packet + 1, FALSE, 0));
+
+    // Packets no longer complete after EoS, not even the one playing when
+    // it arrived. The DPC signals the boundary of the last packet, then
+    // wakes every 1 ms until the position reaches the EoS offset, signals
+    // once more, unless it already got there late, and is not re-armed.
+    signals = stream.Signals;
+    EXPECT_TRUE(FireTimer(clock, stream, Late));
+    while (stream.Timer().Armed())
+    {
+        ASSERT_LE(stream.Timer().DueQpc() - clock.Now(), 10000);
+        if (FireTimer(clock, stream, 0))
+        {
+            break;
+        }
+    }
+
+    EXPECT_FALSE(stream.Timer().Armed());
+    EXPECT_EQ(1, stream.Core().LastBufferRendered);
+    EXPECT_EQ(signals + ((lateBytes >= EosBytes) ? 1 : 2), stream.Signals);
+    EXPECT_EQ((ULONGLONG)Packet * kRenderPacketBytes + EosBytes, stream.Core().LinearPosition);
+    EXPECT_EQ((LONGLONG)Packet - 1, stream.Core().PacketCounter);
+    EXPECT_EQ(0u, stream.Underruns);
+
+    // The presentation position carries on with the clock; the linear
+    // position stays where the stream ended.
+    ULONGLONG linear;
+    ULONGLONG presentation;
+
+    clock.Advance(clock.TicksOfSeconds(0.1));
+    stream.GetPositions(&linear, &presentation, NULL);
+    EXPECT_EQ((ULONGLONG)Packet * kRenderPacketBytes + EosBytes, linear);
+    EXPECT_GE(presentation, linear + 0.1 * 48000 * 4);
+
+    // Pausing does not complete a packet after EoS, and STOP starts over.
+    stream.SetState(KSSTATE_PAUSE);
+    EXPECT_EQ((LONGLONG)Packet - 1, stream.Core().PacketCounter);
+    stream.SetState(KSSTATE_ACQUIRE);
+    stream.SetState(KSSTATE_STOP);
+    EXPECT_EQ(0, stream.Core().EndOfStream);
+    EXPECT_EQ(0, stream.Core().LastBufferRendered);
+    EXPECT_EQ(STATUS_SUCCESS, stream.SetWritePacket(0, FALSE, 0));
+}
+
+} // namespace
+
+TEST(StreamCoreReplay, RenderUnderrunsWhenTheOsFallsBehind)
+{
+    FakeClock       clock(10000000, 1);
+    FakePortStream  stream(clock, 48000, 4, FALSE, FALSE);
+    ULONG           written = 0;
+    ULONGLONG       repeated;
+
+    StartRender(stream);
+
+    // The first write of offset 0 repeats the offset a stopped stream
+    // starts from.
+    repeated = stream.RepeatedWrites;
+
+    // Writing ahead or behind the packet after the one playing fails.
+    EXPECT_EQ(STATUS_DATA_OVERRUN, stream.SetWritePacket(2, FALSE, 0));
+    EXPECT_EQ(STATUS_DATA_LATE_ERROR, stream.SetWritePacket(0, FALSE, 0));
+
+    // An OS that writes a packet per wakeup never underruns.
+    for (int i = 0; i < 10000; i++)
+    {
+        ASSERT_EQ(STATUS_SUCCESS, stream.SetWritePacket(++written, FALSE, 0));
+        ASSERT_TRUE(FireTimer(clock, stream, 0));
+    }
+    EXPECT_EQ(0u, stream.Underruns);
+    EXPECT_EQ(10000u, stream.Signals);
+    EXPECT_EQ(repeated, stream.RepeatedWrites);
+
+    // Every wakeup it misses is an underrun, and the stream keeps going.
+    for (int i = 0; i < 4; i++)
+    {
+        ASSERT_TRUE(FireTimer(clock, stream, 0));
+    }
+    EXPECT_EQ(4u, stream.Underruns);
+    EXPECT_EQ(10004u, stream.Signals);
+
+    // Back on time, but the same packet written twice in a row is
+    // reported, and still counts as written.
+    written = (ULONG)stream.Core().PacketCounter;
+    ASSERT_EQ(STATUS_SUCCESS, stream.SetWritePacket(++written, FALSE, 0));
+    ASSERT_EQ(STATUS_SUCCESS, stream.SetWritePacket(written, FALSE, 0));
+    EXPECT_EQ(repeated + 1, stream.RepeatedWrites);
+    ASSERT_TRUE(FireTimer(clock, stream, 0));
+    EXPECT_EQ(4u, stream.Underruns);
+
+    // A DPC held off for several packets is one completion, and one
+    // underrun at most.
+    ASSERT_EQ(STATUS_SUCCESS, stream.SetWritePacket(++written, FALSE, 0));
+    ASSERT_TRUE(FireTimer(clock, stream, clock.TicksOfSeconds(0.035)));
+    EXPECT_EQ(4u, stream.Underruns);
+    ASSERT_TRUE(FireTimer(clock, stream, 0));
+    EXPECT_EQ(5u, stream.Underruns);
+}
+
+TEST(StreamCoreReplay, RenderStopsAtTheEndOfStream)
+{
+    // The EoS offset still ahead in the buffer.
+    RenderToEndOfStream(7, 1000, 0);
+    RenderToEndOfStream(7, 1000, 80000);
+
+    // Only reached by wrapping around, directly or by a DPC held off past
+    // it.
+    RenderToEndOfStream(8, 1000, 0);
+    RenderToEndOfStream(8, 1000, 80000);
+    RenderToEndOfStream(8, 1916, 80000);
+}
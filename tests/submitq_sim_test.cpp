@@ -0,0 +1,479 @@
+/*++
+
+Module Name:
+
+    submitq_sim_test.cpp
+
+Abstract:
+
+    Simulation of WAIT submissions (MICYAUDIO_CHUNK_FLAG_WAIT) against a
+    simulated capture DPC clock.
+
+    SubmitQueue below is the glue of userpcm.cpp around the queueing rules
+    (submitq.h) and the real ring (pcmring.h), with a deque in place of the
+    cancel-safe queue and an event scheduled on the simulated clock in place
+    of the work item: Advance is UserPcmSubmit_Advance, WakeWaiters is
+    UserPcmRing_WakeWaiters and Worker is UserPcmRing_WaitWorker.
+
+    A feeder keeps a couple of overlapped requests outstanding and submits
+    the next one whenever one completes, which is how a feeder paces itself
+    against the capture clock without sleeping. The DPC drains one packet
+    every 10 ms and checks that every frame arrives whole and in order.
+--*/
+
+#include <gtest/gtest.h>
+
+#include <stdio.h>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "submitq.h"
+#include "testutil.h"
+
+namespace
+{
+
+const ULONG BlockAlign       = 8;                       // 48 kHz stereo int32
+const ULONG BytesPerMs       = 48 * BlockAlign;
+const ULONG PacketMs         = 10;
+const ULONG ChunkFlagWait    = 0x1;                     // MICYAUDIO_CHUNK_FLAG_WAIT
+
+//
+// Byte Index of frame Frame of the feeder's stream; the consumer checks
+// every frame against it, so a torn or reordered frame cannot pass.
+//
+UCHAR FrameByte(uint64_t Frame, ULONG Index)
+{
+    return (UCHAR)(Frame * 7 + Index * 31 + (Frame >> 8) + (Frame >> 16));
+}
+
+struct Chunk
+{
+    std::vector<UCHAR>  Data;
+    ULONG               Flags;
+    ULONG               Consumed;
+};
+
+struct Request
+{
+    std::vector<Chunk>  Chunks;
+    size_t              Next;
+    uint64_t            Length;
+    uint64_t            Accepted;
+    uint64_t            Dropped;
+    int64_t             SubmitUs;
+};
+
+//
+// Discrete event clock in microseconds.
+//
+class EventClock
+{
+public:
+    int64_t Now() const { return m_Now; }
+
+    void At(int64_t TimeUs, std::function<void()> Action)
+    {
+        m_Events.emplace(std::make_pair(TimeUs, m_Sequence++), std::move(Action));
+    }
+
+    bool RunNext(int64_t UntilUs)
+    {
+        if (m_Events.empty() || m_Events.begin()->first.first > UntilUs)
+        {
+            return false;
+        }
+
+        auto event = m_Events.begin();
+        std::function<void()> action = std::move(event->second);
+
+        m_Now = event->first.first;
+        m_Events.erase(event);
+        action();
+        return true;
+    }
+
+private:
+    int64_t m_Now = 0;
+    uint64_t m_Sequence = 0;
+    std::map<std::pair<int64_t, uint64_t>, std::function<void()>> m_Events;
+};
+
+class SubmitQueue
+{
+public:
+    SubmitQueue(EventClock & Clock, ULONG CapacityBytes, int64_t WorkerLatencyUs)
+        : m_Clock(Clock), m_Data(CapacityBytes), m_WorkerLatencyUs(WorkerLatencyUs)
+    {
+        PcmRing_Attach(&m_Ring, &m_Control, m_Data.data(), CapacityBytes);
+    }
+
+    std::function<void(Request *)> OnComplete;
+
+    PPCM_RING Ring() { return &m_Ring; }
+    uint64_t WorkerRuns() const { return m_WorkerRuns; }
+    size_t Waiters() const { return m_Queue.size(); }
+
+    void Dispatch(Request * Irp)
+    {
+        Irp->Next = 0;
+        Irp->Accepted = 0;
+        Irp->Dropped = 0;
+        Irp->SubmitUs = m_Clock.Now();
+
+        if (!Advance(Irp, false))
+        {
+            OnComplete(Irp);
+        }
+    }
+
+    // Consumer side, after every read.
+    void WakeWaiters()
+    {
+        if (!SubmitQ_HeadFits(&m_Ring, m_WakeBytes))
+        {
+            return;
+        }
+
+        if (m_WorkQueued)
+        {
+            return;
+        }
+
+        m_WorkQueued = true;
+        m_Clock.At(m_Clock.Now() + m_WorkerLatencyUs, [this] { Worker(); });
+    }
+
+private:
+    ULONG WriteLocked(const UCHAR * Source, ULONG Length)
+    {
+        return PcmRing_Write(&m_Ring, Source, SubmitQ_WritableBytes(&m_Ring, Length, BlockAlign));
+    }
+
+    // Returns true if Irp is pended.
+    bool Advance(Request * Irp, bool Resumed)
+    {
+        while (Irp->Next < Irp->Chunks.size())
+        {
+            Chunk & chunk = Irp->Chunks[Irp->Next];
+            ULONG   length = (ULONG)chunk.Data.size() - chunk.Consumed;
+            BOOLEAN wait = (chunk.Flags & ChunkFlagWait) != 0;
+            ULONG   written;
+            ULONG   need;
+
+            if (SubmitQ_QueuesBehind(wait, Resumed, !m_Queue.empty()))
+            {
+                m_Queue.push_back(Irp);
+                WakeWaiters();
+                return true;
+            }
+
+            written = WriteLocked(chunk.Data.data() + chunk.Consumed, length);
+            Irp->Accepted += written;
+
+            need = SubmitQ_WakeBytes(length, written, wait, m_Ring.Capacity, BlockAlign);
+            if (need != 0)
+            {
+                chunk.Consumed += written;
+
+                m_Queue.push_front(Irp);
+                m_WakeBytes = need;
+                WakeWaiters();
+                return true;
+            }
+
+            Irp->Dropped += length - written;
+            Irp->Next++;
+        }
+
+        return false;
+    }
+
+    void Worker()
+    {
+        std::vector<Request *> ready;
+
+        m_WorkQueued = false;
+        m_WorkerRuns++;
+
+        for (;;)
+        {
+            if (m_Queue.empty())
+            {
+                m_WakeBytes = 0;
+                break;
+            }
+
+            Request * irp = m_Queue.front();
+            m_Queue.pop_front();
+
+            if (Advance(irp, true))
+            {
+                break;
+            }
+            ready.push_back(irp);
+        }
+
+        for (Request * irp : ready)
+        {
+            OnComplete(irp);
+        }
+    }
+
+    EventClock &            m_Clock;
+    PCM_RING                m_Ring;
+    PCM_RING_CONTROL        m_Control;
+    std::vector<UCHAR>      m_Data;
+    std::deque<Request *>   m_Queue;
+    ULONG                   m_WakeBytes = 0;
+    bool                    m_WorkQueued = false;
+    int64_t                 m_WorkerLatencyUs;
+    uint64_t                m_WorkerRuns = 0;
+};
+
+struct FeederOptions
+{
+    ULONG   Outstanding = 2;            // overlapped requests kept in flight
+    ULONG   MinChunkMs = 5;
+    ULONG   MaxChunkMs = 30;
+    ULONG   ChunksPerRequest = 1;
+    ULONG   PartialEvery = 0;           // every Nth chunk ends in a partial frame
+    ULONG   Flags = ChunkFlagWait;
+    ULONG   ResubmitPercent = 0;        // else wait this share of the audio sent
+};
+
+struct SimResult
+{
+    uint64_t    Submitted = 0;          // by completed requests
+    uint64_t    Accepted = 0;
+    uint64_t    Dropped = 0;
+    uint64_t    Requests = 0;
+    uint64_t    Packets = 0;
+    uint64_t    ShortPackets = 0;       // after the ring first filled up
+    uint64_t    BadFrames = 0;          // torn, reordered or missing
+    uint64_t    MaxPendUs = 0;
+    double      MeanPendUs = 0.0;
+    uint64_t    WorkerRuns = 0;
+    ULONG       MinFillAfterStart = ~0u;
+};
+
+//
+// Runs Seconds of simulated capture: the DPC drains a packet every 10 ms
+// with some timer jitter, the feeder refills through WAIT requests.
+//
+SimResult Simulate(ULONG CapacityMs, const FeederOptions & Options, double Seconds, uint64_t Seed)
+{
+    EventClock      clock;
+    SubmitQueue     queue(clock, PcmRing_RoundCapacity(CapacityMs * BytesPerMs), 500);
+    TestRandom      random(Seed);
+    SimResult       result;
+    uint64_t        nextFrame = 0;          // feeder
+    uint64_t        expectFrame = 0;        // consumer
+    double          pendSum = 0.0;
+    bool            started = false;
+    std::vector<std::unique_ptr<Request>> pool;
+    std::vector<UCHAR> packet(PacketMs * BytesPerMs);
+    int64_t         end = (int64_t)(Seconds * 1e6);
+
+    auto submit = [&](Request * Irp)
+    {
+        Irp->Chunks.resize(Options.ChunksPerRequest);
+        Irp->Length = 0;
+        for (Chunk & chunk : Irp->Chunks)
+        {
+            ULONG frames = random.Range(Options.MinChunkMs, Options.MaxChunkMs) * 48;
+            ULONG partial = 0;
+
+            if (Options.PartialEvery != 0 && random.Range(1, Options.PartialEvery) == 1)
+            {
+                partial = random.Range(1, BlockAlign - 1);
+            }
+
+            chunk.Data.resize(frames * BlockAlign + partial);
+            for (ULONG f = 0; f < frames; f++)
+            {
+                for (ULONG i = 0; i < BlockAlign; i++)
+                {
+                    chunk.Data[f * BlockAlign + i] = FrameByte(nextFrame + f, i);
+                }
+            }
+            for (ULONG i = 0; i < partial; i++)
+            {
+                chunk.Data[frames * BlockAlign + i] = 0xEE;
+            }
+            nextFrame += frames;
+
+            chunk.Flags = Options.Flags;
+            chunk.Consumed = 0;
+            Irp->Length += chunk.Data.size();
+        }
+
+        result.Requests++;
+        queue.Dispatch(Irp);
+    };
+
+    queue.OnComplete = [&](Request * Irp)
+    {
+        uint64_t pendUs = (uint64_t)(clock.Now() - Irp->SubmitUs);
+        int64_t  resubmitUs = clock.Now();
+
+        result.Submitted += Irp->Length;
+        result.Accepted += Irp->Accepted;
+        result.Dropped  += Irp->Dropped;
+        result.MaxPendUs = std::max(result.MaxPendUs, pendUs);
+        pendSum += (double)pendUs;
+
+        // Overlapped I/O: the completion routine sends the next buffer.
+        if (Options.ResubmitPercent != 0)
+        {
+            resubmitUs += (int64_t)(Irp->Length / BlockAlign) * 1000 / 48 * Options.ResubmitPercent / 100;
+        }
+        clock.At(resubmitUs, [&, Irp] { submit(Irp); });
+    };
+
+    std::function<void(int64_t)> dpc = [&](int64_t Boundary)
+    {
+        ULONG fill = PcmRing_Count(queue.Ring());
+        ULONG read = PcmRing_Read(queue.Ring(), packet.data(), (ULONG)packet.size());
+
+        if (fill >= queue.Ring()->Capacity / 2)
+        {
+            started = true;
+        }
+        if (started)
+        {
+            result.MinFillAfterStart = std::min(result.MinFillAfterStart, fill);
+            result.ShortPackets += (read < packet.size());
+        }
+        result.Packets++;
+
+        for (ULONG offset = 0; offset + BlockAlign <= read; offset += BlockAlign)
+        {
+            for (ULONG i = 0; i < BlockAlign; i++)
+            {
+                if (packet[offset + i] != FrameByte(expectFrame, i))
+                {
+                    result.BadFrames++;
+                    break;
+                }
+            }
+            expectFrame++;
+        }
+        if (read % BlockAlign != 0)
+        {
+            result.BadFrames++;
+        }
+
+        queue.WakeWaiters();
+
+        // The timer is armed for the next boundary; the DPC runs a little late.
+        Boundary += PacketMs * 1000;
+        clock.At(Boundary + random.Range(0, 800), [&dpc, Boundary] { dpc(Boundary); });
+    };
+
+    for (ULONG i = 0; i < Options.Outstanding; i++)
+    {
+        pool.emplace_back(new Request());
+        clock.At(0, [&, irp = pool.back().get()] { submit(irp); });
+    }
+    clock.At(PacketMs * 1000, [&] { dpc(PacketMs * 1000); });
+
+    while (clock.RunNext(end))
+    {
+    }
+
+    result.WorkerRuns = queue.WorkerRuns();
+    result.MeanPendUs = result.Requests ? pendSum / (double)result.Requests : 0.0;
+
+    printf("  %.0f s: %llu requests, %llu packets, %llu short, %llu bad frames, "
+           "%llu bytes dropped, min fill %.1f ms, pend mean %.1f ms max %.1f ms, %.1f worker runs/s\n",
+           Seconds, (unsigned long long)result.Requests, (unsigned long long)result.Packets,
+           (unsigned long long)result.ShortPackets, (unsigned long long)result.BadFrames,
+           (unsigned long long)result.Dropped,
+           (result.MinFillAfterStart == ~0u) ? 0.0 : (double)result.MinFillAfterStart / BytesPerMs,
+           result.MeanPendUs / 1000.0, (double)result.MaxPendUs / 1000.0,
+           (double)result.WorkerRuns / Seconds);
+
+    return result;
+}
+
+} // namespace
+
+TEST(SubmitQueueSim, WaitingFeederKeepsTheRingFullWithoutLoss)
+{
+    FeederOptions   options;
+    SimResult       result = Simulate(80, options, 600.0, 6);
+
+    EXPECT_EQ(0u, result.Dropped);
+    EXPECT_EQ(0u, result.BadFrames);
+    EXPECT_EQ(0u, result.ShortPackets);
+
+    // Only the latest completion plus one packet can be missing.
+    EXPECT_GE(result.MinFillAfterStart, (80 - 30 - 2 * PacketMs) * BytesPerMs);
+}
+
+TEST(SubmitQueueSim, BatchesOfSeveralWaitChunks)
+{
+    FeederOptions   options;
+
+    options.ChunksPerRequest = 3;
+    options.MinChunkMs = 2;
+    options.MaxChunkMs = 10;
+
+    SimResult result = Simulate(80, options, 300.0, 7);
+
+    EXPECT_EQ(0u, result.Dropped);
+    EXPECT_EQ(0u, result.BadFrames);
+    EXPECT_EQ(0u, result.ShortPackets);
+}
+
+TEST(SubmitQueueSim, ChunksLargerThanTheRingStillComplete)
+{
+    FeederOptions   options;
+
+    options.Outstanding = 1;
+    options.MinChunkMs = 100;
+    options.MaxChunkMs = 250;
+
+    SimResult result = Simulate(40, options, 300.0, 8);
+
+    EXPECT_EQ(0u, result.Dropped);
+    EXPECT_EQ(0u, result.BadFrames);
+    EXPECT_GT(result.Requests, 300u * 1000 / 250);
+}
+
+TEST(SubmitQueueSim, PartialFramesAreDroppedNotWaitedFor)
+{
+    FeederOptions   options;
+
+    options.PartialEvery = 3;
+
+    SimResult result = Simulate(80, options, 300.0, 9);
+
+    EXPECT_GT(result.Dropped, 0u);
+    EXPECT_LT(result.Dropped, result.Requests * BlockAlign);
+    EXPECT_EQ(result.Submitted, result.Accepted + result.Dropped);
+    EXPECT_EQ(0u, result.BadFrames);
+    EXPECT_EQ(0u, result.ShortPackets);
+}
+
+TEST(SubmitQueueSim, WithoutWaitTheOverflowIsDropped)
+{
+    FeederOptions   options;
+
+    // A feeder that sleeps instead, running 10% fast.
+    options.Flags = 0;
+    options.Outstanding = 1;
+    options.ResubmitPercent = 90;
+
+    SimResult result = Simulate(80, options, 60.0, 10);
+
+    // What does not fit is dropped, so frames go missing.
+    EXPECT_GT(result.Dropped, 0u);
+    EXPECT_GT(result.BadFrames, 0u);
+    EXPECT_EQ(result.Submitted, result.Accepted + result.Dropped);
+}
@@ -0,0 +1,136 @@
+/*++
+
+Module Name:
+
+    testutil.h
+
+Abstract:
+
+    Helpers shared by the host tests: a small deterministic random number
+    generator, the byte pattern the ring tests stream and checks on it, and
+    pinning a thread to a processor.
+--*/
+
+#ifndef _MICYAUDIO_TESTUTIL_H_
+#define _MICYAUDIO_TESTUTIL_H_
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+//
+// xorshift64*, deterministic for a given seed on every host.
+//
+class TestRandom
+{
+public:
+    explicit TestRandom(uint64_t Seed) : m_State(Seed ? Seed : 0x9E3779B97F4A7C15ull) {}
+
+    uint64_t Next()
+    {
+        m_State ^= m_State >> 12;
+        m_State ^= m_State << 25;
+        m_State ^= m_State >> 27;
+        return m_State * 0x2545F4914F6CDD1Dull;
+    }
+
+    // Uniform in [Low, High].
+    uint32_t Range(uint32_t Low, uint32_t High)
+    {
+        return Low + (uint32_t)(Next() % ((uint64_t)High - Low + 1));
+    }
+
+    // Uniform in [0, 1).
+    double Unit()
+    {
+        return (double)(Next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+private:
+    uint64_t m_State;
+};
+
+//
+// Byte at stream offset Position. Depends on high bits too, so a copy from
+// the wrong lap or the wrong offset does not match by accident.
+//
+inline uint8_t TestPatternByte(uint64_t Position)
+{
+    return (uint8_t)(Position ^ (Position >> 8) ^ (Position >> 19) ^ (Position >> 37));
+}
+
+inline void TestPatternFill(uint8_t * Buffer, uint64_t Position, uint32_t Length)
+{
+    for (uint32_t i = 0; i < Length; i++)
+    {
+        Buffer[i] = TestPatternByte(Position + i);
+    }
+}
+
+//
+// Returns the offset of the first byte that does not match, Length if all do.
+//
+inline uint32_t TestPatternCheck(const uint8_t * Buffer, uint64_t Position, uint32_t Length)
+{
+    for (uint32_t i = 0; i < Length; i++)
+    {
+        if (Buffer[i] != TestPatternByte(Position + i))
+        {
+            return i;
+        }
+    }
+    return Length;
+}
+
+inline unsigned TestProcessorCount()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (count > 0) ? (unsigned)count : 1;
+}
+
+//
+// Pins the calling thread to processor Index modulo the processor count.
+// Returns false on a single processor host, where there is nothing to pin.
+//
+inline bool TestPinThread(unsigned Index)
+{
+    unsigned    count = TestProcessorCount();
+    cpu_set_t   set;
+
+    if (count < 2)
+    {
+        return false;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(Index % count, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+//
+// Size knob for the long running tests, from the environment so a CI run
+// and a soak run share the binary.
+//
+inline uint64_t TestEnvU64(const char * Name, uint64_t Default)
+{
+    const char * value = getenv(Name);
+
+    return (value != NULL && *value != '\0') ? strtoull(value, NULL, 0) : Default;
+}
+
+//
+// CPU time the calling thread has used, in seconds.
+//
+inline double TestThreadSeconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+#endif // _MICYAUDIO_TESTUTIL_H_
@@ -0,0 +1,222 @@
+/*++
+
+Module Name:
+
+    timer_sim_test.cpp
+
+Abstract:
+
+    Simulation of the notification timer of an event driven stream.
+
+    The stream is FakePortStream, which arms its timer and runs its DPC the
+    way ArmNotificationTimer and TimerNotifyRT do, through the stream core
+    (streamcore.h). The timer fires its due time late by a random dispatch
+    latency, as a loaded system does. Each run reports the wakeups per
+    second and the boundary jitter, how long after a packet boundary became
+    due the DPC that completed it ran, next to the periodic 1 ms timer the
+    stream used to run from.
+--*/
+
+#include <gtest/gtest.h>
+
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#include "fakeportstream.h"
+#include "testutil.h"
+
+namespace
+{
+
+enum TimerMode
+{
+    TimerNextBoundary,
+    TimerLowLatency,            // MICYAUDIO_CONFIG_FLAG_LOW_LATENCY
+    TimerPeriodic1ms,           // before the one-shot timer
+};
+
+struct TimerResult
+{
+    double      WakeupsPerSecond;
+    double      WastedPerSecond;        // DPCs that completed no packet
+    double      MeanJitterUs;
+    double      P99JitterUs;
+    double      MaxJitterUs;
+    ULONGLONG   Packets;
+    ULONGLONG   Collapsed;              // boundaries folded into a later one
+};
+
+class TimerSim
+{
+public:
+    TimerSim(ULONGLONG Frequency, TimerMode Mode, uint64_t Seed)
+        : m_Clock(Frequency, 1000000),
+          m_Stream(m_Clock, 48000, 8, Mode == TimerLowLatency),
+          m_Mode(Mode),
+          m_Random(Seed)
+    {
+        ULONG actual;
+
+        EXPECT_EQ(STATUS_SUCCESS, m_Stream.AllocateBufferWithNotification(2, 2 * 480 * 8, &actual));
+    }
+
+    TimerResult Run(double Seconds)
+    {
+        LONGLONG                end = m_Clock.Now() + m_Clock.TicksOfSeconds(Seconds);
+        LONGLONG                fire;
+        ULONGLONG               wakeups = 0;
+        ULONGLONG               wasted = 0;
+        std::vector<double>     jitter;
+        TimerResult             result = {};
+
+        m_Stream.SetState(KSSTATE_ACQUIRE);
+        m_Stream.SetState(KSSTATE_PAUSE);
+        m_Stream.SetState(KSSTATE_RUN);
+        fire = NextFire();
+
+        while (fire < end)
+        {
+            const STREAM_CORE & core = m_Stream.Core();
+            ULONGLONG           before = core.NextPacketPosition;
+
+            // Acquiring the position lock takes a moment.
+            m_Clock.AdvanceTo(fire + (LONGLONG)(m_Clock.Frequency() / 1000000));
+            wakeups++;
+
+            if (!m_Stream.TimerNotify())
+            {
+                wasted++;
+            }
+
+            // Each boundary crossed became due at its own QPC. The stream
+            // ran from position 0, so the clock's frames count from it.
+            for (ULONGLONG boundary = before; boundary < core.NextPacketPosition; boundary += core.PacketBytes)
+            {
+                LONGLONG due = VClock_QpcOfFrame(&core.Clock, (LONGLONG)(boundary / 8));
+
+                jitter.push_back((double)(m_Clock.Now() - due) * 1e6 / (double)m_Clock.Frequency());
+            }
+            if (core.NextPacketPosition > before)
+            {
+                result.Collapsed += (core.NextPacketPosition - before) / core.PacketBytes - 1;
+            }
+
+            fire = NextFire();
+        }
+
+        std::sort(jitter.begin(), jitter.end());
+
+        result.WakeupsPerSecond = (double)wakeups / Seconds;
+        result.WastedPerSecond  = (double)wasted / Seconds;
+        result.Packets          = (ULONGLONG)m_Stream.Core().PacketCounter;
+        if (!jitter.empty())
+        {
+            double sum = 0.0;
+
+            for (double j : jitter)
+            {
+                sum += j;
+            }
+            result.MeanJitterUs = sum / (double)jitter.size();
+            result.P99JitterUs  = jitter[jitter.size() * 99 / 100];
+            result.MaxJitterUs  = jitter.back();
+        }
+
+        printf("  %-9s %10llu Hz: %7.1f wakeups/s, %6.1f wasted/s, jitter mean %6.1f us p99 %7.1f us max %7.1f us, %llu collapsed\n",
+               (m_Mode == TimerNextBoundary) ? "boundary" : (m_Mode == TimerLowLatency) ? "lowlat" : "periodic",
+               (unsigned long long)m_Clock.Frequency(), result.WakeupsPerSecond, result.WastedPerSecond,
+               result.MeanJitterUs, result.P99JitterUs, result.MaxJitterUs,
+               (unsigned long long)result.Collapsed);
+
+        return result;
+    }
+
+private:
+    //
+    // When the DPC next runs: the timer's due time, or 1 ms after the last
+    // DPC for the periodic timer, followed by the dispatch latency.
+    //
+    LONGLONG NextFire()
+    {
+        LONGLONG due;
+        LONGLONG latencyUs;
+
+        if (m_Mode == TimerPeriodic1ms)
+        {
+            due = m_Clock.Now() + (LONGLONG)(m_Clock.Frequency() / 1000);
+        }
+        else
+        {
+            due = m_Stream.Timer().DueQpc();
+        }
+
+        if (m_Random.Range(0, 999) == 0)
+        {
+            latencyUs = m_Random.Range(1000, 15000);        // a long DPC elsewhere
+        }
+        else
+        {
+            latencyUs = m_Random.Range(5, 300);
+        }
+
+        return due + latencyUs * (LONGLONG)m_Clock.Frequency() / 1000000;
+    }
+
+    FakeClock       m_Clock;
+    FakePortStream  m_Stream;
+    TimerMode       m_Mode;
+    TestRandom      m_Random;
+};
+
+const ULONGLONG Frequencies[] = { 10000000, 3579545, 2400000000 };
+
+} // namespace
+
+TEST(TimerSim, NextBoundaryWakesOncePerPacket)
+{
+    for (ULONGLONG frequency : Frequencies)
+    {
+        TimerSim    sim(frequency, TimerNextBoundary, 1);
+        TimerResult result = sim.Run(600.0);
+
+        // A late wakeup can fold a boundary into the next one, never the
+        // other way round: the timer is never early.
+        EXPECT_LE(result.WakeupsPerSecond, 100.0);
+        EXPECT_GE(result.WakeupsPerSecond, 95.0);
+        EXPECT_EQ(0.0, result.WastedPerSecond);
+        EXPECT_GE(result.MeanJitterUs, 0.0);
+        EXPECT_LT(result.P99JitterUs, 400.0);
+        EXPECT_LT(result.MaxJitterUs, 16000.0);
+    }
+}
+
+TEST(TimerSim, LowLatencyWakesEveryMillisecond)
+{
+    for (ULONGLONG frequency : Frequencies)
+    {
+        TimerSim    sim(frequency, TimerLowLatency, 2);
+        TimerResult result = sim.Run(120.0);
+
+        // The sub-packet wakeups complete nothing, they pull from the feeder
+        // sooner. The last one before a boundary still aims at it, so the
+        // boundaries see the same jitter as without them.
+        EXPECT_GT(result.WakeupsPerSecond, 500.0);
+        EXPECT_LE(result.WakeupsPerSecond, 1000.0);
+        EXPECT_LT(result.P99JitterUs, 400.0);
+    }
+}
+
+TEST(TimerSim, PeriodicTimerBaseline)
+{
+    TimerSim    boundary(10000000, TimerNextBoundary, 3);
+    TimerSim    periodic(10000000, TimerPeriodic1ms, 3);
+    TimerResult one = boundary.Run(120.0);
+    TimerResult old = periodic.Run(120.0);
+
+    // The same packets for a tenth of the wakeups, and none wasted.
+    EXPECT_NEAR((double)old.Packets, (double)one.Packets, 120.0);
+    EXPECT_LT(one.WakeupsPerSecond * 5, old.WakeupsPerSecond);
+    EXPECT_GT(old.WastedPerSecond, 500.0);
+    EXPECT_EQ(0.0, one.WastedPerSecond);
+}
@@ -0,0 +1,194 @@
+/*++
+
+Module Name:
+
+    vclock_test.cpp
+
+Abstract:
+
+    Tests for vclock.h. The long-run tests drive the clock the way
+    UpdatePosition does, from DPCs arriving at jittered intervals with the
+    occasional long stall, over hours of simulated time (MICY_VCLOCK_HOURS,
+    default 24), and check against a 128-bit reference that the position
+    never drifts and only ever moves by whole frames.
+--*/
+
+#include <gtest/gtest.h>
+
+#include <stdio.h>
+
+#include "vclock.h"
+#include "testutil.h"
+
+namespace
+{
+
+struct ClockConfig
+{
+    ULONGLONG   Frequency;
+    ULONG       FramesPerSecond;
+    ULONG       BlockAlign;
+};
+
+const ClockConfig Configs[] =
+{
+    { 10000000,   48000,  8 },      // usual QPC frequency
+    { 10000000,   44100,  4 },
+    { 3579545,    48000,  6 },      // ACPI PM timer
+    { 3579545,    44100,  8 },
+    { 2400000000, 192000, 32 },     // invariant TSC
+    { 24000000,   8000,   2 },
+    { 14318180,   96000,  12 },     // HPET
+};
+
+ULONGLONG ReferenceFrames(const ClockConfig & Config, ULONGLONG Ticks)
+{
+    return (ULONGLONG)((unsigned __int128)Ticks * Config.FramesPerSecond / Config.Frequency);
+}
+
+} // namespace
+
+TEST(VClock, FramesAtMatchesExactArithmetic)
+{
+    TestRandom random(1);
+
+    for (const ClockConfig & config : Configs)
+    {
+        VCLOCK clock;
+
+        VClock_Init(&clock, config.Frequency, config.FramesPerSecond, config.BlockAlign);
+        VClock_Start(&clock, 12345);
+
+        for (int i = 0; i < 100000; i++)
+        {
+            // Up to about 50 years of ticks.
+            ULONGLONG ticks = random.Next() % (config.Frequency * 86400ull * 365 * 50);
+
+            ASSERT_EQ(ReferenceFrames(config, ticks), VClock_FramesAt(&clock, 12345 + (LONGLONG)ticks));
+        }
+    }
+}
+
+TEST(VClock, QpcOfFrameIsTheInverse)
+{
+    TestRandom random(2);
+
+    for (const ClockConfig & config : Configs)
+    {
+        VCLOCK clock;
+
+        VClock_Init(&clock, config.Frequency, config.FramesPerSecond, config.BlockAlign);
+        VClock_Start(&clock, 1000000);
+
+        for (int i = 0; i < 100000; i++)
+        {
+            LONGLONG frame = (LONGLONG)(random.Next() % (config.FramesPerSecond * 86400ull * 365));
+            LONGLONG qpc = VClock_QpcOfFrame(&clock, frame);
+
+            // Due at qpc, not one tick earlier.
+            ASSERT_GE(VClock_FramesAt(&clock, qpc), (ULONGLONG)frame);
+            if (frame > 0)
+            {
+                ASSERT_LT(VClock_FramesAt(&clock, qpc - 1), (ULONGLONG)frame);
+            }
+        }
+
+        EXPECT_EQ(clock.Epoch, VClock_QpcOfFrame(&clock, 0));
+        EXPECT_LT(VClock_QpcOfFrame(&clock, -1), clock.Epoch);
+    }
+}
+
+TEST(VClock, EarlierQpcDoesNotMoveBackwards)
+{
+    VCLOCK clock;
+
+    VClock_Init(&clock, 10000000, 48000, 8);
+    VClock_Start(&clock, 5000);
+
+    EXPECT_EQ(0u, VClock_Advance(&clock, 4000));
+    EXPECT_EQ(480u, VClock_Advance(&clock, 5000 + 100000));
+    EXPECT_EQ(0u, VClock_Advance(&clock, 5000 + 90000));
+    EXPECT_EQ(480u, clock.Frames);
+    EXPECT_EQ(1u, VClock_Advance(&clock, 5000 + 100000 + 209));
+}
+
+TEST(VClock, HoursOfJitteredDpcsDoNotDrift)
+{
+    ULONGLONG hours = TestEnvU64("MICY_VCLOCK_HOURS", 24);
+    TestRandom random(3);
+
+    for (const ClockConfig & config : Configs)
+    {
+        VCLOCK      clock;
+        LONGLONG    epoch = (LONGLONG)(random.Next() >> 8);
+        ULONGLONG   end = hours * 3600 * config.Frequency;
+        ULONGLONG   ticks = 0;
+        ULONGLONG   position = 0;       // bytes, as the stream keeps it
+        ULONGLONG   dpcs = 0;
+        ULONGLONG   maxDue = 0;
+
+        VClock_Init(&clock, config.Frequency, config.FramesPerSecond, config.BlockAlign);
+        VClock_Start(&clock, epoch);
+
+        while (ticks < end)
+        {
+            ULONGLONG due;
+
+            // 10 ms +- 2 ms, and once in a while a stall of up to 10 s.
+            if (random.Range(0, 99999) == 0)
+            {
+                ticks += config.Frequency * random.Range(1, 10000) / 1000;
+            }
+            else
+            {
+                ticks += config.Frequency * random.Range(8000, 12000) / 1000000;
+            }
+
+            due = VClock_Advance(&clock, epoch + (LONGLONG)ticks);
+            position += due * config.BlockAlign;
+            maxDue = (due > maxDue) ? due : maxDue;
+            dpcs++;
+
+            ASSERT_EQ(0u, position % config.BlockAlign);
+            ASSERT_EQ(ReferenceFrames(config, ticks), clock.Frames);
+        }
+
+        EXPECT_EQ(ReferenceFrames(config, ticks) * config.BlockAlign, position);
+
+        printf("  %llu Hz, %u fps: %llu h, %llu DPCs, %llu frames, longest step %llu frames, drift 0\n",
+               (unsigned long long)config.Frequency, config.FramesPerSecond,
+               (unsigned long long)hours, (unsigned long long)dpcs,
+               (unsigned long long)clock.Frames, (unsigned long long)maxDue);
+    }
+}
+
+TEST(VClock, PauseAndResumeKeepWholeFrames)
+{
+    TestRandom random(4);
+    VCLOCK     clock;
+    LONGLONG   qpc = 777;
+    ULONGLONG  position = 0;
+    ULONGLONG  expected = 0;
+
+    VClock_Init(&clock, 3579545, 44100, 6);
+
+    // Each RUN period starts a new epoch; the stream adds up what each
+    // period produced.
+    for (int run = 0; run < 10000; run++)
+    {
+        LONGLONG   start = qpc;
+        ULONGLONG  length = random.Range(1, 3579545 * 5);
+
+        VClock_Start(&clock, start);
+        while (qpc < start + (LONGLONG)length)
+        {
+            qpc += random.Range(1, 50000);
+            position += VClock_Advance(&clock, qpc) * 6;
+        }
+
+        expected += ((ULONGLONG)(qpc - start) * 44100 / 3579545) * 6;
+        ASSERT_EQ(expected, position);
+
+        qpc += random.Range(0, 3579545);    // paused
+    }
+}